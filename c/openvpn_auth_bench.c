@@ -0,0 +1,407 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Benchmark and load generator for openvpn_authd (openvpn_auth_bench).
+ *
+ * Every simulated openvpn login goes through the same code path as
+ * openvpn_authc (authenticate(): connect, failover, protocol negotiation,
+ * request, response) or, with --keepalive, as openvpn_auth_plugin worker
+ * threads (authenticate_keepalive()). Requests are issued by --concurrency
+ * threads either as fast as possible or at fixed --rate. In fixed rate mode
+ * every request has its scheduled start time and latency is measured from
+ * it, so requests delayed by slow server responses are not hidden from
+ * latency percentiles.
+ *
+ * Server, protocol and timeouts are taken from openvpn_authc configuration
+ * file (--config) or command line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "openvpn_auth_client.h"
+
+#define BENCH_NAME "openvpn_auth_bench"
+#define BENCH_MAX_THREADS 1024
+#define BENCH_DEFAULT_THREADS 10
+#define BENCH_DEFAULT_REQUESTS 1000
+#define BENCH_DEFAULT_USER "bench%d"
+#define BENCH_DEFAULT_PASS "bench"
+#define BENCH_DEFAULT_USERS 100
+
+/**
+ * per-thread results; latencies are kept per thread and merged at the end
+ */
+struct bench_thread {
+	pthread_t tid;
+	unsigned int *lat;		/** request latencies (us) */
+	size_t lat_len;
+	size_t lat_size;
+	unsigned long ok;
+	unsigned long failed;
+};
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long bench_next = 0;		/** next request number */
+static unsigned long bench_requests = BENCH_DEFAULT_REQUESTS;
+static int bench_duration = 0;				/** seconds, overrides bench_requests */
+static double bench_rate = 0;				/** requests per second, 0: as fast as possible */
+static int bench_keepalive = 0;
+static int bench_users = BENCH_DEFAULT_USERS;
+static char bench_user[CRED_BUF_SIZE] = BENCH_DEFAULT_USER;
+static char bench_pass[CRED_BUF_SIZE] = BENCH_DEFAULT_PASS;
+static long long bench_start = 0;
+
+/**
+ * returns microseconds elapsed on monotonic clock
+ */
+static long long bench_clock_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * claims next request number
+ * @return 1 if request should be issued, 0 if benchmark is over
+ */
+static int bench_claim (unsigned long *num, long long *scheduled) {
+	int r;
+
+	pthread_mutex_lock(&bench_lock);
+	*num = bench_next++;
+	pthread_mutex_unlock(&bench_lock);
+
+	if (bench_rate > 0)
+		*scheduled = bench_start + (long long) (*num * 1000000.0 / bench_rate);
+	else
+		*scheduled = bench_clock_us();
+
+	if (bench_duration > 0)
+		r = (*scheduled < bench_start + (long long) bench_duration * 1000000) ? 1 : 0;
+	else
+		r = (*num < bench_requests) ? 1 : 0;
+
+	return r;
+}
+
+/**
+ * formats username of n-th request; "%d" in --user is replaced
+ * with request number modulo --users
+ */
+static void bench_username (char *buf, size_t len, unsigned long n) {
+	char *p = strstr(bench_user, "%d");
+
+	if (p == NULL) {
+		snprintf(buf, len, "%s", bench_user);
+		return;
+	}
+	snprintf(buf, len, "%.*s%lu%s", (int) (p - bench_user), bench_user, n % bench_users, p + 2);
+}
+
+static int bench_record (struct bench_thread *t, unsigned int us) {
+	if (t->lat_len >= t->lat_size) {
+		size_t size = (t->lat_size > 0) ? t->lat_size * 2 : 4096;
+		unsigned int *ptr = realloc(t->lat, size * sizeof(unsigned int));
+		if (ptr == NULL) return 0;
+		t->lat = ptr;
+		t->lat_size = size;
+	}
+	t->lat[t->lat_len++] = us;
+	return 1;
+}
+
+static void * bench_worker (void *arg) {
+	struct bench_thread *t = (struct bench_thread *) arg;
+	struct auth *auth;
+	char common_name[CRED_BUF_SIZE];
+	char untrusted_ip[GEN_BUF_SIZE];
+	FILE *sock = NULL;
+	unsigned int next_id = 0;
+	unsigned long n;
+	long long scheduled, now;
+	int r;
+
+	if ((auth = authstruct_init()) == NULL) return NULL;
+	auth->common_name = common_name;
+	auth->untrusted_ip = untrusted_ip;
+
+	while (bench_claim(&n, &scheduled)) {
+		/** fixed rate: wait for request's turn */
+		if ((now = bench_clock_us()) < scheduled)
+			usleep(scheduled - now);
+
+		bench_username(auth->username, CRED_BUF_SIZE, n);
+		snprintf(auth->password, CRED_BUF_SIZE, "%s", bench_pass);
+		snprintf(common_name, sizeof(common_name), "%s", auth->username);
+		snprintf(untrusted_ip, sizeof(untrusted_ip), "10.%lu.%lu.%lu", (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff);
+		auth->untrusted_port = 1024 + (int) (n % 60000);
+
+		if (bench_keepalive)
+			r = authenticate_keepalive(&sock, auth, &next_id);
+		else
+			r = authenticate(auth);
+
+		now = bench_clock_us();
+		if (r) t->ok++; else t->failed++;
+		if (! bench_record(t, (unsigned int) (now - scheduled))) {
+			fprintf(stderr, "Unable to allocate memory for latency samples.\n");
+			break;
+		}
+	}
+
+	if (sock != NULL) srv_disconnect(sock);
+	authstruct_destroy(auth);
+	return NULL;
+}
+
+static int bench_cmp (const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+	return (x > y) - (x < y);
+}
+
+static double bench_pct (const unsigned int *lat, size_t len, double pct) {
+	size_t i;
+	if (len == 0) return 0;
+	i = (size_t) (pct / 100.0 * (len - 1) + 0.5);
+	return lat[i] / 1000.0;
+}
+
+static void bench_usage (void) {
+	fprintf(stderr, "Usage: %s [OPTIONS]\n\n", BENCH_NAME);
+	fprintf(stderr, "Benchmarks openvpn_authd by simulating openvpn logins using\n");
+	fprintf(stderr, "openvpn_authc's authentication code.\n\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "  -c   --config           Load openvpn_authc configuration file\n");
+	fprintf(stderr, "  -H   --hostname         Authentication server hostname or UNIX\n");
+	fprintf(stderr, "                          domain socket path (Default: \"%s\")\n", DEFAULT_HOSTNAME);
+	fprintf(stderr, "  -p   --port             Authentication server port (Default: %d)\n", DEFAULT_PORT);
+	fprintf(stderr, "  -t   --timeout          Authentication timeout in seconds (Default: %d)\n", DEFAULT_AUTH_TIMEOUT);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -j   --concurrency      Number of concurrent requests (Default: %d)\n", BENCH_DEFAULT_THREADS);
+	fprintf(stderr, "  -n   --requests         Total number of requests (Default: %d)\n", BENCH_DEFAULT_REQUESTS);
+	fprintf(stderr, "  -d   --duration         Run for specified number of seconds instead\n");
+	fprintf(stderr, "  -r   --rate             Issue requests at fixed rate (requests/second);\n");
+	fprintf(stderr, "                          latency includes time spent waiting for free\n");
+	fprintf(stderr, "                          concurrency slot (Default: as fast as possible)\n");
+	fprintf(stderr, "  -k   --keepalive        Reuse connections like openvpn_auth_plugin does\n");
+	fprintf(stderr, "  -T   --tls              Connect using TLS (see tls_* configuration parameters)\n");
+	fprintf(stderr, "  -R   --no-resume        Don't resume TLS sessions (full handshake every time)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -U   --user             Username; %%d is replaced by request number\n");
+	fprintf(stderr, "                          modulo --users (Default: \"%s\")\n", BENCH_DEFAULT_USER);
+	fprintf(stderr, "  -N   --users            Number of distinct usernames (Default: %d)\n", BENCH_DEFAULT_USERS);
+	fprintf(stderr, "  -P   --pass             Password (Default: \"%s\")\n", BENCH_DEFAULT_PASS);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -l   --log              Log every authentication to syslog like openvpn_authc\n");
+	fprintf(stderr, "  -v   --verbose          Print every authentication result to stderr\n");
+	fprintf(stderr, "  -h   --help             This help message\n");
+}
+
+int main (int argc, char **argv) {
+	static struct option long_options[] = {
+		{"config", required_argument, NULL, 'c'},
+		{"hostname", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"timeout", required_argument, NULL, 't'},
+		{"concurrency", required_argument, NULL, 'j'},
+		{"requests", required_argument, NULL, 'n'},
+		{"duration", required_argument, NULL, 'd'},
+		{"rate", required_argument, NULL, 'r'},
+		{"keepalive", no_argument, NULL, 'k'},
+		{"tls", no_argument, NULL, 'T'},
+		{"no-resume", no_argument, NULL, 'R'},
+		{"user", required_argument, NULL, 'U'},
+		{"users", required_argument, NULL, 'N'},
+		{"pass", required_argument, NULL, 'P'},
+		{"log", no_argument, NULL, 'l'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct bench_thread *threads;
+	unsigned int *lat;
+	unsigned long ok = 0, failed = 0;
+	size_t len = 0;
+	double elapsed, sum = 0;
+	long long stop;
+	int c, i, num_threads = BENCH_DEFAULT_THREADS;
+
+	MYNAME = BENCH_NAME;
+	log_open();
+	strncpy(hostname, DEFAULT_HOSTNAME, sizeof(hostname) - 1);
+	log_syslog = 0;
+
+	while ((c = getopt_long(argc, argv, "c:H:p:t:j:n:d:r:kTRU:N:P:lvh", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'c':
+				if (! load_config_file(optarg)) {
+					fprintf(stderr, "Unable to parse config file '%s': %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			case 'H':
+				snprintf(hostname, sizeof(hostname), "%s", optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 'n':
+				bench_requests = strtoul(optarg, NULL, 10);
+				break;
+			case 'd':
+				bench_duration = atoi(optarg);
+				break;
+			case 'r':
+				bench_rate = atof(optarg);
+				break;
+			case 'k':
+				bench_keepalive = 1;
+				break;
+			case 'T':
+				tls = 1;
+				break;
+			case 'R':
+				tls_session_file[0] = '\0';
+				break;
+			case 'U':
+				snprintf(bench_user, sizeof(bench_user), "%s", optarg);
+				break;
+			case 'N':
+				bench_users = atoi(optarg);
+				break;
+			case 'P':
+				snprintf(bench_pass, sizeof(bench_pass), "%s", optarg);
+				break;
+			case 'l':
+				log_syslog = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				bench_usage();
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+
+	if (num_threads < 1 || num_threads > BENCH_MAX_THREADS) {
+		fprintf(stderr, "Concurrency must be between 1 and %d.\n", BENCH_MAX_THREADS);
+		return 1;
+	}
+	if (bench_users < 1) bench_users = 1;
+	/** TLS session file is mapped before threads are started */
+	if (tls && ! tls_client_init()) {
+		fprintf(stderr, "Unable to initialize TLS.\n");
+		return 1;
+	}
+	if ((threads = calloc(num_threads, sizeof(struct bench_thread))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for benchmark threads.\n");
+		return 1;
+	}
+
+	printf("Benchmarking %s", hostname);
+	if (hostname[0] != '/') printf(" (port %d)", port);
+	printf(", concurrency %d, ", num_threads);
+	if (bench_duration > 0)
+		printf("%d second(s)", bench_duration);
+	else
+		printf("%lu request(s)", bench_requests);
+	if (bench_rate > 0)
+		printf(" at %.1f request(s)/s", bench_rate);
+	printf("%s%s, protocol %d.\n", (bench_keepalive) ? ", keep-alive connections" : "", (tls) ? ((tls_session_file[0] != '\0') ? ", TLS" : ", TLS without resumption") : "", protocol);
+	fflush(stdout);
+
+	bench_start = bench_clock_us();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]) != 0) {
+			fprintf(stderr, "Unable to start benchmark thread: %s\n", strerror(errno));
+			num_threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ok += threads[i].ok;
+		failed += threads[i].failed;
+		len += threads[i].lat_len;
+	}
+	stop = bench_clock_us();
+	elapsed = (stop - bench_start) / 1000000.0;
+
+	/** merge latency samples */
+	if ((lat = malloc((len + 1) * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for latency samples.\n");
+		return 1;
+	}
+	len = 0;
+	for (i = 0; i < num_threads; i++) {
+		memcpy(lat + len, threads[i].lat, threads[i].lat_len * sizeof(unsigned int));
+		len += threads[i].lat_len;
+		free(threads[i].lat);
+	}
+	qsort(lat, len, sizeof(unsigned int), bench_cmp);
+	for (i = 0; (size_t) i < len; i++)
+		sum += lat[i];
+
+	printf("\n");
+	printf("Requests:      %lu (%lu succeeded, %lu failed)\n", ok + failed, ok, failed);
+	printf("Elapsed:       %.3f s\n", elapsed);
+	printf("Throughput:    %.1f requests/s\n", (elapsed > 0) ? (ok + failed) / elapsed : 0);
+	printf("Latency (ms):  min %.3f, mean %.3f, max %.3f\n",
+		(len) ? lat[0] / 1000.0 : 0, (len) ? sum / len / 1000.0 : 0, (len) ? lat[len - 1] / 1000.0 : 0);
+	printf("               p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+		bench_pct(lat, len, 50), bench_pct(lat, len, 90), bench_pct(lat, len, 99), bench_pct(lat, len, 99.9));
+	if (tls)
+		printf("TLS:           %lu handshake(s), %lu resumed (%.1f%%), %lu failed\n",
+			tls_stats.handshakes, tls_stats.resumed, (tls_stats.handshakes) ? 100.0 * tls_stats.resumed / tls_stats.handshakes : 0, tls_stats.failed);
+
+	free(lat);
+	free(threads);
+
+	return (failed > 0) ? 2 : 0;
+}
@@ -0,0 +1,709 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * Authentication broker (openvpn_authc --broker).
+ *
+ * Every openvpn_authc invocation normally opens new connection to
+ * openvpn_authd, which costs TCP handshake and fresh preforked daemon
+ * child for every single authentication. Broker listens on local UNIX
+ * domain socket (broker_socket), keeps broker_connections persistent
+ * keep-alive connections to authentication server and multiplexes
+ * client requests over them. Every forwarded request is tagged with
+ * unique request id and server's replies ("<id> OK message") are routed
+ * back to waiting clients by id, so replies may arrive in any order.
+ *
+ * Clients speak plain (untagged) authentication protocol to the broker,
+ * so openvpn_authc only needs broker_socket configuration parameter.
+ * Client requests must not carry their own request id, keep-alive flag
+ * or deadline and must not contain empty line before the terminating
+ * one, so that one user's request can't be split into several requests
+ * on connection shared with other users.
+ *
+ * Connection is used for pipelined requests only after server has
+ * answered with tagged reply; until then it carries one request at a
+ * time, which is also how servers without keep-alive support are
+ * served (one request per connection).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <grp.h>
+
+#include "openvpn_auth_client.h"
+
+#define BROKER_MAX_CLIENTS 1024		/** must be power of 2, see broker_request_id() */
+#define BROKER_CLIENT_BITS 10
+#define BROKER_MAX_CONNECTIONS 64
+#define BROKER_REQ_SIZE (4 * CRED_BUF_SIZE + GEN_BUF_SIZE)
+#define BROKER_RETRY_MS 1000
+
+enum broker_conn_state {
+	CONN_DOWN,
+	CONN_CONNECTING,
+	CONN_HANDSHAKE,			/** TLS handshake in progress */
+	CONN_UP
+};
+
+enum broker_conn_mode {
+	MODE_UNKNOWN,			/** no tagged reply received yet */
+	MODE_KEEPALIVE,			/** server tags replies, requests are pipelined */
+	MODE_LEGACY				/** server doesn't support request ids */
+};
+
+enum broker_client_state {
+	CLIENT_FREE,
+	CLIENT_READING,			/** reading request from client */
+	CLIENT_QUEUED,			/** waiting for server connection */
+	CLIENT_WAITING			/** request sent, waiting for reply */
+};
+
+/**
+ * persistent connection to authentication server
+ */
+struct broker_conn {
+	int fd;
+	struct ssl_st *ssl;		/** TLS connection, NULL if not using TLS */
+	short want;				/** poll events TLS handshake waits for */
+	enum broker_conn_state state;
+	enum broker_conn_mode mode;
+	int server;				/** index of server in hostname list */
+	long long retry_at;
+	long long connect_deadline;
+	int inflight;
+	char *out;				/** pending output */
+	size_t out_len;
+	size_t out_size;
+	char in[GEN_BUF_SIZE];
+	size_t in_len;
+};
+
+/**
+ * client (openvpn_authc) connection
+ */
+struct broker_client {
+	int fd;
+	enum broker_client_state state;
+	unsigned int id;
+	int conn;
+	int retries;
+	long long deadline;
+	char buf[BROKER_REQ_SIZE];
+	size_t len;
+};
+
+static struct broker_conn conns[BROKER_MAX_CONNECTIONS];
+static struct broker_client clients[BROKER_MAX_CLIENTS];
+static int num_conns = 0;
+static unsigned int broker_seq = 0;
+static int broker_legacy_logged = 0;
+static volatile sig_atomic_t broker_stop = 0;
+
+static void broker_sigh_stop (int num) {
+	broker_stop = 1;
+}
+
+/**
+ * returns new request id for client slot; low bits identify client slot,
+ * high bits make ids of consecutive requests from the same slot unique.
+ */
+static unsigned int broker_request_id (int slot) {
+	unsigned int id;
+
+	do {
+		broker_seq++;
+		id = (broker_seq << BROKER_CLIENT_BITS) | (unsigned int) slot;
+	} while (id == 0 || (broker_seq << BROKER_CLIENT_BITS) == 0);
+
+	return id;
+}
+
+/**
+ * sends reply line to client and releases client slot
+ */
+static void broker_client_reply (struct broker_client *cl, const char *line) {
+	if (cl->fd >= 0) {
+		send(cl->fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT);
+		send(cl->fd, "\n", 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(cl->fd);
+	}
+
+	/** don't leave passwords lying around */
+	memset(cl->buf, '\0', sizeof(cl->buf));
+	cl->len = 0;
+	cl->fd = -1;
+	cl->state = CLIENT_FREE;
+}
+
+static void broker_conn_down (int idx, long long now) {
+	struct broker_conn *c = &conns[idx];
+	int i;
+
+	if (c->ssl != NULL)
+		tls_free(c->ssl);
+	else if (c->fd >= 0)
+		close(c->fd);
+	c->ssl = NULL;
+	c->fd = -1;
+	c->state = CONN_DOWN;
+	c->mode = MODE_UNKNOWN;
+	c->inflight = 0;
+	c->in_len = 0;
+	if (c->out != NULL) memset(c->out, '\0', c->out_size);
+	c->out_len = 0;
+
+	/** requeue requests waiting on lost connection once */
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		struct broker_client *cl = &clients[i];
+		if (cl->state != CLIENT_WAITING || cl->conn != idx) continue;
+		if (cl->retries++ < 1)
+			cl->state = CLIENT_QUEUED;
+		else
+			broker_client_reply(cl, "NO Authentication server connection lost.");
+	}
+}
+
+/**
+ * fails all requests waiting on connection and closes it
+ */
+static void broker_conn_fail (int idx, long long now, const char *reply) {
+	int i;
+
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		if (clients[i].state == CLIENT_WAITING && clients[i].conn == idx)
+			broker_client_reply(&clients[i], reply);
+	}
+	broker_conn_down(idx, now);
+}
+
+static void broker_conn_start (int idx, long long now) {
+	struct broker_conn *c = &conns[idx];
+
+	c->retry_at = now + BROKER_RETRY_MS;
+	if ((c->fd = srv_connect_nb(&c->server)) < 0) {
+		c->state = CONN_DOWN;
+		return;
+	}
+	c->state = CONN_CONNECTING;
+	c->connect_deadline = (connect_timeout > 0) ? now + connect_timeout : 0;
+}
+
+/**
+ * appends client's request (tagged with request id) to server connection output
+ * @return 1 on success, otherwise 0
+ */
+static int broker_conn_queue (struct broker_conn *c, struct broker_client *cl) {
+	char tag[128];
+	int tlen;
+	size_t need;
+
+	/** deadline is sent by broker; client's deadline is broker's timeout */
+	if (cl->deadline > 0)
+		tlen = snprintf(tag, sizeof(tag), "deadline=%lld\nid=%u\nkeepalive=1\n\n", wall_ms() + (cl->deadline - clock_ms()), cl->id);
+	else
+		tlen = snprintf(tag, sizeof(tag), "id=%u\nkeepalive=1\n\n", cl->id);
+	/** client request without terminating empty line + id tag */
+	need = c->out_len + cl->len - 1 + tlen;
+
+	if (need > c->out_size) {
+		size_t size = (c->out_size > 0) ? c->out_size : BROKER_REQ_SIZE;
+		char *ptr;
+		while (size < need) size *= 2;
+		if ((ptr = malloc(size)) == NULL) {
+			log_msg("Unable to allocate memory for broker output buffer.");
+			return 0;
+		}
+		if (c->out != NULL) {
+			memcpy(ptr, c->out, c->out_len);
+			memset(c->out, '\0', c->out_size);
+			free(c->out);
+		}
+		c->out = ptr;
+		c->out_size = size;
+	}
+
+	memcpy(c->out + c->out_len, cl->buf, cl->len - 1);
+	c->out_len += cl->len - 1;
+	memcpy(c->out + c->out_len, tag, tlen);
+	c->out_len += tlen;
+
+	return 1;
+}
+
+/**
+ * assigns queued client requests to least loaded server connections
+ */
+static void broker_dispatch (void) {
+	int i, j, best;
+
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		struct broker_client *cl = &clients[i];
+		if (cl->state != CLIENT_QUEUED) continue;
+
+		best = -1;
+		for (j = 0; j < num_conns; j++) {
+			if (conns[j].state != CONN_UP) continue;
+			if (conns[j].mode != MODE_KEEPALIVE && conns[j].inflight > 0) continue;
+			if (best < 0 || conns[j].inflight < conns[best].inflight)
+				best = j;
+		}
+		if (best < 0) return;
+
+		cl->id = broker_request_id(i);
+		if (! broker_conn_queue(&conns[best], cl)) {
+			broker_client_reply(cl, "NO Internal broker error.");
+			continue;
+		}
+		cl->conn = best;
+		cl->state = CLIENT_WAITING;
+		conns[best].inflight++;
+	}
+}
+
+/**
+ * routes server reply line to waiting client
+ * @return 1 on success, 0 if connection must be closed
+ */
+static int broker_conn_line (int idx, char *line, long long now) {
+	struct broker_conn *c = &conns[idx];
+	struct broker_client *cl = NULL;
+	unsigned int id;
+	int i, n = 0;
+
+	if (c->inflight > 0) c->inflight--;
+
+	if ((id = auth_response_id(&line)) > 0) {
+		c->mode = MODE_KEEPALIVE;
+		cl = &clients[id & (BROKER_MAX_CLIENTS - 1)];
+		/** client might have timed out in the meantime */
+		if (cl->state != CLIENT_WAITING || cl->id != id || cl->conn != idx)
+			return 1;
+		broker_client_reply(cl, line);
+		return 1;
+	}
+
+	/**
+	 * untagged reply on connection carrying pipelined requests can't
+	 * be matched to request it answers
+	 */
+	if (c->mode == MODE_KEEPALIVE) {
+		log_msg("Untagged reply from authentication server on keep-alive connection; failing its requests.");
+		broker_conn_fail(idx, now, "NO Invalid reply from authentication server.");
+		return 0;
+	}
+
+	/** server without keep-alive support: one request per connection */
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		if (clients[i].state != CLIENT_WAITING || clients[i].conn != idx) continue;
+		cl = &clients[i];
+		n++;
+	}
+	if (n != 1) {
+		if (n > 1) {
+			log_msg("Untagged reply from authentication server with %d requests in flight; failing them.", n);
+			broker_conn_fail(idx, now, "NO Invalid reply from authentication server.");
+		} else
+			broker_conn_down(idx, now);
+		return 0;
+	}
+	if (! broker_legacy_logged)
+		log_msg("Authentication server doesn't support request ids; falling back to one request per connection.");
+	broker_legacy_logged = 1;
+	c->mode = MODE_LEGACY;
+
+	broker_client_reply(cl, line);
+	return 1;
+}
+
+static ssize_t broker_conn_send (struct broker_conn *c) {
+	if (c->ssl != NULL)
+		return tls_send(c->ssl, c->out, c->out_len);
+	return send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+}
+
+static ssize_t broker_conn_recv (struct broker_conn *c) {
+	if (c->ssl != NULL)
+		return tls_recv(c->ssl, c->in + c->in_len, sizeof(c->in) - c->in_len - 1);
+	return recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len - 1, 0);
+}
+
+/**
+ * handles server connection events
+ */
+static void broker_conn_event (int idx, short revents, long long now) {
+	struct broker_conn *c = &conns[idx];
+	char host[GEN_BUF_SIZE];
+	ssize_t n;
+	char *nl;
+	int err = 0, srv_port, r;
+	socklen_t err_len = sizeof(err);
+
+	if (c->state == CONN_CONNECTING) {
+		/** hang-up without pending error: socket isn't connected */
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0 || (revents & (POLLHUP | POLLERR))) {
+			srv_health_mark(c->server, 0);
+			broker_conn_down(idx, now);
+			return;
+		}
+		srv_health_mark(c->server, 1);
+		c->state = CONN_UP;
+
+		/** UNIX domain socket connections are local and never encrypted */
+		if (tls && srv_address(c->server, host, sizeof(host), &srv_port) && host[0] != '/') {
+			if ((c->ssl = tls_connect_nb(c->fd, host, srv_port)) == NULL) {
+				broker_conn_down(idx, now);
+				return;
+			}
+			c->state = CONN_HANDSHAKE;
+			c->want = POLLOUT;
+		}
+		return;
+	}
+
+	if (c->state == CONN_HANDSHAKE) {
+		if ((r = tls_handshake(c->ssl)) < 0)
+			broker_conn_down(idx, now);
+		else if (r > 0)
+			c->want = r;
+		else
+			c->state = CONN_UP;
+		return;
+	}
+
+	if (revents & POLLOUT && c->out_len > 0) {
+		if ((n = broker_conn_send(c)) < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				broker_conn_down(idx, now);
+				return;
+			}
+		} else {
+			memmove(c->out, c->out + n, c->out_len - n);
+			c->out_len -= n;
+			memset(c->out + c->out_len, '\0', n);
+		}
+	}
+
+	/** TLS connection may hold decrypted data poll(2) doesn't know about */
+	while (c->state == CONN_UP && (revents & (POLLIN | POLLHUP | POLLERR) || (c->ssl != NULL && tls_pending(c->ssl) > 0))) {
+		revents = 0;
+		n = broker_conn_recv(c);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			/** idle connection closed by server; reconnect right away */
+			if (c->inflight == 0) c->retry_at = now;
+			broker_conn_down(idx, now);
+			return;
+		}
+		if (n < 0) return;
+		c->in_len += n;
+		c->in[c->in_len] = '\0';
+
+		while ((nl = strchr(c->in, '\n')) != NULL) {
+			*nl = '\0';
+			if (! broker_conn_line(idx, c->in, now))
+				return;
+			c->in_len -= (nl + 1 - c->in);
+			memmove(c->in, nl + 1, c->in_len + 1);
+		}
+
+		if (c->in_len >= sizeof(c->in) - 1) {
+			log_msg("Too long response line from authentication server.");
+			broker_conn_down(idx, now);
+		}
+		/** legacy server closes connection after reply anyway */
+		else if (c->mode == MODE_LEGACY && c->inflight == 0) {
+			c->retry_at = now;
+			broker_conn_down(idx, now);
+		}
+	}
+}
+
+/**
+ * checks complete client request: no NUL bytes, no empty line before
+ * the terminating one and no request id, keep-alive or deadline
+ * parameters, which are set by broker
+ * @return 1 if request is valid, otherwise 0
+ */
+static int broker_request_valid (struct broker_client *cl) {
+	char *line = cl->buf, *nl;
+	char *end = cl->buf + cl->len - 1;		/** terminating empty line */
+
+	if (memchr(cl->buf, '\0', cl->len) != NULL)
+		return 0;
+	while (line < end) {
+		nl = memchr(line, '\n', end - line);
+		if (nl == NULL || nl == line)
+			return 0;
+		if (strncmp(line, "id=", 3) == 0 || strncmp(line, "keepalive=", 10) == 0 || strncmp(line, "deadline=", 9) == 0)
+			return 0;
+		line = nl + 1;
+	}
+
+	return 1;
+}
+
+/**
+ * reads client's request; request is complete when empty line is received
+ */
+static void broker_client_event (struct broker_client *cl) {
+	ssize_t n;
+
+	n = recv(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len - 1, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		close(cl->fd);
+		cl->fd = -1;
+		broker_client_reply(cl, "");
+		return;
+	}
+	if (n < 0) return;
+	cl->len += n;
+	cl->buf[cl->len] = '\0';
+
+	if (cl->len >= 2 && memcmp(cl->buf + cl->len - 2, "\n\n", 2) == 0) {
+		if (! broker_request_valid(cl)) {
+			broker_client_reply(cl, "NO Invalid authentication request.");
+			return;
+		}
+		cl->retries = 0;
+		cl->state = CLIENT_QUEUED;
+	} else if (cl->len >= sizeof(cl->buf) - 1)
+		broker_client_reply(cl, "NO Invalid authentication request.");
+}
+
+static void broker_accept (int listen_sock, long long now) {
+	int fd, i;
+
+	while ((fd = accept(listen_sock, NULL, NULL)) >= 0) {
+		for (i = 0; i < BROKER_MAX_CLIENTS; i++)
+			if (clients[i].state == CLIENT_FREE) break;
+
+		if (i >= BROKER_MAX_CLIENTS) {
+			log_msg("Too many broker clients (%d), dropping connection.", BROKER_MAX_CLIENTS);
+			send(fd, "NO Authentication broker overloaded.\n", 37, MSG_NOSIGNAL | MSG_DONTWAIT);
+			close(fd);
+			continue;
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		clients[i].fd = fd;
+		clients[i].state = CLIENT_READING;
+		clients[i].len = 0;
+		clients[i].deadline = (timeout > 0) ? now + timeout * 1000LL : 0;
+	}
+}
+
+static int broker_listen (void) {
+	int sock;
+	struct sockaddr_un addr;
+
+	if (broker_socket[0] != '/') {
+		log_msg("Invalid broker_socket '%s': must be absolute path to UNIX domain socket.", broker_socket);
+		return -1;
+	}
+	if (strlen(broker_socket) >= sizeof(addr.sun_path)) {
+		log_msg("Invalid broker_socket '%s': path is longer than %d characters.", broker_socket, (int) sizeof(addr.sun_path) - 1);
+		return -1;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		log_msg("Unable to create UNIX domain socket: %s (errno %d).", strerror(errno), errno);
+		return -1;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, broker_socket, strlen(broker_socket));
+
+	/** remove stale socket file */
+	unlink(broker_socket);
+	if (bind(sock, (const struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 128) < 0) {
+		log_msg("Unable to listen on %s: %s (errno %d).", broker_socket, strerror(errno), errno);
+		close(sock);
+		return -1;
+	}
+	if (broker_socket_group[0] != '\0') {
+		struct group *gr = getgrnam(broker_socket_group);
+		gid_t gid = (gr != NULL) ? gr->gr_gid : (gid_t) strtoul(broker_socket_group, NULL, 10);
+		if ((gr == NULL && strspn(broker_socket_group, "0123456789") != strlen(broker_socket_group)) || chown(broker_socket, -1, gid) < 0) {
+			log_msg("Unable to set group of %s to '%s': %s.", broker_socket, broker_socket_group, (gr == NULL) ? "no such group" : strerror(errno));
+			close(sock);
+			unlink(broker_socket);
+			return -1;
+		}
+	}
+	if (chmod(broker_socket, broker_socket_mode & 0777) < 0) {
+		log_msg("Unable to set permissions of %s: %s (errno %d).", broker_socket, strerror(errno), errno);
+		close(sock);
+		unlink(broker_socket);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	return sock;
+}
+
+/**
+ * runs authentication broker until SIGTERM or SIGINT is received
+ * @return program exit status
+ */
+int broker_run (void) {
+	struct pollfd pfd[1 + BROKER_MAX_CONNECTIONS + BROKER_MAX_CLIENTS];
+	int owner[1 + BROKER_MAX_CONNECTIONS + BROKER_MAX_CLIENTS];
+	struct sigaction act;
+	int listen_sock, nfds, i, r;
+	long long now, wait;
+
+	if (tls && ! tls_client_init())
+		return 1;
+	if ((listen_sock = broker_listen()) < 0)
+		return 1;
+
+	num_conns = broker_connections;
+	if (num_conns < 1) num_conns = 1;
+	if (num_conns > BROKER_MAX_CONNECTIONS) num_conns = BROKER_MAX_CONNECTIONS;
+
+	memset(&act, '\0', sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &act, NULL);
+	act.sa_handler = broker_sigh_stop;
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+		clients[i].state = CLIENT_FREE;
+	}
+	for (i = 0; i < num_conns; i++) {
+		conns[i].fd = -1;
+		conns[i].state = CONN_DOWN;
+	}
+
+	log_msg("%s %s broker listening on %s, %d connection(s) to authentication server %s.", MYNAME, VERSION, broker_socket, num_conns, hostname);
+
+	while (! broker_stop) {
+		now = clock_ms();
+		wait = BROKER_RETRY_MS;
+
+		/** (re)connect server connections */
+		for (i = 0; i < num_conns; i++) {
+			if ((conns[i].state == CONN_CONNECTING || conns[i].state == CONN_HANDSHAKE) && conns[i].connect_deadline > 0) {
+				if (conns[i].connect_deadline <= now) {
+					log_msg("Connect to authentication server timed out after %d ms.", connect_timeout);
+					srv_health_mark(conns[i].server, 0);
+					broker_conn_down(i, now);
+				} else if (conns[i].connect_deadline - now < wait)
+					wait = conns[i].connect_deadline - now;
+			}
+			if (conns[i].state != CONN_DOWN) continue;
+			if (conns[i].retry_at <= now)
+				broker_conn_start(i, now);
+			if (conns[i].state == CONN_DOWN && conns[i].retry_at - now < wait)
+				wait = conns[i].retry_at - now;
+		}
+
+		broker_dispatch();
+
+		/** expire timed out clients */
+		for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+			if (clients[i].state == CLIENT_FREE || clients[i].deadline == 0) continue;
+			if (clients[i].deadline <= now)
+				broker_client_reply(&clients[i], "NO Authentication timed out.");
+			else if (clients[i].deadline - now < wait)
+				wait = clients[i].deadline - now;
+		}
+
+		/** build poll set */
+		nfds = 0;
+		pfd[nfds].fd = listen_sock;
+		pfd[nfds].events = POLLIN;
+		owner[nfds++] = -1;
+		for (i = 0; i < num_conns; i++) {
+			if (conns[i].state == CONN_DOWN) continue;
+			pfd[nfds].fd = conns[i].fd;
+			pfd[nfds].events = (conns[i].state == CONN_CONNECTING || conns[i].out_len > 0) ? POLLOUT : 0;
+			if (conns[i].state == CONN_HANDSHAKE) pfd[nfds].events = conns[i].want;
+			if (conns[i].state == CONN_UP) pfd[nfds].events |= POLLIN;
+			owner[nfds++] = i;
+		}
+		for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+			if (clients[i].state != CLIENT_READING) continue;
+			pfd[nfds].fd = clients[i].fd;
+			pfd[nfds].events = POLLIN;
+			owner[nfds++] = BROKER_MAX_CONNECTIONS + i;
+		}
+
+		if ((r = poll(pfd, nfds, (wait < 0) ? 0 : (int) wait)) < 0) {
+			if (errno == EINTR) continue;
+			log_msg("poll(2) failed: %s (errno %d).", strerror(errno), errno);
+			break;
+		}
+		if (r == 0) continue;
+
+		now = clock_ms();
+		for (i = 0; i < nfds; i++) {
+			if (pfd[i].revents == 0) continue;
+			if (owner[i] < 0)
+				broker_accept(listen_sock, now);
+			else if (owner[i] < BROKER_MAX_CONNECTIONS)
+				broker_conn_event(owner[i], pfd[i].revents, now);
+			else if (clients[owner[i] - BROKER_MAX_CONNECTIONS].state == CLIENT_READING)
+				broker_client_event(&clients[owner[i] - BROKER_MAX_CONNECTIONS]);
+		}
+	}
+
+	log_msg("Broker shutting down.");
+	close(listen_sock);
+	unlink(broker_socket);
+	for (i = 0; i < BROKER_MAX_CLIENTS; i++)
+		if (clients[i].state != CLIENT_FREE)
+			broker_client_reply(&clients[i], "NO Authentication broker shutting down.");
+	for (i = 0; i < num_conns; i++) {
+		if (conns[i].ssl != NULL)
+			tls_free(conns[i].ssl);
+		else if (conns[i].fd >= 0)
+			close(conns[i].fd);
+	}
+
+	return 0;
+}
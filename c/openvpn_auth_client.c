@@ -60,17 +60,12 @@
 #include <libgen.h>
 #include <sys/ioctl.h>
 #include <termio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define VERSION "0.11"
-
-#define CRED_BUF_SIZE 512
-#define GEN_BUF_SIZE 1024
-#define CONF_FILE_MAXLINES 1000
-#define STR_SEP "="
-
-#define DEFAULT_HOSTNAME "127.0.0.1"
-#define DEFAULT_PORT 1559
-#define DEFAULT_AUTH_TIMEOUT 10
+#include "openvpn_auth_client.h"
 
 /**
  * Global configuration variables
@@ -79,24 +74,40 @@ char hostname[GEN_BUF_SIZE];					/** authentication server hostname or unix doma
 int port = DEFAULT_PORT;						/** authentication server listening port */
 int timeout = DEFAULT_AUTH_TIMEOUT;				/** default authentication timeout */
 int verbose = 0;
+int log_syslog = 1;								/** log messages to syslog */
+int plugin_workers = DEFAULT_PLUGIN_WORKERS;	/** number of openvpn plugin worker threads */
+int deferred = 0;								/** use openvpn deferred authentication */
+int connect_timeout = DEFAULT_CONNECT_TIMEOUT;	/** per-server connect timeout (ms) */
+int connect_stagger = DEFAULT_CONNECT_STAGGER;	/** delay before racing next server (ms) */
+char health_file[GEN_BUF_SIZE] = DEFAULT_HEALTH_FILE;	/** server health scoreboard */
+int health_ttl = DEFAULT_HEALTH_TTL;			/** how long dead server is skipped (s) */
+char cache_file[GEN_BUF_SIZE];					/** verdict cache file */
+int cache_ttl = DEFAULT_CACHE_TTL;				/** verdict cache entry lifetime (s) */
+int cache_slots = DEFAULT_CACHE_SLOTS;			/** verdict cache size */
+int protocol = DEFAULT_PROTOCOL;				/** client-server protocol version */
+int protocol_fallback = 0;						/** server doesn't speak protocol v2 */
+char broker_socket[GEN_BUF_SIZE];				/** authentication broker unix domain socket */
+int broker_connections = DEFAULT_BROKER_CONNECTIONS;	/** broker's persistent server connections */
+int broker_socket_mode = DEFAULT_BROKER_SOCKET_MODE;	/** broker socket permissions */
+char broker_socket_group[GEN_BUF_SIZE];			/** broker socket group */
+int tls = 0;									/** use TLS for tcp server connections */
+char tls_ca_file[GEN_BUF_SIZE];					/** CA certificates verifying server certificate */
+char tls_cert_file[GEN_BUF_SIZE];				/** client certificate */
+char tls_key_file[GEN_BUF_SIZE];				/** client certificate private key */
+char tls_server_name[GEN_BUF_SIZE];				/** expected server certificate name */
+char tls_session_file[GEN_BUF_SIZE] = DEFAULT_TLS_SESSION_FILE;	/** TLS sessions shared by all processes */
+char timing_file[GEN_BUF_SIZE];					/** phase timing histogram file */
 
 /**
  * Other runtime variables
  */
 char *MYNAME = NULL;
+void (*log_func) (const char *str, va_list args) = NULL;	/** replaces syslog (openvpn plugin) */
 
-/**
- * authentication data structure
- */
-struct auth {
-	char	*username;
-	char	*password;
-	char	*common_name;
-	char	*untrusted_ip;
-	int		untrusted_port;
-};
-
-int server_socket = 0;
+/** per-thread phase timing of current authentication (microseconds) */
+static __thread long long timing_started = 0;
+static __thread long long timing_us[TIMING_PHASES];
+static __thread unsigned int timing_seen = 0;
 
 char var_buf[GEN_BUF_SIZE];
 char val_buf[GEN_BUF_SIZE];
@@ -133,12 +144,16 @@ void chomp (char *str) {
 void log_msg (const char *str, ...) {
 	va_list args;
 	
-	/** print to syslog */
-	openlog(MYNAME, (LOG_PID|LOG_ODELAY), LOG_AUTHPRIV);
-	va_start(args, str);
-	vsyslog(LOG_INFO, str, args);
-	va_end(args);
-	closelog();
+	/** print to syslog (connection is opened by log_open()) or log callback */
+	if (log_func != NULL) {
+		va_start(args, str);
+		log_func(str, args);
+		va_end(args);
+	} else if (log_syslog) {
+		va_start(args, str);
+		vsyslog(LOG_AUTHPRIV | LOG_INFO, str, args);
+		va_end(args);
+	}
 
 	/** print to stderr */
 	if (verbose) {
@@ -149,6 +164,15 @@ void log_msg (const char *str, ...) {
 	}
 }
 
+/**
+ * sets syslog identity of standalone programs; called once from main()
+ * before threads are started. Never called by openvpn plugin, which
+ * must not change openvpn's syslog identity.
+ */
+void log_open (void) {
+	openlog(MYNAME, (LOG_PID|LOG_ODELAY), LOG_AUTHPRIV);
+}
+
 /**
  * initializes authentication structure
  */
@@ -202,10 +226,17 @@ void printhelp (void) {
 	fprintf(stderr, "  -c   --config           Specifies configuration file\n");
 	fprintf(stderr, "  -d   --default-config   Prints out default configuration file.\n");
 	fprintf(stderr, "  -H   --hostname         Authentication server hostname or UNIX\n");
-	fprintf(stderr, "                          domain socket (Default: \"%s\")\n", hostname);
+	fprintf(stderr, "                          domain socket; comma separated list of\n");
+	fprintf(stderr, "                          host[:port] for failover (Default: \"%s\")\n", hostname);
 	fprintf(stderr, "  -p   --port             Authentication server listening port if not using\n");
 	fprintf(stderr, "                          UNIX domain socket as hostname (Default: %d)\n", port);
 	fprintf(stderr, "  -t   --timeout          Authentication timeout in seconds (Default: %d)\n", timeout);
+	fprintf(stderr, "  -D   --deferred         Return deferred authentication status (2) to openvpn\n");
+	fprintf(stderr, "                          immediately and write authentication result to\n");
+	fprintf(stderr, "                          auth_control_file from background process\n");
+	fprintf(stderr, "  -b   --broker           Run as authentication broker listening on\n");
+	fprintf(stderr, "                          broker_socket UNIX domain socket\n");
+	fprintf(stderr, "  -S   --timing-stats     Print phase timing histograms from timing_file\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "CONFIGURATION FILE AUTO LOAD ORDER:\n");
@@ -245,6 +276,18 @@ void print_default_config (void) {
 	printf("#\n");
 	printf("\n");
 	printf("# Authentication server IP address, full qualified domain name (FQDN) or socket file\n");
+	printf("#\n");
+	printf("# Multiple authentication servers can be specified as\n");
+	printf("# comma separated list without spaces; every server can\n");
+	printf("# have its own port (host:port):\n");
+	printf("#\n");
+	printf("#   hostname = auth1.example.org,auth2.example.org:1560\n");
+	printf("#\n");
+	printf("# Servers are tried in specified order; if server doesn't\n");
+	printf("# accept connection in connect_stagger milliseconds, next\n");
+	printf("# server is tried in parallel and first established\n");
+	printf("# connection is used.\n");
+	printf("#\n");
 	printf("# Type: string\n");
 	printf("# Default: %s\n", DEFAULT_HOSTNAME);
 	printf("hostname = %s\n", DEFAULT_HOSTNAME);
@@ -267,6 +310,184 @@ void print_default_config (void) {
 	printf("# Default: %d\n", DEFAULT_AUTH_TIMEOUT);
 	printf("timeout = %d\n", DEFAULT_AUTH_TIMEOUT);
 	printf("\n");
+	printf("# Client-server protocol version\n");
+	printf("#\n");
+	printf("# 1: text protocol (key=value lines)\n");
+	printf("# 2: length-prefixed binary protocol with numeric\n");
+	printf("#    status codes and server side timing; passwords\n");
+	printf("#    may contain any characters. Client falls back\n");
+	printf("#    to text protocol if server doesn't support it.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_PROTOCOL);
+	printf("protocol = %d\n", DEFAULT_PROTOCOL);
+	printf("\n");
+	printf("# Connect timeout in milliseconds for single\n");
+	printf("# authentication server.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_CONNECT_TIMEOUT);
+	printf("connect_timeout = %d\n", DEFAULT_CONNECT_TIMEOUT);
+	printf("\n");
+	printf("# Delay in milliseconds before next authentication\n");
+	printf("# server is tried in parallel with servers that\n");
+	printf("# haven't accepted connection yet.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_CONNECT_STAGGER);
+	printf("connect_stagger = %d\n", DEFAULT_CONNECT_STAGGER);
+	printf("\n");
+	printf("# Server health scoreboard file shared by all\n");
+	printf("# %s processes. Servers that failed to\n", MYNAME);
+	printf("# accept connection are tried last for health_ttl\n");
+	printf("# seconds. Set to \"none\" to disable scoreboard.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: %s\n", DEFAULT_HEALTH_FILE);
+	printf("health_file = %s\n", DEFAULT_HEALTH_FILE);
+	printf("\n");
+	printf("# How long (in seconds) unreachable authentication\n");
+	printf("# server is considered dead.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_HEALTH_TTL);
+	printf("health_ttl = %d\n", DEFAULT_HEALTH_TTL);
+	printf("\n");
+	printf("# Verdict cache file. If set, successful\n");
+	printf("# authentications are remembered for cache_ttl\n");
+	printf("# seconds and repeated logins with the same\n");
+	printf("# username, password and common name don't\n");
+	printf("# contact authentication server. Cache is shared\n");
+	printf("# by all %s processes and openvpn plugin.\n", MYNAME);
+	printf("#\n");
+	printf("# NOTE: disabled or changed password keeps working\n");
+	printf("#       until cached verdict expires.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (disabled)\n");
+	printf("cache_file = \n");
+	printf("\n");
+	printf("# Verdict cache entry lifetime in seconds\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_CACHE_TTL);
+	printf("cache_ttl = %d\n", DEFAULT_CACHE_TTL);
+	printf("\n");
+	printf("# Number of verdict cache entries; applies only\n");
+	printf("# when cache file is created.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_CACHE_SLOTS);
+	printf("cache_slots = %d\n", DEFAULT_CACHE_SLOTS);
+	printf("\n");
+	printf("# Use TLS for connections to authentication\n");
+	printf("# server? Server certificate is verified against\n");
+	printf("# tls_ca_file (or system CA certificates) and\n");
+	printf("# tls_server_name (or server's hostname). Server\n");
+	printf("# must run openvpn_authd front-end with TLS\n");
+	printf("# enabled. UNIX domain sockets are never encrypted.\n");
+	printf("#\n");
+	printf("# NOTE: requires %s compiled by \"make TLS=1\".\n", MYNAME);
+	printf("#\n");
+	printf("# Type: boolean\n");
+	printf("# Default: 0\n");
+	printf("tls = 0\n");
+	printf("\n");
+	printf("# CA certificate(s) file (PEM) used to verify\n");
+	printf("# authentication server's certificate.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (system CA certificates)\n");
+	printf("tls_ca_file = \n");
+	printf("\n");
+	printf("# Name expected in server certificate; IP\n");
+	printf("# addresses are matched against certificate's\n");
+	printf("# subjectAltName IP entries.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (server's hostname)\n");
+	printf("tls_server_name = \n");
+	printf("\n");
+	printf("# Client certificate and its private key (PEM),\n");
+	printf("# if server requires client certificates.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (no client certificate)\n");
+	printf("tls_cert_file = \n");
+	printf("tls_key_file = \n");
+	printf("\n");
+	printf("# TLS session file shared by all %s\n", MYNAME);
+	printf("# processes. Every run resumes TLS session\n");
+	printf("# negotiated by previous one, which is much cheaper\n");
+	printf("# than full TLS handshake. File contains session\n");
+	printf("# secrets and must be private to user running\n");
+	printf("# %s. Set to \"none\" to always do\n", MYNAME);
+	printf("# full handshake.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: %s\n", DEFAULT_TLS_SESSION_FILE);
+	printf("tls_session_file = %s\n", DEFAULT_TLS_SESSION_FILE);
+	printf("\n");
+	printf("# Phase timing histogram file shared by all\n");
+	printf("# %s processes and openvpn plugin.\n", MYNAME);
+	printf("# Every authentication is logged as single\n");
+	printf("# \"Timing:\" message with time spent in every\n");
+	printf("# phase (config, credentials, cache, resolve,\n");
+	printf("# connect, tls, send, wait); if this file is set,\n");
+	printf("# timings are also added to its histograms.\n");
+	printf("# Run %s --timing-stats to print them.\n", MYNAME);
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (disabled)\n");
+	printf("timing_file = \n");
+	printf("\n");
+	printf("# Use openvpn deferred authentication?\n");
+	printf("# If enabled, %s exits with status 2 immediately\n", MYNAME);
+	printf("# and writes authentication result into file\n");
+	printf("# specified by auth_control_file environment\n");
+	printf("# variable from background process.\n");
+	printf("#\n");
+	printf("# Type: boolean\n");
+	printf("# Default: 0\n");
+	printf("deferred = 0\n");
+	printf("\n");
+	printf("# Number of authentication worker threads\n");
+	printf("# started by openvpn_auth_plugin.so openvpn\n");
+	printf("# plugin. This option is ignored by %s.\n", MYNAME);
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_PLUGIN_WORKERS);
+	printf("plugin_workers = %d\n", DEFAULT_PLUGIN_WORKERS);
+	printf("\n");
+	printf("# Authentication broker UNIX domain socket.\n");
+	printf("# Broker (%s --broker) keeps persistent\n", MYNAME);
+	printf("# connections to authentication server and\n");
+	printf("# multiplexes authentication requests over them.\n");
+	printf("# If set, %s sends requests to broker\n", MYNAME);
+	printf("# and contacts authentication server directly\n");
+	printf("# only if broker is not running.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: \"\" (don't use broker)\n");
+	printf("broker_socket = \n");
+	printf("\n");
+	printf("# Number of persistent authentication server\n");
+	printf("# connections held by broker.\n");
+	printf("#\n");
+	printf("# Type: integer\n");
+	printf("# Default: %d\n", DEFAULT_BROKER_CONNECTIONS);
+	printf("broker_connections = %d\n", DEFAULT_BROKER_CONNECTIONS);
+	printf("\n");
+	printf("# Permissions (octal) and group of broker socket.\n");
+	printf("# Every local user who can connect to broker socket\n");
+	printf("# can verify credentials; allow access only to\n");
+	printf("# user (group) running openvpn.\n");
+	printf("#\n");
+	printf("# Type: string\n");
+	printf("# Default: %04o, \"\" (broker's group)\n", DEFAULT_BROKER_SOCKET_MODE);
+	printf("broker_socket_mode = %04o\n", DEFAULT_BROKER_SOCKET_MODE);
+	printf("broker_socket_group = \n");
+	printf("\n");
 	printf("# EOF\n");
 }
 
@@ -294,7 +515,7 @@ char * config_get_param (char *str) {
 	/** overwrite alpha chars */
 	memset(var_buf, '\0', sizeof(var_buf));
 	i = 0;
-	while(ptr != NULL && isalnum(*ptr)) {
+	while(ptr != NULL && (isalnum(*ptr) || *ptr == '_')) {
 		var_buf[i] = *ptr;
 		i++;
 		ptr++;
@@ -313,16 +534,17 @@ char * config_get_value (char *str) {
 	
 	/** find '=' char */
 	ptr = str;
-	while (ptr != NULL && (*ptr) != '=')
+	while ((*ptr) != '\0' && (*ptr) != '=')
 		ptr++;
+	if ((*ptr) == '\0') return NULL;
 	ptr++;
 	
-	/** skip whitespaces **/
-	while (ptr != NULL && ! isgraph(*ptr))
+	/** skip whitespaces; empty value must not run past end of line **/
+	while ((*ptr) != '\0' && ! isgraph(*ptr))
 		ptr++;
 
 	/** no value found? */
-	if (ptr == NULL) return NULL;
+	if ((*ptr) == '\0') return NULL;
 
 	/** overwrite alpha chars */
 	memset(val_buf, '\0', sizeof(val_buf));
@@ -375,6 +597,48 @@ int load_config_file (char *file) {
 			port = (val != NULL) ? atoi(val) : DEFAULT_PORT;
 		else if (strcmp(var, "timeout") == 0)
 			timeout = (val != NULL) ? atoi(val) : DEFAULT_AUTH_TIMEOUT;
+		else if (strcmp(var, "connect_timeout") == 0)
+			connect_timeout = atoi(val);
+		else if (strcmp(var, "connect_stagger") == 0)
+			connect_stagger = atoi(val);
+		else if (strcmp(var, "health_file") == 0)
+			snprintf(health_file, sizeof(health_file), "%s", (strcmp(val, "none") == 0) ? "" : val);
+		else if (strcmp(var, "health_ttl") == 0)
+			health_ttl = atoi(val);
+		else if (strcmp(var, "cache_file") == 0)
+			snprintf(cache_file, sizeof(cache_file), "%s", val);
+		else if (strcmp(var, "cache_ttl") == 0)
+			cache_ttl = atoi(val);
+		else if (strcmp(var, "cache_slots") == 0)
+			cache_slots = atoi(val);
+		else if (strcmp(var, "protocol") == 0)
+			protocol = atoi(val);
+		else if (strcmp(var, "broker_socket") == 0)
+			snprintf(broker_socket, sizeof(broker_socket), "%s", val);
+		else if (strcmp(var, "broker_connections") == 0)
+			broker_connections = atoi(val);
+		else if (strcmp(var, "broker_socket_mode") == 0)
+			broker_socket_mode = (int) strtol(val, NULL, 8);
+		else if (strcmp(var, "broker_socket_group") == 0)
+			snprintf(broker_socket_group, sizeof(broker_socket_group), "%s", val);
+		else if (strcmp(var, "tls") == 0)
+			tls = atoi(val);
+		else if (strcmp(var, "tls_ca_file") == 0)
+			snprintf(tls_ca_file, sizeof(tls_ca_file), "%s", val);
+		else if (strcmp(var, "tls_cert_file") == 0)
+			snprintf(tls_cert_file, sizeof(tls_cert_file), "%s", val);
+		else if (strcmp(var, "tls_key_file") == 0)
+			snprintf(tls_key_file, sizeof(tls_key_file), "%s", val);
+		else if (strcmp(var, "tls_server_name") == 0)
+			snprintf(tls_server_name, sizeof(tls_server_name), "%s", val);
+		else if (strcmp(var, "tls_session_file") == 0)
+			snprintf(tls_session_file, sizeof(tls_session_file), "%s", (strcmp(val, "none") == 0) ? "" : val);
+		else if (strcmp(var, "timing_file") == 0)
+			snprintf(timing_file, sizeof(timing_file), "%s", (strcmp(val, "none") == 0) ? "" : val);
+		else if (strcmp(var, "deferred") == 0)
+			deferred = atoi(val);
+		else if (strcmp(var, "plugin_workers") == 0)
+			plugin_workers = (val != NULL) ? atoi(val) : DEFAULT_PLUGIN_WORKERS;
 		else
 			log_msg("Warning: unknown configuration parameter '%s' in configuration file '%s' line %d.", var, file, lines);
 	}
@@ -471,70 +735,97 @@ int credentials_retr (struct auth *ptr, char *file) {
 }
 
 /**
- * Connects to authentication server
+ * applies authentication timeout to socket send/receive operations,
+ * so that callers without SIGALRM (openvpn plugin worker threads)
+ * never block forever on a stuck authentication server.
+ * @param sock socket file descriptor
+ */
+void srv_set_timeout (int sock) {
+	struct timeval tv;
+
+	if (timeout < 1) return;
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Connects to authentication server (or broker)
+ * @param host server host or path to unix domain socket
+ * @param srv_port server srv_port (ignored for unix domain sockets)
  * @return FILE* server socket filehandle on success, otherwise NULL
  */
-FILE * srv_connect (void) {
+FILE * srv_connect_to (const char *host, int srv_port) {
 	FILE *socketfd = NULL;	/** socket-wrapped filedescriptor */
+	int server_socket = -1;
 	struct sockaddr_un server_addr_un;
-	struct sockaddr_in local_addr, server_addr;
 
 	/* inet or unix domain socket? */
-	if (hostname[0] == '/') {
-		log_msg("Connecting to authentication server using UNIX domain socket %s.", hostname);
+	if (host[0] == '/') {
+		log_msg("Connecting to authentication server using UNIX domain socket %s.", host);
 		/** create unix socket */
 		if ((server_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
 			log_msg("Unable to create UNIX domain socket: %s (errno %d).", strerror(errno), errno);
+			return NULL;
 		}
+		memset(&server_addr_un, '\0', sizeof(server_addr_un));
 		server_addr_un.sun_family = AF_UNIX;
-		strncpy(server_addr_un.sun_path, hostname, 108);
+		snprintf(server_addr_un.sun_path, sizeof(server_addr_un.sun_path), "%s", host);
 		
 		int len = sizeof(server_addr_un.sun_family) + strlen(server_addr_un.sun_path);
+		srv_set_timeout(server_socket);
 	
 		/** connect to server */
+		long long t = clock_us();
 		if (connect(server_socket, (const struct sockaddr *) &server_addr_un, len) < 0) {
-			log_msg("Unable to connect to %s: %s (errno %d).", hostname, strerror(errno), errno);
+			log_msg("Unable to connect to %s: %s (errno %d).", host, strerror(errno), errno);
 			close(server_socket);
 			return NULL;
 		}
+		timing_add(TIMING_CONNECT, t);
 	} else {
-		log_msg("Connecting to authentication server %s:%d using TCP socket.", hostname, port);
-		struct hostent *h;		/** hostentry */
-		/** resolve */
-		if ((h = gethostbyname(hostname)) == NULL) {
-			log_msg("Unable resolve %s: %s (errno %d).", hostname, strerror(errno), errno);
-			return NULL;
-		}
-
-		if (h == NULL) {
-			log_msg("do_it(), line %d: (h->h_addr_list[0] == NULL) This is weird and should never happen!", __LINE__);
+		log_msg("Connecting to authentication server %s:%d using TCP socket.", host, srv_port);
+		struct addrinfo hints, *res = NULL, *ai;
+		char port_str[16];
+		long long t;
+		int r;
+
+		/** resolve (getaddrinfo(3) is reentrant, gethostbyname(3) is not) */
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port_str, sizeof(port_str), "%d", srv_port);
+
+		t = clock_us();
+		r = getaddrinfo(host, port_str, &hints, &res);
+		t = timing_add(TIMING_RESOLVE, t);
+		if (r != 0) {
+			log_msg("Unable resolve %s: %s.", host, gai_strerror(r));
 			return NULL;
 		}
 
-		server_addr.sin_family = h->h_addrtype;
-		memcpy((char *) &server_addr.sin_addr.s_addr, h->h_addr_list[0], h->h_length);
-		server_addr.sin_port = htons(port);
+		/** try resolved addresses until we're connected */
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((server_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+				log_msg("Unable to create INET socket: %s (errno %d).", strerror(errno), errno);
+				continue;
+			}
+			srv_set_timeout(server_socket);
 
-		/** create inet socket */
-		if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-			log_msg("Unable to create INET socket: %s (errno %d).", strerror(errno), errno);
-		}
-
-		/** bind any port number */
-		local_addr.sin_family = AF_INET;
-		local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-		local_addr.sin_port = htons(0);
+			/** connect to server */
+			if (connect(server_socket, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
 
-		if (bind(server_socket, (struct sockaddr *) &local_addr, sizeof(local_addr)) < 0) {
-			log_msg("Unable to bind %s:%d sock: %s (errno %d).", hostname, port, strerror(errno), errno);
+			log_msg("Unable to connect to %s:%d: %s (errno %d).", host, srv_port, strerror(errno), errno);
+			close(server_socket);
+			server_socket = -1;
 		}
+		freeaddrinfo(res);
+		timing_add(TIMING_CONNECT, t);
 
-		/** connect to server */
-		if (connect(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-			log_msg("Unable to connect to %s:%d: %s (errno %d).", hostname, port, strerror(errno), errno);
-			close(server_socket);
+		if (server_socket < 0)
 			return NULL;
-		}
 	}
 
 	/** wrap socket to filedescriptor */
@@ -547,32 +838,71 @@ FILE * srv_connect (void) {
 	return socketfd;
 }
 
+static int srv_connect_race (char *host, size_t host_len, int *srv_port, long long deadline);
+
+/**
+ * Connects to one of configured authentication servers
+ * @return FILE* server socket (or TLS connection) filehandle on success, otherwise NULL
+ */
+FILE * srv_connect (void) {
+	FILE *socketfd = NULL;
+	char host[GEN_BUF_SIZE];
+	int sock, srv_port;
+
+	if ((sock = srv_connect_race(host, sizeof(host), &srv_port, 0)) < 0)
+		return NULL;
+
+	/** UNIX domain socket connections are local and never encrypted */
+	if (tls && host[0] != '/') {
+		long long t = clock_us();
+		socketfd = tls_connect(sock, host, srv_port);
+		timing_add(TIMING_TLS, t);
+		return socketfd;
+	}
+
+	if ((socketfd = fdopen(sock, "r+")) == NULL) {
+		log_msg("Unable to create stream fd: %s (errno %d).", strerror(errno), errno);
+		close(sock);
+		return NULL;
+	}
+
+	return socketfd;
+}
+
+/**
+ * closes server connection (fclose(3) also closes underlying socket)
+ */
 void srv_disconnect (FILE *socketfd) {
 	fclose(socketfd);
-	close(server_socket);
 }
 
 /**
- * performs authentication
+ * formats authentication request
  * @param ptr authentication structure
- * @return integer 1 on success, otherwise 0
+ * @param buf output buffer
+ * @param len output buffer size
+ * @param id request id; if non-zero, request is tagged with id and
+ *           server is asked to keep connection open (keep-alive)
+ * @param deadline request deadline (see auth_deadline()), 0 for none
+ * @return number of bytes written into buf, 0 if request is too long or
+ *         contains line breaks
  */
-int authenticate (struct auth *ptr) {
-	char write_buf[GEN_BUF_SIZE];	/** socket fd write buffer */
-	char read_buf[GEN_BUF_SIZE];	/** socket fd read buffer */
-	FILE *sock = NULL;
-	char srv_code[4];
-	int result = 0;
-	
-	/** connect to server */
-	if ((sock = srv_connect()) == NULL)
-		return 0; 
-
-	/** format authentication string */
-	snprintf(
-		write_buf,
-		sizeof(write_buf),
-		"username=%s\npassword=%s\ncommon_name=%s\nhost=%s\nport=%d\n\n",
+int auth_format_request (struct auth *ptr, char *buf, size_t len, unsigned int id, long long deadline) {
+	/**
+	 * line break would let one request smuggle another one (or its own
+	 * request id) onto connection shared with other users' requests
+	 */
+	if (strpbrk(ptr->username, "\r\n") != NULL || strpbrk(ptr->password, "\r\n") != NULL ||
+		(ptr->common_name != NULL && strpbrk(ptr->common_name, "\r\n") != NULL) ||
+		(ptr->untrusted_ip != NULL && strpbrk(ptr->untrusted_ip, "\r\n") != NULL)) {
+		log_msg("Authentication request for user '%s' contains line break; refusing to send it.", ptr->username);
+		return 0;
+	}
+
+	int r = snprintf(
+		buf,
+		len,
+		"username=%s\npassword=%s\ncommon_name=%s\nhost=%s\nport=%d\n",
 		ptr->username,
 		ptr->password,
 		ptr->common_name,
@@ -580,104 +910,1710 @@ int authenticate (struct auth *ptr) {
 		ptr->untrusted_port
 	);
 
-	/** send it to server and flush buffers */
-	fprintf(sock, "%s", write_buf);
-	fflush(sock);
+	if (r < 0 || (size_t) r >= len) return 0;
 
-	/* read response from server */
-	if (! fgets(read_buf, sizeof(read_buf), sock)) {
-		log_msg("No response read from authentication server: %s (errno %d)", strerror(errno), errno);
-		goto outta_func;
-	}
-	else if (strlen(read_buf) < 3) {
-		log_msg("Invalid response from server: %s", read_buf);
-		goto outta_func;
+	if (deadline > 0)
+		r += snprintf(buf + r, len - r, "deadline=%lld\n", deadline);
+	if ((size_t) r >= len) return 0;
+
+	if (id > 0)
+		r += snprintf(buf + r, len - r, "id=%u\nkeepalive=1\n\n", id);
+	else
+		r += snprintf(buf + r, len - r, "\n");
+
+	return ((size_t) r >= len) ? 0 : r;
+}
+
+/**
+ * strips request id from keep-alive authentication server response
+ * ("<id> OK message")
+ * @param line pointer to response line, advanced past request id
+ * @return request id or 0 if response is not tagged
+ */
+unsigned int auth_response_id (char **line) {
+	char *ptr = *line;
+	unsigned int id = 0;
+
+	if (! isdigit(*ptr)) return 0;
+	while (isdigit(*ptr))
+		id = id * 10 + (*ptr++ - '0');
+	if (*ptr != ' ') return 0;
+
+	*line = ptr + 1;
+	return id;
+}
+
+/**
+ * evaluates authentication server response line
+ * @param ptr authentication structure
+ * @param line response line read from server
+ * @return integer 1 on success, otherwise 0
+ */
+int auth_check_response (struct auth *ptr, char *line) {
+	char srv_code[4];
+
+	if (strlen(line) < 3) {
+		log_msg("Invalid response from server: %s", line);
+		return 0;
 	}
 
 	/** chop result code and message */
 	memset(srv_code, '\0', sizeof(srv_code));
-	chomp(read_buf);
-	strncpy(srv_code, read_buf, 2);
+	chomp(line);
+	memcpy(srv_code, line, 2);
 
-	if (strcasecmp(srv_code, "OK") != 0)
-		log_msg("Authentication FAILED for user '%s': %s", ptr->username, read_buf);
-	else {
-		log_msg("Authentication SUCCEEDED for user '%s'", ptr->username);
-		result = 1;
+	if (strcasecmp(srv_code, "OK") != 0) {
+		log_msg("Authentication FAILED for user '%s': %s", ptr->username, line);
+		return 0;
 	}
 
-	outta_func:
+	log_msg("Authentication SUCCEEDED for user '%s'", ptr->username);
+	/** remember positive verdict (no-op if verdict cache is disabled) */
+	cache_store(ptr);
+	return 1;
+}
 
-	/* close socket */
-	srv_disconnect(sock);
+/**
+ * writes whole buffer to socket without raising SIGPIPE
+ * @return 1 on success, otherwise 0
+ */
+int srv_write (FILE *sock, const char *buf, size_t len) {
+	size_t off = 0;
+	ssize_t n;
 
-	return result;
+	/** TLS connection stream has no file descriptor */
+	if (fileno(sock) < 0)
+		return (fwrite(buf, 1, len, sock) == len && fflush(sock) == 0) ? 1 : 0;
+
+	while (off < len) {
+		if ((n = send(fileno(sock), buf + off, len - off, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		off += n;
+	}
+
+	return 1;
 }
 
 /**
- * main routine
+ * protocol of calling thread's persistent connection (see authenticate_keepalive())
  */
-int main (int argc, char **argv) {
-	/** command line parsing */
-	extern char *optarg;
-	extern int optind;
-	char *tmp;
-	struct auth *auth_str;
-	struct sigaction act;
-	struct termio tty, oldtty;
-	int cred_from_cmdl = 0;
+static __thread int keepalive_v2 = 0;
 
-	MYNAME = basename(argv[0]);
-	strncpy(hostname, DEFAULT_HOSTNAME, sizeof(hostname));
+/**
+ * @return 1 if binary protocol v2 should be used, otherwise 0
+ */
+static int proto_v2 (void) {
+	return (protocol >= 2 && ! protocol_fallback) ? 1 : 0;
+}
 
-	/** try to load configuration files */
-	load_config_files();
+/**
+ * appends TLV record to protocol v2 frame
+ * @return new buffer offset or 0 if buffer is too small
+ */
+size_t proto2_tlv (unsigned char *buf, size_t off, size_t len, int type, const void *val, size_t vlen) {
+	if (off == 0 || vlen > 0xffff || off + 3 + vlen > len) return 0;
+	buf[off] = (unsigned char) type;
+	buf[off + 1] = (unsigned char) (vlen >> 8);
+	buf[off + 2] = (unsigned char) vlen;
+	memcpy(buf + off + 3, val, vlen);
+	return off + 3 + vlen;
+}
 
-	/** initialize authentication structure */
-	if ((auth_str = authstruct_init()) == NULL) {
-		log_msg("Unable to initialize authentication structure... Possibly out of memory.");
-		return 1;
+size_t proto2_tlv_u32 (unsigned char *buf, size_t off, size_t len, int type, unsigned int val) {
+	unsigned char v[4] = { val >> 24, val >> 16, val >> 8, val };
+	return proto2_tlv(buf, off, len, type, v, sizeof(v));
+}
+
+size_t proto2_tlv_u64 (unsigned char *buf, size_t off, size_t len, int type, unsigned long long val) {
+	unsigned char v[8] = { val >> 56, val >> 48, val >> 40, val >> 32, val >> 24, val >> 16, val >> 8, val };
+	return proto2_tlv(buf, off, len, type, v, sizeof(v));
+}
+
+/**
+ * writes protocol v2 frame header in front of payload written at start + PROTO_HDR_LEN
+ * @return offset of frame end or 0 if frame doesn't fit into buffer
+ */
+size_t proto2_frame (unsigned char *buf, size_t start, size_t end, int type) {
+	size_t plen = end - start - PROTO_HDR_LEN;
+
+	if (end == 0) return 0;
+	buf[start] = PROTO_MAGIC;
+	buf[start + 1] = PROTO_VERSION;
+	buf[start + 2] = (unsigned char) type;
+	buf[start + 3] = 0;
+	buf[start + 4] = (unsigned char) (plen >> 24);
+	buf[start + 5] = (unsigned char) (plen >> 16);
+	buf[start + 6] = (unsigned char) (plen >> 8);
+	buf[start + 7] = (unsigned char) plen;
+
+	return end;
+}
+
+/**
+ * formats protocol v2 authentication request
+ * @param ptr authentication structure
+ * @param buf output buffer
+ * @param len output buffer size
+ * @param id request id; if non-zero, request is tagged with id and
+ *           server is asked to keep connection open (keep-alive)
+ * @param hello prepend HELLO frame (first request on connection)
+ * @return number of bytes written into buf or 0 if buf is too small
+ */
+int proto2_format_request (struct auth *ptr, unsigned char *buf, size_t len, unsigned int id, int hello) {
+	unsigned char ver = PROTO_VERSION, one = 1;
+	unsigned char port_buf[2] = { ptr->untrusted_port >> 8, ptr->untrusted_port };
+	char agent[64];
+	size_t start = 0, off;
+
+	if (hello) {
+		snprintf(agent, sizeof(agent), "%s %s", MYNAME, VERSION);
+		off = proto2_tlv(buf, PROTO_HDR_LEN, len, PROTO_T_VERSION, &ver, 1);
+		off = proto2_tlv_u32(buf, off, len, PROTO_T_CAPS, PROTO_CAP_KEEPALIVE | PROTO_CAP_ID | PROTO_CAP_TIMING);
+		off = proto2_tlv(buf, off, len, PROTO_T_AGENT, agent, strlen(agent));
+		/**
+		 * empty line terminates text protocol request: server without
+		 * protocol v2 support replies to HELLO right away instead of
+		 * waiting for more request lines until its timeout.
+		 */
+		off = proto2_tlv(buf, off, len, PROTO_T_COMPAT, "\n\n", 2);
+		if ((start = proto2_frame(buf, 0, off, PROTO_HELLO)) == 0) return 0;
 	}
 
-	/* configure command line parser */
-	static struct option long_options[] = {
-		/* These options set a flag. */
-		{"default-config", no_argument, NULL, 'd'},
-		{"verbose", no_argument, NULL, 'v'},
-		{"version", no_argument, NULL, 'V'},
-		{"help", no_argument, NULL, 'h'},
+	off = start + PROTO_HDR_LEN;
+	if (off > len) return 0;
+	off = proto2_tlv(buf, off, len, PROTO_T_USERNAME, ptr->username, strlen(ptr->username));
+	off = proto2_tlv(buf, off, len, PROTO_T_PASSWORD, ptr->password, strlen(ptr->password));
+	off = proto2_tlv(buf, off, len, PROTO_T_COMMON_NAME, ptr->common_name, (ptr->common_name != NULL) ? strlen(ptr->common_name) : 0);
+	off = proto2_tlv(buf, off, len, PROTO_T_HOST, ptr->untrusted_ip, (ptr->untrusted_ip != NULL) ? strlen(ptr->untrusted_ip) : 0);
+	off = proto2_tlv(buf, off, len, PROTO_T_PORT, port_buf, sizeof(port_buf));
+	if (timeout > 0)
+		off = proto2_tlv_u64(buf, off, len, PROTO_T_DEADLINE, (unsigned long long) auth_deadline());
+	if (id > 0) {
+		off = proto2_tlv_u32(buf, off, len, PROTO_T_ID, id);
+		off = proto2_tlv(buf, off, len, PROTO_T_KEEPALIVE, &one, 1);
+	}
 
-		/* These options require argument */
-		{"config", required_argument, NULL, 'c'},
-		{"hostname", required_argument, NULL, 'H'},
-		{"port", required_argument, NULL, 'p'},
+	return (int) proto2_frame(buf, start, off, PROTO_AUTH_REQUEST);
+}
 
-		{"user", required_argument, NULL, 'U'},
-		{"pass", required_argument, NULL, 'P'},
-		{"cn", required_argument, NULL, 'C'},
-		{"client-ip", required_argument, NULL, 'X'},
-		{"client-port", required_argument, NULL, 'Y'},
-	};
+/**
+ * checks protocol v2 frame header
+ * @return total frame length, 0 if frame is not complete yet, -1 if header is invalid
+ */
+ssize_t proto2_frame_len (const unsigned char *buf, size_t len) {
+	size_t plen;
 
-	
-	/* parse command line */
-	int r = 1;
-	int opt_idx = 0;		/* option index */
-	while (r) {
-		int c = 0;			/* option character */
-		c = getopt_long(argc, argv, "c:H:p:U:P:C:X:Y:vhdV", long_options, &opt_idx);
+	if (len < PROTO_HDR_LEN) return 0;
+	if (buf[0] != PROTO_MAGIC || buf[1] != PROTO_VERSION) return -1;
+	plen = ((size_t) buf[4] << 24) | ((size_t) buf[5] << 16) | ((size_t) buf[6] << 8) | buf[7];
+	if (plen > PROTO_MAX_FRAME) return -1;
+	if (len < PROTO_HDR_LEN + plen) return 0;
 
-		switch (c) {
-			case 'c':
-				if (! load_config_file(optarg)) {
-					fprintf(stderr, "Unable to parse config file '%s': %s\n", optarg, strerror(errno));
-					return 1;
-				}
+	return PROTO_HDR_LEN + plen;
+}
+
+/**
+ * reads single protocol v2 frame from server
+ * @return total frame length, 0 on EOF/error, -1 on invalid frame,
+ *         -2 if server replied using text protocol
+ */
+ssize_t proto2_read_frame (FILE *sock, unsigned char *buf, size_t len) {
+	ssize_t flen;
+
+	buf[0] = PROTO_MAGIC;
+	if (fread(buf, 1, PROTO_HDR_LEN, sock) != PROTO_HDR_LEN) {
+		/** text protocol server's "NO ..." reply is shorter than frame header */
+		return (ferror(sock) == 0 && buf[0] != PROTO_MAGIC && (buf[0] == 'N' || buf[0] == 'O')) ? -2 : 0;
+	}
+	if (buf[0] != PROTO_MAGIC) return -2;
+	if ((flen = proto2_frame_len(buf, PROTO_HDR_LEN)) == 0)
+		flen = PROTO_HDR_LEN + (((size_t) buf[4] << 24) | ((size_t) buf[5] << 16) | ((size_t) buf[6] << 8) | buf[7]);
+	if (flen < 0 || (size_t) flen > len) return -1;
+	if (flen > PROTO_HDR_LEN && fread(buf + PROTO_HDR_LEN, 1, flen - PROTO_HDR_LEN, sock) != (size_t) flen - PROTO_HDR_LEN)
+		return 0;
+
+	return flen;
+}
+
+unsigned int proto2_u32 (const unsigned char *val, size_t len) {
+	unsigned int r = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < 4; i++)
+		r = (r << 8) | val[i];
+	return r;
+}
+
+unsigned long long proto2_u64 (const unsigned char *val, size_t len) {
+	unsigned long long r = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < 8; i++)
+		r = (r << 8) | val[i];
+	return r;
+}
+
+/**
+ * evaluates protocol v2 AUTH_RESPONSE frame; TLV values are
+ * read in place, nothing is copied out of frame buffer.
+ * @param ptr authentication structure
+ * @param frame complete response frame
+ * @param len frame length
+ * @param id set to response's request id (0 if not tagged)
+ * @return integer 1 on success, otherwise 0
+ */
+int proto2_check_response (struct auth *ptr, const unsigned char *frame, size_t len, unsigned int *id) {
+	static const char *status_str[] = { "OK", "DENIED", "TIMEOUT", "INVALID", "ERROR", "OVERLOADED" };
+	const unsigned char *msg = (const unsigned char *) "";
+	const unsigned char *p = frame + PROTO_HDR_LEN, *end = frame + len;
+	size_t msg_len = 0, l;
+	int status = -1, timing = 0;
+	unsigned int server_us = 0;
+
+	*id = 0;
+	if (len < PROTO_HDR_LEN || frame[2] != PROTO_AUTH_RESPONSE) {
+		log_msg("Invalid response frame type %d from server.", (len < PROTO_HDR_LEN) ? -1 : frame[2]);
+		return 0;
+	}
+
+	while (p + 3 <= end) {
+		l = ((size_t) p[1] << 8) | p[2];
+		if (p + 3 + l > end) break;
+		switch (p[0]) {
+			case PROTO_T_ID:
+				*id = proto2_u32(p + 3, l);
 				break;
-			case 'H':
-				strncpy(hostname, optarg, sizeof(hostname));
+			case PROTO_T_STATUS:
+				status = (l > 0) ? p[3] : -1;
 				break;
-			case 'p':
+			case PROTO_T_MESSAGE:
+				msg = p + 3;
+				msg_len = l;
+				break;
+			case PROTO_T_SERVER_TIME:
+				server_us = proto2_u32(p + 3, l);
+				timing = 1;
+				break;
+		}
+		p += 3 + l;
+	}
+
+	if (status != PROTO_STATUS_OK) {
+		log_msg(
+			"Authentication FAILED for user '%s': %s (status %d), %.*s",
+			ptr->username,
+			(status >= 0 && status <= PROTO_STATUS_OVERLOADED) ? status_str[status] : "UNKNOWN",
+			status,
+			(int) msg_len, msg
+		);
+		return 0;
+	}
+
+	if (timing)
+		log_msg("Authentication SUCCEEDED for user '%s' (server time %u us)", ptr->username, server_us);
+	else
+		log_msg("Authentication SUCCEEDED for user '%s'", ptr->username);
+	cache_store(ptr);
+	return 1;
+}
+
+/**
+ * sends authentication request over connected socket and evaluates response
+ * @param sock connection filehandle
+ * @param ptr authentication structure
+ * @param id request id (0: no keep-alive)
+ * @param v2 use binary protocol v2
+ * @param hello send protocol v2 HELLO frame (first request on connection)
+ * @param broker connection is to authentication broker, which sets
+ *        request deadline itself
+ * @param rid set to response's request id
+ * @return 1 on success, 0 on failed authentication, -1 if no
+ *         response was read, -2 if server doesn't speak protocol v2
+ */
+static int auth_exchange (FILE *sock, struct auth *ptr, unsigned int id, int v2, int hello, int broker, unsigned int *rid) {
+	unsigned char write_buf[PROTO_BUF_SIZE];	/** socket fd write buffer */
+	unsigned char read_buf[PROTO_BUF_SIZE];		/** socket fd read buffer */
+	char *line;
+	ssize_t n;
+	long long t;
+	int len, r = -1;
+
+	*rid = 0;
+
+	/** format authentication request */
+	if (v2)
+		len = proto2_format_request(ptr, write_buf, sizeof(write_buf), id, hello);
+	else
+		len = auth_format_request(ptr, (char *) write_buf, sizeof(write_buf), id, (broker || timeout < 1) ? 0 : auth_deadline());
+	if (len < 1) {
+		log_msg("Unable to format authentication request for user '%s'.", ptr->username);
+		return 0;
+	}
+
+	/** send it to server */
+	t = clock_us();
+	n = srv_write(sock, (char *) write_buf, len);
+	t = timing_add(TIMING_SEND, t);
+	if (! n)
+		goto outta_func;
+
+	/* read response from server */
+	if (v2) {
+		/** skip server's HELLO */
+		while ((n = proto2_read_frame(sock, read_buf, sizeof(read_buf))) > 0 && read_buf[2] == PROTO_HELLO)
+			;
+		if (n == -2)
+			r = -2;
+		else if (n < 0) {
+			log_msg("Invalid protocol v2 frame received from authentication server.");
+			r = 0;
+		}
+		else if (n > 0)
+			r = proto2_check_response(ptr, read_buf, n, rid);
+	}
+	else if (fgets((char *) read_buf, sizeof(read_buf), sock)) {
+		line = (char *) read_buf;
+		*rid = auth_response_id(&line);
+		r = auth_check_response(ptr, line);
+	}
+	timing_add(TIMING_WAIT, t);
+
+	outta_func:
+	memset(write_buf, '\0', sizeof(write_buf));
+
+	return r;
+}
+
+/**
+ * performs authentication
+ * @param ptr authentication structure
+ * @return integer 1 on success, otherwise 0
+ */
+int authenticate (struct auth *ptr) {
+	FILE *sock = NULL;
+	unsigned int rid;
+	int v2 = 0, broker = 0, r;
+	
+	/** connect to broker (text protocol only) or server */
+	if (broker_socket[0] != '\0') {
+		if ((sock = srv_connect_to(broker_socket, 0)) == NULL)
+			log_msg("Authentication broker %s is not available, connecting to authentication server directly.", broker_socket);
+		else
+			broker = 1;
+	}
+	if (sock == NULL) {
+		if ((sock = srv_connect()) == NULL)
+			return 0;
+		v2 = proto_v2();
+	}
+
+	r = auth_exchange(sock, ptr, 0, v2, v2, broker, &rid);
+
+	/** old server: retry using text protocol */
+	if (r == -2) {
+		log_msg("Authentication server doesn't support protocol v2, falling back to text protocol (set protocol = 1 to avoid this).");
+		protocol_fallback = 1;
+		srv_disconnect(sock);
+		if ((sock = srv_connect()) == NULL)
+			return 0;
+		r = auth_exchange(sock, ptr, 0, 0, 0, 0, &rid);
+	}
+	if (r < 0)
+		log_msg("No response read from authentication server: %s (errno %d)", strerror(errno), errno);
+
+	/* close socket */
+	srv_disconnect(sock);
+
+	return (r > 0) ? 1 : 0;
+}
+
+/**
+ * performs authentication over persistent (keep-alive) connection;
+ * connection is (re)established as needed and closed if server
+ * doesn't support keep-alive connections.
+ *
+ * @param sockp pointer to connection filehandle (NULL if not connected)
+ * @param ptr authentication structure
+ * @param next_id pointer to request id counter
+ * @return integer 1 on success, otherwise 0
+ */
+int authenticate_keepalive (FILE **sockp, struct auth *ptr, unsigned int *next_id) {
+	unsigned int id, rid;
+	int attempt, reused, r, result = 0;
+
+	for (attempt = 0; attempt < 3; attempt++) {
+		reused = (*sockp != NULL);
+		if (*sockp == NULL && (*sockp = srv_connect()) == NULL)
+			break;
+
+		if (++(*next_id) == 0) ++(*next_id);
+		id = *next_id;
+
+		/** protocol is chosen per connection: HELLO is sent only on fresh connection */
+		if (! reused)
+			keepalive_v2 = proto_v2();
+		r = auth_exchange(*sockp, ptr, id, keepalive_v2, ! reused, 0, &rid);
+
+		if (r == -2) {
+			log_msg("Authentication server doesn't support protocol v2, falling back to text protocol (set protocol = 1 to avoid this).");
+			protocol_fallback = 1;
+			srv_disconnect(*sockp);
+			*sockp = NULL;
+			continue;
+		}
+		if (r < 0) {
+			srv_disconnect(*sockp);
+			*sockp = NULL;
+			/** server has probably closed idle connection, try again */
+			if (reused) continue;
+			log_msg("No response read from authentication server: %s (errno %d)", strerror(errno), errno);
+			break;
+		}
+		result = r;
+
+		/** server without keep-alive support closes connection after response */
+		if (rid != id) {
+			if (rid != 0)
+				log_msg("Invalid response id %u from server (expected %u).", rid, id);
+			srv_disconnect(*sockp);
+			*sockp = NULL;
+			if (rid != 0) result = 0;
+		}
+		break;
+	}
+
+	return result;
+}
+
+/**
+ * writes authentication verdict to openvpn's auth_control_file; verdict
+ * is written to temporary file in the same directory, which is renamed
+ * over auth_control_file, so openvpn never reads empty file.
+ * @param file auth_control_file path
+ * @param result authentication result
+ * @return 1 on success, otherwise 0
+ */
+int auth_control_write (const char *file, int result) {
+	char tmp[GEN_BUF_SIZE];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= (int) sizeof(tmp)) {
+		log_msg("Too long auth_control_file path %s.", file);
+		return 0;
+	}
+	if ((fd = mkstemp(tmp)) < 0) {
+		log_msg("Unable to create temporary auth_control_file %s: %s (errno %d).", tmp, strerror(errno), errno);
+		return 0;
+	}
+	if (write(fd, (result) ? "1" : "0", 1) != 1) {
+		log_msg("Unable to write auth_control_file %s: %s (errno %d).", tmp, strerror(errno), errno);
+		close(fd);
+		unlink(tmp);
+		return 0;
+	}
+	close(fd);
+
+	if (rename(tmp, file) < 0) {
+		log_msg("Unable to rename %s to auth_control_file %s: %s (errno %d).", tmp, file, strerror(errno), errno);
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/**
+ * returns milliseconds elapsed on monotonic clock
+ */
+long long clock_ms (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * returns microseconds elapsed on monotonic clock
+ */
+long long clock_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * returns milliseconds since epoch; unlike clock_ms() comparable
+ * between processes sharing health scoreboard file.
+ */
+long long wall_ms (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * returns request deadline sent to authentication server (milliseconds
+ * since epoch); server drops requests that waited in its queue past the
+ * moment we stop waiting for reply.
+ */
+long long auth_deadline (void) {
+	return wall_ms() + (long long) timeout * 1000;
+}
+
+/**
+ * authentication server list entry
+ */
+struct auth_server {
+	char host[GEN_BUF_SIZE];
+	int port;
+};
+
+/**
+ * splits hostname configuration parameter ("host1,host2:port,/path/to/socket")
+ * into server list; servers without explicit port use port parameter.
+ * @return number of servers
+ */
+static int srv_list (struct auth_server *list, int max) {
+	char buf[GEN_BUF_SIZE];
+	char *tok, *saveptr = NULL, *colon;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", hostname);
+	for (tok = strtok_r(buf, ", \t", &saveptr); tok != NULL && n < max; tok = strtok_r(NULL, ", \t", &saveptr)) {
+		snprintf(list[n].host, sizeof(list[n].host), "%s", tok);
+		list[n].port = port;
+		/** host:port (but not IPv6 address) */
+		if (tok[0] != '/' && (colon = strchr(list[n].host, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+			*colon = '\0';
+			list[n].port = atoi(colon + 1);
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * server health scoreboard entry; scoreboard is small file mapped into
+ * memory by all openvpn_authc processes (and plugin threads), so that
+ * servers known to be dead are not waited for on every login.
+ */
+struct srv_health {
+	unsigned int key;
+	unsigned int fails;
+	long long dead_until;		/** wall clock ms */
+};
+
+static unsigned int srv_health_key (struct auth_server *srv) {
+	unsigned int h = 2166136261U;	/** FNV-1a */
+	const char *ptr;
+
+	for (ptr = srv->host; *ptr != '\0'; ptr++)
+		h = (h ^ (unsigned char) *ptr) * 16777619U;
+	h = (h ^ (unsigned int) srv->port) * 16777619U;
+
+	return (h == 0) ? 1 : h;
+}
+
+/**
+ * maps health scoreboard file
+ * @return pointer to HEALTH_SLOTS scoreboard entries or NULL if scoreboard is disabled/unavailable
+ */
+static struct srv_health * srv_health_open (void) {
+	struct srv_health *ptr;
+	struct stat st;
+	size_t size = HEALTH_SLOTS * sizeof(struct srv_health);
+	int fd;
+
+	if (health_file[0] == '\0') return NULL;
+	if ((fd = open(health_file, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) < 0)
+		return NULL;
+	/** others must not be able to mark servers dead */
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		log_msg("Server health file %s is not private to uid %d, not tracking server health.", health_file, (int) geteuid());
+		close(fd);
+		return NULL;
+	}
+	if ((size_t) st.st_size < size && ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static void srv_health_close (struct srv_health *health) {
+	if (health != NULL)
+		munmap(health, HEALTH_SLOTS * sizeof(struct srv_health));
+}
+
+static struct srv_health * srv_health_find (struct srv_health *health, struct auth_server *srv, int create) {
+	unsigned int key = srv_health_key(srv);
+	int i, slot = -1;
+
+	if (health == NULL) return NULL;
+	for (i = 0; i < HEALTH_SLOTS; i++) {
+		if (health[i].key == key) return &health[i];
+		if (slot < 0 && (health[i].key == 0 || health[i].dead_until == 0)) slot = i;
+	}
+	if (! create) return NULL;
+	/** reuse slot of healthy (or unused) server, evict oldest entry otherwise */
+	if (slot < 0) {
+		slot = 0;
+		for (i = 1; i < HEALTH_SLOTS; i++)
+			if (health[i].dead_until < health[slot].dead_until) slot = i;
+	}
+	health[slot].key = key;
+	health[slot].fails = 0;
+	health[slot].dead_until = 0;
+
+	return &health[slot];
+}
+
+/**
+ * @return 1 if server is marked dead in health scoreboard, otherwise 0
+ */
+static int srv_health_dead (struct srv_health *health, struct auth_server *srv) {
+	struct srv_health *e = srv_health_find(health, srv, 0);
+	return (e != NULL && e->dead_until > wall_ms()) ? 1 : 0;
+}
+
+static void srv_health_update (struct srv_health *health, struct auth_server *srv, int alive) {
+	struct srv_health *e;
+
+	if (alive) {
+		/** don't touch scoreboard for servers that were never dead */
+		if ((e = srv_health_find(health, srv, 0)) != NULL && e->fails > 0)
+			log_msg("Authentication server %s:%d is alive again.", srv->host, srv->port);
+		if (e != NULL) {
+			e->fails = 0;
+			e->dead_until = 0;
+		}
+		return;
+	}
+
+	if ((e = srv_health_find(health, srv, 1)) == NULL) return;
+	e->fails++;
+	e->dead_until = wall_ms() + (long long) health_ttl * 1000;
+}
+
+/**
+ * records connect result for server returned by srv_connect_nb()
+ * @param server server index
+ * @param alive 1 if server is reachable, otherwise 0
+ */
+void srv_health_mark (int server, int alive) {
+	struct auth_server list[MAX_SERVERS];
+	struct srv_health *health;
+
+	if (server < 0 || server >= srv_list(list, MAX_SERVERS)) return;
+	health = srv_health_open();
+	srv_health_update(health, &list[server], alive);
+	srv_health_close(health);
+}
+
+/**
+ * returns address of server returned by srv_connect_nb()
+ * @param server server index
+ * @param host buffer for server host or UNIX domain socket path
+ * @param len host buffer size
+ * @param srv_port set to server port
+ * @return 1 on success, 0 if server index is invalid
+ */
+int srv_address (int server, char *host, size_t len, int *srv_port) {
+	struct auth_server list[MAX_SERVERS];
+
+	if (server < 0 || server >= srv_list(list, MAX_SERVERS)) return 0;
+	snprintf(host, len, "%s", list[server].host);
+	*srv_port = list[server].port;
+
+	return 1;
+}
+
+/**
+ * orders servers for connecting: servers marked dead in health
+ * scoreboard are moved to the end of list and tried only as last resort.
+ * @return number of servers in order
+ */
+static int srv_order (struct auth_server *list, int n, struct srv_health *health, int *order) {
+	int i, k = 0;
+
+	for (i = 0; i < n; i++)
+		if (! srv_health_dead(health, &list[i])) order[k++] = i;
+	for (i = 0; i < n; i++) {
+		if (! srv_health_dead(health, &list[i])) continue;
+		log_msg("Authentication server %s:%d is marked dead, trying it last.", list[i].host, list[i].port);
+		order[k++] = i;
+	}
+
+	return k;
+}
+
+/**
+ * starts non-blocking connect to single authentication server
+ * @param connected set to 1 if connection was established immediately
+ * @return socket file descriptor on success, otherwise -1
+ */
+static int srv_connect_start (struct auth_server *srv, int *connected) {
+	int sock = -1;
+	struct sockaddr_un server_addr_un;
+
+	*connected = 0;
+	if (srv->host[0] == '/') {
+		if (strlen(srv->host) >= sizeof(server_addr_un.sun_path)) {
+			log_msg("Unable to connect to %s: path of UNIX domain socket is too long.", srv->host);
+			return -1;
+		}
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			log_msg("Unable to create UNIX domain socket: %s (errno %d).", strerror(errno), errno);
+			return -1;
+		}
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+		memset(&server_addr_un, '\0', sizeof(server_addr_un));
+		server_addr_un.sun_family = AF_UNIX;
+		memcpy(server_addr_un.sun_path, srv->host, strlen(srv->host));
+
+		/** EAGAIN: listen backlog is full, socket is not connecting */
+		if (connect(sock, (const struct sockaddr *) &server_addr_un, sizeof(server_addr_un)) == 0)
+			*connected = 1;
+		else if (errno == EAGAIN) {
+			log_msg("Unable to connect to %s: listen queue is full.", srv->host);
+			close(sock);
+			errno = EAGAIN;
+			return -1;
+		}
+		else if (errno != EINPROGRESS) {
+			log_msg("Unable to connect to %s: %s (errno %d).", srv->host, strerror(errno), errno);
+			close(sock);
+			return -1;
+		}
+	} else {
+		struct addrinfo hints, *res = NULL, *ai;
+		char port_str[16];
+		long long t;
+		int r;
+
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port_str, sizeof(port_str), "%d", srv->port);
+
+		t = clock_us();
+		r = getaddrinfo(srv->host, port_str, &hints, &res);
+		timing_add(TIMING_RESOLVE, t);
+		if (r != 0) {
+			log_msg("Unable resolve %s: %s.", srv->host, gai_strerror(r));
+			return -1;
+		}
+
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+			if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+				*connected = 1;
+				break;
+			}
+			if (errno == EINPROGRESS)
+				break;
+			log_msg("Unable to connect to %s:%d: %s (errno %d).", srv->host, srv->port, strerror(errno), errno);
+			close(sock);
+			sock = -1;
+		}
+		freeaddrinfo(res);
+	}
+
+	return sock;
+}
+
+/**
+ * starts non-blocking connect to first authentication server not
+ * marked dead in health scoreboard (used by broker's event loop)
+ * @param server set to index of chosen server, see srv_health_mark()
+ * @return socket file descriptor with connect in progress on success, otherwise -1
+ */
+int srv_connect_nb (int *server) {
+	struct auth_server list[MAX_SERVERS];
+	int order[MAX_SERVERS];
+	struct srv_health *health;
+	int i, n, sock = -1, connected;
+
+	n = srv_list(list, MAX_SERVERS);
+	health = srv_health_open();
+	n = srv_order(list, n, health, order);
+
+	for (i = 0; i < n && sock < 0; i++) {
+		*server = order[i];
+		/** busy server (full listen queue) isn't dead */
+		if ((sock = srv_connect_start(&list[order[i]], &connected)) < 0 && errno != EAGAIN)
+			srv_health_update(health, &list[order[i]], 0);
+	}
+	srv_health_close(health);
+
+	return sock;
+}
+
+/**
+ * connects to one of configured authentication servers.
+ *
+ * Non-blocking connects are raced: next server in list is tried after
+ * connect_stagger milliseconds (or immediately if previous connect
+ * has failed), every connect attempt is abandoned after connect_timeout
+ * milliseconds. First established connection wins. Unreachable servers
+ * are marked dead in health scoreboard for health_ttl seconds.
+ *
+ * @param host buffer for connected server's host
+ * @param host_len host buffer size
+ * @param srv_port set to connected server's port
+ * @param deadline clock_ms() time when connecting fails (0: timeout seconds from now)
+ * @return connected (blocking) socket file descriptor on success, otherwise -1
+ */
+static int srv_connect_race (char *host, size_t host_len, int *srv_port, long long deadline) {
+	struct auth_server list[MAX_SERVERS];
+	struct pollfd pfd[MAX_SERVERS];
+	int order[MAX_SERVERS], fds[MAX_SERVERS], idx[MAX_SERVERS];
+	long long started[MAX_SERVERS];
+	struct srv_health *health;
+	long long now, wait, next_start;
+	long long t = clock_us(), resolved = timing_us[TIMING_RESOLVE];
+	int i, n, next = 0, active = 0, winner = -1, connected, err;
+	socklen_t err_len;
+
+	n = srv_list(list, MAX_SERVERS);
+	health = srv_health_open();
+	n = srv_order(list, n, health, order);
+
+	for (i = 0; i < n; i++) fds[i] = -1;
+	now = clock_ms();
+	next_start = now;
+	if (deadline == 0 && timeout > 0)
+		deadline = now + (long long) timeout * 1000;
+
+	while (winner < 0) {
+		now = clock_ms();
+		if (deadline > 0 && now >= deadline) {
+			log_msg("Authentication timeout (%d seconds) exceeded while connecting.", timeout);
+			break;
+		}
+
+		/** start next connect attempt? */
+		if (next < n && (active == 0 || now >= next_start)) {
+			i = order[next++];
+			log_msg("Connecting to authentication server %s:%d.", list[i].host, list[i].port);
+			if ((fds[i] = srv_connect_start(&list[i], &connected)) < 0) {
+				/** busy server (full listen queue) isn't dead */
+				if (errno != EAGAIN)
+					srv_health_update(health, &list[i], 0);
+				next_start = now;
+				continue;
+			}
+			if (connected) {
+				started[i] = now;
+				winner = i;
+				break;
+			}
+			started[i] = now;
+			next_start = now + connect_stagger;
+			active++;
+			continue;
+		}
+		if (active == 0) break;
+
+		/** wait for connects */
+		wait = (next < n) ? next_start - now : -1;
+		active = 0;
+		for (i = 0; i < n; i++) {
+			if (fds[i] < 0) continue;
+			if (connect_timeout > 0 && now >= started[i] + connect_timeout) {
+				log_msg("Connect to authentication server %s:%d timed out after %d ms.", list[i].host, list[i].port, connect_timeout);
+				close(fds[i]);
+				fds[i] = -1;
+				srv_health_update(health, &list[i], 0);
+				next_start = now;
+				continue;
+			}
+			if (connect_timeout > 0 && (wait < 0 || started[i] + connect_timeout - now < wait))
+				wait = started[i] + connect_timeout - now;
+			pfd[active].fd = fds[i];
+			pfd[active].events = POLLOUT;
+			pfd[active].revents = 0;
+			idx[active++] = i;
+		}
+		if (active == 0) continue;
+		if (deadline > 0 && (wait < 0 || deadline - now < wait))
+			wait = deadline - now;
+
+		if (poll(pfd, active, (int) wait) < 0) {
+			if (errno == EINTR) continue;
+			log_msg("poll(2) failed: %s (errno %d).", strerror(errno), errno);
+			break;
+		}
+
+		for (i = 0; i < active && winner < 0; i++) {
+			if (pfd[i].revents == 0) continue;
+			err = 0;
+			err_len = sizeof(err);
+			/** hang-up without pending error: socket isn't connected */
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0 || (pfd[i].revents & (POLLHUP | POLLERR))) {
+				if (err == 0) err = ECONNREFUSED;
+				log_msg("Unable to connect to %s:%d: %s (errno %d).", list[idx[i]].host, list[idx[i]].port, strerror(err), err);
+				close(fds[idx[i]]);
+				fds[idx[i]] = -1;
+				srv_health_update(health, &list[idx[i]], 0);
+				next_start = now;
+				continue;
+			}
+			winner = idx[i];
+		}
+		active = 0;
+		for (i = 0; i < n; i++)
+			if (fds[i] >= 0) active++;
+	}
+
+	/**
+	 * close losers; servers that were tried before the winner and
+	 * still haven't answered are too slow and are tried last next time
+	 */
+	for (i = 0; i < n; i++) {
+		if (i == winner || fds[i] < 0) continue;
+		close(fds[i]);
+		if (winner >= 0 && started[i] < started[winner]) {
+			log_msg("Authentication server %s:%d didn't answer in %lld ms.", list[i].host, list[i].port, clock_ms() - started[i]);
+			srv_health_update(health, &list[i], 0);
+		}
+	}
+
+	if (winner >= 0) {
+		snprintf(host, host_len, "%s", list[winner].host);
+		*srv_port = list[winner].port;
+		srv_health_update(health, &list[winner], 1);
+		fcntl(fds[winner], F_SETFL, fcntl(fds[winner], F_GETFL) & ~O_NONBLOCK);
+		srv_set_timeout(fds[winner]);
+	} else
+		log_msg("Unable to connect to any authentication server (%s).", hostname);
+	srv_health_close(health);
+
+	/** connect time excludes name resolution */
+	timing_add(TIMING_CONNECT, t + timing_us[TIMING_RESOLVE] - resolved);
+
+	return (winner >= 0) ? fds[winner] : -1;
+}
+
+/**
+ * connects to one of configured authentication servers, see srv_connect_race()
+ * @return connected (blocking) socket file descriptor on success, otherwise -1
+ */
+int srv_connect_fd (void) {
+	char host[GEN_BUF_SIZE];
+	int srv_port;
+
+	return srv_connect_race(host, sizeof(host), &srv_port, 0);
+}
+
+/**
+ * verdict cache file header
+ */
+struct cache_header {
+	unsigned int magic;
+	unsigned int slots;
+	unsigned long long key[4];	/** two SipHash keys */
+	unsigned long long pad[3];
+};
+
+/**
+ * verdict cache entry; readers never lock, writers try to lock entry
+ * by making sequence number odd and skip the update if entry is busy.
+ */
+struct cache_entry {
+	volatile unsigned int seq;
+	unsigned int pad;
+	unsigned long long tag[2];
+	long long expires;			/** wall clock ms */
+};
+
+static struct cache_header *cache = NULL;
+static size_t cache_map_size = 0;
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while (0)
+
+/**
+ * SipHash-2-4 keyed hash
+ */
+static unsigned long long siphash24 (const unsigned char *in, size_t len, unsigned long long k0, unsigned long long k1) {
+	unsigned long long v0 = 0x736f6d6570736575ULL ^ k0;
+	unsigned long long v1 = 0x646f72616e646f6dULL ^ k1;
+	unsigned long long v2 = 0x6c7967656e657261ULL ^ k0;
+	unsigned long long v3 = 0x7465646279746573ULL ^ k1;
+	unsigned long long m, b = ((unsigned long long) len) << 56;
+	size_t i, left = len & 7;
+	const unsigned char *end = in + len - left;
+
+	for (; in != end; in += 8) {
+		for (m = 0, i = 0; i < 8; i++)
+			m |= ((unsigned long long) in[i]) << (8 * i);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	for (i = 0; i < left; i++)
+		b |= ((unsigned long long) in[i]) << (8 * i);
+
+	v3 ^= b;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (i = 0; i < 4; i++)
+		SIP_ROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * maps verdict cache file, creating it (with random hash key) if needed;
+ * existing file must be owned by effective uid and not accessible by
+ * others. Not thread safe: must be called before threads are started,
+ * cache_lookup() and cache_store() don't map the cache themselves.
+ * @return 1 if cache is available, otherwise 0
+ */
+int cache_open (void) {
+	struct cache_header hdr;
+	struct stat st;
+	size_t size;
+	int fd, rnd;
+	void *ptr;
+
+	if (cache != NULL) return 1;
+	if (cache_file[0] == '\0' || cache_ttl < 1) return 0;
+	if (cache_slots < 64) cache_slots = 64;
+
+	if ((fd = open(cache_file, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) >= 0) {
+		/** new cache file: write header with fresh random key */
+		memset(&hdr, '\0', sizeof(hdr));
+		hdr.slots = cache_slots;
+		if ((rnd = open("/dev/urandom", O_RDONLY)) < 0 || read(rnd, hdr.key, sizeof(hdr.key)) != sizeof(hdr.key)) {
+			log_msg("Unable to read random verdict cache key: %s (errno %d).", strerror(errno), errno);
+			if (rnd >= 0) close(rnd);
+			close(fd);
+			unlink(cache_file);
+			return 0;
+		}
+		close(rnd);
+		size = sizeof(hdr) + (size_t) hdr.slots * sizeof(struct cache_entry);
+		if (ftruncate(fd, size) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			log_msg("Unable to initialize verdict cache file %s: %s (errno %d).", cache_file, strerror(errno), errno);
+			close(fd);
+			unlink(cache_file);
+			return 0;
+		}
+		/** magic marks header as complete for concurrent openers */
+		hdr.magic = CACHE_MAGIC;
+		pwrite(fd, &hdr.magic, sizeof(hdr.magic), 0);
+	} else if ((fd = open(cache_file, O_RDWR | O_NOFOLLOW)) < 0) {
+		log_msg("Unable to open verdict cache file %s: %s (errno %d).", cache_file, strerror(errno), errno);
+		return 0;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		log_msg("Verdict cache file %s is not private to uid %d, not caching verdicts.", cache_file, (int) geteuid());
+		close(fd);
+		return 0;
+	}
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != CACHE_MAGIC || hdr.slots < 1 || (size_t) st.st_size < sizeof(hdr) + (size_t) hdr.slots * sizeof(struct cache_entry)) {
+		close(fd);
+		return 0;
+	}
+
+	size = sizeof(hdr) + (size_t) hdr.slots * sizeof(struct cache_entry);
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		log_msg("Unable to map verdict cache file %s: %s (errno %d).", cache_file, strerror(errno), errno);
+		return 0;
+	}
+
+	cache = (struct cache_header *) ptr;
+	cache_map_size = size;
+	return 1;
+}
+
+/**
+ * computes cache tag of username, password and common_name
+ */
+static void cache_tag (struct auth *ptr, unsigned long long *tag) {
+	unsigned char buf[3 * CRED_BUF_SIZE + 3];
+	size_t len = 0, l;
+
+	l = strnlen(ptr->username, CRED_BUF_SIZE);
+	memcpy(buf + len, ptr->username, l);
+	len += l;
+	buf[len++] = '\0';
+	l = strnlen(ptr->password, CRED_BUF_SIZE);
+	memcpy(buf + len, ptr->password, l);
+	len += l;
+	buf[len++] = '\0';
+	l = (ptr->common_name != NULL) ? strnlen(ptr->common_name, CRED_BUF_SIZE) : 0;
+	memcpy(buf + len, ptr->common_name, l);
+	len += l;
+
+	tag[0] = siphash24(buf, len, cache->key[0], cache->key[1]);
+	tag[1] = siphash24(buf, len, cache->key[2], cache->key[3]);
+	memset(buf, '\0', sizeof(buf));
+}
+
+static struct cache_entry * cache_slot (unsigned int i) {
+	return (struct cache_entry *) ((char *) cache + sizeof(struct cache_header)) + (i % cache->slots);
+}
+
+/**
+ * looks up positive verdict for given credentials in verdict cache
+ * @param ptr authentication structure
+ * @return 1 on cache hit, otherwise 0
+ */
+int cache_lookup (struct auth *ptr) {
+	unsigned long long tag[2], t0, t1;
+	struct cache_entry *e;
+	unsigned int i, seq;
+	long long expires, now = wall_ms();
+
+	if (cache == NULL) return 0;
+	cache_tag(ptr, tag);
+
+	for (i = 0; i < CACHE_PROBES; i++) {
+		e = cache_slot((unsigned int) tag[0] + i);
+		/** seqlock read: entry is consistent if sequence is even and unchanged */
+		seq = e->seq;
+		__sync_synchronize();
+		t0 = e->tag[0];
+		t1 = e->tag[1];
+		expires = e->expires;
+		__sync_synchronize();
+		if ((seq & 1) || seq != e->seq) continue;
+
+		if (t0 == tag[0] && t1 == tag[1] && expires > now) {
+			log_msg("Verdict cache HIT for user '%s'.", ptr->username);
+			return 1;
+		}
+	}
+
+	log_msg("Verdict cache MISS for user '%s'.", ptr->username);
+	return 0;
+}
+
+/**
+ * stores positive verdict for given credentials into verdict cache
+ * @param ptr authentication structure
+ */
+void cache_store (struct auth *ptr) {
+	unsigned long long tag[2];
+	struct cache_entry *e, *victim = NULL;
+	unsigned int i, seq;
+	long long now = wall_ms();
+
+	if (cache == NULL) return;
+	cache_tag(ptr, tag);
+
+	/** same credentials, free/expired slot or entry expiring first */
+	for (i = 0; i < CACHE_PROBES; i++) {
+		e = cache_slot((unsigned int) tag[0] + i);
+		if (e->tag[0] == tag[0] && e->tag[1] == tag[1]) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL || e->expires < victim->expires)
+			victim = e;
+		if (e->expires <= now) break;
+	}
+
+	seq = victim->seq;
+	if ((seq & 1) || ! __sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+		return;
+	victim->tag[0] = tag[0];
+	victim->tag[1] = tag[1];
+	victim->expires = now + (long long) cache_ttl * 1000;
+	__sync_synchronize();
+	victim->seq = seq + 2;
+}
+
+static const char *timing_names[TIMING_PHASES] = {
+	"total", "config", "credentials", "cache", "resolve", "connect", "tls", "send", "wait"
+};
+static const char *timing_results[TIMING_RESULTS] = { "ok", "failed", "cached" };
+
+/**
+ * timing histogram file: header followed by TIMING_PHASES histograms;
+ * bucket i counts durations shorter than 2^i microseconds. File is
+ * shared by all openvpn_authc processes and plugin threads, counters
+ * are updated with atomic additions.
+ */
+struct timing_header {
+	unsigned int magic;
+	unsigned int phases;
+	unsigned int buckets;
+	unsigned int pad;
+	unsigned long long results[TIMING_RESULTS];
+	unsigned long long pad2;
+};
+
+struct timing_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long bucket[TIMING_BUCKETS];
+};
+
+#define TIMING_FILE_SIZE (sizeof(struct timing_header) + TIMING_PHASES * sizeof(struct timing_hist))
+
+/**
+ * starts timing of new authentication
+ */
+void timing_reset (void) {
+	memset(timing_us, '\0', sizeof(timing_us));
+	timing_seen = 0;
+	timing_started = clock_us();
+}
+
+/**
+ * adds time elapsed since given moment to phase
+ * @param phase TIMING_* phase
+ * @param since clock_us() at start of phase
+ * @return current clock_us()
+ */
+long long timing_add (int phase, long long since) {
+	long long now = clock_us();
+
+	if (phase > TIMING_TOTAL && phase < TIMING_PHASES && now > since) {
+		timing_us[phase] += now - since;
+		timing_seen |= 1 << phase;
+	}
+
+	return now;
+}
+
+/**
+ * maps timing histogram file
+ * @param create create file if it doesn't exist
+ * @return pointer to file header or NULL if file is disabled/unavailable
+ */
+static struct timing_header * timing_open (int create) {
+	struct timing_header *ptr;
+	struct stat st;
+	int fd;
+
+	if (timing_file[0] == '\0') return NULL;
+	if ((fd = open(timing_file, O_RDWR | O_NOFOLLOW | ((create) ? O_CREAT : 0), 0600)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		log_msg("Timing histogram file %s is not private to uid %d, not recording timings.", timing_file, (int) geteuid());
+		close(fd);
+		return NULL;
+	}
+	if ((size_t) st.st_size < TIMING_FILE_SIZE && ftruncate(fd, TIMING_FILE_SIZE) < 0) {
+		close(fd);
+		return NULL;
+	}
+	ptr = mmap(NULL, TIMING_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) return NULL;
+
+	/** fresh (zeroed) file is claimed by first process */
+	__sync_bool_compare_and_swap(&ptr->magic, 0, TIMING_MAGIC);
+	if (ptr->magic != TIMING_MAGIC || ptr->phases != TIMING_PHASES || ptr->buckets != TIMING_BUCKETS) {
+		if (ptr->magic == TIMING_MAGIC && ptr->phases == 0 && ptr->buckets == 0) {
+			ptr->phases = TIMING_PHASES;
+			ptr->buckets = TIMING_BUCKETS;
+		} else {
+			log_msg("Invalid timing histogram file %s.", timing_file);
+			munmap(ptr, TIMING_FILE_SIZE);
+			return NULL;
+		}
+	}
+
+	return ptr;
+}
+
+static void timing_hist_add (struct timing_hist *h, long long us) {
+	unsigned long long v = (us > 0) ? (unsigned long long) us : 0, max;
+	int b = 0;
+
+	while (b < TIMING_BUCKETS - 1 && (v >> b) != 0)
+		b++;
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->sum, v);
+	__sync_fetch_and_add(&h->bucket[b], 1);
+	while ((max = h->max) < v && ! __sync_bool_compare_and_swap(&h->max, max, v))
+		;
+}
+
+/**
+ * logs phase timing of current authentication as single message and
+ * adds it to timing histogram file (if configured)
+ * @param result TIMING_OK, TIMING_FAILED or TIMING_CACHED
+ */
+void timing_report (int result) {
+	struct timing_header *hdr;
+	struct timing_hist *hist;
+	char buf[GEN_BUF_SIZE];
+	size_t off;
+	int i;
+
+	if (timing_started == 0) return;
+	timing_us[TIMING_TOTAL] = clock_us() - timing_started;
+	timing_seen |= 1 << TIMING_TOTAL;
+
+	off = snprintf(buf, sizeof(buf), "Timing: result=%s", timing_results[result]);
+	for (i = 0; i < TIMING_PHASES && off < sizeof(buf); i++) {
+		if (! (timing_seen & (1 << i))) continue;
+		off += snprintf(buf + off, sizeof(buf) - off, " %s_us=%lld", timing_names[i], timing_us[i]);
+	}
+	log_msg("%s", buf);
+
+	if ((hdr = timing_open(1)) == NULL) return;
+	hist = (struct timing_hist *) (hdr + 1);
+	__sync_fetch_and_add(&hdr->results[result], 1);
+	for (i = 0; i < TIMING_PHASES; i++)
+		if (timing_seen & (1 << i))
+			timing_hist_add(&hist[i], timing_us[i]);
+	munmap(hdr, TIMING_FILE_SIZE);
+}
+
+/**
+ * returns upper bound of given percentile from histogram (microseconds)
+ */
+static unsigned long long timing_percentile (struct timing_hist *h, double pct) {
+	unsigned long long want = (unsigned long long) (h->count * pct / 100.0 + 0.5), seen = 0;
+	int b;
+
+	if (want < 1) want = 1;
+	for (b = 0; b < TIMING_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want)
+			return (b == TIMING_BUCKETS - 1 || (1ULL << b) > h->max) ? h->max : (1ULL << b);
+	}
+
+	return h->max;
+}
+
+/**
+ * prints summary of timing histogram file to stdout
+ * @return 1 on success, otherwise 0
+ */
+int timing_stats (void) {
+	struct timing_header *hdr;
+	struct timing_hist *h;
+	int i;
+
+	if (timing_file[0] == '\0') {
+		fprintf(stderr, "Timing histogram file (timing_file) is not configured.\n");
+		return 0;
+	}
+	if ((hdr = timing_open(0)) == NULL) {
+		fprintf(stderr, "Unable to open timing histogram file %s.\n", timing_file);
+		return 0;
+	}
+	h = (struct timing_hist *) (hdr + 1);
+
+	printf("Authentications: %llu ok, %llu failed, %llu cached\n\n",
+		hdr->results[TIMING_OK], hdr->results[TIMING_FAILED], hdr->results[TIMING_CACHED]);
+	printf("%-12s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (i = 0; i < TIMING_PHASES; i++) {
+		if (h[i].count == 0) continue;
+		printf("%-12s %10llu %10llu %10llu %10llu %10llu %10llu\n", timing_names[i], h[i].count, h[i].sum / h[i].count,
+			timing_percentile(&h[i], 50), timing_percentile(&h[i], 90), timing_percentile(&h[i], 99), h[i].max);
+	}
+	printf("\nPercentiles are upper bounds of power of two histogram buckets.\n");
+	munmap(hdr, TIMING_FILE_SIZE);
+
+	return 1;
+}
+
+/**
+ * deferred authentication session states
+ */
+enum auth_state {
+	AUTH_STATE_SENDING,
+	AUTH_STATE_RECEIVING,
+	AUTH_STATE_DONE
+};
+
+/**
+ * performs authentication driven by poll(2) based state machine.
+ * Unlike authenticate() it never relies on SIGALRM: connect race (see
+ * srv_connect_race()), sending and receiving share single deadline and
+ * authentication fails as soon as timeout expires.
+ *
+ * @param ptr authentication structure
+ * @return integer 1 on success, otherwise 0
+ */
+int authenticate_nb (struct auth *ptr) {
+	unsigned char write_buf[PROTO_BUF_SIZE];
+	unsigned char read_buf[PROTO_BUF_SIZE];
+	size_t wlen = 0, woff = 0, roff = 0;
+	enum auth_state state;
+	long long deadline = clock_ms() + (long long) timeout * 1000;
+	long long t = 0;
+	struct pollfd pfd;
+	unsigned int rid;
+	ssize_t flen;
+	char host[GEN_BUF_SIZE];
+	int sock, srv_port, v2, attempt, legacy = 0, result = 0;
+
+	/**
+	 * TLS connections are served by blocking authenticate(); socket
+	 * timeouts bound every TLS read and write.
+	 */
+	if (tls)
+		return authenticate(ptr);
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if ((sock = srv_connect_race(host, sizeof(host), &srv_port, (timeout > 0) ? deadline : 0)) < 0)
+			return 0;
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+		v2 = proto_v2();
+		if (v2)
+			wlen = proto2_format_request(ptr, write_buf, sizeof(write_buf), 0, 1);
+		else
+			wlen = auth_format_request(ptr, (char *) write_buf, sizeof(write_buf), 0, (timeout > 0) ? auth_deadline() : 0);
+		if (wlen < 1) {
+			log_msg("Unable to format authentication request for user '%s'.", ptr->username);
+			close(sock);
+			return 0;
+		}
+		woff = roff = 0;
+		legacy = 0;
+		state = AUTH_STATE_SENDING;
+		memset(read_buf, '\0', sizeof(read_buf));
+		t = clock_us();
+
+		while (state != AUTH_STATE_DONE) {
+			long long left = deadline - clock_ms();
+			ssize_t n;
+
+			/** timeout < 1 means no timeout, just like alarm(0) */
+			if (timeout < 1)
+				left = -1;
+			else if (left <= 0) {
+				log_msg("Authentication timeout (%d seconds) exceeded.", timeout);
+				break;
+			}
+
+			pfd.fd = sock;
+			pfd.events = (state == AUTH_STATE_RECEIVING) ? POLLIN : POLLOUT;
+			pfd.revents = 0;
+
+			if ((n = poll(&pfd, 1, (int) left)) < 0) {
+				if (errno == EINTR) continue;
+				log_msg("poll(2) failed: %s (errno %d).", strerror(errno), errno);
+				break;
+			}
+			else if (n == 0)
+				continue;
+
+			switch (state) {
+				case AUTH_STATE_SENDING:
+					if ((n = send(sock, write_buf + woff, wlen - woff, MSG_NOSIGNAL)) < 0) {
+						if (errno == EAGAIN || errno == EINTR) break;
+						log_msg("Unable to send authentication request: %s (errno %d).", strerror(errno), errno);
+						goto outta_func;
+					}
+					woff += n;
+					if (woff >= wlen) {
+						state = AUTH_STATE_RECEIVING;
+						t = timing_add(TIMING_SEND, t);
+					}
+					break;
+
+				case AUTH_STATE_RECEIVING:
+					if ((n = read(sock, read_buf + roff, sizeof(read_buf) - roff - 1)) < 0) {
+						if (errno == EAGAIN || errno == EINTR) break;
+						log_msg("No response read from authentication server: %s (errno %d)", strerror(errno), errno);
+						goto outta_func;
+					}
+					else if (n == 0 && ! (v2 && roff > 0 && read_buf[0] != PROTO_MAGIC)) {
+						log_msg("Authentication server closed connection without response.");
+						goto outta_func;
+					}
+					roff += n;
+
+					if (! v2) {
+						if (memchr(read_buf, '\n', roff) != NULL || roff >= sizeof(read_buf) - 1) {
+							char *line = (char *) read_buf;
+							auth_response_id(&line);
+							result = auth_check_response(ptr, line);
+							state = AUTH_STATE_DONE;
+						}
+						break;
+					}
+
+					/** protocol v2: skip server's HELLO, evaluate AUTH_RESPONSE */
+					while (roff > 0 && state != AUTH_STATE_DONE) {
+						if (read_buf[0] != PROTO_MAGIC) {
+							legacy = 1;
+							goto outta_func;
+						}
+						if ((flen = proto2_frame_len(read_buf, roff)) == 0)
+							break;
+						if (flen < 0) {
+							log_msg("Invalid protocol v2 frame received from authentication server.");
+							goto outta_func;
+						}
+						if (read_buf[2] == PROTO_HELLO) {
+							memmove(read_buf, read_buf + flen, roff - flen);
+							roff -= flen;
+							continue;
+						}
+						result = proto2_check_response(ptr, read_buf, flen, &rid);
+						state = AUTH_STATE_DONE;
+					}
+					if (state != AUTH_STATE_DONE && roff >= sizeof(read_buf) - 1) {
+						log_msg("Too long response from authentication server.");
+						goto outta_func;
+					}
+					break;
+
+				default:
+					break;
+			}
+		}
+
+		outta_func:
+		timing_add((state == AUTH_STATE_RECEIVING || state == AUTH_STATE_DONE) ? TIMING_WAIT : TIMING_SEND, t);
+		close(sock);
+		memset(write_buf, '\0', sizeof(write_buf));
+
+		/** old server: retry using text protocol */
+		if (! legacy) break;
+		log_msg("Authentication server doesn't support protocol v2, falling back to text protocol (set protocol = 1 to avoid this).");
+		protocol_fallback = 1;
+	}
+
+	return result;
+}
+
+/**
+ * detaches from openvpn and performs deferred authentication
+ * in background process.
+ *
+ * @param ptr authentication structure
+ * @param control_file openvpn's auth_control_file
+ * @return exit status for openvpn: 2 (deferred) or 1 on error
+ */
+int authenticate_deferred (struct auth *ptr, const char *control_file) {
+	pid_t pid;
+	int fd, r;
+
+	if ((pid = fork()) < 0) {
+		log_msg("Unable to fork deferred authentication process: %s (errno %d).", strerror(errno), errno);
+		return 1;
+	}
+	/** parent: tell openvpn that result will be written later */
+	else if (pid > 0)
+		return 2;
+
+	/** child: detach from openvpn */
+	setsid();
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO) close(fd);
+	}
+	verbose = 0;
+
+	r = authenticate_nb(ptr);
+	auth_control_write(control_file, r);
+	timing_report((r) ? TIMING_OK : TIMING_FAILED);
+	authstruct_destroy(ptr);
+	_exit(0);
+}
+
+#ifndef OPENVPN_AUTH_NO_MAIN
+/**
+ * main routine
+ */
+int main (int argc, char **argv) {
+	/** command line parsing */
+	extern char *optarg;
+	extern int optind;
+	char *tmp;
+	struct auth *auth_str;
+	struct sigaction act;
+	struct termio tty, oldtty;
+	int cred_from_cmdl = 0;
+	int broker = 0;
+	int stats = 0;
+	long long t;
+
+	timing_reset();
+	MYNAME = basename(argv[0]);
+	log_open();
+	strncpy(hostname, DEFAULT_HOSTNAME, sizeof(hostname));
+
+	/** try to load configuration files */
+	load_config_files();
+
+	/** initialize authentication structure */
+	if ((auth_str = authstruct_init()) == NULL) {
+		log_msg("Unable to initialize authentication structure... Possibly out of memory.");
+		return 1;
+	}
+
+	/* configure command line parser */
+	static struct option long_options[] = {
+		/* These options set a flag. */
+		{"default-config", no_argument, NULL, 'd'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"version", no_argument, NULL, 'V'},
+		{"help", no_argument, NULL, 'h'},
+		{"deferred", no_argument, NULL, 'D'},
+		{"broker", no_argument, NULL, 'b'},
+		{"timing-stats", no_argument, NULL, 'S'},
+
+		/* These options require argument */
+		{"config", required_argument, NULL, 'c'},
+		{"hostname", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+
+		{"user", required_argument, NULL, 'U'},
+		{"pass", required_argument, NULL, 'P'},
+		{"cn", required_argument, NULL, 'C'},
+		{"client-ip", required_argument, NULL, 'X'},
+		{"client-port", required_argument, NULL, 'Y'},
+	};
+
+	
+	/* parse command line */
+	int r = 1;
+	int opt_idx = 0;		/* option index */
+	while (r) {
+		int c = 0;			/* option character */
+		c = getopt_long(argc, argv, "c:H:p:U:P:C:X:Y:vhdVDbS", long_options, &opt_idx);
+
+		switch (c) {
+			case 'c':
+				if (! load_config_file(optarg)) {
+					fprintf(stderr, "Unable to parse config file '%s': %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			case 'H':
+				strncpy(hostname, optarg, sizeof(hostname));
+				break;
+			case 'p':
 				port = atoi(optarg);
 				break;
 			case 'U':
@@ -703,6 +2639,15 @@ int main (int argc, char **argv) {
 			case 'v':
 				verbose = 1;
 				break;
+			case 'D':
+				deferred = 1;
+				break;
+			case 'b':
+				broker = 1;
+				break;
+			case 'S':
+				stats = 1;
+				break;
 			case 'd':
 				print_default_config();
 				return 0;
@@ -725,6 +2670,20 @@ int main (int argc, char **argv) {
 		}
 	}
 
+	t = timing_add(TIMING_CONFIG, timing_started);
+
+	/** print timing histograms? */
+	if (stats) {
+		authstruct_destroy(auth_str);
+		return ! timing_stats();
+	}
+
+	/** broker mode? */
+	if (broker) {
+		authstruct_destroy(auth_str);
+		return broker_run();
+	}
+
 	/** check if we're really called as openvpn argument */
 	if ((tmp = getenv("script_type")) == NULL || (strcmp(tmp, "auth-user-pass-verify") != 0 && strcmp(tmp, "user-pass-verify") != 0)) {
 		log_msg("Program is not executed as --auth-user-pass-verify openvpn server argument. Environment variable \"script_type\" != \"(auth-)?user-pass-verify\" (%s)", tmp);
@@ -736,6 +2695,7 @@ int main (int argc, char **argv) {
 		/** retrieve credentials */
 		if (! credentials_retr(auth_str, argv[optind]))
 			return 1;
+		t = timing_add(TIMING_CREDENTIALS, t);
 	}
 	/** testing mode? */
 	else {
@@ -769,6 +2729,29 @@ int main (int argc, char **argv) {
 
 		fprintf(stderr, "\n--- VERBOSE OUTPUT ---\n");
 	}
+
+	/** recently verified credentials? */
+	if (! cred_from_cmdl) {
+		cache_open();
+		r = cache_lookup(auth_str);
+		timing_add(TIMING_CACHE, t);
+		if (r) {
+			timing_report(TIMING_CACHED);
+			authstruct_destroy(auth_str);
+			return 0;
+		}
+	}
+
+	/** deferred authentication? */
+	if (deferred && ! cred_from_cmdl) {
+		if ((tmp = getenv("auth_control_file")) == NULL || strlen(tmp) < 1)
+			log_msg("Deferred authentication requested, but environment variable auth_control_file is not set; authenticating synchronously.");
+		else {
+			r = authenticate_deferred(auth_str, tmp);
+			authstruct_destroy(auth_str);
+			return r;
+		}
+	}
 	
 	/** install signal handler */
 	act.sa_handler = sigh_alrm;
@@ -782,6 +2765,7 @@ int main (int argc, char **argv) {
 
 	/** perform authentication */
 	r = authenticate(auth_str);
+	timing_report((r) ? TIMING_OK : TIMING_FAILED);
 	
 	if (cred_from_cmdl) {
 		fprintf(stderr, "--- VERBOSE OUTPUT ---\n\n");
@@ -793,3 +2777,4 @@ int main (int argc, char **argv) {
 
 	return (! r);
 }
+#endif /* OPENVPN_AUTH_NO_MAIN */
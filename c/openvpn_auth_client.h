@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Declarations shared between openvpn_authc and other programs
+ * built from openvpn_auth_client.c (compiled with -DOPENVPN_AUTH_NO_MAIN).
+ */
+
+#ifndef _OPENVPN_AUTH_CLIENT_H
+#define _OPENVPN_AUTH_CLIENT_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#define VERSION "0.11"
+
+#define CRED_BUF_SIZE 512
+#define GEN_BUF_SIZE 1024
+#define CONF_FILE_MAXLINES 1000
+#define STR_SEP "="
+
+#define DEFAULT_HOSTNAME "127.0.0.1"
+#define DEFAULT_PORT 1559
+#define DEFAULT_AUTH_TIMEOUT 10
+#define DEFAULT_PLUGIN_WORKERS 4
+#define DEFAULT_BROKER_CONNECTIONS 2
+#define DEFAULT_BROKER_SOCKET_MODE 0660
+#define DEFAULT_CONNECT_TIMEOUT 500
+#define DEFAULT_CONNECT_STAGGER 150
+#define DEFAULT_HEALTH_FILE "/tmp/openvpn_authc.health"
+#define DEFAULT_HEALTH_TTL 30
+
+#define DEFAULT_PROTOCOL 2
+#define DEFAULT_CACHE_TTL 60
+#define DEFAULT_CACHE_SLOTS 8192
+#define DEFAULT_TLS_SESSION_FILE "/tmp/openvpn_authc.tls"
+
+#define MAX_SERVERS 16
+#define HEALTH_SLOTS 64
+#define CACHE_MAGIC 0x6f766163
+#define CACHE_PROBES 8
+#define TLS_SESSION_SLOTS 32
+#define TLS_SESSION_SIZE 4072
+#define TIMING_MAGIC 0x6f766174
+#define TIMING_BUCKETS 32
+
+/**
+ * Phases of single authentication timed by timing_add(); see
+ * timing_report() and timing_file configuration parameter.
+ */
+#define TIMING_TOTAL 0
+#define TIMING_CONFIG 1
+#define TIMING_CREDENTIALS 2
+#define TIMING_CACHE 3
+#define TIMING_RESOLVE 4
+#define TIMING_CONNECT 5
+#define TIMING_TLS 6
+#define TIMING_SEND 7
+#define TIMING_WAIT 8
+#define TIMING_PHASES 9
+
+#define TIMING_OK 0
+#define TIMING_FAILED 1
+#define TIMING_CACHED 2
+#define TIMING_RESULTS 3
+
+/**
+ * Binary protocol v2: frame header (magic, version, frame type, flags,
+ * 32 bit big-endian payload length) followed by TLV records (type,
+ * 16 bit big-endian length, value). See Net::OpenVPN::Protocol.
+ */
+#define PROTO_MAGIC 0x00
+#define PROTO_VERSION 2
+#define PROTO_HDR_LEN 8
+#define PROTO_MAX_FRAME 65536
+#define PROTO_BUF_SIZE (4 * CRED_BUF_SIZE + GEN_BUF_SIZE)
+
+#define PROTO_HELLO 1
+#define PROTO_AUTH_REQUEST 2
+#define PROTO_AUTH_RESPONSE 3
+
+#define PROTO_T_VERSION 0x01
+#define PROTO_T_CAPS 0x02
+#define PROTO_T_AGENT 0x03
+#define PROTO_T_COMPAT 0x04
+#define PROTO_T_USERNAME 0x10
+#define PROTO_T_PASSWORD 0x11
+#define PROTO_T_COMMON_NAME 0x12
+#define PROTO_T_HOST 0x13
+#define PROTO_T_PORT 0x14
+#define PROTO_T_ID 0x15
+#define PROTO_T_KEEPALIVE 0x16
+#define PROTO_T_DEADLINE 0x17
+#define PROTO_T_STATUS 0x20
+#define PROTO_T_MESSAGE 0x21
+#define PROTO_T_SERVER_TIME 0x22
+
+#define PROTO_CAP_KEEPALIVE 0x01
+#define PROTO_CAP_ID 0x02
+#define PROTO_CAP_TIMING 0x04
+
+#define PROTO_STATUS_OK 0
+#define PROTO_STATUS_DENIED 1
+#define PROTO_STATUS_TIMEOUT 2
+#define PROTO_STATUS_INVALID 3
+#define PROTO_STATUS_ERROR 4
+#define PROTO_STATUS_OVERLOADED 5
+
+/**
+ * authentication data structure
+ */
+struct auth {
+	char	*username;
+	char	*password;
+	char	*common_name;
+	char	*untrusted_ip;
+	int		untrusted_port;
+};
+
+/**
+ * Global configuration variables
+ */
+extern char hostname[GEN_BUF_SIZE];
+extern int port;
+extern int timeout;
+extern int verbose;
+extern int log_syslog;
+extern int plugin_workers;
+extern int deferred;
+extern int connect_timeout;
+extern int connect_stagger;
+extern char health_file[GEN_BUF_SIZE];
+extern int health_ttl;
+extern char cache_file[GEN_BUF_SIZE];
+extern int cache_ttl;
+extern int cache_slots;
+extern int protocol;
+extern int protocol_fallback;
+extern char broker_socket[GEN_BUF_SIZE];
+extern int broker_connections;
+extern int broker_socket_mode;
+extern char broker_socket_group[GEN_BUF_SIZE];
+extern int tls;
+extern char tls_ca_file[GEN_BUF_SIZE];
+extern char tls_cert_file[GEN_BUF_SIZE];
+extern char tls_key_file[GEN_BUF_SIZE];
+extern char tls_server_name[GEN_BUF_SIZE];
+extern char tls_session_file[GEN_BUF_SIZE];
+extern char timing_file[GEN_BUF_SIZE];
+
+/**
+ * TLS handshake counters (openvpn_auth_tls.c)
+ */
+struct tls_stats {
+	unsigned long handshakes;
+	unsigned long resumed;
+	unsigned long failed;
+};
+
+extern struct tls_stats tls_stats;
+
+extern char *MYNAME;
+extern void (*log_func) (const char *str, va_list args);
+
+void chomp (char *str);
+void log_open (void);
+void log_msg (const char *str, ...);
+
+struct auth * authstruct_init (void);
+void authstruct_destroy (struct auth *ptr);
+
+int load_config_file (char *file);
+void load_config_files (void);
+
+FILE * srv_connect (void);
+FILE * srv_connect_to (const char *host, int srv_port);
+void srv_disconnect (FILE *socketfd);
+int authenticate (struct auth *ptr);
+int authenticate_keepalive (FILE **sockp, struct auth *ptr, unsigned int *next_id);
+
+int auth_format_request (struct auth *ptr, char *buf, size_t len, unsigned int id, long long deadline);
+unsigned int auth_response_id (char **line);
+int srv_write (FILE *sock, const char *buf, size_t len);
+
+size_t proto2_tlv (unsigned char *buf, size_t off, size_t len, int type, const void *val, size_t vlen);
+size_t proto2_tlv_u32 (unsigned char *buf, size_t off, size_t len, int type, unsigned int val);
+size_t proto2_tlv_u64 (unsigned char *buf, size_t off, size_t len, int type, unsigned long long val);
+size_t proto2_frame (unsigned char *buf, size_t start, size_t end, int type);
+unsigned int proto2_u32 (const unsigned char *val, size_t len);
+unsigned long long proto2_u64 (const unsigned char *val, size_t len);
+int proto2_format_request (struct auth *ptr, unsigned char *buf, size_t len, unsigned int id, int hello);
+ssize_t proto2_frame_len (const unsigned char *buf, size_t len);
+ssize_t proto2_read_frame (FILE *sock, unsigned char *buf, size_t len);
+int proto2_check_response (struct auth *ptr, const unsigned char *frame, size_t len, unsigned int *id);
+int auth_check_response (struct auth *ptr, char *line);
+int auth_control_write (const char *file, int result);
+
+long long clock_ms (void);
+long long clock_us (void);
+long long wall_ms (void);
+long long auth_deadline (void);
+int srv_connect_fd (void);
+int srv_connect_nb (int *server);
+int srv_address (int server, char *host, size_t len, int *srv_port);
+void srv_health_mark (int server, int alive);
+int authenticate_nb (struct auth *ptr);
+int authenticate_deferred (struct auth *ptr, const char *control_file);
+
+int cache_open (void);
+int cache_lookup (struct auth *ptr);
+void cache_store (struct auth *ptr);
+
+void timing_reset (void);
+long long timing_add (int phase, long long since);
+void timing_report (int result);
+int timing_stats (void);
+
+int broker_run (void);
+
+/** TLS transport, see openvpn_auth_tls.c */
+struct ssl_st;
+
+int tls_client_init (void);
+FILE * tls_connect (int sock, const char *host, int srv_port);
+struct ssl_st * tls_connect_nb (int sock, const char *host, int srv_port);
+int tls_server_init (const char *cert_file, const char *key_file, const char *ca_file, int shm_fd, int slots, int session_timeout);
+struct ssl_st * tls_accept (int sock);
+int tls_handshake (struct ssl_st *ssl);
+ssize_t tls_send (struct ssl_st *ssl, const void *buf, size_t len);
+ssize_t tls_recv (struct ssl_st *ssl, void *buf, size_t len);
+int tls_pending (struct ssl_st *ssl);
+void tls_free (struct ssl_st *ssl);
+
+#endif /* _OPENVPN_AUTH_CLIENT_H */
@@ -0,0 +1,359 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * OpenVPN plugin version of openvpn_authc.
+ *
+ * Plugin handles OPENVPN_PLUGIN_AUTH_USER_PASS_VERIFY events without
+ * forking external program. Every authentication request is queued,
+ * openvpn gets OPENVPN_PLUGIN_FUNC_DEFERRED immediately and one of the
+ * plugin worker threads contacts openvpn_authd and writes authentication
+ * verdict ("1" or "0") to file named by openvpn's auth_control_file
+ * environment variable. Every worker keeps its own persistent (keep-alive)
+ * connection to openvpn_authd.
+ *
+ * openvpn server configuration:
+ *
+ *   plugin /path/to/openvpn_auth_plugin.so [/path/to/openvpn_authc.conf]
+ *
+ * If configuration file is omitted, openvpn_authc configuration file
+ * auto load order applies.
+ *
+ * Messages are logged through openvpn's plugin log callback (openvpn 2.3
+ * and later); worker threads and older openvpn servers log to syslog
+ * without changing openvpn's syslog identity.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include <openvpn-plugin.h>
+
+#include "openvpn_auth_client.h"
+
+#define PLUGIN_NAME "openvpn_auth_plugin"
+#define PLUGIN_MAX_WORKERS 256
+
+/**
+ * queued authentication request
+ */
+struct plugin_job {
+	struct auth *auth;
+	char common_name[CRED_BUF_SIZE];
+	char untrusted_ip[GEN_BUF_SIZE];
+	char control_file[GEN_BUF_SIZE];
+	struct plugin_job *next;
+};
+
+/**
+ * plugin instance (openvpn_plugin_handle_t)
+ */
+struct plugin_context {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct plugin_job *head;
+	struct plugin_job *tail;
+	int shutdown;
+	int num_workers;
+	pthread_t *workers;
+};
+
+static plugin_vlog_t openvpn_vlog = NULL;		/** openvpn's log callback */
+static pthread_t openvpn_thread;				/** thread openvpn calls plugin from */
+
+/**
+ * log_msg() backend: openvpn's log callback isn't thread safe, so it's
+ * used only from openvpn's own thread
+ */
+static void plugin_log_msg (const char *str, va_list args) {
+	char buf[GEN_BUF_SIZE];
+
+	if (openvpn_vlog != NULL && pthread_equal(pthread_self(), openvpn_thread)) {
+		openvpn_vlog(PLOG_NOTE, PLUGIN_NAME, str, args);
+		return;
+	}
+	if (! log_syslog) return;
+
+	vsnprintf(buf, sizeof(buf), str, args);
+	syslog(LOG_AUTHPRIV | LOG_INFO, "%s: %s", PLUGIN_NAME, buf);
+}
+
+/**
+ * returns value of environment variable from openvpn supplied envp
+ */
+static const char * plugin_getenv (const char *name, const char *envp[]) {
+	int i;
+	size_t len;
+
+	if (envp == NULL) return NULL;
+	len = strlen(name);
+	for (i = 0; envp[i] != NULL; i++) {
+		if (strncmp(envp[i], name, len) == 0 && envp[i][len] == '=')
+			return envp[i] + len + 1;
+	}
+
+	return NULL;
+}
+
+/**
+ * copies openvpn environment into newly allocated job
+ * @return job pointer on success, otherwise NULL
+ */
+static struct plugin_job * plugin_job_create (const char *envp[]) {
+	struct plugin_job *job;
+	const char *tmp;
+
+	if ((job = calloc(1, sizeof(struct plugin_job))) == NULL) {
+		log_msg("Unable to allocate memory for authentication job.");
+		return NULL;
+	}
+	if ((job->auth = authstruct_init()) == NULL) {
+		free(job);
+		return NULL;
+	}
+
+	if ((tmp = plugin_getenv("username", envp)) != NULL)
+		strncpy(job->auth->username, tmp, CRED_BUF_SIZE - 1);
+	if ((tmp = plugin_getenv("password", envp)) != NULL)
+		strncpy(job->auth->password, tmp, CRED_BUF_SIZE - 1);
+	if ((tmp = plugin_getenv("common_name", envp)) != NULL)
+		strncpy(job->common_name, tmp, sizeof(job->common_name) - 1);
+	if ((tmp = plugin_getenv("untrusted_ip", envp)) != NULL)
+		strncpy(job->untrusted_ip, tmp, sizeof(job->untrusted_ip) - 1);
+	if ((tmp = plugin_getenv("auth_control_file", envp)) != NULL)
+		strncpy(job->control_file, tmp, sizeof(job->control_file) - 1);
+
+	tmp = plugin_getenv("untrusted_port", envp);
+	job->auth->untrusted_port = (tmp != NULL) ? atoi(tmp) : 0;
+
+	/** auth structure points to job owned buffers */
+	job->auth->common_name = job->common_name;
+	job->auth->untrusted_ip = job->untrusted_ip;
+
+	return job;
+}
+
+static void plugin_job_destroy (struct plugin_job *job) {
+	if (job == NULL) return;
+	/** don't leave passwords lying around in freed memory */
+	memset(job->auth->password, '\0', CRED_BUF_SIZE);
+	authstruct_destroy(job->auth);
+	free(job);
+}
+
+/**
+ * worker thread: waits for queued jobs and authenticates them
+ */
+static void * plugin_worker (void *arg) {
+	struct plugin_context *ctx = (struct plugin_context *) arg;
+	struct plugin_job *job;
+	FILE *sock = NULL;			/** persistent (keep-alive) server connection */
+	unsigned int next_id = 0;
+	int r;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		while (ctx->head == NULL && ! ctx->shutdown)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+		if (ctx->head == NULL) {
+			/** shutdown requested and queue is drained */
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+
+		job = ctx->head;
+		ctx->head = job->next;
+		if (ctx->head == NULL) ctx->tail = NULL;
+		pthread_mutex_unlock(&ctx->lock);
+
+		timing_reset();
+		r = authenticate_keepalive(&sock, job->auth, &next_id);
+		auth_control_write(job->control_file, r);
+		timing_report((r) ? TIMING_OK : TIMING_FAILED);
+		plugin_job_destroy(job);
+	}
+
+	if (sock != NULL) srv_disconnect(sock);
+	return NULL;
+}
+
+/**
+ * initializes plugin and starts worker threads
+ * @return plugin context or NULL on error
+ */
+static struct plugin_context * plugin_open (unsigned int *type_mask, const char **argv) {
+	struct plugin_context *ctx;
+	int i;
+
+	MYNAME = PLUGIN_NAME;
+	log_func = plugin_log_msg;
+	openvpn_thread = pthread_self();
+	strncpy(hostname, DEFAULT_HOSTNAME, sizeof(hostname) - 1);
+
+	/** configuration file given as plugin argument? */
+	if (argv != NULL && argv[0] != NULL && argv[1] != NULL) {
+		if (! load_config_file((char *) argv[1])) {
+			log_msg("Unable to parse config file '%s': %s", argv[1], strerror(errno));
+			return NULL;
+		}
+	} else
+		load_config_files();
+
+	/** map verdict cache and TLS session file before worker threads are started */
+	cache_open();
+	if (tls && ! tls_client_init())
+		return NULL;
+
+	if (plugin_workers < 1) plugin_workers = 1;
+	if (plugin_workers > PLUGIN_MAX_WORKERS) plugin_workers = PLUGIN_MAX_WORKERS;
+
+	if ((ctx = calloc(1, sizeof(struct plugin_context))) == NULL) {
+		log_msg("Unable to allocate memory for plugin context.");
+		return NULL;
+	}
+	if ((ctx->workers = calloc(plugin_workers, sizeof(pthread_t))) == NULL) {
+		log_msg("Unable to allocate memory for plugin context.");
+		free(ctx);
+		return NULL;
+	}
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->cond, NULL);
+
+	/** start workers */
+	for (i = 0; i < plugin_workers; i++) {
+		if (pthread_create(&ctx->workers[i], NULL, plugin_worker, ctx) != 0) {
+			log_msg("Unable to start worker thread: %s", strerror(errno));
+			break;
+		}
+		ctx->num_workers++;
+	}
+
+	if (ctx->num_workers < 1) {
+		pthread_cond_destroy(&ctx->cond);
+		pthread_mutex_destroy(&ctx->lock);
+		free(ctx->workers);
+		free(ctx);
+		return NULL;
+	}
+
+	log_msg("%s %s initialized with %d worker thread(s), authentication server %s.", PLUGIN_NAME, VERSION, ctx->num_workers, hostname);
+
+	*type_mask = OPENVPN_PLUGIN_MASK(OPENVPN_PLUGIN_AUTH_USER_PASS_VERIFY);
+	return ctx;
+}
+
+OPENVPN_EXPORT openvpn_plugin_handle_t openvpn_plugin_open_v1 (unsigned int *type_mask, const char *argv[], const char *envp[]) {
+	return (openvpn_plugin_handle_t) plugin_open(type_mask, argv);
+}
+
+OPENVPN_EXPORT int openvpn_plugin_open_v3 (const int version, struct openvpn_plugin_args_open_in const *args, struct openvpn_plugin_args_open_return *ret) {
+	unsigned int type_mask = 0;
+	struct plugin_context *ctx;
+
+	if (args->callbacks != NULL)
+		openvpn_vlog = args->callbacks->plugin_vlog;
+
+	if ((ctx = plugin_open(&type_mask, (const char **) args->argv)) == NULL)
+		return OPENVPN_PLUGIN_FUNC_ERROR;
+
+	ret->type_mask = type_mask;
+	ret->handle = (openvpn_plugin_handle_t) ctx;
+	return OPENVPN_PLUGIN_FUNC_SUCCESS;
+}
+
+OPENVPN_EXPORT int openvpn_plugin_func_v1 (openvpn_plugin_handle_t handle, const int type, const char *argv[], const char *envp[]) {
+	struct plugin_context *ctx = (struct plugin_context *) handle;
+	struct plugin_job *job;
+	int r;
+
+	if (type != OPENVPN_PLUGIN_AUTH_USER_PASS_VERIFY)
+		return OPENVPN_PLUGIN_FUNC_ERROR;
+
+	if ((job = plugin_job_create(envp)) == NULL)
+		return OPENVPN_PLUGIN_FUNC_ERROR;
+
+	/** recently verified credentials? */
+	if (cache_lookup(job->auth)) {
+		plugin_job_destroy(job);
+		return OPENVPN_PLUGIN_FUNC_SUCCESS;
+	}
+
+	/** openvpn without deferred auth support: authenticate synchronously */
+	if (strlen(job->control_file) < 1) {
+		timing_reset();
+		r = authenticate(job->auth);
+		timing_report((r) ? TIMING_OK : TIMING_FAILED);
+		plugin_job_destroy(job);
+		return (r) ? OPENVPN_PLUGIN_FUNC_SUCCESS : OPENVPN_PLUGIN_FUNC_ERROR;
+	}
+
+	/** enqueue job and wake up one worker */
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->tail != NULL)
+		ctx->tail->next = job;
+	else
+		ctx->head = job;
+	ctx->tail = job;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return OPENVPN_PLUGIN_FUNC_DEFERRED;
+}
+
+OPENVPN_EXPORT void openvpn_plugin_close_v1 (openvpn_plugin_handle_t handle) {
+	struct plugin_context *ctx = (struct plugin_context *) handle;
+	int i;
+
+	if (ctx == NULL) return;
+
+	/** let workers drain the queue and exit */
+	pthread_mutex_lock(&ctx->lock);
+	ctx->shutdown = 1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (i = 0; i < ctx->num_workers; i++)
+		pthread_join(ctx->workers[i], NULL);
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->workers);
+	free(ctx);
+}
@@ -0,0 +1,190 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Password verification benchmark (openvpn_auth_pwbench).
+ *
+ * Drives pw_verify_batch() with known hashes of every supported
+ * algorithm and reports verifications per second. Half of every batch
+ * uses wrong password; results are checked, so benchmark doubles as
+ * self test of native verifier.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "openvpn_auth_pwverify.h"
+
+#define DEFAULT_BATCH 1000
+#define DEFAULT_DURATION 1.0
+
+/** hashes of password "password" */
+static const char *vectors[PW_ALG_MAX] = {
+	"password",
+	"abJnggxhB/yWI",
+	"$1$saltsalt$qjXMvbEw8oaL.CzflDtaK/",
+	"$6$saltsalt$qFmFH.bQmmtXzyBY0s9v7Oicd2z4XSIecDzlB5KiA2/jctKu9YterLp8wwnSq.qc.eoxqOmSuNp2xS0ktL3nh/",
+	"5f4dcc3b5aa765d61d8327deb882cf99",
+	"5baa61e4c9b93f3f0682250b6cf8331b7ee68fd8",
+	"8846F7EAEE8FB117AD06BDD830B7586C",
+	"{SSHA}yrht1iYXEIkejLVu42JWkadd80RzYWx0c2FsdA==",
+	"{SSHA256}DIzeh0gCRMTRu9dAH3C3rr7fWkRT0Bp2ZdtRqvTX3XJzYWx0c2FsdA==",
+	"{SSHA512}9ZxHVj4YomwqqFiYKcIjExMLx2ZblYfXRGc4KMqbgvHq2+HOgwiTIi+eO/Uam/8D0beDAkGpvx14+UFlfBskLnNhbHRzYWx0"
+};
+
+static double now (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void printhelp (const char *name) {
+	printf("Usage: %s [OPTIONS]\n\n", name);
+	printf("Benchmarks native password hash verification.\n\n");
+	printf("OPTIONS:\n");
+	printf("  -a    --algorithm=NAME     Benchmark only specified algorithm (may be repeated)\n");
+	printf("  -n    --batch=N            Verifications per batch (Default: %d)\n", DEFAULT_BATCH);
+	printf("  -d    --duration=SECONDS   Minimum duration per algorithm (Default: %.1f)\n", DEFAULT_DURATION);
+	printf("  -h    --help               This help message\n");
+}
+
+/* returns number of wrong results */
+static long bench (pw_ctx *ctx, int alg, size_t batch, double duration) {
+	const char **hashes = malloc(batch * sizeof(char *));
+	const char **passwords = malloc(batch * sizeof(char *));
+	int *results = malloc(batch * sizeof(int));
+	double start, elapsed;
+	long errors = 0, total = 0;
+	size_t i;
+
+	if (hashes == NULL || passwords == NULL || results == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (i = 0; i < batch; i++) {
+		hashes[i] = vectors[alg];
+		passwords[i] = (i % 2) ? "passw0rd" : "password";
+	}
+
+	start = now();
+	do {
+		size_t ok = pw_verify_batch(ctx, alg, batch, hashes, passwords, results);
+		if (ok != (batch + 1) / 2)
+			errors++;
+		for (i = 0; i < batch; i++) {
+			if (results[i] != ((i % 2) ? PW_INVALID : PW_OK)) {
+				if (results[i] == PW_ERROR)
+					fprintf(stderr, "%s: %s\n", pw_alg_name(alg), pw_error(ctx));
+				errors++;
+				break;
+			}
+		}
+		total += batch;
+		elapsed = now() - start;
+	} while (elapsed < duration && errors == 0);
+
+	printf("%-10s %10ld %8.3f %12.0f %10.3f%s\n",
+		pw_alg_name(alg), total, elapsed, total / elapsed, elapsed * 1e6 / total,
+		(errors) ? "  WRONG RESULTS" : "");
+
+	free(hashes);
+	free(passwords);
+	free(results);
+	return errors;
+}
+
+int main (int argc, char **argv) {
+	static struct option long_options[] = {
+		{ "algorithm", required_argument, NULL, 'a' },
+		{ "batch", required_argument, NULL, 'n' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int selected[PW_ALG_MAX];
+	int any_selected = 0;
+	size_t batch = DEFAULT_BATCH;
+	double duration = DEFAULT_DURATION;
+	long errors = 0;
+	pw_ctx *ctx;
+	int c, i;
+
+	memset(selected, 0, sizeof(selected));
+	while ((c = getopt_long(argc, argv, "a:n:d:h", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'a':
+				i = pw_alg_lookup(optarg);
+				if (i < 0) {
+					fprintf(stderr, "Unsupported algorithm: %s\n", optarg);
+					return 1;
+				}
+				selected[i] = 1;
+				any_selected = 1;
+				break;
+			case 'n':
+				batch = (size_t) atol(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 'h':
+				printhelp(argv[0]);
+				return 0;
+			default:
+				fprintf(stderr, "Invalid command line options. Run %s --help for instructions.\n", argv[0]);
+				return 1;
+		}
+	}
+	if (batch < 1)
+		batch = 1;
+
+	ctx = pw_ctx_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "Unable to allocate verification context.\n");
+		return 1;
+	}
+
+	printf("%-10s %10s %8s %12s %10s\n", "ALGORITHM", "VERIFIED", "SECONDS", "VERIFIES/S", "USEC/VERIFY");
+	for (i = 0; i < PW_ALG_MAX; i++) {
+		if (any_selected && ! selected[i])
+			continue;
+		errors += bench(ctx, i, batch, duration);
+	}
+
+	pw_ctx_free(ctx);
+	return (errors) ? 2 : 0;
+}
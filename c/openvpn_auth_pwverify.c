@@ -0,0 +1,460 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Native password hash verification, see openvpn_auth_pwverify.h.
+ *
+ * Supported stored hash formats (password "password"):
+ *
+ *   PLAIN      password
+ *   CRYPT      abJnggxhB/yWI (any crypt(3) hash understood by libc)
+ *   CRYPTMD5   $1$saltsalt$qjXMvbEw8oaL.CzflDtaK/
+ *   SHACRYPT   $5$... or $6$[rounds=N$]salt$...
+ *   MD5, SHA1  hex or base64 encoded digest, optional {TAG} prefix
+ *   NTLM       hex encoded MD4 digest of UTF-16LE password
+ *   SSHA*      base64(digest(password + salt) + salt), optional {TAG} prefix
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <crypt.h>
+#include <openssl/evp.h>
+
+#include "openvpn_auth_pwverify.h"
+
+struct pw_ctx {
+	struct crypt_data cd;
+	EVP_MD_CTX *md;
+	const char *error;
+	char pw_buf[PW_MAX_LEN + 1];
+	char hash_buf[PW_MAX_LEN + 1];
+};
+
+static const char *pw_alg_names[PW_ALG_MAX] = {
+	"PLAIN",
+	"CRYPT",
+	"CRYPTMD5",
+	"SHACRYPT",
+	"MD5",
+	"SHA1",
+	"NTLM",
+	"SSHA",
+	"SSHA256",
+	"SSHA512"
+};
+
+pw_ctx *pw_ctx_new (void) {
+	pw_ctx *ctx = calloc(1, sizeof(pw_ctx));
+	if (ctx == NULL)
+		return NULL;
+	ctx->md = EVP_MD_CTX_new();
+	if (ctx->md == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	ctx->error = "";
+	return ctx;
+}
+
+void pw_ctx_free (pw_ctx *ctx) {
+	if (ctx == NULL)
+		return;
+	EVP_MD_CTX_free(ctx->md);
+	/* crypt_data may contain password derived state */
+	memset(ctx, 0, sizeof(pw_ctx));
+	free(ctx);
+}
+
+const char *pw_error (pw_ctx *ctx) {
+	return ctx->error;
+}
+
+int pw_alg_lookup (const char *name) {
+	int i;
+	for (i = 0; i < PW_ALG_MAX; i++) {
+		if (strcasecmp(name, pw_alg_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *pw_alg_name (int alg) {
+	if (alg < 0 || alg >= PW_ALG_MAX)
+		return NULL;
+	return pw_alg_names[alg];
+}
+
+int pw_ct_equal (const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len) {
+	unsigned char d = 0;
+	size_t i;
+
+	/* compare a with itself on length mismatch, so timing doesn't depend on b */
+	if (a_len != b_len) {
+		b = a;
+		d = 1;
+	}
+	for (i = 0; i < a_len; i++)
+		d |= a[i] ^ b[i];
+
+	return d == 0;
+}
+
+static int hex_val (int c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int hex_decode (const char *in, size_t len, unsigned char *out, size_t out_size) {
+	size_t i;
+	if (len % 2 || len / 2 > out_size)
+		return -1;
+	for (i = 0; i < len; i += 2) {
+		int h = hex_val(in[i]), l = hex_val(in[i + 1]);
+		if (h < 0 || l < 0)
+			return -1;
+		out[i / 2] = (unsigned char) ((h << 4) | l);
+	}
+	return (int) (len / 2);
+}
+
+static int b64_val (int c) {
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+static int b64_decode (const char *in, size_t len, unsigned char *out, size_t out_size) {
+	uint32_t acc = 0;
+	size_t i, n = 0;
+	int bits = 0;
+
+	while (len > 0 && in[len - 1] == '=')
+		len--;
+	for (i = 0; i < len; i++) {
+		int v = b64_val(in[i]);
+		if (v < 0)
+			return -1;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n >= out_size)
+				return -1;
+			out[n++] = (unsigned char) (acc >> bits);
+		}
+	}
+	return (int) n;
+}
+
+/**
+ * MD4 (RFC 1320), needed only for NTLM hashes; libcrypto 3.x provides
+ * it only through legacy provider.
+ */
+#define MD4_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD4_G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md4_block (uint32_t st[4], const unsigned char *p) {
+	static const int r3[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+	uint32_t x[16], a = st[0], b = st[1], c = st[2], d = st[3];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = (uint32_t) p[4 * i] | ((uint32_t) p[4 * i + 1] << 8) | ((uint32_t) p[4 * i + 2] << 16) | ((uint32_t) p[4 * i + 3] << 24);
+
+	for (i = 0; i < 16; i += 4) {
+		a = MD4_ROTL(a + MD4_F(b, c, d) + x[i], 3);
+		d = MD4_ROTL(d + MD4_F(a, b, c) + x[i + 1], 7);
+		c = MD4_ROTL(c + MD4_F(d, a, b) + x[i + 2], 11);
+		b = MD4_ROTL(b + MD4_F(c, d, a) + x[i + 3], 19);
+	}
+	for (i = 0; i < 4; i++) {
+		a = MD4_ROTL(a + MD4_G(b, c, d) + x[i] + 0x5a827999, 3);
+		d = MD4_ROTL(d + MD4_G(a, b, c) + x[i + 4] + 0x5a827999, 5);
+		c = MD4_ROTL(c + MD4_G(d, a, b) + x[i + 8] + 0x5a827999, 9);
+		b = MD4_ROTL(b + MD4_G(c, d, a) + x[i + 12] + 0x5a827999, 13);
+	}
+	for (i = 0; i < 16; i += 4) {
+		a = MD4_ROTL(a + MD4_H(b, c, d) + x[r3[i]] + 0x6ed9eba1, 3);
+		d = MD4_ROTL(d + MD4_H(a, b, c) + x[r3[i + 1]] + 0x6ed9eba1, 9);
+		c = MD4_ROTL(c + MD4_H(d, a, b) + x[r3[i + 2]] + 0x6ed9eba1, 11);
+		b = MD4_ROTL(b + MD4_H(c, d, a) + x[r3[i + 3]] + 0x6ed9eba1, 15);
+	}
+
+	st[0] += a;
+	st[1] += b;
+	st[2] += c;
+	st[3] += d;
+}
+
+static void md4 (const unsigned char *msg, size_t len, unsigned char out[16]) {
+	uint32_t st[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	unsigned char tail[128];
+	uint64_t bits = (uint64_t) len * 8;
+	size_t i, rest, tail_len;
+
+	for (i = 0; i + 64 <= len; i += 64)
+		md4_block(st, msg + i);
+
+	rest = len - i;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, msg + i, rest);
+	tail[rest] = 0x80;
+	tail_len = (rest < 56) ? 64 : 128;
+	for (i = 0; i < 8; i++)
+		tail[tail_len - 8 + i] = (unsigned char) (bits >> (8 * i));
+	md4_block(st, tail);
+	if (tail_len == 128)
+		md4_block(st, tail + 64);
+
+	for (i = 0; i < 4; i++) {
+		out[4 * i] = (unsigned char) st[i];
+		out[4 * i + 1] = (unsigned char) (st[i] >> 8);
+		out[4 * i + 2] = (unsigned char) (st[i] >> 16);
+		out[4 * i + 3] = (unsigned char) (st[i] >> 24);
+	}
+}
+
+/**
+ * Converts UTF-8 password to UTF-16LE; invalid UTF-8 is treated as
+ * ISO-8859-1. Returns number of bytes written.
+ */
+static size_t utf16le (const unsigned char *in, size_t len, unsigned char *out) {
+	size_t i = 0, n = 0;
+
+	while (i < len) {
+		uint32_t cp;
+		int extra;
+		if (in[i] < 0x80) {
+			cp = in[i];
+			extra = 0;
+		} else if ((in[i] & 0xe0) == 0xc0) {
+			cp = in[i] & 0x1f;
+			extra = 1;
+		} else if ((in[i] & 0xf0) == 0xe0) {
+			cp = in[i] & 0x0f;
+			extra = 2;
+		} else if ((in[i] & 0xf8) == 0xf0) {
+			cp = in[i] & 0x07;
+			extra = 3;
+		} else {
+			goto latin1;
+		}
+		if (extra > 0 && i + extra >= len)
+			goto latin1;
+		i++;
+		while (extra-- > 0) {
+			if ((in[i] & 0xc0) != 0x80)
+				goto latin1;
+			cp = (cp << 6) | (in[i++] & 0x3f);
+		}
+		if (cp > 0x10ffff)
+			goto latin1;
+		if (cp >= 0x10000) {
+			cp -= 0x10000;
+			out[n++] = (unsigned char) ((0xd800 | (cp >> 10)) & 0xff);
+			out[n++] = (unsigned char) ((0xd800 | (cp >> 10)) >> 8);
+			cp = 0xdc00 | (cp & 0x3ff);
+		}
+		out[n++] = (unsigned char) (cp & 0xff);
+		out[n++] = (unsigned char) (cp >> 8);
+	}
+	return n;
+
+	latin1:
+	for (i = 0; i < len; i++) {
+		out[2 * i] = in[i];
+		out[2 * i + 1] = 0;
+	}
+	return 2 * len;
+}
+
+static int verify_crypt (pw_ctx *ctx, const char *prefix, const char *prefix2, const char *hash, size_t hash_len, const char *password, size_t password_len) {
+	const char *r;
+
+	if ((prefix != NULL && strncmp(hash, prefix, strlen(prefix)) != 0) &&
+		(prefix2 == NULL || strncmp(hash, prefix2, strlen(prefix2)) != 0)) {
+		ctx->error = "Password hash is not in expected crypt(3) format.";
+		return PW_ERROR;
+	}
+	/* crypt_r(3) works with NUL terminated strings */
+	if (memchr(password, '\0', password_len) != NULL) {
+		ctx->error = "Invalid password.";
+		return PW_INVALID;
+	}
+	memcpy(ctx->pw_buf, password, password_len);
+	ctx->pw_buf[password_len] = '\0';
+	memcpy(ctx->hash_buf, hash, hash_len);
+	ctx->hash_buf[hash_len] = '\0';
+
+	r = crypt_r(ctx->pw_buf, ctx->hash_buf, &ctx->cd);
+	memset(ctx->pw_buf, 0, password_len);
+	if (r == NULL || r[0] == '*') {
+		ctx->error = "Password hash is not supported by crypt(3).";
+		return PW_ERROR;
+	}
+
+	if (! pw_ct_equal((const unsigned char *) hash, hash_len, (const unsigned char *) r, strlen(r))) {
+		ctx->error = "Invalid password.";
+		return PW_INVALID;
+	}
+	return PW_OK;
+}
+
+static int verify_digest (pw_ctx *ctx, const EVP_MD *md, int salted, const char *hash, size_t hash_len, const char *password, size_t password_len) {
+	unsigned char stored[PW_MAX_LEN];
+	unsigned char calc[EVP_MAX_MD_SIZE];
+	unsigned int calc_len = 0;
+	size_t dlen = (size_t) EVP_MD_size(md);
+	int n;
+
+	/* {SSHA}..., {SHA}... */
+	if (hash_len > 0 && hash[0] == '{') {
+		const char *p = memchr(hash, '}', hash_len);
+		if (p != NULL) {
+			hash_len -= (size_t) (p + 1 - hash);
+			hash = p + 1;
+		}
+	}
+
+	if (! salted && hash_len == 2 * dlen)
+		n = hex_decode(hash, hash_len, stored, sizeof(stored));
+	else
+		n = b64_decode(hash, hash_len, stored, sizeof(stored));
+	if (n < 0 || (salted && (size_t) n <= dlen) || (! salted && (size_t) n != dlen)) {
+		ctx->error = "Malformed password hash.";
+		return PW_ERROR;
+	}
+
+	if (! EVP_DigestInit_ex(ctx->md, md, NULL) ||
+		! EVP_DigestUpdate(ctx->md, password, password_len) ||
+		(salted && ! EVP_DigestUpdate(ctx->md, stored + dlen, n - dlen)) ||
+		! EVP_DigestFinal_ex(ctx->md, calc, &calc_len)) {
+		ctx->error = "Error computing password digest.";
+		return PW_ERROR;
+	}
+
+	if (! pw_ct_equal(calc, calc_len, stored, dlen)) {
+		ctx->error = "Invalid password.";
+		return PW_INVALID;
+	}
+	return PW_OK;
+}
+
+static int verify_ntlm (pw_ctx *ctx, const char *hash, size_t hash_len, const char *password, size_t password_len) {
+	unsigned char stored[16];
+	unsigned char calc[16];
+	unsigned char buf[4 * PW_MAX_LEN];
+
+	if (hex_decode(hash, hash_len, stored, sizeof(stored)) != sizeof(stored)) {
+		ctx->error = "Malformed password hash.";
+		return PW_ERROR;
+	}
+	md4(buf, utf16le((const unsigned char *) password, password_len, buf), calc);
+	memset(buf, 0, sizeof(buf));
+
+	if (! pw_ct_equal(calc, sizeof(calc), stored, sizeof(stored))) {
+		ctx->error = "Invalid password.";
+		return PW_INVALID;
+	}
+	return PW_OK;
+}
+
+int pw_verify (pw_ctx *ctx, int alg, const char *hash, size_t hash_len, const char *password, size_t password_len) {
+	ctx->error = "";
+
+	if (hash_len > PW_MAX_LEN || password_len > PW_MAX_LEN) {
+		ctx->error = "Password or password hash is too long.";
+		return PW_ERROR;
+	}
+
+	switch (alg) {
+		case PW_PLAIN:
+			if (! pw_ct_equal((const unsigned char *) hash, hash_len, (const unsigned char *) password, password_len)) {
+				ctx->error = "Invalid password.";
+				return PW_INVALID;
+			}
+			return PW_OK;
+		case PW_CRYPT:
+			return verify_crypt(ctx, NULL, NULL, hash, hash_len, password, password_len);
+		case PW_CRYPTMD5:
+			return verify_crypt(ctx, "$1$", NULL, hash, hash_len, password, password_len);
+		case PW_SHACRYPT:
+			return verify_crypt(ctx, "$5$", "$6$", hash, hash_len, password, password_len);
+		case PW_MD5:
+			return verify_digest(ctx, EVP_md5(), 0, hash, hash_len, password, password_len);
+		case PW_SHA1:
+			return verify_digest(ctx, EVP_sha1(), 0, hash, hash_len, password, password_len);
+		case PW_NTLM:
+			return verify_ntlm(ctx, hash, hash_len, password, password_len);
+		case PW_SSHA:
+			return verify_digest(ctx, EVP_sha1(), 1, hash, hash_len, password, password_len);
+		case PW_SSHA256:
+			return verify_digest(ctx, EVP_sha256(), 1, hash, hash_len, password, password_len);
+		case PW_SSHA512:
+			return verify_digest(ctx, EVP_sha512(), 1, hash, hash_len, password, password_len);
+	}
+
+	ctx->error = "Unsupported password hashing algorithm.";
+	return PW_ERROR;
+}
+
+size_t pw_verify_batch (pw_ctx *ctx, int alg, size_t n, const char *const *hashes, const char *const *passwords, int *results) {
+	size_t i, ok = 0;
+	for (i = 0; i < n; i++) {
+		results[i] = pw_verify(ctx, alg, hashes[i], strlen(hashes[i]), passwords[i], strlen(passwords[i]));
+		if (results[i] == PW_OK)
+			ok++;
+	}
+	return ok;
+}
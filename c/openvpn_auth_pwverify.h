@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Native password hash verification (openvpn_auth_pwverify).
+ *
+ * Used by Net::OpenVPN::PasswordVerify (XS) and openvpn_auth_pwbench.
+ * Crypt(3) family hashes are verified with crypt_r(3), digests with
+ * libcrypto; all hash comparisons take constant time.
+ */
+
+#ifndef _OPENVPN_AUTH_PWVERIFY_H
+#define _OPENVPN_AUTH_PWVERIFY_H
+
+#include <stddef.h>
+
+#define PW_VERIFY_VERSION "0.10"
+
+/** verification results */
+#define PW_OK 1
+#define PW_INVALID 0
+#define PW_ERROR -1
+
+/** supported algorithms; names match Net::OpenVPN::PasswordValidator */
+enum pw_alg {
+	PW_PLAIN = 0,
+	PW_CRYPT,
+	PW_CRYPTMD5,
+	PW_SHACRYPT,
+	PW_MD5,
+	PW_SHA1,
+	PW_NTLM,
+	PW_SSHA,
+	PW_SSHA256,
+	PW_SSHA512,
+	PW_ALG_MAX
+};
+
+/** maximum accepted password and hash length */
+#define PW_MAX_LEN 1024
+
+typedef struct pw_ctx pw_ctx;
+
+/**
+ * Allocates verification context. Context holds crypt_r(3) and digest
+ * state, so it must not be shared between threads.
+ */
+pw_ctx *pw_ctx_new (void);
+void pw_ctx_free (pw_ctx *ctx);
+
+/** last error message of context */
+const char *pw_error (pw_ctx *ctx);
+
+/** returns algorithm number for name (case insensitive) or -1 */
+int pw_alg_lookup (const char *name);
+const char *pw_alg_name (int alg);
+
+/**
+ * Verifies password against stored hash. Returns PW_OK, PW_INVALID or
+ * PW_ERROR (unsupported algorithm or malformed hash, see pw_error()).
+ */
+int pw_verify (pw_ctx *ctx, int alg, const char *hash, size_t hash_len, const char *password, size_t password_len);
+
+/**
+ * Verifies n NUL terminated hash/password pairs using the same
+ * algorithm; results[i] receives pw_verify() result. Returns number of
+ * valid passwords.
+ */
+size_t pw_verify_batch (pw_ctx *ctx, int alg, size_t n, const char *const *hashes, const char *const *passwords, int *results);
+
+/** constant time comparison, returns 1 if buffers are equal */
+int pw_ct_equal (const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len);
+
+#endif /* _OPENVPN_AUTH_PWVERIFY_H */
@@ -0,0 +1,84 @@
+/**
+ * Perl binding of native password verifier (Net::OpenVPN::PasswordVerify),
+ * built by "make pwverify". See openvpn_auth_pwverify.h.
+ */
+
+#include "EXTERN.h"
+#include "perl.h"
+#include "XSUB.h"
+
+#include "openvpn_auth_pwverify.h"
+
+/* authentication workers are processes, one context is enough */
+static pw_ctx *ctx = NULL;
+
+static pw_ctx *get_ctx (pTHX) {
+	if (ctx == NULL) {
+		ctx = pw_ctx_new();
+		if (ctx == NULL)
+			croak("Unable to allocate password verification context.");
+	}
+	return ctx;
+}
+
+MODULE = Net::OpenVPN::PasswordVerify		PACKAGE = Net::OpenVPN::PasswordVerify
+
+PROTOTYPES: DISABLE
+
+void
+algorithms()
+    PREINIT:
+	int i;
+    PPCODE:
+	for (i = 0; i < PW_ALG_MAX; i++)
+		XPUSHs(sv_2mortal(newSVpv(pw_alg_name(i), 0)));
+
+int
+verify(alg, hash, password)
+	const char *alg
+	SV *hash
+	SV *password
+    PREINIT:
+	STRLEN hash_len, password_len;
+	const char *h, *p;
+	int a;
+    CODE:
+	a = pw_alg_lookup(alg);
+	h = SvPVbyte(hash, hash_len);
+	p = SvPVbyte(password, password_len);
+	if (a < 0)
+		RETVAL = pw_verify(get_ctx(aTHX), PW_ALG_MAX, h, hash_len, p, password_len);
+	else
+		RETVAL = pw_verify(get_ctx(aTHX), a, h, hash_len, p, password_len);
+    OUTPUT:
+	RETVAL
+
+void
+verify_batch(alg, hashes, passwords)
+	const char *alg
+	AV *hashes
+	AV *passwords
+    PREINIT:
+	SSize_t i, n;
+	int a;
+    PPCODE:
+	a = pw_alg_lookup(alg);
+	n = av_len(hashes) + 1;
+	if (av_len(passwords) + 1 != n)
+		croak("Number of hashes and passwords differ.");
+	EXTEND(SP, n);
+	for (i = 0; i < n; i++) {
+		SV **h = av_fetch(hashes, i, 0);
+		SV **p = av_fetch(passwords, i, 0);
+		STRLEN hash_len = 0, password_len = 0;
+		const char *hs = (h != NULL) ? SvPVbyte(*h, hash_len) : "";
+		const char *ps = (p != NULL) ? SvPVbyte(*p, password_len) : "";
+		PUSHs(sv_2mortal(newSViv(pw_verify(get_ctx(aTHX), (a < 0) ? PW_ALG_MAX : a, hs, hash_len, ps, password_len))));
+	}
+
+const char *
+error()
+    CODE:
+	RETVAL = pw_error(get_ctx(aTHX));
+    OUTPUT:
+	RETVAL
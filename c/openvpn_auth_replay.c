@@ -0,0 +1,613 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Replays openvpn_authd request capture (openvpn_auth_replay).
+ *
+ * openvpn_authd with $daemon_capture_file appends record of every answered
+ * request to capture file (see Net::OpenVPN::Capture for format). This tool
+ * reissues captured requests against (test) openvpn_authd through the same
+ * code as openvpn_authc (authenticate()) or, with --keepalive, as
+ * openvpn_auth_plugin (authenticate_keepalive()), keeping original spacing
+ * between requests scaled by --speed, or as fast as --concurrency threads
+ * allow (--speed 0). Like in openvpn_auth_bench's fixed rate mode, latency
+ * is measured from request's scheduled time.
+ *
+ * Capture contains no passwords: request which originally succeeded is sent
+ * with user's synthetic password token, failed one with token prefixed by
+ * '!'. --passwd writes password file (username:token) for test daemon's File
+ * backend, so that replayed verdicts match captured ones.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "openvpn_auth_client.h"
+
+#define REPLAY_NAME "openvpn_auth_replay"
+#define REPLAY_MAX_THREADS 1024
+#define REPLAY_DEFAULT_THREADS 64
+#define REPLAY_DEFAULT_SPEED 1.0
+
+#define CAPTURE_MAGIC "OVAC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN 32
+#define CAPTURE_RECORD_LEN 18		/** fixed part of record */
+#define CAPTURE_STRINGS 6
+
+#define CAPTURE_FLAG_KEEPALIVE 0x01
+#define CAPTURE_FLAG_PROTO_V2 0x02
+#define CAPTURE_FLAG_NOT_RUN 0x04
+
+/**
+ * captured request; strings are allocated in one block with the structure
+ */
+struct replay_req {
+	long long time;				/** receive time (us since epoch) */
+	unsigned int latency;		/** captured server latency (us) */
+	unsigned char status;
+	unsigned char flags;
+	int untrusted_port;
+	char *username;
+	char *token;
+	char *common_name;
+	char *untrusted_ip;
+	char *source;
+	char *path;
+};
+
+/**
+ * per-thread results; latencies are kept per thread and merged at the end
+ */
+struct replay_thread {
+	pthread_t tid;
+	unsigned int *lat;		/** request latencies (us) */
+	size_t lat_len;
+	size_t lat_size;
+	unsigned long ok;
+	unsigned long failed;
+	unsigned long differ;	/** verdict differs from captured one */
+	long long max_lag;		/** latest start after scheduled time (us) */
+};
+
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct replay_req **replay_reqs = NULL;
+static size_t replay_len = 0;
+static size_t replay_next = 0;
+static double replay_speed = REPLAY_DEFAULT_SPEED;
+static int replay_keepalive = 0;
+static long long replay_start = 0;
+
+/**
+ * returns microseconds elapsed on monotonic clock
+ */
+static long long replay_clock_us (void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int replay_u32 (const unsigned char *p) {
+	return ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+}
+
+static int replay_time_cmp (const void *a, const void *b) {
+	const struct replay_req *x = *(struct replay_req * const *) a, *y = *(struct replay_req * const *) b;
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/**
+ * parses single capture record
+ * @return request or NULL if record is malformed or memory is exhausted
+ */
+static struct replay_req * replay_parse (const unsigned char *rec, size_t len) {
+	struct replay_req *req;
+	char **str[CAPTURE_STRINGS];
+	const unsigned char *p = rec + CAPTURE_RECORD_LEN;
+	char *dst;
+	size_t i, l;
+
+	if (len < CAPTURE_RECORD_LEN) return NULL;
+	/** strings are at most len bytes, plus terminating zeros */
+	if ((req = malloc(sizeof(struct replay_req) + len + CAPTURE_STRINGS)) == NULL) return NULL;
+	req->time = (long long) replay_u32(rec + 2) * 1000000 + replay_u32(rec + 6);
+	req->latency = replay_u32(rec + 10);
+	req->status = rec[14];
+	req->flags = rec[15];
+	req->untrusted_port = (rec[16] << 8) | rec[17];
+
+	str[0] = &req->username;
+	str[1] = &req->token;
+	str[2] = &req->common_name;
+	str[3] = &req->untrusted_ip;
+	str[4] = &req->source;
+	str[5] = &req->path;
+	dst = (char *) (req + 1);
+	for (i = 0; i < CAPTURE_STRINGS; i++) {
+		if (p >= rec + len || p + 1 + *p > rec + len) {
+			free(req);
+			return NULL;
+		}
+		l = *p++;
+		memcpy(dst, p, l);
+		dst[l] = '\0';
+		*str[i] = dst;
+		dst += l + 1;
+		p += l;
+	}
+
+	return req;
+}
+
+/**
+ * loads capture file and sorts requests by receive time (workers append
+ * records in order of responses)
+ * @return 1 on success, otherwise 0
+ */
+static int replay_load (const char *file) {
+	unsigned char hdr[CAPTURE_HEADER_LEN], rec[65536];
+	struct replay_req *req, **ptr;
+	size_t size = 0, len;
+	unsigned long bad = 0;
+	FILE *fd;
+
+	if ((fd = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "Unable to open capture file '%s': %s\n", file, strerror(errno));
+		return 0;
+	}
+	if (fread(hdr, 1, sizeof(hdr), fd) != sizeof(hdr) || memcmp(hdr, CAPTURE_MAGIC, 4) != 0 ||
+		((hdr[4] << 8) | hdr[5]) != CAPTURE_VERSION || ((hdr[6] << 8) | hdr[7]) != CAPTURE_HEADER_LEN) {
+		fprintf(stderr, "File '%s' is not capture file version %d.\n", file, CAPTURE_VERSION);
+		fclose(fd);
+		return 0;
+	}
+
+	while (fread(rec, 1, 2, fd) == 2) {
+		len = (rec[0] << 8) | rec[1];
+		if (len < CAPTURE_RECORD_LEN || fread(rec + 2, 1, len - 2, fd) != len - 2) {
+			/** daemon killed in the middle of write */
+			bad++;
+			break;
+		}
+		if ((req = replay_parse(rec, len)) == NULL) {
+			bad++;
+			continue;
+		}
+		if (replay_len >= size) {
+			size = (size > 0) ? size * 2 : 4096;
+			if ((ptr = realloc(replay_reqs, size * sizeof(struct replay_req *))) == NULL) {
+				fprintf(stderr, "Unable to allocate memory for captured requests.\n");
+				free(req);
+				fclose(fd);
+				return 0;
+			}
+			replay_reqs = ptr;
+		}
+		replay_reqs[replay_len++] = req;
+	}
+	fclose(fd);
+
+	if (bad > 0)
+		fprintf(stderr, "Skipped %lu malformed or truncated record(s) in '%s'.\n", bad, file);
+	qsort(replay_reqs, replay_len, sizeof(struct replay_req *), replay_time_cmp);
+
+	return 1;
+}
+
+/**
+ * claims next request
+ * @return request or NULL if replay is over
+ */
+static struct replay_req * replay_claim (long long *scheduled) {
+	struct replay_req *req = NULL;
+
+	pthread_mutex_lock(&replay_lock);
+	if (replay_next < replay_len)
+		req = replay_reqs[replay_next++];
+	pthread_mutex_unlock(&replay_lock);
+	if (req == NULL) return NULL;
+
+	if (replay_speed > 0)
+		*scheduled = replay_start + (long long) ((req->time - replay_reqs[0]->time) / replay_speed);
+	else
+		*scheduled = replay_clock_us();
+
+	return req;
+}
+
+static int replay_record (struct replay_thread *t, unsigned int us) {
+	if (t->lat_len >= t->lat_size) {
+		size_t size = (t->lat_size > 0) ? t->lat_size * 2 : 4096;
+		unsigned int *ptr = realloc(t->lat, size * sizeof(unsigned int));
+		if (ptr == NULL) return 0;
+		t->lat = ptr;
+		t->lat_size = size;
+	}
+	t->lat[t->lat_len++] = us;
+	return 1;
+}
+
+static void * replay_worker (void *arg) {
+	struct replay_thread *t = (struct replay_thread *) arg;
+	struct replay_req *req;
+	struct auth *auth;
+	char common_name[CRED_BUF_SIZE];
+	char untrusted_ip[GEN_BUF_SIZE];
+	FILE *sock = NULL;
+	unsigned int next_id = 0;
+	long long scheduled, now;
+	int r;
+
+	if ((auth = authstruct_init()) == NULL) return NULL;
+	auth->common_name = common_name;
+	auth->untrusted_ip = untrusted_ip;
+
+	while ((req = replay_claim(&scheduled)) != NULL) {
+		/** wait for request's turn */
+		if ((now = replay_clock_us()) < scheduled)
+			usleep(scheduled - now);
+		else if (now - scheduled > t->max_lag)
+			t->max_lag = now - scheduled;
+
+		snprintf(auth->username, CRED_BUF_SIZE, "%s", req->username);
+		snprintf(auth->password, CRED_BUF_SIZE, "%s%s", (req->status == PROTO_STATUS_OK) ? "" : "!", req->token);
+		snprintf(common_name, sizeof(common_name), "%s", req->common_name);
+		snprintf(untrusted_ip, sizeof(untrusted_ip), "%s", req->untrusted_ip);
+		auth->untrusted_port = req->untrusted_port;
+
+		if (replay_keepalive)
+			r = authenticate_keepalive(&sock, auth, &next_id);
+		else
+			r = authenticate(auth);
+
+		now = replay_clock_us();
+		if (r) t->ok++; else t->failed++;
+		if (r != (req->status == PROTO_STATUS_OK)) {
+			t->differ++;
+			if (verbose)
+				fprintf(stderr, "Verdict for user '%s' differs from captured one (status %d, path '%s').\n", req->username, req->status, req->path);
+		}
+		if (! replay_record(t, (unsigned int) (now - scheduled))) {
+			fprintf(stderr, "Unable to allocate memory for latency samples.\n");
+			break;
+		}
+	}
+
+	if (sock != NULL) srv_disconnect(sock);
+	authstruct_destroy(auth);
+	return NULL;
+}
+
+static int replay_cmp (const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+	return (x > y) - (x < y);
+}
+
+static int replay_user_cmp (const void *a, const void *b) {
+	return strcmp((*(struct replay_req * const *) a)->username, (*(struct replay_req * const *) b)->username);
+}
+
+static double replay_pct (const unsigned int *lat, size_t len, double pct) {
+	size_t i;
+	if (len == 0) return 0;
+	i = (size_t) (pct / 100.0 * (len - 1) + 0.5);
+	return lat[i] / 1000.0;
+}
+
+static void replay_print_latency (const char *title, unsigned int *lat, size_t len) {
+	double sum = 0;
+	size_t i;
+
+	qsort(lat, len, sizeof(unsigned int), replay_cmp);
+	for (i = 0; i < len; i++)
+		sum += lat[i];
+
+	printf("%-15smin %.3f, mean %.3f, max %.3f\n", title,
+		(len) ? lat[0] / 1000.0 : 0, (len) ? sum / len / 1000.0 : 0, (len) ? lat[len - 1] / 1000.0 : 0);
+	printf("               p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+		replay_pct(lat, len, 50), replay_pct(lat, len, 90), replay_pct(lat, len, 99), replay_pct(lat, len, 99.9));
+}
+
+/**
+ * prints captured requests sorted by receive time
+ */
+static void replay_dump (void) {
+	struct replay_req *req;
+	struct tm tm;
+	time_t sec;
+	char buf[64];
+	size_t i;
+
+	for (i = 0; i < replay_len; i++) {
+		req = replay_reqs[i];
+		sec = (time_t) (req->time / 1000000);
+		localtime_r(&sec, &tm);
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s.%06lld status=%d latency=%.3fms user=%s token=%s common_name=%s untrusted_ip=%s untrusted_port=%d source=%s path=%s%s%s%s\n",
+			buf, req->time % 1000000, req->status, req->latency / 1000.0, req->username, req->token,
+			req->common_name, req->untrusted_ip, req->untrusted_port, req->source, req->path,
+			(req->flags & CAPTURE_FLAG_KEEPALIVE) ? " keepalive" : "",
+			(req->flags & CAPTURE_FLAG_PROTO_V2) ? " v2" : "",
+			(req->flags & CAPTURE_FLAG_NOT_RUN) ? " not-run" : "");
+	}
+}
+
+/**
+ * writes password file (username:token) for test daemon's File backend
+ * @return 1 on success, otherwise 0
+ */
+static int replay_passwd (const char *file) {
+	struct replay_req **users;
+	unsigned long n = 0;
+	FILE *fd;
+	size_t i;
+
+	if ((users = malloc((replay_len + 1) * sizeof(struct replay_req *))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for usernames.\n");
+		return 0;
+	}
+	memcpy(users, replay_reqs, replay_len * sizeof(struct replay_req *));
+	qsort(users, replay_len, sizeof(struct replay_req *), replay_user_cmp);
+
+	if ((fd = (strcmp(file, "-") == 0) ? stdout : fopen(file, "w")) == NULL) {
+		fprintf(stderr, "Unable to open password file '%s': %s\n", file, strerror(errno));
+		free(users);
+		return 0;
+	}
+	for (i = 0; i < replay_len; i++) {
+		if (i > 0 && strcmp(users[i]->username, users[i - 1]->username) == 0) continue;
+		if (strchr(users[i]->username, ':') != NULL || users[i]->username[0] == '\0') continue;
+		fprintf(fd, "%s:%s\n", users[i]->username, users[i]->token);
+		n++;
+	}
+	free(users);
+
+	if (fd != stdout && fclose(fd) != 0) {
+		fprintf(stderr, "Unable to write password file '%s': %s\n", file, strerror(errno));
+		return 0;
+	}
+	if (fd != stdout)
+		fprintf(stderr, "Wrote %lu user(s) to password file '%s'.\n", n, file);
+
+	return 1;
+}
+
+static void replay_usage (void) {
+	fprintf(stderr, "Usage: %s [OPTIONS] <capture file>\n\n", REPLAY_NAME);
+	fprintf(stderr, "Replays openvpn_authd request capture ($daemon_capture_file) using\n");
+	fprintf(stderr, "openvpn_authc's authentication code.\n\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "  -c   --config           Load openvpn_authc configuration file\n");
+	fprintf(stderr, "  -H   --hostname         Authentication server hostname or UNIX\n");
+	fprintf(stderr, "                          domain socket path (Default: \"%s\")\n", DEFAULT_HOSTNAME);
+	fprintf(stderr, "  -p   --port             Authentication server port (Default: %d)\n", DEFAULT_PORT);
+	fprintf(stderr, "  -t   --timeout          Authentication timeout in seconds (Default: %d)\n", DEFAULT_AUTH_TIMEOUT);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -s   --speed            Replay speed: 1 keeps captured spacing between\n");
+	fprintf(stderr, "                          requests, 10 replays ten times faster, 0 as fast\n");
+	fprintf(stderr, "                          as possible (Default: %.0f)\n", REPLAY_DEFAULT_SPEED);
+	fprintf(stderr, "  -j   --concurrency      Maximum number of concurrent requests (Default: %d)\n", REPLAY_DEFAULT_THREADS);
+	fprintf(stderr, "  -k   --keepalive        Reuse connections like openvpn_auth_plugin does\n");
+	fprintf(stderr, "  -T   --tls              Connect using TLS (see tls_* configuration parameters)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -w   --passwd           Write password file (username:token) for test\n");
+	fprintf(stderr, "                          daemon's File backend and exit (\"-\": stdout)\n");
+	fprintf(stderr, "  -D   --dump             Print captured requests and exit\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -l   --log              Log every authentication to syslog like openvpn_authc\n");
+	fprintf(stderr, "  -v   --verbose          Print every authentication result to stderr\n");
+	fprintf(stderr, "  -h   --help             This help message\n");
+}
+
+int main (int argc, char **argv) {
+	static struct option long_options[] = {
+		{"config", required_argument, NULL, 'c'},
+		{"hostname", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"timeout", required_argument, NULL, 't'},
+		{"speed", required_argument, NULL, 's'},
+		{"concurrency", required_argument, NULL, 'j'},
+		{"keepalive", no_argument, NULL, 'k'},
+		{"tls", no_argument, NULL, 'T'},
+		{"passwd", required_argument, NULL, 'w'},
+		{"dump", no_argument, NULL, 'D'},
+		{"log", no_argument, NULL, 'l'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	struct replay_thread *threads;
+	unsigned int *lat;
+	unsigned long ok = 0, failed = 0, differ = 0, expected_ok = 0;
+	long long stop, max_lag = 0;
+	double elapsed, span;
+	char *passwd = NULL;
+	size_t len = 0, k;
+	int c, i, dump = 0, num_threads = REPLAY_DEFAULT_THREADS;
+
+	MYNAME = REPLAY_NAME;
+	log_open();
+	strncpy(hostname, DEFAULT_HOSTNAME, sizeof(hostname) - 1);
+	log_syslog = 0;
+
+	while ((c = getopt_long(argc, argv, "c:H:p:t:s:j:kTw:Dlvh", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'c':
+				if (! load_config_file(optarg)) {
+					fprintf(stderr, "Unable to parse config file '%s': %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			case 'H':
+				snprintf(hostname, sizeof(hostname), "%s", optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			case 's':
+				replay_speed = atof(optarg);
+				break;
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 'k':
+				replay_keepalive = 1;
+				break;
+			case 'T':
+				tls = 1;
+				break;
+			case 'w':
+				passwd = optarg;
+				break;
+			case 'D':
+				dump = 1;
+				break;
+			case 'l':
+				log_syslog = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				replay_usage();
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		replay_usage();
+		return 1;
+	}
+	if (num_threads < 1 || num_threads > REPLAY_MAX_THREADS) {
+		fprintf(stderr, "Concurrency must be between 1 and %d.\n", REPLAY_MAX_THREADS);
+		return 1;
+	}
+	if (replay_speed < 0) replay_speed = 0;
+	if (! replay_load(argv[optind])) return 1;
+
+	if (dump) {
+		replay_dump();
+		return 0;
+	}
+	if (passwd != NULL)
+		return (replay_passwd(passwd)) ? 0 : 1;
+	if (replay_len == 0) {
+		fprintf(stderr, "Capture file '%s' contains no requests.\n", argv[optind]);
+		return 1;
+	}
+
+	/** TLS session file is mapped before threads are started */
+	if (tls && ! tls_client_init()) {
+		fprintf(stderr, "Unable to initialize TLS.\n");
+		return 1;
+	}
+	if ((threads = calloc(num_threads, sizeof(struct replay_thread))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for replay threads.\n");
+		return 1;
+	}
+
+	span = (replay_reqs[replay_len - 1]->time - replay_reqs[0]->time) / 1000000.0;
+	printf("Replaying %lu request(s) captured over %.3f s to %s", (unsigned long) replay_len, span, hostname);
+	if (hostname[0] != '/') printf(" (port %d)", port);
+	printf(", concurrency %d, ", num_threads);
+	if (replay_speed > 0)
+		printf("speed %gx", replay_speed);
+	else
+		printf("maximum speed");
+	printf("%s%s, protocol %d.\n", (replay_keepalive) ? ", keep-alive connections" : "", (tls) ? ", TLS" : "", protocol);
+	fflush(stdout);
+
+	replay_start = replay_clock_us();
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, replay_worker, &threads[i]) != 0) {
+			fprintf(stderr, "Unable to start replay thread: %s\n", strerror(errno));
+			num_threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ok += threads[i].ok;
+		failed += threads[i].failed;
+		differ += threads[i].differ;
+		len += threads[i].lat_len;
+		if (threads[i].max_lag > max_lag) max_lag = threads[i].max_lag;
+	}
+	stop = replay_clock_us();
+	elapsed = (stop - replay_start) / 1000000.0;
+
+	/** merge latency samples; captured latencies go after them */
+	if ((lat = malloc((len + replay_len + 1) * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "Unable to allocate memory for latency samples.\n");
+		return 1;
+	}
+	len = 0;
+	for (i = 0; i < num_threads; i++) {
+		memcpy(lat + len, threads[i].lat, threads[i].lat_len * sizeof(unsigned int));
+		len += threads[i].lat_len;
+		free(threads[i].lat);
+	}
+	for (k = 0; k < replay_len; k++) {
+		lat[len + k] = replay_reqs[k]->latency;
+		if (replay_reqs[k]->status == PROTO_STATUS_OK) expected_ok++;
+	}
+
+	printf("\n");
+	printf("Requests:      %lu (%lu succeeded, %lu failed; captured %lu succeeded, %lu failed)\n",
+		ok + failed, ok, failed, expected_ok, (unsigned long) replay_len - expected_ok);
+	printf("Verdicts:      %lu differ from capture\n", differ);
+	printf("Elapsed:       %.3f s (captured %.3f s)\n", elapsed, span);
+	printf("Throughput:    %.1f requests/s\n", (elapsed > 0) ? (ok + failed) / elapsed : 0);
+	if (replay_speed > 0)
+		printf("Schedule:      started up to %.3f ms late\n", max_lag / 1000.0);
+	replay_print_latency("Latency (ms):", lat, len);
+	replay_print_latency("Captured (ms):", lat + len, replay_len);
+	if (tls)
+		printf("TLS:           %lu handshake(s), %lu resumed (%.1f%%), %lu failed\n",
+			tls_stats.handshakes, tls_stats.resumed, (tls_stats.handshakes) ? 100.0 * tls_stats.resumed / tls_stats.handshakes : 0, tls_stats.failed);
+
+	free(lat);
+	free(threads);
+
+	return (differ > 0) ? 2 : 0;
+}
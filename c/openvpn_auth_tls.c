@@ -0,0 +1,858 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * TLS transport between openvpn_authc (and programs sharing its client
+ * code) and openvpn_authd_frontend.
+ *
+ * Full TLS handshake costs more than whole authentication exchange, and
+ * openvpn_authc is executed for every single login. Client therefore
+ * stores sessions (tickets) negotiated with every server in small file
+ * mapped by all openvpn_authc processes (tls_session_file), so that next
+ * openvpn_authc run resumes session instead of doing full handshake.
+ * Front-end processes share session ticket keys and session id cache in
+ * shared memory, so that session established with one front-end process
+ * can be resumed by any other.
+ *
+ * TLS support requires OpenSSL and is compiled in only by "make TLS=1"
+ * (-DOPENVPN_AUTH_TLS); otherwise every function below fails.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "openvpn_auth_client.h"
+
+struct tls_stats tls_stats;
+
+#ifdef OPENVPN_AUTH_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+#define TLS_SHM_MAGIC 0x6f767473
+#define TLS_SHM_PROBES 4
+#define TLS_TICKET_KEYS_LEN 80		/** key name, HMAC key, AES key */
+#define TLS_SESSION_ID_CONTEXT "openvpn_authd"
+
+/**
+ * client session file entry (one per server); readers never lock,
+ * writers make sequence number odd while entry is being updated.
+ */
+struct tls_session_entry {
+	volatile unsigned int seq;
+	unsigned int key;
+	long long expires;			/** wall clock ms */
+	unsigned int len;
+	unsigned int pad;
+	unsigned char der[TLS_SESSION_SIZE];
+};
+
+/**
+ * front-end shared memory header, followed by session id cache entries
+ */
+struct tls_shm_header {
+	unsigned int magic;
+	unsigned int slots;
+	unsigned char ticket_keys[TLS_TICKET_KEYS_LEN];
+};
+
+struct tls_shm_entry {
+	volatile unsigned int seq;
+	unsigned int id_len;
+	long long expires;			/** wall clock ms */
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int len;
+	unsigned int pad;
+	unsigned char der[TLS_SESSION_SIZE];
+};
+
+static SSL_CTX *client_ctx = NULL;
+static SSL_CTX *server_ctx = NULL;
+static struct tls_session_entry *sessions = NULL;
+static struct tls_shm_header *shm = NULL;
+
+/**
+ * formats reason of last failed TLS operation
+ */
+static const char * tls_error (SSL *ssl, char *buf, size_t len) {
+	unsigned long e = ERR_get_error();
+	long v;
+
+	if (ssl != NULL && (v = SSL_get_verify_result(ssl)) != X509_V_OK)
+		snprintf(buf, len, "certificate verification failed: %s", X509_verify_cert_error_string(v));
+	else if (e != 0)
+		ERR_error_string_n(e, buf, len);
+	else
+		snprintf(buf, len, "%s", (errno != 0) ? strerror(errno) : "connection closed");
+	ERR_clear_error();
+
+	return buf;
+}
+
+/**
+ * loads certificate chain and private key into context
+ * @return 1 on success, otherwise 0
+ */
+static int tls_load_cert (SSL_CTX *ctx, const char *cert_file, const char *key_file) {
+	char buf[256];
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+		log_msg("Unable to load TLS certificate %s: %s", cert_file, tls_error(NULL, buf, sizeof(buf)));
+		return 0;
+	}
+	/** private key may be stored together with certificate */
+	if (key_file == NULL || key_file[0] == '\0') key_file = cert_file;
+	if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+		log_msg("Unable to load TLS private key %s: %s", key_file, tls_error(NULL, buf, sizeof(buf)));
+		return 0;
+	}
+
+	return 1;
+}
+
+static void tls_handshake_done (SSL *ssl) {
+	int resumed = SSL_session_reused(ssl);
+
+	__sync_fetch_and_add(&tls_stats.handshakes, 1);
+	if (resumed) __sync_fetch_and_add(&tls_stats.resumed, 1);
+	if (verbose)
+		log_msg("TLS connection established (%s, %s, %s session).", SSL_get_version(ssl), SSL_get_cipher_name(ssl), (resumed) ? "resumed" : "new");
+}
+
+/**
+ * translates failed SSL_read(3)/SSL_write(3) into read(2)/write(2) semantics
+ * @return 0 on clean connection close, otherwise -1 with errno set
+ *         (EAGAIN if operation should be retried once socket is ready)
+ */
+static ssize_t tls_io_error (SSL *ssl, int r) {
+	int saved = errno;
+
+	switch (SSL_get_error(ssl, r)) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+		case SSL_ERROR_SYSCALL:
+			errno = (saved != 0) ? saved : ECONNRESET;
+			break;
+		default:
+			errno = EIO;
+			break;
+	}
+	ERR_clear_error();
+
+	return -1;
+}
+
+/**
+ * resumed session is not verified again, so key covers everything
+ * server certificate was verified against, not just server address.
+ * @return session file key for server (FNV-1a of host, port, verified name and CA file)
+ */
+static unsigned int tls_session_key (const char *host, int srv_port, const char *name) {
+	const char *str[3] = { host, name, tls_ca_file };
+	unsigned int h = 2166136261U;
+	const char *ptr;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		for (ptr = str[i]; *ptr != '\0'; ptr++)
+			h = (h ^ (unsigned char) *ptr) * 16777619U;
+		h = (h ^ 0xff) * 16777619U;
+	}
+	h = (h ^ (unsigned int) srv_port) * 16777619U;
+
+	return (h == 0) ? 1 : h;
+}
+
+/**
+ * maps client session file; sessions contain secrets, so file must be
+ * private to user running openvpn_authc.
+ * @return pointer to TLS_SESSION_SLOTS entries or NULL if file is disabled/unusable
+ */
+static struct tls_session_entry * tls_session_map (void) {
+	struct tls_session_entry *ptr;
+	struct stat st;
+	size_t size = TLS_SESSION_SLOTS * sizeof(struct tls_session_entry);
+	int fd;
+
+	if (tls_session_file[0] == '\0') return NULL;
+	if ((fd = open(tls_session_file, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) < 0) {
+		log_msg("Unable to open TLS session file %s: %s (errno %d).", tls_session_file, strerror(errno), errno);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+		log_msg("TLS session file %s is not private to uid %d, not resuming TLS sessions.", tls_session_file, (int) geteuid());
+		close(fd);
+		return NULL;
+	}
+	if ((size_t) st.st_size < size && ftruncate(fd, size) < 0) {
+		close(fd);
+		return NULL;
+	}
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+/**
+ * looks up stored session for server
+ * @return session (caller frees it) or NULL
+ */
+static SSL_SESSION * tls_session_get (unsigned int key) {
+	unsigned char der[TLS_SESSION_SIZE];
+	const unsigned char *p = der;
+	struct tls_session_entry *e;
+	SSL_SESSION *sess = NULL;
+	unsigned int seq, len;
+	long long expires;
+	int i;
+
+	if (sessions == NULL) return NULL;
+	for (i = 0; i < TLS_SESSION_SLOTS && sess == NULL; i++) {
+		e = &sessions[i];
+		if (e->key != key) continue;
+		seq = e->seq;
+		__sync_synchronize();
+		len = e->len;
+		expires = e->expires;
+		if (len > sizeof(der)) continue;
+		memcpy(der, e->der, len);
+		__sync_synchronize();
+		if ((seq & 1) || seq != e->seq || e->key != key || len == 0 || expires <= wall_ms())
+			continue;
+		p = der;
+		sess = d2i_SSL_SESSION(NULL, &p, len);
+	}
+	memset(der, '\0', sizeof(der));
+
+	return sess;
+}
+
+/**
+ * stores session into slot of the same server, free/expired slot or
+ * slot expiring first; update is skipped if slot is being written.
+ */
+static void tls_session_put (unsigned int key, const unsigned char *der, unsigned int len, long long expires) {
+	struct tls_session_entry *e, *victim = NULL;
+	unsigned int seq;
+	long long now = wall_ms();
+	int i;
+
+	for (i = 0; i < TLS_SESSION_SLOTS; i++) {
+		e = &sessions[i];
+		if (e->key == key) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL || e->expires < victim->expires)
+			victim = e;
+	}
+	if (victim->key != key && victim->expires > now)
+		log_msg("TLS session file %s is full, replacing session expiring first.", tls_session_file);
+
+	seq = victim->seq;
+	if ((seq & 1) || ! __sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+		return;
+	victim->key = key;
+	victim->len = len;
+	victim->expires = expires;
+	memcpy(victim->der, der, len);
+	__sync_synchronize();
+	victim->seq = seq + 2;
+}
+
+/**
+ * new client session callback; with TLSv1.3 called when server's session
+ * ticket arrives (after handshake), possibly more than once per connection.
+ */
+static int tls_session_new (SSL *ssl, SSL_SESSION *sess) {
+	unsigned char der[TLS_SESSION_SIZE], *p = der;
+	unsigned int key = (unsigned int) (unsigned long) SSL_get_app_data(ssl);
+	int len;
+
+	if (sessions == NULL || key == 0 || ! SSL_SESSION_is_resumable(sess)) return 0;
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 || (size_t) len > sizeof(der)) {
+		log_msg("TLS session too large (%d bytes) for TLS session file, not stored.", len);
+		return 0;
+	}
+	i2d_SSL_SESSION(sess, &p);
+	tls_session_put(key, der, len, ((long long) SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess)) * 1000);
+	memset(der, '\0', len);
+
+	return 0;
+}
+
+/**
+ * creates client TLS context and maps session file; must be called
+ * before threads are started (it is called by tls_connect() otherwise).
+ * @return 1 on success, otherwise 0
+ */
+int tls_client_init (void) {
+	struct sigaction act;
+	SSL_CTX *ctx;
+	char buf[256];
+
+	if (client_ctx != NULL) return 1;
+	if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+		log_msg("Unable to create TLS context: %s", tls_error(NULL, buf, sizeof(buf)));
+		return 0;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	/** server certificate is always verified */
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (tls_ca_file[0] != '\0') {
+		if (SSL_CTX_load_verify_locations(ctx, tls_ca_file, NULL) != 1) {
+			log_msg("Unable to load TLS CA certificates %s: %s", tls_ca_file, tls_error(NULL, buf, sizeof(buf)));
+			SSL_CTX_free(ctx);
+			return 0;
+		}
+	}
+	else
+		SSL_CTX_set_default_verify_paths(ctx);
+
+	if (tls_cert_file[0] != '\0' && ! tls_load_cert(ctx, tls_cert_file, tls_key_file)) {
+		SSL_CTX_free(ctx);
+		return 0;
+	}
+
+	/** sessions are kept only in session file */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_session_new);
+	sessions = tls_session_map();
+
+	/** SSL_write(3) to connection closed by server would raise SIGPIPE */
+	if (sigaction(SIGPIPE, NULL, &act) == 0 && act.sa_handler == SIG_DFL) {
+		act.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &act, NULL);
+	}
+
+	client_ctx = ctx;
+	return 1;
+}
+
+/**
+ * creates client TLS connection on connected socket; stored session
+ * for the same server is offered for resumption.
+ */
+static SSL * tls_client_new (int sock, const char *host, int srv_port) {
+	const char *name = (tls_server_name[0] != '\0') ? tls_server_name : host;
+	unsigned char addr[16];
+	unsigned int key = tls_session_key(host, srv_port, name);
+	SSL_SESSION *sess;
+	SSL *ssl;
+	char buf[256];
+
+	if (! tls_client_init()) return NULL;
+	if ((ssl = SSL_new(client_ctx)) == NULL || SSL_set_fd(ssl, sock) != 1) {
+		log_msg("Unable to create TLS connection: %s", tls_error(NULL, buf, sizeof(buf)));
+		if (ssl != NULL) SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_app_data(ssl, (void *) (unsigned long) key);
+
+	/** IP address is matched against certificate's subjectAltName IP */
+	if (inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1)
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name);
+	else {
+		SSL_set_tlsext_host_name(ssl, name);
+		SSL_set1_host(ssl, name);
+	}
+
+	if ((sess = tls_session_get(key)) != NULL) {
+		SSL_set_session(ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+
+	return ssl;
+}
+
+static ssize_t tls_cookie_read (void *cookie, char *buf, size_t len) {
+	return tls_recv((SSL *) cookie, buf, len);
+}
+
+static ssize_t tls_cookie_write (void *cookie, const char *buf, size_t len) {
+	ssize_t n = tls_send((SSL *) cookie, buf, len);
+	return (n > 0) ? n : 0;
+}
+
+static int tls_cookie_close (void *cookie) {
+	tls_free((SSL *) cookie);
+	return 0;
+}
+
+/**
+ * performs TLS handshake on connected (blocking) socket
+ * @param sock socket file descriptor, closed on failure
+ * @param host server host name as configured (session file key, certificate name)
+ * @param srv_port server port
+ * @return FILE* stream reading and writing through TLS connection or NULL on error
+ */
+FILE * tls_connect (int sock, const char *host, int srv_port) {
+	cookie_io_functions_t io = { tls_cookie_read, tls_cookie_write, NULL, tls_cookie_close };
+	char buf[256];
+	FILE *fd;
+	SSL *ssl;
+
+	if ((ssl = tls_client_new(sock, host, srv_port)) == NULL) {
+		close(sock);
+		return NULL;
+	}
+	ERR_clear_error();
+	errno = 0;
+	if (SSL_connect(ssl) != 1) {
+		log_msg("TLS handshake with %s:%d failed: %s", host, srv_port, tls_error(ssl, buf, sizeof(buf)));
+		__sync_fetch_and_add(&tls_stats.failed, 1);
+		SSL_free(ssl);
+		close(sock);
+		return NULL;
+	}
+	tls_handshake_done(ssl);
+
+	if ((fd = fopencookie(ssl, "r+", io)) == NULL) {
+		log_msg("Unable to create stream fd: %s (errno %d).", strerror(errno), errno);
+		tls_free(ssl);
+		return NULL;
+	}
+
+	return fd;
+}
+
+/**
+ * creates client TLS connection on non-blocking socket; handshake is
+ * driven by tls_handshake().
+ * @return TLS connection or NULL on error (socket is left open)
+ */
+SSL * tls_connect_nb (int sock, const char *host, int srv_port) {
+	SSL *ssl;
+
+	if ((ssl = tls_client_new(sock, host, srv_port)) != NULL)
+		SSL_set_connect_state(ssl);
+
+	return ssl;
+}
+
+/**
+ * maps front-end shared memory segment, initializing it (random session
+ * ticket keys) if this is the first front-end process using it.
+ * @return 1 on success, otherwise 0
+ */
+static int tls_shm_map (int fd, int slots) {
+	struct tls_shm_header hdr;
+	struct flock lock;
+	struct stat st;
+	size_t size;
+	void *ptr;
+	int r = 0;
+
+	memset(&lock, '\0', sizeof(lock));
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	if (fcntl(fd, F_SETLKW, &lock) < 0) {
+		log_msg("Unable to lock TLS session cache: %s (errno %d).", strerror(errno), errno);
+		return 0;
+	}
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != TLS_SHM_MAGIC) {
+		memset(&hdr, '\0', sizeof(hdr));
+		hdr.slots = slots;
+		if (RAND_bytes(hdr.ticket_keys, sizeof(hdr.ticket_keys)) != 1) {
+			log_msg("Unable to generate TLS session ticket keys.");
+			goto outta_func;
+		}
+		size = sizeof(hdr) + (size_t) hdr.slots * sizeof(struct tls_shm_entry);
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			log_msg("Unable to initialize TLS session cache: %s (errno %d).", strerror(errno), errno);
+			goto outta_func;
+		}
+		hdr.magic = TLS_SHM_MAGIC;
+		pwrite(fd, &hdr.magic, sizeof(hdr.magic), 0);
+	}
+
+	size = sizeof(hdr) + (size_t) hdr.slots * sizeof(struct tls_shm_entry);
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < size) {
+		log_msg("TLS session cache is truncated.");
+		goto outta_func;
+	}
+	if ((ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		log_msg("Unable to map TLS session cache: %s (errno %d).", strerror(errno), errno);
+		goto outta_func;
+	}
+	shm = (struct tls_shm_header *) ptr;
+	r = 1;
+
+	outta_func:
+	memset(&hdr, '\0', sizeof(hdr));
+	lock.l_type = F_UNLCK;
+	fcntl(fd, F_SETLK, &lock);
+
+	return r;
+}
+
+static struct tls_shm_entry * tls_shm_slot (const unsigned char *id, unsigned int id_len, unsigned int i) {
+	unsigned int h = 2166136261U, k;
+
+	for (k = 0; k < id_len; k++)
+		h = (h ^ id[k]) * 16777619U;
+
+	return (struct tls_shm_entry *) ((char *) shm + sizeof(struct tls_shm_header)) + ((h + i) % shm->slots);
+}
+
+/**
+ * new server session callback: stores session into shared session id cache
+ */
+static int tls_shm_new (SSL *ssl, SSL_SESSION *sess) {
+	unsigned char der[TLS_SESSION_SIZE], *p = der;
+	const unsigned char *id;
+	struct tls_shm_entry *e, *victim = NULL;
+	unsigned int id_len, seq, i;
+	long long now = wall_ms();
+	int len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return 0;
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 || (size_t) len > sizeof(der)) return 0;
+	i2d_SSL_SESSION(sess, &p);
+
+	for (i = 0; i < TLS_SHM_PROBES; i++) {
+		e = tls_shm_slot(id, id_len, i);
+		if (victim == NULL || e->expires < victim->expires)
+			victim = e;
+		if (e->expires <= now) break;
+	}
+
+	seq = victim->seq;
+	if (! (seq & 1) && __sync_bool_compare_and_swap(&victim->seq, seq, seq + 1)) {
+		victim->id_len = id_len;
+		memcpy(victim->id, id, id_len);
+		victim->len = len;
+		memcpy(victim->der, der, len);
+		victim->expires = ((long long) SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess)) * 1000;
+		__sync_synchronize();
+		victim->seq = seq + 2;
+	}
+	memset(der, '\0', len);
+
+	return 0;
+}
+
+/**
+ * server session lookup callback
+ */
+static SSL_SESSION * tls_shm_get (SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+	unsigned char der[TLS_SESSION_SIZE];
+	const unsigned char *p;
+	struct tls_shm_entry *e;
+	SSL_SESSION *sess = NULL;
+	unsigned int seq, len, i;
+	long long expires;
+
+	*copy = 0;
+	if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return NULL;
+
+	for (i = 0; i < TLS_SHM_PROBES && sess == NULL; i++) {
+		e = tls_shm_slot(id, id_len, i);
+		seq = e->seq;
+		__sync_synchronize();
+		if (e->id_len != (unsigned int) id_len || memcmp(e->id, id, id_len) != 0) continue;
+		len = e->len;
+		expires = e->expires;
+		if (len > sizeof(der)) continue;
+		memcpy(der, e->der, len);
+		__sync_synchronize();
+		if ((seq & 1) || seq != e->seq || len == 0 || expires <= wall_ms()) continue;
+		p = der;
+		sess = d2i_SSL_SESSION(NULL, &p, len);
+	}
+	memset(der, '\0', sizeof(der));
+
+	return sess;
+}
+
+/**
+ * server session removal callback (session was invalidated)
+ */
+static void tls_shm_remove (SSL_CTX *ctx, SSL_SESSION *sess) {
+	const unsigned char *id;
+	struct tls_shm_entry *e;
+	unsigned int id_len, seq, i;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	for (i = 0; i < TLS_SHM_PROBES; i++) {
+		e = tls_shm_slot(id, id_len, i);
+		if (e->id_len != id_len || memcmp(e->id, id, id_len) != 0) continue;
+		seq = e->seq;
+		if ((seq & 1) || ! __sync_bool_compare_and_swap(&e->seq, seq, seq + 1)) continue;
+		e->expires = 0;
+		e->len = 0;
+		__sync_synchronize();
+		e->seq = seq + 2;
+	}
+}
+
+/**
+ * creates server TLS context (openvpn_authd_frontend)
+ * @param cert_file server certificate chain (PEM)
+ * @param key_file private key (PEM), NULL if stored in cert_file
+ * @param ca_file if set, clients must present certificate signed by one of these CAs
+ * @param shm_fd file shared by all front-end processes holding session
+ *        ticket keys and session id cache, -1 for per-process cache
+ * @param slots number of session id cache entries
+ * @param session_timeout session lifetime in seconds
+ * @return 1 on success, otherwise 0
+ */
+int tls_server_init (const char *cert_file, const char *key_file, const char *ca_file, int shm_fd, int slots, int session_timeout) {
+	STACK_OF(X509_NAME) *names;
+	SSL_CTX *ctx;
+	char buf[256];
+
+	if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+		log_msg("Unable to create TLS context: %s", tls_error(NULL, buf, sizeof(buf)));
+		return 0;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	if (! tls_load_cert(ctx, cert_file, key_file))
+		goto outta_func;
+
+	if (ca_file != NULL && ca_file[0] != '\0') {
+		if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1 || (names = SSL_load_client_CA_file(ca_file)) == NULL) {
+			log_msg("Unable to load TLS CA certificates %s: %s", ca_file, tls_error(NULL, buf, sizeof(buf)));
+			goto outta_func;
+		}
+		SSL_CTX_set_client_CA_list(ctx, names);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	}
+
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *) TLS_SESSION_ID_CONTEXT, strlen(TLS_SESSION_ID_CONTEXT));
+	if (session_timeout > 0)
+		SSL_CTX_set_timeout(ctx, session_timeout);
+
+	if (shm_fd >= 0 && slots > 0) {
+		if (! tls_shm_map(shm_fd, slots))
+			goto outta_func;
+		/** tickets issued by one front-end process are accepted by all of them */
+		SSL_CTX_set_tlsext_ticket_keys(ctx, shm->ticket_keys, sizeof(shm->ticket_keys));
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, tls_shm_new);
+		SSL_CTX_sess_set_get_cb(ctx, tls_shm_get);
+		SSL_CTX_sess_set_remove_cb(ctx, tls_shm_remove);
+	}
+
+	server_ctx = ctx;
+	return 1;
+
+	outta_func:
+	SSL_CTX_free(ctx);
+	return 0;
+}
+
+/**
+ * creates server TLS connection on accepted non-blocking socket;
+ * handshake is driven by tls_handshake().
+ */
+SSL * tls_accept (int sock) {
+	char buf[256];
+	SSL *ssl;
+
+	if (server_ctx == NULL) return NULL;
+	if ((ssl = SSL_new(server_ctx)) == NULL || SSL_set_fd(ssl, sock) != 1) {
+		log_msg("Unable to create TLS connection: %s", tls_error(NULL, buf, sizeof(buf)));
+		if (ssl != NULL) SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+
+	return ssl;
+}
+
+/**
+ * continues non-blocking TLS handshake
+ * @return 0 if handshake is complete, POLLIN or POLLOUT (equal to
+ *         EPOLLIN and EPOLLOUT) if handshake waits for socket, -1 on error
+ */
+int tls_handshake (SSL *ssl) {
+	char buf[256];
+	int r;
+
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_do_handshake(ssl)) == 1) {
+		tls_handshake_done(ssl);
+		return 0;
+	}
+
+	switch (SSL_get_error(ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+			return POLLIN;
+		case SSL_ERROR_WANT_WRITE:
+			return POLLOUT;
+	}
+	log_msg("TLS handshake failed: %s", tls_error(ssl, buf, sizeof(buf)));
+	__sync_fetch_and_add(&tls_stats.failed, 1);
+
+	return -1;
+}
+
+/**
+ * @return number of bytes written, or -1 with errno set (see tls_io_error())
+ */
+ssize_t tls_send (SSL *ssl, const void *buf, size_t len) {
+	int r;
+
+	if (len == 0) return 0;
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_write(ssl, buf, (len > INT_MAX) ? INT_MAX : (int) len)) > 0)
+		return r;
+
+	return tls_io_error(ssl, r);
+}
+
+/**
+ * @return number of bytes read, 0 on connection close, or -1 with errno set
+ */
+ssize_t tls_recv (SSL *ssl, void *buf, size_t len) {
+	int r;
+
+	if (len == 0) return 0;
+	ERR_clear_error();
+	errno = 0;
+	if ((r = SSL_read(ssl, buf, (len > INT_MAX) ? INT_MAX : (int) len)) > 0)
+		return r;
+
+	return tls_io_error(ssl, r);
+}
+
+/**
+ * @return number of decrypted bytes buffered in TLS connection; these
+ *         are not reported by poll(2)
+ */
+int tls_pending (SSL *ssl) {
+	return SSL_pending(ssl);
+}
+
+/**
+ * sends close_notify (without waiting for peer's), frees TLS
+ * connection and closes its socket
+ */
+void tls_free (SSL *ssl) {
+	int fd;
+
+	if (ssl == NULL) return;
+	fd = SSL_get_fd(ssl);
+	if (SSL_is_init_finished(ssl))
+		SSL_shutdown(ssl);
+	ERR_clear_error();
+	SSL_free(ssl);
+	if (fd >= 0) close(fd);
+}
+
+#else /* OPENVPN_AUTH_TLS */
+
+static void tls_unsupported (void) {
+	log_msg("TLS support is not compiled in (run \"make TLS=1\" in c directory).");
+}
+
+int tls_client_init (void) {
+	tls_unsupported();
+	return 0;
+}
+
+FILE * tls_connect (int sock, const char *host, int srv_port) {
+	tls_unsupported();
+	close(sock);
+	return NULL;
+}
+
+struct ssl_st * tls_connect_nb (int sock, const char *host, int srv_port) {
+	tls_unsupported();
+	return NULL;
+}
+
+int tls_server_init (const char *cert_file, const char *key_file, const char *ca_file, int shm_fd, int slots, int session_timeout) {
+	tls_unsupported();
+	return 0;
+}
+
+struct ssl_st * tls_accept (int sock) {
+	return NULL;
+}
+
+int tls_handshake (struct ssl_st *ssl) {
+	return -1;
+}
+
+ssize_t tls_send (struct ssl_st *ssl, const void *buf, size_t len) {
+	errno = EIO;
+	return -1;
+}
+
+ssize_t tls_recv (struct ssl_st *ssl, void *buf, size_t len) {
+	errno = EIO;
+	return -1;
+}
+
+int tls_pending (struct ssl_st *ssl) {
+	return 0;
+}
+
+void tls_free (struct ssl_st *ssl) {
+}
+
+#endif /* OPENVPN_AUTH_TLS */
@@ -0,0 +1,1166 @@
+/**
+ * Copyright (c) 2006, Branko F. Gracnar
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * + Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ * + Redistributions in binary form must reproduce the above copyright notice,
+ *  this list of conditions and the following disclaimer in the documentation
+ *  and/or other materials provided with the distribution.
+ *
+ * + Neither the name of the Branko F. Gracnar nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/**
+ * Event-loop front-end for openvpn_authd (openvpn_authd_frontend).
+ *
+ * Net::Server::PreFork based openvpn_authd ties up whole perl process for
+ * every open client connection. When $daemon_frontend is configured,
+ * openvpn_authd starts this program with its listening socket and one end
+ * of UNIX domain socket pair for every perl authentication worker. Front-end
+ * accepts and reads client connections using epoll(7), decodes text and
+ * protocol v2 requests and dispatches every complete request to idle worker
+ * as protocol v2 AUTH_REQUEST frame tagged with request id. Worker's reply
+ * is translated back to client's protocol. Idle and slow clients cost only
+ * file descriptor and small buffer, never perl process.
+ *
+ * Front-end is started by openvpn_authd (see Net::OpenVPN::AuthDaemon):
+ *
+ *   openvpn_authd_frontend -l <fd>[,<fd>...] -w <fd>[,<fd>...] [-t auth_timeout]
+ *       [-k keepalive_timeout] [-c max_clients] [-n name] [-q max_queue]
+ *       [-s deadline_slack]
+ *       [-A cidr[,cidr...]] [-X cidr[,cidr...]] [-v]
+ *       [-T cert_file [-K key_file] [-C ca_file] [-M shm_fd] [-N slots] [-E timeout]]
+ *
+ * With -T, tcp clients are served over TLS. Session ticket keys and
+ * session id cache live in file shared by all front-end processes (-M,
+ * anonymous temporary file created by openvpn_authd), so that TLS
+ * session negotiated with one front-end is resumed by any other.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "openvpn_auth_client.h"
+
+#define FRONTEND_NAME "openvpn_authd_frontend"
+#define FRONTEND_MAX_WORKERS 256
+#define FRONTEND_MAX_LISTEN 64
+#define FRONTEND_MAX_CIDRS 64
+#define FRONTEND_DEFAULT_CLIENTS 4096
+#define FRONTEND_DEFAULT_AUTH_TIMEOUT 5
+#define FRONTEND_DEFAULT_KEEPALIVE_TIMEOUT 30
+#define FRONTEND_KEEPALIVE_MAX_REQUESTS 1000
+#define FRONTEND_MAX_LINES 20				/** see Net::OpenVPN::AuthDaemon::readStruct() */
+#define FRONTEND_GRACE_MS 2000				/** worker reply grace period after auth timeout */
+#define FRONTEND_DEFAULT_DEADLINE_SLACK 1000	/** client deadline clock skew allowance (ms) */
+#define FRONTEND_STATS_MS 1000				/** load shedding log interval */
+#define FRONTEND_TICK_MS 250
+#define FRONTEND_EVENTS 256
+#define FRONTEND_OUT_SIZE (GEN_BUF_SIZE + 64)
+#define FRONTEND_DEFAULT_TLS_SLOTS 1024
+#define FRONTEND_DEFAULT_TLS_TIMEOUT 7200
+
+/** epoll event owner tags */
+#define TAG_LISTEN 0
+#define TAG_WORKER 1
+#define TAG_CLIENT 2
+
+enum fe_client_state {
+	FE_FREE,
+	FE_READING,			/** reading request from client */
+	FE_QUEUED,			/** waiting for idle worker */
+	FE_WAITING			/** request sent to worker */
+};
+
+/**
+ * client connection
+ */
+struct fe_client {
+	int fd;
+	struct ssl_st *ssl;		/** TLS connection, NULL for plain connection */
+	int handshake;			/** TLS handshake in progress */
+	enum fe_client_state state;
+	int v2;					/** -1 unknown yet, 0 text protocol, 1 protocol v2 */
+	int keepalive;
+	int has_id;
+	unsigned int id;		/** client's request id */
+	int requests;
+	int lines;				/** text request lines read so far */
+	int closing;			/** close connection after reply is written */
+	unsigned int events;	/** registered epoll events */
+	long long deadline;
+	long long expires;		/** client's request deadline (ms since epoch), 0 if none */
+	int next;				/** run queue link */
+	unsigned char in[PROTO_BUF_SIZE];
+	size_t in_len;
+	unsigned char req[PROTO_BUF_SIZE];	/** request frame payload for worker */
+	size_t req_len;
+	unsigned char out[FRONTEND_OUT_SIZE];
+	size_t out_len;
+};
+
+/**
+ * perl authentication worker connection
+ */
+struct fe_worker {
+	int fd;
+	int client;				/** client being served, -1 if none */
+	int busy;
+	int stale;				/** still working on timed out request */
+	unsigned int id;		/** id of request sent to worker */
+	unsigned int events;
+	long long deadline;
+	unsigned char in[PROTO_BUF_SIZE];
+	size_t in_len;
+	unsigned char out[PROTO_BUF_SIZE + 16];
+	size_t out_len;
+};
+
+struct fe_cidr {
+	int family;
+	unsigned char addr[16];
+	int bits;
+};
+
+static struct fe_client **clients = NULL;
+static struct fe_worker workers[FRONTEND_MAX_WORKERS];
+static int listeners[FRONTEND_MAX_LISTEN];
+static unsigned int listen_events[FRONTEND_MAX_LISTEN];
+static struct fe_cidr cidr_allow[FRONTEND_MAX_CIDRS];
+static struct fe_cidr cidr_deny[FRONTEND_MAX_CIDRS];
+static int num_allow = 0;
+static int num_deny = 0;
+static int num_workers = 0;
+static int num_listeners = 0;
+static int max_clients = FRONTEND_DEFAULT_CLIENTS;
+static int num_clients = 0;
+static int auth_timeout = FRONTEND_DEFAULT_AUTH_TIMEOUT;
+static int keepalive_timeout = FRONTEND_DEFAULT_KEEPALIVE_TIMEOUT;
+static int max_queue = 0;
+static int deadline_slack = FRONTEND_DEFAULT_DEADLINE_SLACK;
+static int num_queued = 0;
+static unsigned int shed_overloaded = 0;
+static unsigned int shed_expired = 0;
+static char agent[GEN_BUF_SIZE] = FRONTEND_NAME;
+static int epfd = -1;
+static int queue_head = -1;
+static int queue_tail = -1;
+static unsigned int request_seq = 0;
+static volatile sig_atomic_t fe_stop = 0;
+static int fe_tls = 0;
+
+static void fe_sigh_stop (int num) {
+	fe_stop = 1;
+}
+
+static void fe_epoll_set (int fd, unsigned int *cur, unsigned int events, int tag, int idx) {
+	struct epoll_event ev;
+
+	if (*cur == events) return;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ((unsigned long long) tag << 32) | (unsigned int) idx;
+	epoll_ctl(epfd, (*cur == 0) ? EPOLL_CTL_ADD : ((events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD), fd, &ev);
+	*cur = events;
+}
+
+/**
+ * parses address[/bits] network specification
+ * @return 1 on success, otherwise 0
+ */
+static int fe_cidr_parse (const char *str, struct fe_cidr *cidr) {
+	char buf[128];
+	char *slash;
+	int max;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+	if ((slash = strchr(buf, '/')) != NULL) *slash++ = '\0';
+
+	memset(cidr, '\0', sizeof(struct fe_cidr));
+	if (inet_pton(AF_INET, buf, cidr->addr) == 1) {
+		cidr->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, cidr->addr) == 1) {
+		cidr->family = AF_INET6;
+		max = 128;
+	} else
+		return 0;
+
+	cidr->bits = (slash != NULL) ? atoi(slash) : max;
+	return (cidr->bits >= 0 && cidr->bits <= max) ? 1 : 0;
+}
+
+static int fe_cidr_list (char *str, struct fe_cidr *list, int *num) {
+	char *tok, *save = NULL;
+
+	for (tok = strtok_r(str, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if (*num >= FRONTEND_MAX_CIDRS || ! fe_cidr_parse(tok, &list[*num])) {
+			log_msg("Invalid or too many network specifications: '%s'.", tok);
+			return 0;
+		}
+		(*num)++;
+	}
+
+	return 1;
+}
+
+static int fe_cidr_match (const struct fe_cidr *list, int num, int family, const unsigned char *addr) {
+	int i, full, rest;
+
+	for (i = 0; i < num; i++) {
+		if (list[i].family != family) continue;
+		full = list[i].bits / 8;
+		rest = list[i].bits % 8;
+		if (memcmp(list[i].addr, addr, full) != 0) continue;
+		if (rest && ((list[i].addr[full] ^ addr[full]) & (0xff << (8 - rest))) != 0) continue;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * applies $hosts_allow/$hosts_deny to tcp client (same semantics as Net::Server)
+ * @return 1 if client is allowed to connect, otherwise 0
+ */
+static int fe_client_allowed (int fd) {
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	const unsigned char *addr;
+	int family;
+
+	if (num_allow == 0 && num_deny == 0) return 1;
+	if (getpeername(fd, (struct sockaddr *) &ss, &len) < 0) return 0;
+
+	if (ss.ss_family == AF_INET) {
+		family = AF_INET;
+		addr = (const unsigned char *) &((struct sockaddr_in *) &ss)->sin_addr;
+	} else if (ss.ss_family == AF_INET6) {
+		family = AF_INET6;
+		addr = (const unsigned char *) &((struct sockaddr_in6 *) &ss)->sin6_addr;
+		/** IPv4-mapped IPv6 address */
+		if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *) addr)) {
+			family = AF_INET;
+			addr += 12;
+		}
+	} else
+		return 1;
+
+	if (fe_cidr_match(cidr_deny, num_deny, family, addr)) return 0;
+	if (num_allow == 0) return 1;
+	return fe_cidr_match(cidr_allow, num_allow, family, addr);
+}
+
+static void fe_queue_remove (int idx);
+
+static void fe_client_close (int idx) {
+	struct fe_client *cl = clients[idx];
+	int i;
+
+	if (cl == NULL) return;
+	if (cl->state == FE_QUEUED) fe_queue_remove(idx);
+	/** worker's reply to this client will be discarded */
+	for (i = 0; i < num_workers; i++)
+		if (workers[i].client == idx) workers[i].client = -1;
+	fe_epoll_set(cl->fd, &cl->events, 0, TAG_CLIENT, idx);
+	if (cl->ssl != NULL)
+		tls_free(cl->ssl);
+	else
+		close(cl->fd);
+
+	/** don't leave passwords lying around in freed memory */
+	memset(cl, '\0', sizeof(struct fe_client));
+	free(cl);
+	clients[idx] = NULL;
+	num_clients--;
+}
+
+/**
+ * writes pending client output
+ * @return 1 if connection is still open, otherwise 0
+ */
+static int fe_client_flush (int idx) {
+	struct fe_client *cl = clients[idx];
+	ssize_t n;
+
+	while (cl->out_len > 0) {
+		if (cl->ssl != NULL)
+			n = tls_send(cl->ssl, cl->out, cl->out_len);
+		else
+			n = send(cl->fd, cl->out, cl->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+			fe_client_close(idx);
+			return 0;
+		}
+		memmove(cl->out, cl->out + n, cl->out_len - n);
+		cl->out_len -= n;
+	}
+
+	if (cl->out_len == 0 && cl->closing && cl->state == FE_READING) {
+		if (cl->ssl == NULL)
+			shutdown(cl->fd, SHUT_RDWR);
+		fe_client_close(idx);
+		return 0;
+	}
+
+	fe_epoll_set(cl->fd, &cl->events, ((cl->state == FE_READING && ! cl->closing) ? EPOLLIN : 0) | ((cl->out_len > 0) ? EPOLLOUT : 0), TAG_CLIENT, idx);
+	return 1;
+}
+
+/**
+ * appends authentication response to client output in client's protocol
+ */
+static void fe_client_response (struct fe_client *cl, int status, const unsigned char *msg, size_t msg_len, int has_time, unsigned int server_us) {
+	size_t off, room = sizeof(cl->out) - cl->out_len;
+	unsigned char st = (unsigned char) status;
+
+	if (msg_len > GEN_BUF_SIZE / 2) msg_len = GEN_BUF_SIZE / 2;
+
+	if (cl->v2 == 1) {
+		off = PROTO_HDR_LEN;
+		if (cl->has_id) off = proto2_tlv_u32(cl->out + cl->out_len, off, room, PROTO_T_ID, cl->id);
+		off = proto2_tlv(cl->out + cl->out_len, off, room, PROTO_T_STATUS, &st, 1);
+		off = proto2_tlv(cl->out + cl->out_len, off, room, PROTO_T_MESSAGE, msg, msg_len);
+		if (has_time) off = proto2_tlv_u32(cl->out + cl->out_len, off, room, PROTO_T_SERVER_TIME, server_us);
+		cl->out_len += proto2_frame(cl->out + cl->out_len, 0, off, PROTO_AUTH_RESPONSE);
+	} else {
+		char id_buf[16] = "";
+		int n;
+		if (cl->has_id) snprintf(id_buf, sizeof(id_buf), "%u ", cl->id);
+		n = snprintf((char *) cl->out + cl->out_len, room, "%s%s %.*s\n", id_buf, (status == PROTO_STATUS_OK) ? "OK" : "NO", (int) msg_len, msg);
+		if (n > 0 && (size_t) n < room) cl->out_len += n;
+	}
+}
+
+/**
+ * rejects client's request and closes connection once reply is written
+ */
+static void fe_client_reject (int idx, int status, const char *msg) {
+	struct fe_client *cl = clients[idx];
+
+	if (cl->v2 < 0) cl->v2 = 0;
+	fe_client_response(cl, status, (const unsigned char *) msg, strlen(msg), 0, 0);
+	cl->state = FE_READING;
+	cl->closing = 1;
+	fe_client_flush(idx);
+}
+
+static void fe_queue_push (int idx) {
+	num_queued++;
+	clients[idx]->next = -1;
+	if (queue_tail >= 0)
+		clients[queue_tail]->next = idx;
+	else
+		queue_head = idx;
+	queue_tail = idx;
+}
+
+static void fe_queue_remove (int idx) {
+	int i, prev = -1;
+
+	for (i = queue_head; i >= 0; prev = i, i = clients[i]->next) {
+		if (i != idx) continue;
+		if (prev >= 0)
+			clients[prev]->next = clients[i]->next;
+		else
+			queue_head = clients[i]->next;
+		if (queue_tail == i) queue_tail = prev;
+		num_queued--;
+		return;
+	}
+}
+
+static void fe_client_reset_request (struct fe_client *cl);
+
+/**
+ * @return 1 if client has already given up waiting for reply, otherwise 0
+ */
+static int fe_client_expired (struct fe_client *cl) {
+	return (cl->expires > 0 && deadline_slack >= 0 && wall_ms() > cl->expires + deadline_slack) ? 1 : 0;
+}
+
+/**
+ * answers request without passing it to worker; connection stays
+ * open for next request unless it's about to be closed anyway.
+ */
+static void fe_client_shed (struct fe_client *cl, int status, const char *msg) {
+	if (cl->v2 < 0) cl->v2 = 0;
+	fe_client_response(cl, status, (const unsigned char *) msg, strlen(msg), 0, 0);
+	cl->state = FE_READING;
+	fe_client_reset_request(cl);
+}
+
+/**
+ * request is complete; queues it for the next idle worker
+ * unless client's deadline has passed or queue is full
+ */
+static void fe_client_queue (int idx, long long now) {
+	struct fe_client *cl = clients[idx];
+
+	cl->requests++;
+	if (! cl->keepalive || cl->requests >= FRONTEND_KEEPALIVE_MAX_REQUESTS) cl->closing = 1;
+
+	if (fe_client_expired(cl)) {
+		shed_expired++;
+		fe_client_shed(cl, PROTO_STATUS_TIMEOUT, "Request deadline expired.");
+		return;
+	}
+	if (max_queue > 0 && num_queued >= max_queue) {
+		shed_overloaded++;
+		fe_client_shed(cl, PROTO_STATUS_OVERLOADED, "overloaded");
+		return;
+	}
+
+	cl->state = FE_QUEUED;
+	cl->deadline = now + auth_timeout * 1000LL + FRONTEND_GRACE_MS;
+	fe_queue_push(idx);
+	fe_client_flush(idx);
+}
+
+static void fe_client_reset_request (struct fe_client *cl) {
+	cl->has_id = 0;
+	cl->id = 0;
+	cl->keepalive = 0;
+	cl->expires = 0;
+	cl->lines = 0;
+	memset(cl->req, '\0', cl->req_len);
+	cl->req_len = 0;
+}
+
+/**
+ * appends TLV record to request for worker; records that don't fit are dropped
+ */
+static void fe_client_req_add (struct fe_client *cl, int type, const void *val, size_t len) {
+	size_t off = proto2_tlv(cl->req, (cl->req_len) ? cl->req_len : PROTO_HDR_LEN, sizeof(cl->req), type, val, len);
+	if (off > 0) cl->req_len = off;
+}
+
+static void fe_client_req_add_u64 (struct fe_client *cl, int type, unsigned long long val) {
+	size_t off = proto2_tlv_u64(cl->req, (cl->req_len) ? cl->req_len : PROTO_HDR_LEN, sizeof(cl->req), type, val);
+	if (off > 0) cl->req_len = off;
+}
+
+/**
+ * handles single text protocol request line ("key=value")
+ * @return 1 if request is complete, otherwise 0
+ */
+static int fe_text_line (struct fe_client *cl, char *line) {
+	char *val, *end;
+	unsigned char port_buf[2];
+	int type = 0, p;
+
+	/** trim whitespace, like Net::OpenVPN::AuthDaemon::readStruct() does */
+	if (strlen(line) > GEN_BUF_SIZE) line[GEN_BUF_SIZE] = '\0';
+	while (isspace((unsigned char) *line)) line++;
+	end = line + strlen(line);
+	while (end > line && isspace((unsigned char) end[-1])) *--end = '\0';
+	if (*line == '\0') return 1;
+	cl->lines++;
+
+	if ((val = strchr(line, '=')) != NULL)
+		*val++ = '\0';
+	else
+		val = end;
+
+	if (strcmp(line, "id") == 0) {
+		cl->has_id = (*val != '\0' && strspn(val, "0123456789") == strlen(val)) ? 1 : 0;
+		cl->id = (cl->has_id) ? (unsigned int) strtoul(val, NULL, 10) : 0;
+	}
+	else if (strcmp(line, "keepalive") == 0)
+		cl->keepalive = (*val != '\0' && strcmp(val, "0") != 0) ? 1 : 0;
+	else if (strcmp(line, "deadline") == 0) {
+		if (*val != '\0' && strspn(val, "0123456789") == strlen(val)) {
+			cl->expires = strtoll(val, NULL, 10);
+			fe_client_req_add_u64(cl, PROTO_T_DEADLINE, (unsigned long long) cl->expires);
+		}
+	}
+	else if (strcmp(line, "port") == 0) {
+		p = atoi(val);
+		port_buf[0] = (unsigned char) (p >> 8);
+		port_buf[1] = (unsigned char) p;
+		fe_client_req_add(cl, PROTO_T_PORT, port_buf, 2);
+	}
+	else {
+		if (strcmp(line, "username") == 0) type = PROTO_T_USERNAME;
+		else if (strcmp(line, "password") == 0) type = PROTO_T_PASSWORD;
+		else if (strcmp(line, "common_name") == 0) type = PROTO_T_COMMON_NAME;
+		else if (strcmp(line, "host") == 0) type = PROTO_T_HOST;
+		if (type)
+			fe_client_req_add(cl, type, val, strlen(val));
+	}
+
+	return (cl->lines >= FRONTEND_MAX_LINES) ? 1 : 0;
+}
+
+/**
+ * decodes protocol v2 AUTH_REQUEST payload; everything except request id
+ * and keep-alive flag is passed to worker as is.
+ * @return 1 on success, otherwise 0
+ */
+static int fe_v2_request (struct fe_client *cl, const unsigned char *p, const unsigned char *end) {
+	size_t l;
+	int t;
+
+	cl->req_len = PROTO_HDR_LEN;
+	while (p + 3 <= end) {
+		t = p[0];
+		l = ((size_t) p[1] << 8) | p[2];
+		if (p + 3 + l > end) return 0;
+		if (t == PROTO_T_ID) {
+			cl->has_id = (l == 4) ? 1 : 0;
+			cl->id = proto2_u32(p + 3, l);
+		}
+		else if (t == PROTO_T_KEEPALIVE)
+			cl->keepalive = (l == 1 && p[3]) ? 1 : 0;
+		else {
+			if (t == PROTO_T_DEADLINE && l == 8)
+				cl->expires = (long long) proto2_u64(p + 3, l);
+			memcpy(cl->req + cl->req_len, p, 3 + l);
+			cl->req_len += 3 + l;
+		}
+		p += 3 + l;
+	}
+
+	return (p == end) ? 1 : 0;
+}
+
+/**
+ * parses buffered client input
+ */
+static void fe_client_parse (int idx, long long now) {
+	struct fe_client *cl = clients[idx];
+	unsigned char caps[4] = { 0, 0, 0, PROTO_CAP_KEEPALIVE | PROTO_CAP_ID | PROTO_CAP_TIMING };
+	unsigned char ver = PROTO_VERSION;
+	unsigned char *nl;
+	ssize_t flen;
+	size_t off, room;
+	int done;
+
+	while (cl->state == FE_READING && ! cl->closing && cl->in_len > 0) {
+		if (cl->v2 < 0) cl->v2 = (cl->in[0] == PROTO_MAGIC) ? 1 : 0;
+
+		if (cl->v2) {
+			if ((flen = proto2_frame_len(cl->in, cl->in_len)) < 0) {
+				fe_client_reject(idx, PROTO_STATUS_INVALID, "Invalid request: Invalid frame header.");
+				return;
+			}
+			if (flen == 0) {
+				if (cl->in_len >= sizeof(cl->in))
+					fe_client_reject(idx, PROTO_STATUS_INVALID, "Invalid request: Frame too long.");
+				return;
+			}
+
+			if (cl->in[2] == PROTO_HELLO) {
+				room = sizeof(cl->out) - cl->out_len;
+				off = proto2_tlv(cl->out + cl->out_len, PROTO_HDR_LEN, room, PROTO_T_VERSION, &ver, 1);
+				off = proto2_tlv(cl->out + cl->out_len, off, room, PROTO_T_CAPS, caps, 4);
+				off = proto2_tlv(cl->out + cl->out_len, off, room, PROTO_T_AGENT, agent, strlen(agent));
+				cl->out_len += proto2_frame(cl->out + cl->out_len, 0, off, PROTO_HELLO);
+			}
+			else if (cl->in[2] == PROTO_AUTH_REQUEST) {
+				fe_client_reset_request(cl);
+				if (! fe_v2_request(cl, cl->in + PROTO_HDR_LEN, cl->in + flen)) {
+					fe_client_reject(idx, PROTO_STATUS_INVALID, "Invalid request: Truncated TLV record.");
+					return;
+				}
+				fe_client_queue(idx, now);
+			}
+			else {
+				fe_client_reject(idx, PROTO_STATUS_INVALID, "Invalid request: unexpected frame type.");
+				return;
+			}
+
+			memset(cl->in, '\0', flen);
+			memmove(cl->in, cl->in + flen, cl->in_len - flen);
+			cl->in_len -= flen;
+			continue;
+		}
+
+		if ((nl = memchr(cl->in, '\n', cl->in_len)) == NULL) {
+			if (cl->in_len >= sizeof(cl->in))
+				fe_client_reject(idx, PROTO_STATUS_INVALID, "Invalid authentication request.");
+			return;
+		}
+		*nl = '\0';
+		if (cl->lines == 0 && cl->req_len == 0) fe_client_reset_request(cl);
+		done = fe_text_line(cl, (char *) cl->in);
+		off = nl + 1 - cl->in;
+		memset(cl->in, '\0', off);
+		memmove(cl->in, cl->in + off, cl->in_len - off);
+		cl->in_len -= off;
+		if (done) fe_client_queue(idx, now);
+	}
+
+	if (clients[idx] != NULL) fe_client_flush(idx);
+}
+
+static void fe_client_event (int idx, unsigned int revents, long long now) {
+	struct fe_client *cl = clients[idx];
+	ssize_t n;
+	int r;
+
+	if (cl->handshake) {
+		if ((r = tls_handshake(cl->ssl)) < 0) {
+			fe_client_close(idx);
+			return;
+		}
+		if (r > 0) {
+			fe_epoll_set(cl->fd, &cl->events, r, TAG_CLIENT, idx);
+			return;
+		}
+		cl->handshake = 0;
+		fe_epoll_set(cl->fd, &cl->events, EPOLLIN, TAG_CLIENT, idx);
+		/** request may have arrived together with end of handshake */
+		revents = EPOLLIN;
+	}
+
+	if (revents & EPOLLOUT) {
+		if (! fe_client_flush(idx)) return;
+	}
+	if (! (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) || cl->state != FE_READING) return;
+
+	if (cl->ssl != NULL)
+		n = tls_recv(cl->ssl, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len);
+	else
+		n = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (n <= 0) {
+		/** text client may half-close connection after sending request */
+		if (n == 0 && cl->v2 == 0 && cl->in_len > 0) {
+			cl->in[cl->in_len] = '\0';
+			fe_text_line(cl, (char *) cl->in);
+			memset(cl->in, '\0', cl->in_len);
+			cl->in_len = 0;
+		}
+		if (n == 0 && cl->v2 == 0 && cl->lines > 0) {
+			cl->closing = 1;
+			fe_client_queue(idx, now);
+			if (cl->state == FE_READING) fe_client_flush(idx);
+		} else
+			fe_client_close(idx);
+		return;
+	}
+
+	cl->in_len += n;
+	if (cl->requests == 0 || cl->in_len == (size_t) n)
+		cl->deadline = now + auth_timeout * 1000LL;
+	fe_client_parse(idx, now);
+
+	/** decrypted data buffered in TLS connection doesn't wake up epoll */
+	if (clients[idx] != NULL && cl->ssl != NULL && cl->state == FE_READING && cl->in_len < sizeof(cl->in) && tls_pending(cl->ssl) > 0)
+		fe_client_event(idx, EPOLLIN, now);
+}
+
+/**
+ * @return 1 if socket is tcp socket, otherwise 0
+ */
+static int fe_is_inet (int fd) {
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0) return 0;
+	return (ss.ss_family == AF_INET || ss.ss_family == AF_INET6) ? 1 : 0;
+}
+
+static void fe_accept (int listen_sock, long long now) {
+	struct fe_client *cl;
+	int fd, i;
+
+	while ((fd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (! fe_client_allowed(fd)) {
+			close(fd);
+			continue;
+		}
+		if (num_clients >= max_clients) {
+			log_msg("Too many client connections (%d), dropping connection.", max_clients);
+			close(fd);
+			continue;
+		}
+		for (i = 0; i < max_clients; i++)
+			if (clients[i] == NULL) break;
+		if ((cl = calloc(1, sizeof(struct fe_client))) == NULL) {
+			log_msg("Unable to allocate memory for client connection.");
+			close(fd);
+			continue;
+		}
+
+		/** UNIX domain socket clients are local and never encrypted */
+		if (fe_tls && fe_is_inet(fd)) {
+			if ((cl->ssl = tls_accept(fd)) == NULL) {
+				free(cl);
+				close(fd);
+				continue;
+			}
+			cl->handshake = 1;
+		}
+
+		cl->fd = fd;
+		cl->state = FE_READING;
+		cl->v2 = -1;
+		cl->next = -1;
+		cl->deadline = now + auth_timeout * 1000LL;
+		clients[i] = cl;
+		num_clients++;
+		fe_epoll_set(fd, &cl->events, EPOLLIN, TAG_CLIENT, i);
+	}
+}
+
+/**
+ * writes pending worker output
+ * @return 1 on success, 0 on write error
+ */
+static int fe_worker_flush (int idx) {
+	struct fe_worker *w = &workers[idx];
+	ssize_t n;
+
+	while (w->out_len > 0) {
+		if ((n = send(w->fd, w->out, w->out_len, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+			return 0;
+		}
+		memmove(w->out, w->out + n, w->out_len - n);
+		w->out_len -= n;
+		memset(w->out + w->out_len, '\0', n);
+	}
+
+	fe_epoll_set(w->fd, &w->events, EPOLLIN | ((w->out_len > 0) ? EPOLLOUT : 0), TAG_WORKER, idx);
+	return 1;
+}
+
+/**
+ * hands queued requests to idle workers
+ */
+static void fe_dispatch (long long now) {
+	struct fe_client *cl;
+	struct fe_worker *w;
+	size_t end;
+	int i, idx;
+
+	for (i = 0; i < num_workers && queue_head >= 0; i++) {
+		w = &workers[i];
+		if (w->busy || w->stale || w->out_len > 0) continue;
+
+		idx = queue_head;
+		cl = clients[idx];
+		queue_head = cl->next;
+		if (queue_head < 0) queue_tail = -1;
+		num_queued--;
+
+		/** don't waste worker on request nobody waits for */
+		if (fe_client_expired(cl)) {
+			shed_expired++;
+			fe_client_shed(cl, PROTO_STATUS_TIMEOUT, "Request deadline expired.");
+			if (fe_client_flush(idx)) fe_client_parse(idx, now);
+			i--;
+			continue;
+		}
+
+		do {
+			request_seq++;
+		} while (request_seq == 0);
+
+		/** client's request + our request id */
+		memcpy(w->out + w->out_len, cl->req, (cl->req_len) ? cl->req_len : PROTO_HDR_LEN);
+		end = proto2_tlv_u32(w->out + w->out_len, (cl->req_len) ? cl->req_len : PROTO_HDR_LEN, sizeof(w->out) - w->out_len, PROTO_T_ID, request_seq);
+		w->out_len += proto2_frame(w->out + w->out_len, 0, end, PROTO_AUTH_REQUEST);
+		memset(cl->req, '\0', cl->req_len);
+		cl->req_len = 0;
+
+		w->busy = 1;
+		w->client = idx;
+		w->id = request_seq;
+		w->deadline = now + auth_timeout * 1000LL + FRONTEND_GRACE_MS;
+		cl->state = FE_WAITING;
+		fe_worker_flush(i);
+	}
+}
+
+/**
+ * routes worker's AUTH_RESPONSE frame to waiting client
+ */
+static void fe_worker_frame (int idx, const unsigned char *frame, size_t len, long long now) {
+	struct fe_worker *w = &workers[idx];
+	struct fe_client *cl;
+	const unsigned char *p = frame + PROTO_HDR_LEN, *end = frame + len;
+	const unsigned char *msg = (const unsigned char *) "";
+	size_t l, msg_len = 0;
+	unsigned int id = 0, server_us = 0;
+	int status = PROTO_STATUS_ERROR, has_time = 0;
+
+	while (p + 3 <= end) {
+		l = ((size_t) p[1] << 8) | p[2];
+		if (p + 3 + l > end) break;
+		switch (p[0]) {
+			case PROTO_T_ID: id = proto2_u32(p + 3, l); break;
+			case PROTO_T_STATUS: if (l == 1) status = p[3]; break;
+			case PROTO_T_MESSAGE: msg = p + 3; msg_len = l; break;
+			case PROTO_T_SERVER_TIME: server_us = proto2_u32(p + 3, l); has_time = 1; break;
+		}
+		p += 3 + l;
+	}
+
+	/** late reply to request that already timed out: worker is available again */
+	if (w->stale && id == w->id) {
+		w->stale = 0;
+		return;
+	}
+	if (! w->busy || id != w->id) return;
+
+	w->busy = 0;
+	if (w->client < 0 || (cl = clients[w->client]) == NULL) return;
+
+	fe_client_response(cl, status, msg, msg_len, has_time, server_us);
+	cl->state = FE_READING;
+	cl->deadline = now + keepalive_timeout * 1000LL;
+	fe_client_reset_request(cl);
+	idx = w->client;
+	w->client = -1;
+
+	/** process pipelined request, if any */
+	if (fe_client_flush(idx)) fe_client_parse(idx, now);
+}
+
+/**
+ * reads worker replies
+ * @return 1 on success, 0 if worker connection is lost
+ */
+static int fe_worker_event (int idx, unsigned int revents, long long now) {
+	struct fe_worker *w = &workers[idx];
+	ssize_t n, flen;
+
+	if ((revents & EPOLLOUT) && ! fe_worker_flush(idx)) return 0;
+	if (! (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))) return 1;
+
+	n = recv(w->fd, w->in + w->in_len, sizeof(w->in) - w->in_len, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 1;
+	if (n <= 0) return 0;
+	w->in_len += n;
+
+	while ((flen = proto2_frame_len(w->in, w->in_len)) > 0) {
+		fe_worker_frame(idx, w->in, flen, now);
+		memmove(w->in, w->in + flen, w->in_len - flen);
+		w->in_len -= flen;
+	}
+	if (flen < 0 || w->in_len >= sizeof(w->in)) {
+		log_msg("Invalid response from authentication worker %d.", idx);
+		w->in_len = 0;
+	}
+
+	return 1;
+}
+
+/**
+ * expires timed out clients and stuck workers
+ */
+static void fe_expire (long long now) {
+	struct fe_client *cl;
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		if (! workers[i].busy || workers[i].deadline > now) continue;
+		/**
+		 * worker died or hangs; openvpn_authd replaces dead workers.
+		 * Worker gets no requests until its late reply arrives.
+		 */
+		log_msg("Authentication worker %d didn't reply in %d second(s).", i, auth_timeout);
+		workers[i].busy = 0;
+		workers[i].stale = 1;
+		if (workers[i].client >= 0 && clients[workers[i].client] != NULL) {
+			clients[workers[i].client]->state = FE_READING;
+			fe_client_reject(workers[i].client, PROTO_STATUS_ERROR, "Authentication worker failed.");
+		}
+		workers[i].client = -1;
+	}
+
+	for (i = 0; i < max_clients; i++) {
+		if ((cl = clients[i]) == NULL || cl->deadline > now) continue;
+
+		if (cl->state == FE_QUEUED) {
+			fe_queue_remove(i);
+			cl->state = FE_READING;
+			fe_client_reject(i, PROTO_STATUS_TIMEOUT, "Authentication timed out.");
+		}
+		else if (cl->state == FE_WAITING) {
+			/** worker still owns the request, its late reply is discarded */
+			int j;
+			for (j = 0; j < num_workers; j++)
+				if (workers[j].client == i) workers[j].client = -1;
+			cl->state = FE_READING;
+			fe_client_reject(i, PROTO_STATUS_TIMEOUT, "Authentication timed out.");
+		}
+		else if (cl->in_len > 0 || cl->lines > 0)
+			fe_client_reject(i, PROTO_STATUS_TIMEOUT, "Authentication timed out.");
+		else
+			/** idle (keep-alive) connection or client stuck writing */
+			fe_client_close(i);
+	}
+}
+
+static int fe_set_fd (const char *str) {
+	int fd = atoi(str);
+
+	if (fd < 0 || fcntl(fd, F_GETFD) < 0) {
+		log_msg("Invalid file descriptor '%s'.", str);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+static void fe_usage (void) {
+	fprintf(stderr, "Usage: %s -l <fd>[,<fd>...] -w <fd>[,<fd>...] [OPTIONS]\n\n", FRONTEND_NAME);
+	fprintf(stderr, "Event-loop front-end for openvpn_authd; started by openvpn_authd\n");
+	fprintf(stderr, "when $daemon_frontend is configured.\n\n");
+	fprintf(stderr, "OPTIONS:\n");
+	fprintf(stderr, "  -l   Comma separated list of listening socket file descriptors\n");
+	fprintf(stderr, "  -w   Comma separated list of authentication worker socket file descriptors\n");
+	fprintf(stderr, "  -t   Authentication timeout in seconds (Default: %d)\n", FRONTEND_DEFAULT_AUTH_TIMEOUT);
+	fprintf(stderr, "  -k   Keep-alive connection idle timeout in seconds (Default: %d)\n", FRONTEND_DEFAULT_KEEPALIVE_TIMEOUT);
+	fprintf(stderr, "  -c   Maximum number of client connections (Default: %d)\n", FRONTEND_DEFAULT_CLIENTS);
+	fprintf(stderr, "  -n   Server name announced to protocol v2 clients (Default: %s)\n", FRONTEND_NAME);
+	fprintf(stderr, "  -q   Maximum number of queued requests, 0 for unlimited (Default: 0)\n");
+	fprintf(stderr, "  -s   Client deadline clock skew allowance in milliseconds,\n");
+	fprintf(stderr, "       negative value disables deadline checks (Default: %d)\n", FRONTEND_DEFAULT_DEADLINE_SLACK);
+	fprintf(stderr, "  -A   Comma separated list of allowed client networks\n");
+	fprintf(stderr, "  -X   Comma separated list of denied client networks\n");
+	fprintf(stderr, "  -T   Serve tcp clients over TLS using specified certificate chain file\n");
+	fprintf(stderr, "  -K   TLS private key file (Default: certificate file)\n");
+	fprintf(stderr, "  -C   Require TLS client certificates signed by CA(s) in specified file\n");
+	fprintf(stderr, "  -M   TLS session cache shared memory file descriptor\n");
+	fprintf(stderr, "  -N   Number of TLS session cache entries (Default: %d)\n", FRONTEND_DEFAULT_TLS_SLOTS);
+	fprintf(stderr, "  -E   TLS session lifetime in seconds (Default: %d)\n", FRONTEND_DEFAULT_TLS_TIMEOUT);
+	fprintf(stderr, "  -v   Log to stderr too\n");
+}
+
+int main (int argc, char **argv) {
+	struct epoll_event events[FRONTEND_EVENTS];
+	struct sigaction act;
+	struct rlimit rl;
+	char *tok, *save = NULL;
+	char *tls_cert = NULL, *tls_key = NULL, *tls_ca = NULL;
+	int tls_shm = -1, tls_slots = FRONTEND_DEFAULT_TLS_SLOTS, tls_timeout = FRONTEND_DEFAULT_TLS_TIMEOUT;
+	pid_t parent = getppid();
+	int c, i, n, tag, idx;
+	long long now, next_expire = 0, next_stats = 0;
+
+	MYNAME = FRONTEND_NAME;
+	log_open();
+
+	while ((c = getopt(argc, argv, "l:w:t:k:c:n:q:s:A:X:T:K:C:M:N:E:vh")) != -1) {
+		switch (c) {
+			case 'l':
+				for (tok = strtok_r(optarg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+					if (num_listeners >= FRONTEND_MAX_LISTEN) {
+						log_msg("Too many listening sockets (max %d).", FRONTEND_MAX_LISTEN);
+						return 1;
+					}
+					if ((listeners[num_listeners++] = fe_set_fd(tok)) < 0) return 1;
+				}
+				break;
+			case 'w':
+				for (tok = strtok_r(optarg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+					if (num_workers >= FRONTEND_MAX_WORKERS) {
+						log_msg("Too many authentication workers (max %d).", FRONTEND_MAX_WORKERS);
+						return 1;
+					}
+					if ((workers[num_workers].fd = fe_set_fd(tok)) < 0) return 1;
+					workers[num_workers].client = -1;
+					num_workers++;
+				}
+				break;
+			case 't':
+				auth_timeout = atoi(optarg);
+				break;
+			case 'k':
+				keepalive_timeout = atoi(optarg);
+				break;
+			case 'c':
+				max_clients = atoi(optarg);
+				break;
+			case 'n':
+				snprintf(agent, sizeof(agent), "%s", optarg);
+				break;
+			case 'q':
+				max_queue = atoi(optarg);
+				break;
+			case 's':
+				deadline_slack = atoi(optarg);
+				break;
+			case 'A':
+				if (! fe_cidr_list(optarg, cidr_allow, &num_allow)) return 1;
+				break;
+			case 'X':
+				if (! fe_cidr_list(optarg, cidr_deny, &num_deny)) return 1;
+				break;
+			case 'T':
+				tls_cert = optarg;
+				break;
+			case 'K':
+				tls_key = optarg;
+				break;
+			case 'C':
+				tls_ca = optarg;
+				break;
+			case 'M':
+				if ((tls_shm = fe_set_fd(optarg)) < 0) return 1;
+				break;
+			case 'N':
+				tls_slots = atoi(optarg);
+				break;
+			case 'E':
+				tls_timeout = atoi(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				fe_usage();
+				return 1;
+		}
+	}
+
+	if (num_listeners < 1 || num_workers < 1) {
+		fe_usage();
+		return 1;
+	}
+	if (auth_timeout < 1) auth_timeout = FRONTEND_DEFAULT_AUTH_TIMEOUT;
+	if (keepalive_timeout < 1) keepalive_timeout = FRONTEND_DEFAULT_KEEPALIVE_TIMEOUT;
+	if (max_clients < 1) max_clients = FRONTEND_DEFAULT_CLIENTS;
+
+	/** every client connection needs file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur != RLIM_INFINITY && (rlim_t) max_clients + num_workers + 16 > rl.rlim_cur) {
+			max_clients = (int) rl.rlim_cur - num_workers - 16;
+			log_msg("Open file limit allows only %d client connections.", max_clients);
+			if (max_clients < 1) return 1;
+		}
+	}
+
+	if (tls_cert != NULL) {
+		if (! tls_server_init(tls_cert, tls_key, tls_ca, tls_shm, tls_slots, tls_timeout))
+			return 1;
+		fe_tls = 1;
+	}
+
+	if ((clients = calloc(max_clients, sizeof(struct fe_client *))) == NULL) {
+		log_msg("Unable to allocate memory for client table.");
+		return 1;
+	}
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		log_msg("Unable to create epoll instance: %s (errno %d).", strerror(errno), errno);
+		return 1;
+	}
+
+	memset(&act, '\0', sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &act, NULL);
+	sigaction(SIGHUP, &act, NULL);
+	act.sa_handler = fe_sigh_stop;
+	sigaction(SIGTERM, &act, NULL);
+	sigaction(SIGINT, &act, NULL);
+
+	for (i = 0; i < num_workers; i++)
+		fe_epoll_set(workers[i].fd, &workers[i].events, EPOLLIN, TAG_WORKER, i);
+
+	log_msg("%s %s started with %d listening socket(s)%s, %d authentication worker(s), max %d client connection(s), max %d queued request(s).", FRONTEND_NAME, VERSION, num_listeners, (fe_tls) ? " (TLS)" : "", num_workers, max_clients, max_queue);
+
+	while (! fe_stop) {
+		now = clock_ms();
+		if (now >= next_expire) {
+			/** openvpn_authd is gone */
+			if (getppid() != parent) {
+				log_msg("openvpn_authd exited, shutting down.");
+				break;
+			}
+			fe_expire(now);
+			next_expire = now + FRONTEND_TICK_MS;
+		}
+		if (now >= next_stats) {
+			if (shed_overloaded > 0 || shed_expired > 0) {
+				log_msg("Load shedding: %u request(s) rejected as overloaded (max queue %d), %u expired request(s) dropped; %d request(s) queued.", shed_overloaded, max_queue, shed_expired, num_queued);
+				shed_overloaded = shed_expired = 0;
+			}
+			next_stats = now + FRONTEND_STATS_MS;
+		}
+		fe_dispatch(now);
+
+		/** don't accept new connections while client table is full */
+		for (i = 0; i < num_listeners; i++)
+			fe_epoll_set(listeners[i], &listen_events[i], (num_clients < max_clients) ? EPOLLIN : 0, TAG_LISTEN, i);
+
+		if ((n = epoll_wait(epfd, events, FRONTEND_EVENTS, FRONTEND_TICK_MS)) < 0) {
+			if (errno == EINTR) continue;
+			log_msg("epoll_wait(2) failed: %s (errno %d).", strerror(errno), errno);
+			break;
+		}
+
+		now = clock_ms();
+		for (i = 0; i < n; i++) {
+			tag = (int) (events[i].data.u64 >> 32);
+			idx = (int) (events[i].data.u64 & 0xffffffff);
+			if (tag == TAG_LISTEN)
+				fe_accept(listeners[idx], now);
+			else if (tag == TAG_WORKER) {
+				if (! fe_worker_event(idx, events[i].events, now)) {
+					log_msg("Lost connection to authentication worker %d, shutting down.", idx);
+					fe_stop = 1;
+					break;
+				}
+			}
+			else if (clients[idx] != NULL)
+				fe_client_event(idx, events[i].events, now);
+		}
+	}
+
+	for (i = 0; i < max_clients; i++)
+		if (clients[i] != NULL) fe_client_close(i);
+	for (i = 0; i < num_workers; i++)
+		close(workers[i].fd);
+	for (i = 0; i < num_listeners; i++)
+		close(listeners[i]);
+	free(clients);
+
+	return 0;
+}
@@ -215,6 +215,24 @@ sub authenticate {
 	return 0;
 }
 
+# prepares module for serving requests (opens persistent
+# backend connections); called in every worker before it
+# starts accepting requests. Returns 1 on success, otherwise 0.
+sub warmup {
+	my ($self) = @_;
+	$self->{error} = "";
+	return 1;
+}
+
+# called in forked process (parallel chain branch) before
+# authenticate(); module must forget persistent backend
+# connections inherited from parent without closing them,
+# so that parent's connections stay usable.
+sub forked {
+	my ($self) = @_;
+	return 1;
+}
+
 =head1 AUTHOR
 
 Brane F. Gracnar
@@ -7,6 +7,9 @@ use warnings;
 
 use Log::Log4perl;
 
+# my modules
+use Net::OpenVPN::RuleSet;
+
 =head1 NAME AuthStruct
 
 Authentication structure validating module. This module does not provide authentication,
@@ -144,8 +147,44 @@ B<untrusted_ip> (perl code reference, undef)
 
 B<untrusted_port> (perl code reference, undef)
 
+B<rules> (array reference of strings, undef) Declarative allow/deny rules, see below.
+
+B<rules_file> (string, undef) File containing declarative rules, one per line.
+
+B<rules_log_interval> (integer, 300) How often (in seconds) every worker logs hit counters of its most frequently hit rules; 0 disables logging.
+
 B<If none of above listed properties are defined this module returns authentication success.>
 
+B<DECLARATIVE RULES>
+
+Username regexes, certificate CN matches and client address allow/deny
+lists don't need validation functions. Rules of form
+B<E<lt>allow|denyE<gt> E<lt>fieldE<gt> E<lt>patternE<gt>> are compiled
+when module is created into one combined regular expression per field
+and address prefix trie (see L<Net::OpenVPN::RuleSet> for syntax and
+semantics), which is much faster than calling perl function for every
+rule. Rules are evaluated before validation functions; both must succeed.
+
+ validator => {
+ 	driver => 'AuthStruct',
+ 	required => 1,
+
+ 	rules_file => '/etc/openvpn_auth/authstruct.rules',
+ 	rules => [
+ 		'deny username ^(?:root|admin)$',
+ 		'allow common_name ^[a-z0-9_.-]+\.vpn\.example\.org$',
+ 		'allow untrusted_ip 0.0.0.0/0',
+ 		'deny untrusted_ip 192.0.2.0/24',
+ 	],
+
+ 	# custom logic still works
+ 	username => \ &username_validator,
+ },
+
+If rules can't be compiled, error is logged and every authentication
+fails. Every rule counts its hits; workers periodically log counters of
+most frequently hit rules (see B<rules_log_interval> and getRuleHits()).
+
 =cut
 sub new {
 	my $proto = shift;
@@ -161,11 +200,15 @@ sub new {
 	##################################################
 	$self->{_name} = "Allow";
 	$self->{_log} = Log::Log4perl->get_logger(__PACKAGE__);
+	$self->{_rules} = undef;
+	$self->{_rules_error} = "";
+	$self->{_rules_logged} = 0;
 
 	bless($self, $class);
 
 	$self->clearParams();
 	$self->setParams(@_);
+	$self->_compileRules();
 
 	return $self;
 }
@@ -179,6 +222,9 @@ sub clearParams {
 	$self->{common_name} = undef;
 	$self->{untrusted_ip} = undef;
 	$self->{untrusted_port} = undef;
+	$self->{rules} = undef;
+	$self->{rules_file} = undef;
+	$self->{rules_log_interval} = 300;
 
 	return 1;
 }
@@ -194,7 +240,9 @@ sub isSufficient {
 
 sub authenticate {
 	my ($self, $struct) = @_;
+	$self->{error} = "";
 
+	return 0 unless ($self->_validateRules($struct));
 	return 0 unless ($self->_validateUsername($struct));
 	return 0 unless ($self->_validatePassword($struct));
 	return 0 unless ($self->_validateCN($struct));
@@ -204,6 +252,91 @@ sub authenticate {
 	return 1;
 }
 
+=head2 getRuleHits ()
+
+Returns list of [ origin, rule, hits ] of declarative rules which were
+hit in this process, most frequently hit first.
+
+=cut
+sub getRuleHits {
+	my ($self) = @_;
+	return () unless (defined $self->{_rules});
+	return $self->{_rules}->getHits();
+}
+
+sub _compileRules {
+	my ($self) = @_;
+	$self->{_rules} = undef;
+	$self->{_rules_error} = "";
+
+	my $rules = Net::OpenVPN::RuleSet->new();
+	my $ok = 1;
+	if (defined $self->{rules_file} && length($self->{rules_file}) > 0) {
+		$ok = $rules->load($self->{rules_file});
+	}
+	if ($ok && defined $self->{rules}) {
+		my $list = (ref($self->{rules}) eq 'ARRAY') ? $self->{rules} : [ $self->{rules} ];
+		my $i = 0;
+		foreach my $line (@{$list}) {
+			$i++;
+			last unless ($ok = $rules->add($line, "rules[$i]"));
+		}
+	}
+	$ok = $rules->compile() if ($ok);
+
+	unless ($ok) {
+		$self->{_rules_error} = $rules->getError();
+		$self->{_log}->error("Unable to compile validation rules: $self->{_rules_error}");
+		return 0;
+	}
+	return 1 unless ($rules->count() > 0);
+
+	$self->{_rules} = $rules;
+	$self->{_log}->info("Compiled " . $rules->count() . " validation rule(s).");
+	return 1;
+}
+
+sub _validateRules {
+	my ($self, $struct) = @_;
+
+	if (length($self->{_rules_error}) > 0) {
+		$self->{error} = "Invalid validation rules: $self->{_rules_error}";
+		$self->{_log}->error($self->{error});
+		return 0;
+	}
+	return 1 unless (defined $self->{_rules});
+
+	my ($r, $rule) = $self->{_rules}->match($struct);
+	$self->_logRuleHits();
+	unless ($r) {
+		$self->{error} = $self->{_rules}->getError();
+		$self->{_log}->error("Validation rules failed: $self->{error}");
+		return 0;
+	}
+
+	$self->{_log}->debug("Validation rules succeeded" . ((defined $rule) ? ", last decided by $rule->{where}." : "."));
+	return 1;
+}
+
+# logs most frequently hit rules every rules_log_interval seconds
+sub _logRuleHits {
+	my ($self) = @_;
+	return 1 unless ($self->{rules_log_interval} > 0);
+
+	my $now = time();
+	unless ($self->{_rules_logged}) {
+		$self->{_rules_logged} = $now;
+		return 1;
+	}
+	return 1 if ($now - $self->{_rules_logged} < $self->{rules_log_interval});
+	$self->{_rules_logged} = $now;
+
+	my @hits = $self->getRuleHits();
+	splice(@hits, 20) if (@hits > 20);
+	$self->{_log}->info("Validation rule hits: " . join(", ", map { "$_->[0] ($_->[1]): $_->[2]" } @hits)) if (@hits);
+	return 1;
+}
+
 sub _validateUsername {
 	my $self = shift;
 	return $self->_runRef("username", @_);
@@ -263,6 +396,7 @@ Brane F. Gracnar
 
 L<Net::OpenVPN::Auth>
 L<Net::OpenVPN::AuthChain>
+L<Net::OpenVPN::RuleSet>
 
 =cut
 
@@ -11,6 +11,10 @@ use Log::Log4perl;
 # my modules
 use Net::OpenVPN::PasswordValidator;
 
+# handles inherited from parent process; referenced until
+# process exits, so that their destructors never run
+my @INHERITED = ();
+
 =head1 NAME DBI
 
 SQL backend authentication module. This module can be used to authenticate against
@@ -126,6 +130,24 @@ sub authenticate {
 	return $r;
 }
 
+sub warmup {
+	my ($self) = @_;
+	$self->{error} = "";
+	return 1 unless ($self->{persistent_connection});
+	return $self->_prepareSQL();
+}
+
+# parent's connection is shared with forked process; forget it
+# without disconnecting
+sub forked {
+	my ($self) = @_;
+	$self->{_conn}->{InactiveDestroy} = 1 if (defined $self->{_conn});
+	push(@INHERITED, grep { defined } ($self->{_sql}, $self->{_conn}));
+	$self->{_sql} = undef;
+	$self->{_conn} = undef;
+	return 1;
+}
+
 sub _connect {
 	my ($self) = @_;
 
@@ -10,6 +10,7 @@ use Log::Log4perl;
 
 # my modules
 use Net::OpenVPN::PasswordValidator;
+use Net::OpenVPN::PasswdIndex;
 
 =head1 NAME File
 
@@ -38,6 +39,11 @@ initialization into memory.
 B<file_read_once> (boolean, 0) Read password file specified by B<file> property only on object initialization. This is very useful if openvpn_authd runs
 in chroot jail and you don't want to put password file into chroot jail.   
 
+B<file> can also be password index built by B<passwd2index> or B<ldap2passwd --index> (see L<Net::OpenVPN::PasswdIndex>); index is detected
+automatically. Index is memory mapped instead of parsed, lookup cost doesn't depend on number of users and replaced index file is picked up
+without restart, so B<file_read_once> is not needed for large password databases. B<split_regex>, B<username_index> and B<password_index>
+are ignored for password indexes.
+
 B<split_regex> (string, "/:/") Password file must be somehow parsed to fetch username and password. File is read line by line, therefore each line must
 contain username and password separated by some field delimited. This option must be in the following syntax:
 
@@ -106,7 +112,11 @@ sub new {
 
 	# should we read entire password into memory?
 	if ($self->{file_read_once}) {
-		$self->_readFileToInstance();
+		if (Net::OpenVPN::PasswdIndex->isIndex($self->{file})) {
+			$self->_openIndex();
+		} else {
+			$self->_readFileToInstance();
+		}
 	}
 
 	return $self;
@@ -125,6 +135,7 @@ sub clearParams {
 
 	$self->{_split_regex} = undef;
 	$self->{_data} = {};
+	$self->{_index} = undef;
 
 	return 1;
 }
@@ -166,7 +177,13 @@ sub _init {
 # retrieves password hash
 sub _getPasswordHash {
 	my ($self, $username) = @_;
-	if ($self->{file_read_once}) {
+	my $index = $self->_getIndex();
+	return undef unless (defined $index);
+
+	if ($index) {
+		return $self->_getPasswordHashIndex($username);
+	}
+	elsif ($self->{file_read_once}) {
 		return $self->_getPasswordHashMem($username);
 	} else {
 		return $self->_getPasswordHashFile($username);
@@ -199,6 +216,49 @@ sub _getPasswordHashFile {
 	return $self->_getPasswordHashMem($username, $data);
 }
 
+sub _getPasswordHashIndex {
+	my ($self, $username) = @_;
+	my @r = $self->{_index}->lookup($username);
+	if (! @r) {
+		$self->{error} = "Username not found.";
+		$self->{_log}->debug($self->{error});
+		return undef;
+	}
+	elsif (! defined $r[0]) {
+		$self->{error} = $self->{_index}->getError();
+		$self->{_log}->error($self->{error});
+		return undef;
+	}
+
+	return $r[0];
+}
+
+# returns opened password index, 0 if password
+# file is not an index or undef on error
+sub _getIndex {
+	my ($self) = @_;
+	return $self->{_index} if (defined $self->{_index});
+	return 0 if ($self->{file_read_once});
+	return 0 unless (Net::OpenVPN::PasswdIndex->isIndex($self->{file}));
+	return undef unless ($self->_openIndex());
+	return $self->{_index};
+}
+
+sub _openIndex {
+	my ($self) = @_;
+	$self->{_log}->info("Opening password index '$self->{file}'.");
+	my $index = Net::OpenVPN::PasswdIndex->new();
+	unless ($index->open($self->{file})) {
+		$self->{error} = $index->getError();
+		$self->{_log}->error($self->{error});
+		return 0;
+	}
+
+	$self->{_log}->debug("Password index contains " . $index->getNumEntries() . " entries.");
+	$self->{_index} = $index;
+	return 1;
+}
+
 sub _readFile {
 	my ($self, $file, $search_username) = @_;
 	$self->{error} = "";
@@ -305,6 +365,7 @@ Brane F. Gracnar
 
 L<Net::OpenVPN::Auth>
 L<Net::OpenVPN::AuthChain>
+L<Net::OpenVPN::PasswdIndex>
 L<perl_re>
 
 =cut
@@ -9,10 +9,20 @@ use Socket;
 use Net::LDAP;
 use Log::Log4perl;
 use List::Util qw(shuffle);
+use Time::HiRes qw(time);
 
 # my modules
+use Net::OpenVPN::LRUCache;
 use Net::OpenVPN::PasswordValidator;
 
+# LDAP result codes meaning that connection is unusable
+# (LDAP_SERVER_DOWN, LDAP_LOCAL_ERROR, LDAP_TIMEOUT, LDAP_CONNECT_ERROR)
+my %CONN_ERRORS = map { $_ => 1 } (0x51, 0x52, 0x55, 0x5b);
+
+# connections inherited from parent process; referenced until
+# process exits, so that their destructors never run
+my @INHERITED = ();
+
 =head1 NAME LDAP
 
 LDAP directory service authentication backend module.
@@ -48,7 +58,7 @@ otherwise is completely ignored, becouse password validation is done by LDAP ser
 B<password_default_hash> (string, "PLAIN") Normally, LDAP objects have stored password in {PASSWORD_HASH_TYPE}HASH_TEXT format. This property specifies
 password hashing algorithm when retrieved password doesn't have {PASSWORD_HASH_TYPE} prefix. If you have properly configured LDAP server, you don't need
 to set this property. This property is used only, when B<auth_method> is set to B<pass_attr>, otherwise is completely ignored. Supported password hashes:
-B<PLAIN, CRYPTMD5, MD5, NTLM, SHA1, SSHA>
+B<PLAIN, CRYPTMD5, SHACRYPT, MD5, NTLM, SHA1, SSHA, SSHA256, SSHA512>
 
 B<host> (string, "127.0.0.1") LDAP server hostname or ip address. If you want to specifiy multiple ldap servers, you can separate them using comma (,) or
 semicolon (;) character. B<Example>: ldap1.example.org, ldap2.example.org; ldap3.example.org
@@ -59,7 +69,17 @@ connection will be made to random resolved ldap server. This option provides loa
 connection will be first tried to first specified host, if it fails, then the next specified host will be tried.
 
 B<persistent_connection> (boolean, 0) If set to value of 1, ldap connection will not be destroyed after each authentication request. Setting this to 1
-can lead to better authentication performance, but it can lead to unpredictable results in case of ldap server restart.
+can lead to better authentication performance. Every worker then keeps bound search connection and separate connection used for binding as users
+(B<search> method); both use TCP keepalive and are transparently reestablished and operation retried once if LDAP server closes them.
+
+B<keepalive_interval> (integer, 60) Persistent search connection idle for more than this many seconds is checked (root DSE read) before it is used
+and reestablished if it is dead. Set to 0 to disable checks.
+
+B<dn_cache_size> (integer, 0) Number of search results (user DNs) cached by each worker for B<search> authentication method; least recently used
+entries are evicted. Repeated logins skip the search. If bind as cached DN fails, cache entry is dropped and search is repeated, so moved or
+renamed entries are picked up. Set to 0 to disable cache. Results are never cached if B<search_filter> contains %{password}.
+
+B<dn_cache_ttl> (integer, 300) DN cache entry lifetime in seconds.
 
 B<port> (integer, 389) LDAP server port.
 
@@ -179,7 +199,14 @@ sub clearParams {
 	$self->{debug} = 0;
 	$self->{timeout} = 2;
 
-	$self->{_conn} = undef;
+	$self->{keepalive_interval} = 60;	# health check idle persistent connection
+	$self->{dn_cache_size} = 0;			# cached search results (username => DN)
+	$self->{dn_cache_ttl} = 300;		# cached search result lifetime
+
+	$self->{_conn} = undef;				# search connection
+	$self->{_conn_used} = 0;			# last successful use of search connection
+	$self->{_bind_conn} = undef;		# user bind connection
+	$self->{_dn_cache} = undef;
 	return 1;
 }
 
@@ -205,6 +232,23 @@ sub authenticate {
 	return $r;
 }
 
+sub warmup {
+	my ($self) = @_;
+	$self->{error} = "";
+	return 1 unless ($self->{persistent_connection});
+	return $self->_connect();
+}
+
+# parent's connections are shared with forked process: requests
+# sent over them would mix up replies (message ids) of both
+sub forked {
+	my ($self) = @_;
+	push(@INHERITED, grep { defined } ($self->{_conn}, $self->{_bind_conn}));
+	$self->{_conn} = undef;
+	$self->{_bind_conn} = undef;
+	return 1;
+}
+
 sub _init {
 	my ($self) = @_;
 	
@@ -215,6 +259,14 @@ sub _init {
 
 	# create password validator object
 	$self->{_validator} = Net::OpenVPN::PasswordValidator->new();
+
+	# user DN cache
+	if ($self->{dn_cache_size} > 0) {
+		$self->{_dn_cache} = Net::OpenVPN::LRUCache->new(
+			size => $self->{dn_cache_size},
+			ttl => $self->{dn_cache_ttl},
+		);
+	}
 	# $self->{_log}->debug("Module supported password hashing algorithms: ", join(", ", sort(@unavail, @avail)));
 	# $self->{_log}->debug("Disabled password hashing algorithms (required perl modules are unavailable): ", join(", ", sort(@unavail)));
 	# $self->{_log}->info("Enabled password hashing algorithms: ", join(", ", sort(@avail)));
@@ -291,6 +343,9 @@ sub _authenticatePwAttr {
 	elsif ($pwhash =~ m/^\$2\$/) {
 		$pwtype = "CRYPTBLOWFISH";
 	}
+	elsif ($pwhash =~ m/^\$[56]\$/) {
+		$pwtype = "SHACRYPT";
+	}
 	elsif ($pwtype eq 'MD5') {
 		$pwtype = "MD5";
 	}
@@ -324,13 +379,50 @@ sub _authenticateSearch {
 	my $filter = $self->_getFilter($struct);
 	return 0 unless (defined $filter);
 
+	# cached DN?
+	my $cache = ($self->{search_filter} =~ m/%\{password\}/) ? undef : $self->{_dn_cache};
+	my $dn = (defined $cache) ? $cache->get($filter) : undef;
+	my $cached = (defined $dn) ? 1 : 0;
+	if ($cached) {
+		$self->{_log}->debug("Using cached DN '$dn' for filter '$filter'.");
+	} else {
+		$dn = $self->_searchDN($filter);
+		return 0 unless (defined $dn);
+		$cache->set($filter, $dn) if (defined $cache);
+	}
+
+	# ... and finally... try to bind directory
+	my $r = $self->_bindUser($dn, $struct->{password});
+
+	# cached DN may be stale (entry moved or removed)
+	if (! $r && $cached) {
+		my $err = $self->{error};
+		$cache->remove($filter);
+		my $fresh = $self->_searchDN($filter);
+		return 0 unless (defined $fresh);
+		$cache->set($filter, $fresh);
+		if ($fresh eq $dn) {
+			$self->{error} = $err;
+			return 0;
+		}
+		$self->{_log}->info("Cached DN '$dn' is stale, retrying bind as '$fresh'.");
+		$r = $self->_bindUser($fresh, $struct->{password});
+	}
+
+	return $r;
+}
+
+# searches for user's DN
+sub _searchDN {
+	my ($self, $filter) = @_;
+
 	# run search
 	my $r = $self->_ldapSearch($filter);
 
 	# check
 	unless (defined $r) {
 		$self->{error} = "Invalid username.";
-		return 0;
+		return undef;
 	}
 
 	# get dn
@@ -340,19 +432,38 @@ sub _authenticateSearch {
 	unless (defined $dn && length($dn) > 0) {
 		$self->{error} = "Found LDAP entry with invalid DN. How can that be?!";
 		$self->{_log}->error($self->{error});
-		return 0;
+		return undef;
 	}
 
-	# ok, create new ldap connection...
-	my $conn = $self->_ldapConnect($self->{host});
-	return 0 unless (defined $conn);
+	return $dn;
+}
 
-	# ... and finally... try to bind directory
-	return $self->_ldapBind(
-		$conn,
-		$dn,
-		$struct->{password}
-	);
+# binds as user; user bind connection is
+# kept open if connections are persistent
+sub _bindUser {
+	my ($self, $dn, $password) = @_;
+	my $conn = $self->{_bind_conn};
+	my $reused = (defined $conn) ? 1 : 0;
+
+	foreach my $try (1 .. 2) {
+		unless (defined $conn) {
+			$conn = $self->_ldapConnect($self->{host});
+			return 0 unless (defined $conn);
+		}
+
+		my $r = $self->_ldapBind($conn, $dn, $password);
+		if (! $r && $reused && $try == 1 && $CONN_ERRORS{$self->{_bind_code}}) {
+			$self->{_log}->warn("Persistent LDAP bind connection failed ($self->{error}), reconnecting.");
+			$self->{_bind_conn} = undef;
+			$conn = undef;
+			next;
+		}
+
+		$self->{_bind_conn} = ($self->{persistent_connection} && ! $CONN_ERRORS{$self->{_bind_code}}) ? $conn : undef;
+		return $r;
+	}
+
+	return 0;
 }
 
 sub _getFilter {
@@ -387,13 +498,23 @@ sub _ldapSearch {
 	return undef unless ($self->_connect());
 	$self->{_log}->debug("LDAP search filter: $filter");
 
-	my $r = $self->{_conn}->search(
+	my %opt = (
 		base => $self->{search_basedn},
 		scope => $self->{search_scope},
 		deref => $self->{search_deref},
 		timelimit => $self->{timeout},
 		filter => $filter,
 	);
+	my $r = $self->{_conn}->search(%opt);
+
+	# persistent connection closed by server?
+	if ($r->is_error() && $CONN_ERRORS{$r->code()} && $self->{persistent_connection}) {
+		$self->{_log}->warn("Persistent LDAP connection failed (" . $r->error() . "), reconnecting.");
+		$self->{_conn} = undef;
+		return undef unless ($self->_connect());
+		$r = $self->{_conn}->search(%opt);
+	}
+	$self->{_conn_used} = time() unless ($r->is_error() && $CONN_ERRORS{$r->code()});
 	
 	if ($r->is_error()) {
 		$self->{error} = "Error performing LDAP search with filter '$filter' in search base '$self->{search_basedn}': " . $r->error();
@@ -432,6 +553,7 @@ sub _ldapConnect {
 		port => $self->{port},
 		timeout => $self->{timeout},
 		version => $self->{ldap_version},
+		keepalive => ($self->{persistent_connection}) ? 1 : 0,
 		debug => $self->{debug}	
 	);
 	
@@ -551,6 +673,7 @@ sub _ldapBind {
 	}
 
 	# check for injuries
+	$self->{_bind_code} = (defined $r) ? $r->code() : -1;
 	if ($r->is_error()) {
 		$self->{error} = "Error binding LDAP server: " . $r->error();
 		$self->{_log}->debug($self->{error});
@@ -568,10 +691,10 @@ sub _connect {
 
 	# check for cached connection
 	if ($self->{persistent_connection} && defined $self->{_conn}) {
-		return 1;
-	} else {
-		$self->{_conn} = undef;
+		return 1 if ($self->_isAlive());
+		$self->{_log}->warn("Persistent LDAP connection is dead, reconnecting.");
 	}
+	$self->{_conn} = undef;
 
 	my $result = 0;
 	$self->{error} = "";
@@ -600,6 +723,7 @@ sub _connect {
 	}
 	
 	$result = 1;
+	$self->{_conn_used} = time();
 
 	outta_connect:
 	unless ($result) {
@@ -610,6 +734,29 @@ sub _connect {
 	return $result;
 }
 
+# checks idle persistent connection
+sub _isAlive {
+	my ($self) = @_;
+	return 1 if ($self->{keepalive_interval} <= 0);
+	return 1 if (time() - $self->{_conn_used} < $self->{keepalive_interval});
+
+	$self->{_log}->debug("Checking idle persistent LDAP connection.");
+	my $r = eval {
+		$self->{_conn}->search(
+			base => "",
+			scope => "base",
+			filter => "(objectClass=*)",
+			attrs => [ '1.1' ],
+			timelimit => $self->{timeout},
+		);
+	};
+	return 0 unless (defined $r);
+	return 0 if ($r->is_error() && $CONN_ERRORS{$r->code()});
+
+	$self->{_conn_used} = time();
+	return 1;
+}
+
 # disconnects from LDAP server
 sub _disconnect {
 	my ($self) = @_;
@@ -617,6 +764,10 @@ sub _disconnect {
 		$self->{_conn}->disconnect();
 		$self->{_conn} = undef;
 	}
+	if (defined $self->{_bind_conn}) {
+		$self->{_bind_conn}->disconnect();
+		$self->{_bind_conn} = undef;
+	}
 
 	return 1;
 }
@@ -668,6 +819,7 @@ Brane F. Gracnar
 
 L<Net::OpenVPN::Auth>
 L<Net::OpenVPN::AuthChain>
+L<Net::OpenVPN::LRUCache>
 L<Net::LDAP>
 L<IO::Socket::SSL>
 L<Net::SSLeay>
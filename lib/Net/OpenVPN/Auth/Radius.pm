@@ -6,7 +6,9 @@ use strict;
 use warnings;
 
 use Log::Log4perl;
-use Authen::Radius;
+
+# my modules
+use Net::OpenVPN::RadiusClient;
 
 =head1 NAME Radius
 
@@ -26,15 +28,22 @@ B<sufficient> (boolean, 0) successful authentication result is sufficient for en
 
 =head2 Module specific parameters
 
-B<host> (string, "localhost") radius server host
+B<host> (string, "localhost") radius server host; comma separated list of "host", "host:port" or "[address]:port" for multiple servers, fastest responding one is preferred
 
-B<service> (string, "") radius service
+B<service> (string, "radius") radius service (default port)
 
 B<secret> (string, "") radius secret
 
 B<use_nas_ipaddr> (boolean, 0) Set authentication client's remote ip address as NAS IP?
 
-B<timeout> (integer, 2) timeout for socket operations
+B<timeout> (integer, 2) timeout for authentication request
+
+B<retransmit> (float, 1) seconds after which unanswered request is sent again (to next server)
+
+B<require_message_authenticator> (boolean, 1) discard answers without Message-Authenticator attribute; disable for legacy servers which don't send it
+
+All requests of worker are sent from single UDP socket, see
+L<Net::OpenVPN::RadiusClient>.
 
 =cut
 sub new {
@@ -51,6 +60,7 @@ sub new {
 	##################################################
 	$self->{_name} = "Radius";
 	$self->{_log} = Log::Log4perl->get_logger(__PACKAGE__);
+	$self->{_client} = undef;
 
 	bless($self, $class);
 
@@ -69,6 +79,10 @@ sub clearParams {
 	$self->{secret} = "";
 	$self->{use_nas_ipaddr} = 0;
 	$self->{timeout} = 2;
+	$self->{retransmit} = 1;
+	$self->{require_message_authenticator} = 1;
+
+	$self->{_client} = undef;
 
 	return 1;
 }
@@ -76,31 +90,59 @@ sub clearParams {
 sub authenticate {
 	my ($self, $struct) = @_;
 	return 0 unless ($self->validateParamsStruct($struct));
-	$self->{_log}->debug("Creating radius auth object: host => '$self->{host}', secret => '$self->{secret}', service => '$self->{service}', timeout => $self->{timeout}.");
-	my $radius = Authen::Radius->new(
-		Host => $self->{host},
-		Secret => $self->{secret},
-		Service => $self->{service},
-		Timeout => $self->{timeout},
-		Debug => ($self->{_log}->is_debug() ? 1 : 0)
-	);
+	my $client = $self->_client();
 
 	# validate password
 	my $ip = ($self->{use_nas_ipaddr}) ? $struct->{untrusted_ip} : "127.0.0.1";
 	$self->{_log}->debug("Performing Radius auth with NAS ip $ip");
-	my $r = $radius->check_pwd(
+	my $r = $client->authenticate(
 		$struct->{username},
 		$struct->{password},
 		$ip
 	);
 	
 	unless ($r) {
-		$self->{error} = "Radius error: " . $radius->strerror();
-		$self->{_log}->error($self->{error});
+		$self->{error} = "Radius error: " . $client->getError();
+		if (defined $r) {
+			$self->{_log}->debug($self->{error});
+		} else {
+			$self->{_log}->error($self->{error});
+		}
 		return 0;
 	}
 	
-	return $r;
+	return 1;
+}
+
+sub warmup {
+	my ($self) = @_;
+	my $client = $self->_client();
+	unless ($client->prepare()) {
+		$self->{error} = "Radius error: " . $client->getError();
+		return 0;
+	}
+	return 1;
+}
+
+# client is created once, so that round trip times of
+# servers are remembered between requests
+sub _client {
+	my ($self) = @_;
+	return $self->{_client} if (defined $self->{_client});
+
+	my $port = getservbyname($self->{service}, 'udp');
+	$port = 1812 unless (defined $port);
+	$self->{_log}->debug("Creating radius client: host => '$self->{host}', service => '$self->{service}', timeout => $self->{timeout}, retransmit => $self->{retransmit}.");
+	$self->{_client} = Net::OpenVPN::RadiusClient->new(
+		servers => [ grep { length($_) > 0 } split(/\s*,\s*/, $self->{host}) ],
+		port => $port,
+		secret => $self->{secret},
+		timeout => $self->{timeout},
+		retransmit => $self->{retransmit},
+		require_message_authenticator => $self->{require_message_authenticator},
+	);
+
+	return $self->{_client};
 }
 
 =head1 AUTHOR
@@ -113,7 +155,7 @@ Brane F. Gracnar
 
 L<Net::OpenVPN::Auth>
 L<Net::OpenVPN::AuthChain>
-L<Authen::Radius>
+L<Net::OpenVPN::RadiusClient>
 
 =cut
 
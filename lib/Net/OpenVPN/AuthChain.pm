@@ -3,7 +3,10 @@ package Net::OpenVPN::AuthChain;
 use strict;
 use warnings;
 
+use POSIX qw(_exit);
+use IO::Select;
 use Log::Log4perl;
+use Time::HiRes qw(time);
 
 ##################################################
 #             OBJECT CONSTRUCTOR                 #
@@ -19,10 +22,17 @@ sub new {
 	##################################################
 	$self->{error} = "";
 
+	# run consecutive sufficient modules at the same time
+	$self->{parallel} = 0;
+
+	# maximum lifetime (seconds) of parallel branch process (0: unlimited)
+	$self->{branch_timeout} = 0;
+
 	##################################################
 	#              PRIVATE VARS                      #
 	##################################################
 	$self->{_log} = Log::Log4perl->get_logger(__PACKAGE__);
+	$self->{_timing} = [];
 
 	bless($self, $class);
 
@@ -175,14 +185,34 @@ sub getModuleIndex {
 	return -1;
 }
 
+=head2 authenticate ($struct)
+
+Runs authentication modules in chain order. Successful B<sufficient>
+module returns success immediately, failed B<required> module returns
+failure immediately, successful last module returns success.
+
+If B<parallel> is set, every run of two or more consecutive sufficient
+(and not required) modules is evaluated at the same time, each module in
+its own forked process. First successful module decides the verdict and
+the remaining branches are killed; if all of them fail, chain continues
+with the next module. Verdicts are the same as in sequential mode, since
+required modules are never run in parallel. Branches never use persistent
+backend connections (B<persistent_connection>) of the worker: every branch
+opens its own connections, which are closed when branch exits.
+
+Latency of every module and module which decided the verdict are logged.
+
+=cut
 sub authenticate {
 	my ($self, $struct) = @_;
 	$self->{_log}->debug("Startup.");
 
 	my $i = 0;
 	my $num = $#{$self->{_chain}} + 1;
-	foreach my $name (@{$self->{_chain}}) {
-		$i++;
+	my @timing = ();
+	$self->{_timing} = \ @timing;
+	while ($i < $num) {
+		my $name = $self->{_chain}->[$i];
 		$self->{_log}->debug("Checking module '$name'.");
 		unless (exists($self->{_mods}->{$name})) {
 			$self->{error} = "Invalid module name. This should never happen.";
@@ -195,24 +225,44 @@ sub authenticate {
 		# required module cannot be sufficient
 		$s = 0 if ($r);
 
+		# speculatively run consecutive sufficient modules
+		if ($self->{parallel} && $s) {
+			my @group = $self->_sufficientGroup($i);
+			if (@group > 1) {
+				$i += scalar(@group);
+				my $winner = $self->_authenticateParallel($struct, \@group, \@timing);
+				if (defined $winner) {
+					$self->_logVerdict($struct, 1, $winner, \@timing);
+					return 1;
+				}
+				next;
+			}
+		}
+		$i++;
+
 		# perform authentication
+		my $started = time();
 		my $auth_res = $self->{_mods}->{$name}->authenticate($struct);
+		push(@timing, [ $name, time() - $started, ($auth_res) ? 'success' : 'failure' ]);
 		
 		$self->{_log}->debug("Module '$name' authentication result: $auth_res");
 
 		if ($auth_res) {
 			if ($s) {
 				$self->{_log}->debug("Module '$name' is sufficient and returned successfull authentication result. Assuming that global authentication succeeded, returning success.");
+				$self->_logVerdict($struct, 1, $name, \@timing);
 				return 1;
 			}
 			elsif ($i >= $num) {
 				$self->{_log}->debug("Module '$name' is marked as required, returned successfull authentication response and is last module in authentication chain. Assuming that global authentication succeeded, returning success.");
+				$self->_logVerdict($struct, 1, $name, \@timing);
 				return 1;				
 			}
 		}
 
 		if ($r && ! $auth_res) {
 			$self->{_log}->debug("Module '$name' is required chain and returned unsuccessfull authentication result. Assuming that global authentication failed, returning error.");
+			$self->_logVerdict($struct, 0, $name, \@timing);
 			return 0;
 		}
 	}
@@ -220,11 +270,166 @@ sub authenticate {
 	if ($i < 1) {
 		$self->{error} = "No authentication modules are set.";
 		$self->{_log}->error($self->{error});
+	} else {
+		$self->_logVerdict($struct, 0, undef, \@timing);
 	}
 
 	return 0;
 }
 
+=head2 getTiming ()
+
+Returns list of modules run by last L<authenticate> call, in order of
+completion. Every element is array reference of module name, run time
+in seconds and outcome (B<success>, B<failure> or B<cancelled> for
+parallel branches killed after other module succeeded).
+
+=cut
+sub getTiming {
+	my ($self) = @_;
+	return @{$self->{_timing}};
+}
+
+=head2 warmup ()
+
+Prepares every module for serving requests (opens persistent backend
+connections), so that first authentication in new worker doesn't pay for
+it. Failures are only logged, module retries on first authentication.
+Modules run in parallel branches are skipped, since branches can't share
+connections. Returns number of modules which failed.
+
+=cut
+sub warmup {
+	my ($self) = @_;
+	my $failed = 0;
+	my %parallel = ();
+	if ($self->{parallel}) {
+		for my $i (0 .. $#{$self->{_chain}}) {
+			my @group = $self->_sufficientGroup($i);
+			next unless (@group > 1);
+			$parallel{$_} = 1 foreach (@group);
+		}
+	}
+	foreach my $name (@{$self->{_chain}}) {
+		next if ($parallel{$name});
+		next if ($self->{_mods}->{$name}->warmup());
+		$self->{_log}->warn("Unable to warm up module '$name': " . $self->{_mods}->{$name}->getError());
+		$failed++;
+	}
+	return $failed;
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+# returns names of consecutive sufficient, not required
+# modules starting at specified chain index
+sub _sufficientGroup {
+	my ($self, $i) = @_;
+	my @group = ();
+	while ($i <= $#{$self->{_chain}}) {
+		my $obj = $self->{_mods}->{$self->{_chain}->[$i]};
+		last unless (defined $obj && $obj->isSufficient() && ! $obj->isRequired());
+		push(@group, $self->{_chain}->[$i]);
+		$i++;
+	}
+	return @group;
+}
+
+# runs modules in forked processes; returns name of first module
+# which returned successful authentication result or undef
+sub _authenticateParallel {
+	my ($self, $struct, $names, $timing) = @_;
+	local $SIG{CHLD} = 'DEFAULT';
+
+	$self->{_log}->debug("Running modules " . join(", ", map { "'$_'" } @{$names}) . " in parallel.");
+	my $started = time();
+	my $sel = IO::Select->new();
+	my %branch = ();
+	my %result = ();
+	my $winner = undef;
+
+	foreach my $name (@{$names}) {
+		my ($rd, $wr);
+		my $pid = (pipe($rd, $wr)) ? fork() : undef;
+		if (! defined $pid) {
+			# run module here if we can't fork
+			$self->{_log}->warn("Unable to start parallel branch for module '$name': $!; running it sequentially.");
+			my $t = time();
+			$result{$name} = $self->{_mods}->{$name}->authenticate($struct) ? 1 : 0;
+			$self->{error} = $self->{_mods}->{$name}->getError() unless ($result{$name});
+			push(@{$timing}, [ $name, time() - $t, ($result{$name}) ? 'success' : 'failure' ]);
+			if ($result{$name}) {
+				$winner = $name;
+				last;
+			}
+			next;
+		}
+		elsif ($pid == 0) {
+			# branch process: report result and exit without
+			# running destructors of inherited objects
+			close($rd);
+			$SIG{ALRM} = 'DEFAULT';
+			alarm($self->{branch_timeout}) if ($self->{branch_timeout} > 0);
+			my $obj = $self->{_mods}->{$name};
+			$obj->forked();
+			my $res = eval { $obj->authenticate($struct) } ? 1 : 0;
+			my $err = ($@) ? $@ : $obj->getError();
+			$err = "" unless (defined $err);
+			syswrite($wr, $res . $err);
+			POSIX::_exit(0);
+		}
+
+		close($wr);
+		$branch{fileno($rd)} = { pid => $pid, name => $name, fh => $rd };
+		$sel->add($rd);
+	}
+
+	# collect results until first success
+	while (! defined $winner && $sel->count() > 0) {
+		foreach my $fh ($sel->can_read()) {
+			my $b = delete($branch{fileno($fh)});
+			$sel->remove($fh);
+			my $buf = '';
+			sysread($fh, $buf, 4096);
+			close($fh);
+			waitpid($b->{pid}, 0);
+
+			my $name = $b->{name};
+			$result{$name} = (length($buf) > 0 && substr($buf, 0, 1) eq '1') ? 1 : 0;
+			push(@{$timing}, [ $name, time() - $started, ($result{$name}) ? 'success' : 'failure' ]);
+			$self->{_log}->debug("Module '$name' authentication result: $result{$name}");
+			if ($result{$name}) {
+				$winner = $name unless (defined $winner);
+			} else {
+				$self->{error} = (length($buf) > 1) ? substr($buf, 1) : "Parallel branch of module '$name' exited without result.";
+			}
+		}
+	}
+
+	# cancel slower branches
+	foreach my $b (values %branch) {
+		kill('KILL', $b->{pid});
+		waitpid($b->{pid}, 0);
+		close($b->{fh});
+		push(@{$timing}, [ $b->{name}, time() - $started, 'cancelled' ]);
+	}
+
+	return $winner;
+}
+
+sub _logVerdict {
+	my ($self, $struct, $ok, $name, $timing) = @_;
+	my $user = (defined $struct->{username}) ? $struct->{username} : '';
+	$self->{_log}->info(
+		"Authentication " . (($ok) ? "succeeded" : "failed") .
+		" for user '$user'" .
+		((defined $name) ? ", decided by module '$name'" : "") .
+		" (" . join(", ", map { ($_->[2] eq 'cancelled') ? "$_->[0]=cancelled" : sprintf("%s=%.1fms", $_->[0], $_->[1] * 1000) } @{$timing}) . ")."
+	);
+}
+
 =head1 AUTHOR
 
 Brane F. Gracnar
@@ -7,17 +7,40 @@ package Net::OpenVPN::AuthDaemon;
 use strict;
 use warnings;
 
+use POSIX qw(setsid WNOHANG);
+use Fcntl qw(F_GETFD F_SETFD FD_CLOEXEC);
+use Socket;
+use IO::Socket;
+use IO::Socket::UNIX;
+use IO::Socket::INET;
 use Log::Log4perl;
 use Net::Server::PreFork;
+use File::Spec;
 use File::Basename qw(basename);
+use Time::HiRes qw(time);
 
 use vars qw($MYNAME);
 
 use Net::OpenVPN::AuthChain;
+use Net::OpenVPN::SingleFlight;
+use Net::OpenVPN::Throttle;
+use Net::OpenVPN::Metrics;
+use Net::OpenVPN::Capture qw(FLAG_KEEPALIVE FLAG_PROTO_V2 FLAG_NOT_RUN);
+use Net::OpenVPN::Protocol qw(:all);
 
 use constant MAXLINES => 20;
 use constant MAX_LINE_LENGTH => 1024;
 
+# response status => metrics label
+my %STATUS_NAMES = (
+	STATUS_OK() => 'ok',
+	STATUS_DENIED() => 'denied',
+	STATUS_TIMEOUT() => 'timeout',
+	STATUS_INVALID() => 'invalid',
+	STATUS_ERROR() => 'error',
+	STATUS_OVERLOADED() => 'overloaded',
+);
+
 ##################################################
 #             OBJECT CONSTRUCTOR                 #
 ##################################################
@@ -33,11 +56,69 @@ sub new {
 	$self->{auth_timeout} = 5;
 	$self->{umask} = umask();
 
+	# maximum idle time between requests on
+	# keep-alive client connection (seconds)
+	$self->{keepalive_timeout} = 30;
+
+	# maximum number of requests served on single
+	# keep-alive client connection
+	$self->{keepalive_max_requests} = 1000;
+
+	# requests received later than client's deadline
+	# plus this many milliseconds (clock skew allowance)
+	# are dropped without authentication; negative value
+	# disables deadline checks
+	$self->{deadline_slack} = 1000;
+
+	# answer "NO overloaded" if this many requests are
+	# waiting for authentication worker (0: unlimited)
+	$self->{max_queue} = 0;
+
+	# concurrent requests with identical credentials wait
+	# up to this many seconds for verdict of the one being
+	# authenticated instead of querying backends (0: disabled)
+	$self->{coalesce_wait} = 0;
+
+	# brute-force throttling: failed authentications per
+	# minute per client address and per username (0:
+	# unlimited), bucket sizes and lockout times; see
+	# Net::OpenVPN::Throttle
+	$self->{throttle_ip_rate} = 0;
+	$self->{throttle_ip_burst} = 10;
+	$self->{throttle_user_rate} = 0;
+	$self->{throttle_user_burst} = 5;
+	$self->{throttle_backoff} = 1;
+	$self->{throttle_max_backoff} = 300;
+
+	# serve metrics in Prometheus text format over http
+	# on this address (see parseListen; empty: disabled)
+	$self->{metrics_listen} = "";
+
+	# names of authentication modules, which might be
+	# added to chain on reload; their metrics series
+	# are declared at startup together with current
+	# chain's modules
+	$self->{metrics_modules} = [];
+
+	# append record of every answered request to this
+	# file (see Net::OpenVPN::Capture; empty: disabled)
+	$self->{capture_file} = "";
+
 	##################################################
 	#              PRIVATE VARS                      #
 	##################################################
 	$self->{_log} = Log::Log4perl->get_logger(__PACKAGE__);
 	$self->{_myname} = "AuthDaemon";
+	$self->{_flight} = undef;
+	$self->{_throttle} = undef;
+	$self->{_metrics} = undef;
+	$self->{_metrics_pid} = 0;
+	$self->{_capture} = undef;
+	$self->{_request} = undef;		# current request for capture
+	$self->{_received} = 0;			# receive time of current request
+	$self->{_reload} = undef;		# code building new chain on SIGHUP
+	$self->{_busy} = 0;				# worker is serving request
+	$self->{_retire} = 0;			# worker exits after current request
 
 	bless($self, $class);
 	return $self;
@@ -67,14 +148,473 @@ sub post_bind_hook {
 	open(STDIN, File::Spec->devnull());
 }
 
+# runs in parent after privileges have been dropped
+sub pre_loop_hook {
+	my ($self) = @_;
+	$self->_flightCreate();
+	$self->_throttleCreate();
+	$self->_metricsCreate();
+	$self->_captureCreate();
+}
+
+sub pre_server_close_hook {
+	my ($self) = @_;
+	$self->_captureDestroy();
+	$self->_metricsDestroy();
+	$self->_flightDestroy();
+	$self->_throttleDestroy();
+}
+
+# runs in parent on SIGHUP: replaces authentication chain
+# and lets children finish their requests and exit, instead
+# of Net::Server's default re-exec of whole server
+sub sig_hup {
+	my ($self) = @_;
+	return unless ($self->reload());
+	my @children = keys %{$self->{server}->{children} || {}};
+	$self->{_log}->info("Retiring " . scalar(@children) . " worker(s).");
+	kill('HUP', @children);
+}
+
+# runs in every new child before it accepts connections
+sub child_init_hook {
+	my ($self) = @_;
+	$SIG{HUP} = sub {
+		$self->{_retire} = 1;
+		$self->{server}->{done} = 1;
+		exit 0 unless ($self->{_busy});
+	};
+	$self->{_chain}->warmup() if (defined $self->{_chain});
+}
+
+=head2 parseListen ($spec)
+
+Parses listening address specification: B<host:port>, B<[ipv6]:port>,
+B<*:port>, B<port> or absolute path to UNIX domain socket. Returns
+list of (proto, host, port) on success, otherwise empty list.
+
+=cut
+sub parseListen {
+	my ($self, $spec) = @_;
+	$self->{error} = "";
+
+	return ('unix', $spec, $spec) if (defined $spec && $spec =~ m/^\//);
+	if (defined $spec && $spec =~ m/^(?:\[([0-9a-fA-F:.]+)\]:|([^:\[\]]+):)?(\d+)$/) {
+		my $host = defined($1) ? $1 : defined($2) ? $2 : '*';
+		return ('tcp', $host, $3);
+	}
+
+	$self->{error} = "Invalid listening address '" . (defined $spec ? $spec : '') . "'.";
+	return ();
+}
+
+=head2 runFrontend (%args)
+
+Runs authentication server behind native event-loop front-end
+(B<openvpn_authd_frontend>) instead of Net::Server::PreFork. Front-end
+accepts and reads client connections and dispatches complete requests
+to fixed pool of authentication workers over UNIX domain socket pairs,
+so open client connections don't occupy perl processes.
+
+Arguments: B<frontend> (path to front-end binary), B<listen> (array
+reference of listening addresses, see L<parseListen>), B<reuseport>,
+B<workers>, B<max_requests>, B<user>, B<group>, B<chroot>, B<pid_file>,
+B<background>, B<cidr_allow>, B<cidr_deny> (array references),
+B<tls_cert>, B<tls_key>, B<tls_ca>, B<tls_session_cache>,
+B<tls_session_timeout>.
+
+If B<reuseport> is greater than 1, every tcp address is bound by that
+many SO_REUSEPORT sockets and as many front-end processes are started,
+each with its own share of listening sockets and workers; kernel then
+spreads incoming connections across them.
+
+If B<tls_cert> is set, front-ends serve tcp clients over TLS. Their
+session ticket keys and cache of B<tls_session_cache> sessions live in
+anonymous temporary file mapped by all front-end processes, so clients
+resume TLS sessions no matter which front-end accepts the connection.
+
+Returns 0 if server can't be started (see L<getError>), otherwise 1
+after server shutdown.
+
+=cut
+sub runFrontend {
+	my ($self, %args) = @_;
+	$self->{error} = "";
+	my $workers = ($args{workers} && $args{workers} > 0) ? $args{workers} : 1;
+	my $shards = ($args{reuseport} && $args{reuseport} > 1) ? $args{reuseport} : 1;
+	$shards = $workers if ($shards > $workers);
+
+	unless (defined $args{frontend} && -x $args{frontend}) {
+		$self->{error} = "Front-end program '" . (defined $args{frontend} ? $args{frontend} : '') . "' does not exist or is not executable.";
+		return 0;
+	}
+
+	eval { require IO::Socket::IP; };
+	if ($@) {
+		$self->{error} = "Front-end requires IO::Socket::IP module: $@";
+		return 0;
+	}
+
+	# listening sockets of every front-end process
+	my @listen = map { [] } (1 .. $shards);
+	foreach my $spec (@{$args{listen}}) {
+		my ($proto, $host, $port) = $self->parseListen($spec);
+		return 0 unless (defined $proto);
+
+		if ($proto eq 'unix') {
+			unlink($host);
+			my $sock = IO::Socket::UNIX->new(
+				Local => $host,
+				Type => SOCK_STREAM,
+				Listen => SOMAXCONN,
+			);
+			unless (defined $sock) {
+				$self->{error} = "Unable to listen on $host: $!";
+				return 0;
+			}
+			# UNIX domain socket can't be sharded; front-ends share it
+			push(@{$_}, $sock) foreach (@listen);
+			next;
+		}
+
+		for my $i (0 .. $shards - 1) {
+			my $sock = IO::Socket::IP->new(
+				LocalHost => ($host eq '*') ? '0.0.0.0' : $host,
+				LocalPort => $port,
+				Proto => 'tcp',
+				ReuseAddr => 1,
+				($shards > 1) ? (ReusePort => 1) : (),
+				Listen => SOMAXCONN,
+			);
+			unless (defined $sock) {
+				$self->{error} = "Unable to listen on $spec: $!";
+				return 0;
+			}
+			push(@{$listen[$i]}, $sock);
+		}
+	}
+	unless (@{$listen[0]}) {
+		$self->{error} = "No listening addresses.";
+		return 0;
+	}
+
+	# TLS session cache shared by front-ends
+	my $tls = (defined $args{tls_cert} && length($args{tls_cert}) > 0);
+	my $tls_shm = undef;
+	if ($tls) {
+		foreach my $file (grep { defined $_ && length($_) > 0 } @args{qw(tls_cert tls_key tls_ca)}) {
+			next if (-r $file);
+			$self->{error} = "Unable to read TLS file '$file'.";
+			return 0;
+		}
+		if ($args{tls_session_cache} && $args{tls_session_cache} > 0) {
+			unless (open($tls_shm, '+>', undef)) {
+				$self->{error} = "Unable to create TLS session cache file: $!";
+				return 0;
+			}
+		}
+	}
+
+	if ($args{background}) {
+		my $pid = fork();
+		unless (defined $pid) {
+			$self->{error} = "Unable to fork: $!";
+			return 0;
+		}
+		exit 0 if ($pid);
+		setsid();
+		open(STDOUT, '>', File::Spec->devnull());
+		open(STDERR, '>', File::Spec->devnull());
+	}
+	$self->post_bind_hook();
+
+	# worker socket pairs; master keeps worker ends open,
+	# so that replacement workers can inherit them.
+	my @pairs = ();
+	for (1 .. $workers) {
+		my ($front, $back) = IO::Socket->socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC);
+		unless (defined $back) {
+			$self->{error} = "Unable to create worker socket pair: $!";
+			return 0;
+		}
+		push(@pairs, [ $front, $back ]);
+	}
+
+	if (defined $args{pid_file}) {
+		my $fd = IO::File->new($args{pid_file}, 'w');
+		if (defined $fd) {
+			print $fd $$, "\n";
+			$fd->close();
+		} else {
+			$self->{_log}->warn("Unable to write pid file '$args{pid_file}': $!");
+		}
+	}
+
+	# start front-ends; they must be executed before entering chroot jail
+	my %frontends = ();
+	for my $shard (0 .. $shards - 1) {
+		my @own = map { $pairs[$_]->[0] } grep { $_ % $shards == $shard } (0 .. $#pairs);
+		my $pid = fork();
+		unless (defined $pid) {
+			$self->{error} = "Unable to fork: $!";
+			kill('TERM', keys %frontends);
+			return 0;
+		}
+		if ($pid == 0) {
+			foreach my $fh (@{$listen[$shard]}, @own, (defined $tls_shm) ? $tls_shm : ()) {
+				fcntl($fh, F_SETFD, fcntl($fh, F_GETFD, 0) & ~FD_CLOEXEC);
+			}
+			$_->[1]->close() foreach (@pairs);
+			$self->_setIds($args{user}, $args{group});
+			my @cmd = (
+				$args{frontend},
+				'-l', join(',', map { fileno($_) } @{$listen[$shard]}),
+				'-w', join(',', map { fileno($_) } @own),
+				'-t', $self->{auth_timeout},
+				'-k', $self->{keepalive_timeout},
+				'-n', $self->{_myname},
+				'-q', $self->{max_queue},
+				'-s', $self->{deadline_slack},
+			);
+			push(@cmd, '-A', join(',', @{$args{cidr_allow}})) if (ref($args{cidr_allow}) && @{$args{cidr_allow}});
+			push(@cmd, '-X', join(',', @{$args{cidr_deny}})) if (ref($args{cidr_deny}) && @{$args{cidr_deny}});
+			if ($tls) {
+				push(@cmd, '-T', $args{tls_cert});
+				push(@cmd, '-K', $args{tls_key}) if (defined $args{tls_key} && length($args{tls_key}) > 0);
+				push(@cmd, '-C', $args{tls_ca}) if (defined $args{tls_ca} && length($args{tls_ca}) > 0);
+				push(@cmd, '-M', fileno($tls_shm), '-N', $args{tls_session_cache}) if (defined $tls_shm);
+				push(@cmd, '-E', $args{tls_session_timeout}) if ($args{tls_session_timeout});
+			}
+			exec(@cmd) or do {
+				$self->{_log}->error("Unable to execute front-end '$args{frontend}': $!");
+				POSIX::_exit(1);
+			};
+		}
+		$frontends{$pid} = $shard;
+	}
+
+	# front-ends own listening sockets and their socket pair ends now
+	my %seen = ();
+	foreach my $sock (map { @{$_} } @listen) {
+		$sock->close() unless ($seen{$sock}++);
+	}
+	$_->[0]->close() foreach (@pairs);
+	close($tls_shm) if (defined $tls_shm);
+	$self->{_pairs} = [ map { $_->[1] } @pairs ];
+
+	if (defined $args{chroot}) {
+		unless (chroot($args{chroot}) && chdir('/')) {
+			$self->{_log}->error("Unable to chroot to '$args{chroot}': $!");
+			kill('TERM', keys %frontends);
+			return 0;
+		}
+	}
+	$self->_setIds($args{user}, $args{group});
+	$self->_flightCreate();
+	$self->_throttleCreate();
+	$self->_metricsCreate();
+	$self->_captureCreate();
+
+	$self->{_log}->info("Started $shards front-end(s) '$args{frontend}' listening on " . join(", ", @{$args{listen}}) . (($tls) ? " (TLS)" : "") . " with $workers authentication worker(s).");
+
+	my $stop = 0;
+	my $reload = 0;
+	local $SIG{TERM} = sub { $stop = 1; };
+	local $SIG{INT} = sub { $stop = 1; };
+	local $SIG{HUP} = sub { $reload = 1; };
+	local $SIG{PIPE} = 'IGNORE';
+
+	my %running = ();
+	my @started = ();
+	for my $i (0 .. $#pairs) {
+		my $pid = $self->_spawnWorker($i, $args{max_requests});
+		$running{$pid} = $i if ($pid);
+		$started[$i] = time();
+	}
+
+	# supervise front-ends and workers
+	while (! $stop) {
+		# replace chain, retire workers; their replacements
+		# are spawned as soon as they exit
+		if ($reload) {
+			$reload = 0;
+			if ($self->reload()) {
+				$self->{_log}->info("Retiring " . scalar(keys %running) . " worker(s).");
+				$started[$_] = 0 foreach (values %running);
+				kill('HUP', keys %running);
+			}
+		}
+
+		# perl restarts interrupted waitpid(2), sleep(3) is interruptible
+		my $pid = waitpid(-1, WNOHANG);
+		last if ($pid < 0);
+		if ($pid == 0) {
+			sleep(1);
+			next;
+		}
+
+		if (exists($frontends{$pid})) {
+			$self->{_log}->error("Front-end $frontends{$pid} exited with status " . ($? >> 8) . ", shutting down.");
+			delete($frontends{$pid});
+			last;
+		}
+		next unless (exists($running{$pid}));
+		my $i = delete($running{$pid});
+
+		# don't respawn broken workers in tight loop
+		sleep(1) if (time() - $started[$i] < 1);
+		$started[$i] = time();
+		my $new = $self->_spawnWorker($i, $args{max_requests});
+		$running{$new} = $i if ($new);
+	}
+
+	$self->{_log}->info("Shutting down.");
+	$self->_captureDestroy();
+	$self->_metricsDestroy();
+	kill('TERM', keys %frontends, keys %running);
+	while (waitpid(-1, 0) > 0) {}
+	$self->_flightDestroy();
+	$self->_throttleDestroy();
+	unlink($args{pid_file}) if (defined $args{pid_file});
+
+	return 1;
+}
+
 sub process_request {
 	my ($self) = @_;
-	my $params = undef;
-	my $result_str = "NO Invalid credentials.";
+	my $num = 0;
+
+	$self->{_busy} = 1;
+
+	# binary protocol v2 or text protocol?
+	$self->{_proto} = Net::OpenVPN::Protocol->new($self->{server}->{client});
+	$self->{_v2} = $self->{_proto}->isFrameStart();
+
+	# Clients that send keepalive=1 may issue multiple requests
+	# over single connection; each request can be tagged with
+	# id=<number>, which is then prepended to response line.
+	while (1) {
+		my $struct = undef;
+		if ($num > 0) {
+			# wait for next request on keep-alive connection;
+			# retiring worker may exit meanwhile
+			$self->{_busy} = 0;
+			eval {
+				local $SIG{ALRM} = sub { die "idle timeout\n"; };
+				alarm($self->{keepalive_timeout});
+				$struct = $self->_readRequest();
+				alarm(0);
+			};
+			alarm(0);
+			if ($@) {
+				$self->{_log}->debug("Keep-alive connection idle for $self->{keepalive_timeout} second(s), closing.");
+				last;
+			}
+			last unless (defined $struct);
+			$self->{_busy} = 1;
+		}
+		last unless ($self->_processOne($struct));
+		$num++;
+		last if ($num >= $self->{keepalive_max_requests});
+		last if ($self->{_retire});
+	}
+
+	# ... and shutdown client's socket...
+	$self->_cleanup();
+	$self->{_busy} = 0;
+
+	return 1;
+}
+
+# forks authentication worker serving front-end
+# over i-th socket pair; returns worker's pid
+sub _spawnWorker {
+	my ($self, $i, $max_requests) = @_;
+	my $pid = fork();
+	unless (defined $pid) {
+		$self->{_log}->error("Unable to fork authentication worker: $!");
+		return 0;
+	}
+	return $pid if ($pid);
+
+	$SIG{TERM} = 'DEFAULT';
+	$SIG{INT} = 'DEFAULT';
+	$SIG{HUP} = sub { $self->{_retire} = 1; };
+	my $fh = $self->{_pairs}->[$i];
+	for my $j (0 .. $#{$self->{_pairs}}) {
+		$self->{_pairs}->[$j]->close() unless ($j == $i);
+	}
+
+	# front-end sends protocol v2 requests tagged with request id
+	$self->{_worker} = 1;
+	$self->{server}->{client} = $fh;
+	$self->{_proto} = Net::OpenVPN::Protocol->new($fh);
+	$self->{_v2} = 1;
+	$self->{_chain}->warmup() if (defined $self->{_chain});
+
+	# front-end sends next request only after response, so retiring
+	# worker exits while waiting and request stays in socket buffer
+	my $rin = '';
+	vec($rin, fileno($fh), 1) = 1;
+	my $num = 0;
+	while (! $max_requests || $num < $max_requests) {
+		until ($self->{_retire}) {
+			last if (select(my $rout = $rin, undef, undef, undef) > 0);
+		}
+		last if ($self->{_retire});
+		my $struct = $self->_readRequest();
+		last unless (defined $struct);
+		$self->_processOne($struct);
+		$num++;
+	}
+
+	POSIX::_exit(0);
+}
+
+# changes group and user id
+sub _setIds {
+	my ($self, $user, $group) = @_;
+
+	if (defined $group && length($group)) {
+		my $gid = ($group =~ m/^\d+$/) ? $group : getgrnam($group);
+		unless (defined $gid) {
+			$self->{_log}->error("Unknown group '$group'.");
+			POSIX::_exit(1);
+		}
+		$) = "$gid $gid";
+		$( = $gid;
+		# $( and $) list supplementary groups after the current one
+		unless ((split(/\s+/, $)))[0] == $gid && (split(/\s+/, $())[0] == $gid) {
+			$self->{_log}->error("Unable to change group to '$group': $!");
+			POSIX::_exit(1);
+		}
+	}
+	if (defined $user && length($user)) {
+		my $uid = ($user =~ m/^\d+$/) ? $user : getpwnam($user);
+		unless (defined $uid) {
+			$self->{_log}->error("Unknown user '$user'.");
+			POSIX::_exit(1);
+		}
+		POSIX::setuid($uid);
+		unless ($< == $uid && $> == $uid) {
+			$self->{_log}->error("Unable to change user to '$user': $!");
+			POSIX::_exit(1);
+		}
+	}
+
+	return 1;
+}
+
+# processes single authentication request; returns 1
+# if client connection should be kept open for next request
+sub _processOne {
+	my ($self, $struct) = @_;
+	my $first = (defined $struct) ? 0 : 1;
+	my $id = undef;
 	
 	# set up signal handler
 	local $SIG{ALRM} = sub {
-		print {$self->{server}->{client}} "NO Authentication timed out.\n";
+		$self->_writeResponse($id, STATUS_TIMEOUT, "Authentication timed out.");
 		$self->{_log}->warn("Authentication timed out.");
 		$self->_cleanup();
 		exit 0;
@@ -84,12 +624,92 @@ sub process_request {
 	alarm($self->{auth_timeout});
 	
 	# read client data
-	my $struct = $self->readStruct();
+	$struct = $self->_readRequest() unless (defined $struct);
+
+	# client closed keep-alive connection?
+	unless (defined $struct) {
+		alarm(0);
+		return 0 unless ($first && ! $self->{_v2});
+		$struct = {};
+		$self->resetStruct($struct);
+	}
+
+	$self->{_received} = time();
+	$self->{_metrics}->setWorkerState(1) if (defined $self->{_metrics});
+
+	# invalid protocol v2 request?
+	unless (ref($struct)) {
+		alarm(0);
+		$self->_writeResponse(undef, STATUS_INVALID, $struct);
+		return 0;
+	}
+
+	# strip protocol fields
+	$id = delete($struct->{id});
+	$id = undef if (defined $id && $id !~ m/^\d+$/);
+	my $keepalive = delete($struct->{keepalive});
+	my $deadline = delete($struct->{deadline});
+	$self->{_request} = { struct => $struct, keepalive => $keepalive, ran => 0 } if (defined $self->{_capture});
+
+	# client has already given up?
+	if (defined $deadline && $deadline =~ m/^\d+$/ && $self->{deadline_slack} >= 0) {
+		my $late = int(time() * 1000) - $deadline - $self->{deadline_slack};
+		if ($late > 0) {
+			alarm(0);
+			$self->{_log}->warn("Dropping request for user '" . $struct->{username} . "': deadline expired " . ($late + $self->{deadline_slack}) . " ms ago.");
+			$self->_writeResponse($id, STATUS_TIMEOUT, "Request deadline expired.");
+			return ($keepalive) ? 1 : 0;
+		}
+	}
+
+	# shed load while connections pile up in listen queue
+	# (front-end applies queue depth limit by itself)
+	if ($self->{max_queue} > 0 && ! $self->{_worker}) {
+		my $depth = $self->_queueDepth();
+		if ($depth >= $self->{max_queue}) {
+			alarm(0);
+			$self->{_log}->warn("Rejecting request for user '" . $struct->{username} . "': $depth connection(s) waiting in listen queue (max $self->{max_queue}).");
+			$self->_writeResponse($id, STATUS_OVERLOADED, "overloaded");
+			return ($keepalive) ? 1 : 0;
+		}
+	}
+
+	# too many failed authentications?
+	if (defined $self->{_throttle}) {
+		my ($reason, $new) = $self->{_throttle}->check($struct);
+		if (defined $reason) {
+			alarm(0);
+			my $msg = "Rejecting request for user '" . $struct->{username} . "': $reason.";
+			if ($new) {
+				$self->{_log}->warn($msg);
+			} else {
+				$self->{_log}->debug($msg);
+			}
+			$self->_writeResponse($id, STATUS_DENIED, "Too many failed authentications.");
+			return ($keepalive) ? 1 : 0;
+		}
+	}
 
 	# authenticate
-	my $r = $self->{_chain}->authenticate($struct);
+	my $started = time();
+	my $status = STATUS_DENIED;
+	my $msg = "Invalid credentials.";
+	my $ran = 0;
+	my $auth = sub {
+		$ran = 1;
+		$self->{_request}->{ran} = 1 if (defined $self->{_request});
+		return $self->{_chain}->authenticate($struct);
+	};
+	my $r = (defined $self->{_flight}) ? $self->{_flight}->run($struct, $auth) : $auth->();
+	$self->{_throttle}->update($struct, $r) if (defined $self->{_throttle});
+	if ($ran && defined $self->{_metrics}) {
+		foreach my $t ($self->{_chain}->getTiming()) {
+			$self->{_metrics}->observe('module_duration_seconds', { module => $t->[0], outcome => $t->[2] }, $t->[1]);
+		}
+	}
 	if ($r) {
-		$result_str = "OK Valid credentials.";
+		$status = STATUS_OK;
+		$msg = "Valid credentials.";
 		$self->{_log}->info("Successfull authentication for user '" . $struct->{username} . "'.");
 	} else {
 		$self->{_log}->info("Unsuccessful authentication for user '" . $struct->{username}. "'.");
@@ -99,10 +719,324 @@ sub process_request {
 	alarm(0);
 
 	# write response back to client...
-	print {$self->{server}->{client}} $result_str, "\n";
+	$self->_writeResponse($id, $status, $msg, time() - $started);
 
-	# ... and shutdown client's socket...
-	$self->_cleanup();
+	return ($keepalive) ? 1 : 0;
+}
+
+# creates table of in-flight authentications shared by workers
+sub _flightCreate {
+	my ($self) = @_;
+	return 1 unless ($self->{coalesce_wait} > 0);
+
+	my $flight = Net::OpenVPN::SingleFlight->new(wait => $self->{coalesce_wait});
+	unless ($flight->create()) {
+		$self->{_log}->warn("Request coalescing disabled: " . $flight->getError());
+		return 0;
+	}
+	$self->{_flight} = $flight;
+	return 1;
+}
+
+sub _flightDestroy {
+	my ($self) = @_;
+	return 1 unless (defined $self->{_flight});
+	$self->{_flight}->destroy();
+	$self->{_flight} = undef;
+	return 1;
+}
+
+# creates brute-force throttling tables shared by workers
+sub _throttleCreate {
+	my ($self) = @_;
+	my $throttle = Net::OpenVPN::Throttle->new(
+		map { $_ => $self->{'throttle_' . $_} } qw(ip_rate ip_burst user_rate user_burst backoff max_backoff)
+	);
+	return 1 unless ($throttle->isEnabled());
+
+	unless ($throttle->create()) {
+		$self->{_log}->warn("Brute-force throttling disabled: " . $throttle->getError());
+		return 0;
+	}
+	$self->{_throttle} = $throttle;
+	return 1;
+}
+
+sub _throttleDestroy {
+	my ($self) = @_;
+	return 1 unless (defined $self->{_throttle});
+
+	my $s = $self->{_throttle}->getStats();
+	$self->{_log}->info("Throttling: $s->{checked} request(s) checked, " . ($s->{rejected_ip} + $s->{rejected_user}) .
+		" rejected without querying authentication backends ($s->{rejected_ip} by address, $s->{rejected_user} by username), $s->{lockouts} lockout(s).");
+
+	$self->{_throttle}->destroy();
+	$self->{_throttle} = undef;
+	return 1;
+}
+
+# declares metrics and starts process serving them
+sub _metricsCreate {
+	my ($self) = @_;
+	return 1 unless (defined $self->{metrics_listen} && length($self->{metrics_listen}) > 0);
+
+	my $m = Net::OpenVPN::Metrics->new(prefix => 'openvpn_authd');
+	$m->counter('requests_total', 'Answered authentication requests by response status.', map { { status => $_ } } sort values %STATUS_NAMES);
+	$m->histogram('request_duration_seconds', 'Time from reading request to writing response.');
+	my %seen = ();
+	my @mods = grep { ! $seen{$_}++ } ((defined $self->{_chain}) ? $self->{_chain}->getChain() : (), @{$self->{metrics_modules}});
+	$m->histogram(
+		'module_duration_seconds', 'Authentication module run time by outcome.',
+		map { my $mod = $_; map { { module => $mod, outcome => $_ } } qw(success failure cancelled) } @mods
+	);
+	unless ($m->create()) {
+		$self->{_log}->warn("Metrics disabled: " . $m->getError());
+		return 0;
+	}
+
+	my ($proto, $host, $port) = $self->parseListen($self->{metrics_listen});
+	my $sock = undef;
+	if (! defined $proto) {
+		$self->{_log}->warn("Metrics disabled: " . $self->{error});
+	}
+	else {
+		if ($proto eq 'unix') {
+			unlink($host);
+			$sock = IO::Socket::UNIX->new(Local => $host, Type => SOCK_STREAM, Listen => SOMAXCONN);
+		} else {
+			my $class = (eval { require IO::Socket::IP; 1; }) ? 'IO::Socket::IP' : 'IO::Socket::INET';
+			$sock = $class->new(
+				LocalAddr => ($host eq '*') ? '0.0.0.0' : $host,
+				LocalPort => $port,
+				Proto => 'tcp',
+				ReuseAddr => 1,
+				Listen => SOMAXCONN,
+			);
+		}
+		$self->{_log}->warn("Metrics disabled: unable to listen on $self->{metrics_listen}: $!") unless (defined $sock);
+	}
+	unless (defined $sock) {
+		$m->destroy();
+		return 0;
+	}
+
+	my $pid = fork();
+	unless (defined $pid) {
+		$self->{_log}->warn("Metrics disabled: unable to fork: $!");
+		$m->destroy();
+		return 0;
+	}
+	if ($pid == 0) {
+		$self->_metricsServe($sock, $m);
+		POSIX::_exit(0);
+	}
+
+	$sock->close();
+	$self->{_metrics} = $m;
+	$self->{_metrics_pid} = $pid;
+	$self->{_log}->info("Serving metrics on $self->{metrics_listen}.");
+	return 1;
+}
+
+sub _metricsDestroy {
+	my ($self) = @_;
+	if ($self->{_metrics_pid}) {
+		kill('TERM', $self->{_metrics_pid});
+		waitpid($self->{_metrics_pid}, 0);
+		$self->{_metrics_pid} = 0;
+	}
+	return 1 unless (defined $self->{_metrics});
+	$self->{_metrics}->destroy();
+	$self->{_metrics} = undef;
+	return 1;
+}
+
+# answers http requests for metrics; runs in its own process,
+# so that scrapes never wait for authentication workers
+sub _metricsServe {
+	my ($self, $sock, $m) = @_;
+	$SIG{$_} = 'DEFAULT' foreach (qw(TERM INT HUP CHLD));
+	$SIG{PIPE} = 'IGNORE';
+
+	while (1) {
+		my $client = $sock->accept();
+		next unless (defined $client);
+
+		eval {
+			local $SIG{ALRM} = sub { die "timeout\n"; };
+			alarm(5);
+			my $req = $client->getline();
+			# skip request headers
+			while (defined(my $line = $client->getline())) {
+				last if ($line =~ m/^\r?\n$/);
+			}
+
+			my ($code, $type, $body) = (404, 'text/plain', "Not found.\n");
+			if (defined $req && $req =~ m/^GET\s+\/metrics(?:\?\S*)?\s/) {
+				my %extra = ();
+				if (defined $self->{_throttle}) {
+					my $s = $self->{_throttle}->getStats();
+					$extra{throttle_rejected_address_total} = [ 'counter', 'Requests rejected by per-address throttling.', $s->{rejected_ip} ];
+					$extra{throttle_rejected_username_total} = [ 'counter', 'Requests rejected by per-username throttling.', $s->{rejected_user} ];
+					$extra{throttle_lockouts_total} = [ 'counter', 'Throttling lockouts started.', $s->{lockouts} ];
+				}
+				if (ref($self->{server}->{sock})) {
+					$extra{listen_queue_depth} = [ 'gauge', 'Connections waiting in listen queues (Linux only).', $self->_queueDepth() ];
+				}
+				($code, $type, $body) = (200, 'text/plain; version=0.0.4', $m->render(\ %extra));
+			}
+
+			print $client "HTTP/1.0 $code " . (($code == 200) ? "OK" : "Not Found") . "\r\n",
+				"Content-Type: $type\r\n",
+				"Content-Length: " . length($body) . "\r\n",
+				"Connection: close\r\n\r\n",
+				$body;
+			alarm(0);
+		};
+		alarm(0);
+		$client->close();
+	}
+}
+
+# opens capture file shared by workers
+sub _captureCreate {
+	my ($self) = @_;
+	return 1 unless (defined $self->{capture_file} && length($self->{capture_file}) > 0);
+
+	my $cap = Net::OpenVPN::Capture->new(file => $self->{capture_file});
+	unless ($cap->open()) {
+		$self->{_log}->warn("Request capture disabled: " . $cap->getError());
+		return 0;
+	}
+	$self->{_capture} = $cap;
+	$self->{_log}->info("Capturing requests to '$self->{capture_file}'.");
+	return 1;
+}
+
+sub _captureDestroy {
+	my ($self) = @_;
+	return 1 unless (defined $self->{_capture});
+	$self->{_capture}->close();
+	$self->{_capture} = undef;
+	return 1;
+}
+
+# appends record of current request to capture file
+sub _captureRequest {
+	my ($self, $status) = @_;
+	my $req = $self->{_request};
+	$self->{_request} = undef;
+	return 0 unless (defined $self->{_capture} && $self->{_received});
+
+	# front-end doesn't tell workers where request came from
+	my $source = '';
+	unless ($self->{_worker}) {
+		my $addr = $self->{server}->{peeraddr};
+		$source = (defined $addr && length($addr) > 0 && $addr ne '0.0.0.0') ? $addr . ':' . $self->{server}->{peerport} : 'unix';
+	}
+
+	my $flags = 0;
+	$flags |= FLAG_KEEPALIVE if ($req->{keepalive});
+	$flags |= FLAG_PROTO_V2 if ($self->{_v2});
+	$flags |= FLAG_NOT_RUN unless ($req->{ran});
+
+	my $r = $self->{_capture}->record(
+		$req->{struct},
+		time => $self->{_received},
+		latency => time() - $self->{_received},
+		status => $status,
+		flags => $flags,
+		source => $source,
+		path => ($req->{ran}) ? [ $self->{_chain}->getTiming() ] : [],
+	);
+	$self->{_log}->warn($self->{_capture}->getError()) unless ($r);
+	return $r;
+}
+
+# returns number of connections waiting in listen queues of
+# tcp listening sockets (Linux only, 0 if unknown)
+sub _queueDepth {
+	my ($self) = @_;
+	my $opt = eval { Socket::TCP_INFO() };
+	return 0 unless (defined $opt && ref($self->{server}->{sock}));
+
+	my $depth = 0;
+	foreach my $sock (@{$self->{server}->{sock}}) {
+		# tcpi_unacked of listening socket is its accept queue length
+		my $info = getsockopt($sock, Socket::IPPROTO_TCP(), $opt);
+		next unless (defined $info && length($info) >= 28);
+		$depth += unpack('x24 L', $info);
+	}
+
+	return $depth;
+}
+
+# reads next request from client using connection's protocol;
+# returns authentication structure, undef on EOF or error message
+# (string) if protocol v2 request is invalid
+sub _readRequest {
+	my ($self) = @_;
+	return $self->readStruct() unless ($self->{_v2});
+
+	while (1) {
+		my @frame = $self->{_proto}->readFrame();
+		return undef unless (@frame);
+		my ($type, $payload) = @frame;
+		return "Invalid request: " . $self->{_proto}->getError() unless (defined $type);
+
+		if ($type == PROTO_HELLO) {
+			my $tlv = $self->{_proto}->decode($payload);
+			return "Invalid request: " . $self->{_proto}->getError() unless (defined $tlv);
+			$self->{_log}->debug("Client hello: protocol version " . ($tlv->{T_VERSION()} || 0) . ", capabilities " . ($tlv->{T_CAPS()} || 0) . ", agent '" . ($tlv->{T_AGENT()} || '') . "'.");
+			$self->{_proto}->writeFrame(
+				PROTO_HELLO,
+				T_VERSION, PROTO_VERSION,
+				T_CAPS, CAP_KEEPALIVE | CAP_ID | CAP_TIMING,
+				T_AGENT, $self->{_myname},
+			);
+			next;
+		}
+		elsif ($type == PROTO_AUTH_REQUEST) {
+			my $struct = {};
+			$self->resetStruct($struct);
+			my $req = $self->{_proto}->decodeRequest($payload);
+			return "Invalid request: " . $self->{_proto}->getError() unless (defined $req);
+			map { $struct->{$_} = $req->{$_}; } keys %{$req};
+			$self->{_log}->debug("Readed protocol v2 request for user '" . $struct->{username} . "'.");
+			return $struct;
+		}
+
+		return "Invalid request: unexpected frame type $type.";
+	}
+}
+
+# writes authentication response using connection's protocol
+sub _writeResponse {
+	my ($self, $id, $status, $msg, $elapsed) = @_;
+
+	if ($self->{_v2}) {
+		$self->{_proto}->writeFrame(
+			PROTO_AUTH_RESPONSE,
+			T_ID, $id,
+			T_STATUS, $status,
+			T_MESSAGE, $msg,
+			T_SERVER_TIME, (defined $elapsed) ? int($elapsed * 1000000) : undef,
+		);
+	} else {
+		my $str = (($status == STATUS_OK) ? "OK " : "NO ") . $msg;
+		$str = $id . " " . $str if (defined $id);
+		print {$self->{server}->{client}} $str, "\n";
+	}
+
+	$self->{server}->{client}->flush();
+
+	if (defined $self->{_metrics}) {
+		$self->{_metrics}->inc('requests_total', { status => $STATUS_NAMES{$status} });
+		$self->{_metrics}->observe('request_duration_seconds', undef, time() - $self->{_received}) if ($self->{_received});
+		$self->{_metrics}->setWorkerState(0);
+	}
+	$self->_captureRequest($status) if (defined $self->{_request});
+	$self->{_received} = 0;
 
 	return 1;
 }
@@ -145,6 +1079,66 @@ sub getChain {
 	return $self->{_chain};
 }
 
+=head2 setReloadHandler ($code)
+
+Sets code reference called on SIGHUP. It must return new authentication
+chain, or undef and error message if chain can't be built.
+
+=cut
+sub setReloadHandler {
+	my ($self, $code) = @_;
+	$self->{error} = "";
+	unless (ref($code) eq 'CODE') {
+		$self->{error} = "Reload handler is not a code reference.";
+		return 0;
+	}
+	$self->{_reload} = $code;
+	return 1;
+}
+
+=head2 reload ()
+
+Builds new authentication chain using reload handler and assigns it to
+server. Runs in parent process: workers forked afterwards use new chain,
+running workers keep the old one until they are retired. Chain is built
+before it's assigned, so password files are read and shared by all new
+workers; persistent backend connections are opened by every worker
+before it takes its first request. On failure old chain is kept. Returns
+1 on success, otherwise 0.
+
+=cut
+sub reload {
+	my ($self) = @_;
+	$self->{error} = "";
+	unless (defined $self->{_reload}) {
+		$self->{error} = "Reload handler is not set.";
+		$self->{_log}->warn("Ignoring reload request: $self->{error}");
+		return 0;
+	}
+
+	$self->{_log}->info("Reloading authentication chain.");
+	my $started = time();
+	my ($chain, $err) = eval { $self->{_reload}->() };
+	$err = $@ if ($@);
+	unless (defined $chain && $self->setChain($chain)) {
+		$self->{error} = (defined $chain) ? $self->{error} : (defined $err) ? $err : "unknown error";
+		$self->{error} =~ s/\s+$//;
+		$self->{_log}->error("Unable to reload authentication chain, keeping current one: $self->{error}");
+		return 0;
+	}
+
+	$self->{_log}->info(sprintf("Authentication chain reloaded in %.1f ms: %s.", (time() - $started) * 1000, join(", ", $chain->getChain())));
+
+	# metrics segment is sized at startup
+	if (defined $self->{_metrics}) {
+		foreach my $mod ($chain->getChain()) {
+			next if ($self->{_metrics}->hasSeries('module_duration_seconds', { module => $mod, outcome => 'success' }));
+			$self->{_log}->warn("Authentication module '$mod' wasn't configured at startup; its run time won't be exported as metrics until restart.");
+		}
+	}
+	return 1;
+}
+
 sub getName {
 	my ($self) = @_;
 	return $self->{_myname};
@@ -167,8 +1161,10 @@ sub readStruct {
 	$self->resetStruct($struct);
 
 	my $i = 0;
+	my $got_data = 0;
 	while ($i < MAXLINES && defined(my $line = $self->{server}->{client}->getline())) {
 		$i++;
+		$got_data = 1;
 		$line = substr($line, 0, MAX_LINE_LENGTH);
 		$line =~ s/\s+$//g;
 		$line =~ s/^\s+//g;
@@ -187,6 +1183,10 @@ sub readStruct {
 		$self->{_log}->debug("Readed structure: " . $str);
 	}
 
+	# return undef if client closed connection
+	# without sending anything
+	return undef unless ($got_data);
+
 	return $struct;
 }
 
@@ -220,7 +1220,8 @@ sub _cleanup {
 
 	if (defined $self->{server}->{client}) {
 		$self->{server}->{client}->flush();
-		$self->{server}->{client}->shutdown(2);
+		# front-end's worker socket is shared with replacement worker
+		$self->{server}->{client}->shutdown(2) unless ($self->{_worker});
 	}
 
 	return 1;
@@ -0,0 +1,279 @@
+package Net::OpenVPN::Capture;
+
+use strict;
+use warnings;
+
+use Exporter;
+use Fcntl qw(O_RDWR O_APPEND O_CREAT SEEK_SET);
+use Digest::SHA qw(hmac_sha256_hex);
+use Time::HiRes qw(time);
+
+# my modules
+use Net::OpenVPN::SharedMemory;
+
+# file header: magic, version, header length, creation
+# time, token salt
+use constant MAGIC => 'OVAC';
+use constant VERSION => 1;
+use constant HEADER_LEN => 32;
+use constant HEADER_FMT => 'a4 n n N a16 x4';
+
+# record: record length (16 bit), receive time (seconds,
+# microseconds), latency (microseconds), response
+# status, flags, client's untrusted port; followed by
+# length-prefixed strings (see STRINGS)
+use constant RECORD_FMT => 'N N N C C n';
+use constant STRINGS => qw(username token common_name untrusted_ip source path);
+
+use constant FLAG_KEEPALIVE => 0x01;
+use constant FLAG_PROTO_V2 => 0x02;
+use constant FLAG_NOT_RUN => 0x04;
+
+use constant TOKEN_LEN => 16;
+
+use vars qw(@ISA @EXPORT_OK);
+@ISA = qw(Exporter);
+@EXPORT_OK = qw(FLAG_KEEPALIVE FLAG_PROTO_V2 FLAG_NOT_RUN);
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::Capture - append-only capture of authentication requests
+
+=head1 SYNOPSIS
+
+ # in parent, before forking workers
+ my $cap = Net::OpenVPN::Capture->new(file => "/var/tmp/openvpn_authd.cap");
+ $cap->open() || die $cap->getError();
+
+ # in worker, after response has been written
+ $cap->record($struct, time => $received, latency => $elapsed, status => $status, path => [ $chain->getTiming() ]);
+
+=head1 DESCRIPTION
+
+Writes one binary record per answered authentication request: receive
+time, latency, response status, username, common name, client address,
+source of request and modules which ran (path through authentication
+chain) with their outcome. Records are replayed by
+openvpn_auth_replay.
+
+Passwords are never written. Every username gets synthetic password
+token instead (HMAC of username keyed by random salt stored in file
+header), same for all its requests and for all daemon runs appending
+to the same file; openvpn_auth_replay sends token for requests which
+originally succeeded and something else for failed ones, and writes
+password file for test openvpn_authd, so that verdicts can be
+reproduced.
+
+File is opened with O_APPEND once in parent and inherited by workers;
+every record is written by single write(2), so records of concurrent
+workers don't interleave.
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+	$self->{file} = undef;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_fd} = undef;
+	$self->{_salt} = undef;
+	$self->{_tokens} = {};
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 open ()
+
+Opens capture file for appending; new file gets header with random
+token salt, existing file's header is checked and its salt is reused.
+Returns 1 on success, otherwise 0.
+
+=cut
+sub open {
+	my ($self) = @_;
+	$self->{error} = "";
+	$self->close();
+
+	unless (defined $self->{file} && length($self->{file}) > 0) {
+		$self->{error} = "Capture file is not set.";
+		return 0;
+	}
+
+	my $fd = undef;
+	unless (sysopen($fd, $self->{file}, O_RDWR | O_APPEND | O_CREAT, 0600)) {
+		$self->{error} = "Unable to open capture file '$self->{file}': $!";
+		return 0;
+	}
+	binmode($fd);
+
+	my $hdr = '';
+	sysseek($fd, 0, SEEK_SET);
+	sysread($fd, $hdr, HEADER_LEN);
+	if (length($hdr) == 0) {
+		my $salt = Net::OpenVPN::SharedMemory->randomKey(16);
+		$hdr = pack(HEADER_FMT, MAGIC, VERSION, HEADER_LEN, int(time()), $salt);
+		unless (defined syswrite($fd, $hdr)) {
+			$self->{error} = "Unable to write capture file '$self->{file}' header: $!";
+			CORE::close($fd);
+			return 0;
+		}
+	}
+
+	my ($magic, $version, $len, $created, $salt) = unpack(HEADER_FMT, $hdr . ("\0" x HEADER_LEN));
+	unless ($magic eq MAGIC && $version == VERSION && $len == HEADER_LEN) {
+		$self->{error} = "File '$self->{file}' is not capture file version " . VERSION . ".";
+		CORE::close($fd);
+		return 0;
+	}
+
+	$self->{_fd} = $fd;
+	$self->{_salt} = $salt;
+	$self->{_tokens} = {};
+	return 1;
+}
+
+=head2 close ()
+
+Closes capture file.
+
+=cut
+sub close {
+	my ($self) = @_;
+	CORE::close($self->{_fd}) if (defined $self->{_fd});
+	$self->{_fd} = undef;
+	return 1;
+}
+
+=head2 token ($username)
+
+Returns synthetic password token of specified username.
+
+=cut
+sub token {
+	my ($self, $user) = @_;
+	$user = '' unless (defined $user);
+	$self->{_tokens} = {} if (scalar(keys %{$self->{_tokens}}) > 10000);
+	$self->{_tokens}->{$user} = substr(hmac_sha256_hex($user, $self->{_salt}), 0, TOKEN_LEN)
+		unless (exists($self->{_tokens}->{$user}));
+	return $self->{_tokens}->{$user};
+}
+
+=head2 record ($struct, %info)
+
+Appends record of request in authentication structure I<$struct>.
+Recognized I<%info> keys: B<time> (receive time, float seconds),
+B<latency> (seconds), B<status> (response status), B<flags>, B<source>
+(string) and B<path> (list of [ module, seconds, outcome ] as returned by
+L<Net::OpenVPN::AuthChain/getTiming>). Returns 1 on success, otherwise 0.
+
+=cut
+sub record {
+	my ($self, $struct, %info) = @_;
+	$self->{error} = "";
+	return 0 unless (defined $self->{_fd});
+
+	my $t = (defined $info{time}) ? $info{time} : time();
+	my $latency = int((($info{latency} || 0) * 1000000) + 0.5);
+	$latency = 0xffffffff if ($latency > 0xffffffff);
+	my $port = $struct->{port};
+	$port = 0 unless (defined $port && $port =~ m/^\d+$/ && $port < 65536);
+
+	my %str = (
+		username => $struct->{username},
+		token => $self->token($struct->{username}),
+		common_name => $struct->{common_name},
+		untrusted_ip => $struct->{host},
+		source => $info{source},
+		path => join(',', map { $_->[0] . ':' . substr($_->[2], 0, 1) } @{$info{path} || []}),
+	);
+	my $body = pack(
+		RECORD_FMT,
+		int($t), int(($t - int($t)) * 1000000), $latency,
+		$info{status} || 0, $info{flags} || 0, $port,
+	);
+	foreach my $name (STRINGS) {
+		my $s = (defined $str{$name}) ? $str{$name} : '';
+		$body .= pack('C/a*', substr($s, 0, 255));
+	}
+	my $rec = pack('n', length($body) + 2) . $body;
+
+	my $r = syswrite($self->{_fd}, $rec);
+	unless (defined $r && $r == length($rec)) {
+		$self->{error} = "Unable to write capture file '$self->{file}': " . ((defined $r) ? "short write" : $!);
+		return 0;
+	}
+
+	return 1;
+}
+
+=head1 RECORD FORMAT
+
+All integers are in network byte order.
+
+ header:  "OVAC", version (16 bit), header length (16 bit),
+          creation time (32 bit), token salt (16 bytes), padding (4 bytes)
+ record:  record length (16 bit), receive time seconds (32 bit),
+          receive time microseconds (32 bit), latency in microseconds
+          (32 bit), response status (8 bit), flags (8 bit; 0x01
+          keep-alive, 0x02 protocol v2, 0x04 modules didn't run),
+          untrusted port (16 bit), username, password token, common
+          name, untrusted ip, source, path (each 8 bit length and
+          bytes)
+
+Source is client's address (B<unix> for UNIX domain socket clients);
+workers behind front-end don't know it and write empty string and
+protocol v2 flag. Path is comma separated list of
+I<module>:I<outcome>, where outcome is B<s> (success), B<f> (failure) or
+B<c> (cancelled).
+
+=cut
+
+sub DESTROY {
+	my ($self) = @_;
+	$self->close();
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::AuthDaemon>
+L<Net::OpenVPN::AuthChain>
+
+=cut
+
+1;
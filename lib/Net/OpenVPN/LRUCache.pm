@@ -0,0 +1,191 @@
+package Net::OpenVPN::LRUCache;
+
+use strict;
+use warnings;
+
+use Time::HiRes qw(time);
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::LRUCache - bounded least recently used cache with TTL
+
+=head1 SYNOPSIS
+
+ my $cache = Net::OpenVPN::LRUCache->new(size => 1000, ttl => 300);
+ $cache->set($key, $value);
+ my $value = $cache->get($key);
+
+=head1 DESCRIPTION
+
+Cache holds at most B<size> entries; when full, least recently used entry
+is evicted. Entries older than B<ttl> seconds (0: never expire) are not
+returned. All operations take constant time.
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+	$self->{size} = 1000;
+	$self->{ttl} = 0;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{_map} = {};		# key => node [ key, value, expires, prev, next ]
+	$self->{_head} = undef;	# most recently used
+	$self->{_tail} = undef;	# least recently used
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+=head2 get ($key)
+
+Returns cached value or undef if key is not cached or has expired.
+
+=cut
+sub get {
+	my ($self, $key) = @_;
+	my $node = $self->{_map}->{$key};
+	return undef unless (defined $node);
+
+	if ($node->[2] && $node->[2] < time()) {
+		$self->_unlink($node);
+		delete($self->{_map}->{$key});
+		return undef;
+	}
+
+	$self->_unlink($node);
+	$self->_push($node);
+	return $node->[1];
+}
+
+=head2 set ($key, $value)
+
+Stores value, evicting least recently used entry if cache is full.
+
+=cut
+sub set {
+	my ($self, $key, $value) = @_;
+	return 0 unless ($self->{size} > 0);
+
+	my $node = $self->{_map}->{$key};
+	if (defined $node) {
+		$self->_unlink($node);
+	} else {
+		$node = [ $key ];
+		$self->{_map}->{$key} = $node;
+	}
+	$node->[1] = $value;
+	$node->[2] = ($self->{ttl} > 0) ? time() + $self->{ttl} : 0;
+	$self->_push($node);
+
+	while (scalar(keys %{$self->{_map}}) > $self->{size}) {
+		my $lru = $self->{_tail};
+		$self->_unlink($lru);
+		delete($self->{_map}->{$lru->[0]});
+	}
+
+	return 1;
+}
+
+=head2 remove ($key)
+
+Removes entry from cache.
+
+=cut
+sub remove {
+	my ($self, $key) = @_;
+	my $node = delete($self->{_map}->{$key});
+	return 0 unless (defined $node);
+	$self->_unlink($node);
+	return 1;
+}
+
+=head2 clear ()
+
+Removes all entries.
+
+=cut
+sub clear {
+	my ($self) = @_;
+	# break reference cycles
+	foreach my $node (values %{$self->{_map}}) {
+		$node->[3] = $node->[4] = undef;
+	}
+	$self->{_map} = {};
+	$self->{_head} = $self->{_tail} = undef;
+	return 1;
+}
+
+=head2 count ()
+
+Returns number of cached entries (including expired ones not yet evicted).
+
+=cut
+sub count {
+	my ($self) = @_;
+	return scalar(keys %{$self->{_map}});
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+sub _unlink {
+	my ($self, $node) = @_;
+	if (defined $node->[3]) {
+		$node->[3]->[4] = $node->[4];
+	} else {
+		$self->{_head} = $node->[4];
+	}
+	if (defined $node->[4]) {
+		$node->[4]->[3] = $node->[3];
+	} else {
+		$self->{_tail} = $node->[3];
+	}
+	$node->[3] = $node->[4] = undef;
+}
+
+sub _push {
+	my ($self, $node) = @_;
+	$node->[3] = undef;
+	$node->[4] = $self->{_head};
+	$self->{_head}->[3] = $node if (defined $self->{_head});
+	$self->{_head} = $node;
+	$self->{_tail} = $node unless (defined $self->{_tail});
+}
+
+sub DESTROY {
+	my ($self) = @_;
+	$self->clear();
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+1;
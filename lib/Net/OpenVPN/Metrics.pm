@@ -0,0 +1,378 @@
+package Net::OpenVPN::Metrics;
+
+use strict;
+use warnings;
+
+# my modules
+use Net::OpenVPN::SharedMemory;
+
+# histogram bucket upper bounds (seconds): 0.5ms .. 16s, doubling
+use constant BUCKETS => map { 0.0005 * 2 ** $_ } (0 .. 15);
+
+# worker slot: pid, state
+use constant WORKER_LEN => 8;
+use constant WORKER_FMT => 'N C x3';
+use constant WORKER_IDLE => 0;
+use constant WORKER_BUSY => 1;
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::Metrics - counters and latency histograms shared by daemon workers
+
+=head1 SYNOPSIS
+
+ # in parent, before forking workers
+ my $m = Net::OpenVPN::Metrics->new(prefix => 'openvpn_authd');
+ $m->counter('requests_total', 'Answered requests.', { status => 'ok' }, { status => 'denied' });
+ $m->histogram('request_duration_seconds', 'Request processing time.');
+ $m->create() || die $m->getError();
+
+ # in workers
+ $m->setWorkerState(1);
+ $m->inc('requests_total', { status => 'ok' });
+ $m->observe('request_duration_seconds', undef, 0.012);
+ $m->setWorkerState(0);
+
+ # anywhere
+ print $m->render();
+
+=head1 DESCRIPTION
+
+All series are declared before shared memory segment is created (see
+L<Net::OpenVPN::SharedMemory>), so every series has fixed place in it;
+updates of undeclared series are ignored. Histogram buckets are
+logarithmic: from 0.5ms up to 16.384s, every next bucket twice as wide.
+Workers also record whether they are busy; workers which have exited are
+not counted. L<render> formats everything in Prometheus text exposition
+format, reading whole segment at once.
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+	$self->{prefix} = "openvpn_authd";
+
+	# maximum number of concurrently running workers
+	$self->{workers} = 1024;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_shm} = undef;
+	$self->{_series} = {};		# series key => [ offset, type, name, labels ]
+	$self->{_order} = [];		# metric names in declaration order
+	$self->{_help} = {};		# metric name => [ type, help ]
+	$self->{_size} = 0;			# bytes used by series
+	$self->{_wslot} = undef;	# offset of this worker's slot
+	$self->{_wpid} = 0;
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 counter ($name, $help [, \%labels, ...])
+
+Declares counter with specified label sets (none: single series without
+labels).
+
+=cut
+sub counter {
+	my ($self, $name, $help, @labels) = @_;
+	return $self->_declare('counter', $name, $help, 1, @labels);
+}
+
+=head2 histogram ($name, $help [, \%labels, ...])
+
+Declares histogram with specified label sets.
+
+=cut
+sub histogram {
+	my ($self, $name, $help, @labels) = @_;
+	my @b = (BUCKETS);
+	# buckets, +Inf bucket, sum, count
+	return $self->_declare('histogram', $name, $help, scalar(@b) + 3, @labels);
+}
+
+=head2 create ()
+
+Allocates shared memory; must be called after all series have been
+declared and before workers are forked. Returns 1 on success, otherwise 0.
+
+=cut
+sub create {
+	my ($self) = @_;
+	$self->{error} = "";
+	$self->destroy();
+
+	my $shm = Net::OpenVPN::SharedMemory->new(size => $self->{_size} + $self->{workers} * WORKER_LEN);
+	unless ($shm->create()) {
+		$self->{error} = $shm->getError();
+		return 0;
+	}
+	$self->{_shm} = $shm;
+	return 1;
+}
+
+=head2 destroy ()
+
+Removes shared memory (only in process which created it).
+
+=cut
+sub destroy {
+	my ($self) = @_;
+	$self->{_shm}->destroy() if (defined $self->{_shm});
+	$self->{_shm} = undef;
+	$self->{_wslot} = undef;
+	return 1;
+}
+
+=head2 hasSeries ($name, \%labels)
+
+Returns 1 if series with specified labels is declared, otherwise 0.
+
+=cut
+sub hasSeries {
+	my ($self, $name, $labels) = @_;
+	return (exists($self->{_series}->{_key($name, $labels)})) ? 1 : 0;
+}
+
+=head2 inc ($name, \%labels [, $value])
+
+Increments counter by I<$value> (default 1).
+
+=cut
+sub inc {
+	my ($self, $name, $labels, $value) = @_;
+	return 0 unless (defined $self->{_shm});
+	my $s = $self->{_series}->{_key($name, $labels)};
+	return 0 unless (defined $s && $s->[1] eq 'counter');
+	$value = 1 unless (defined $value);
+
+	return 0 unless ($self->{_shm}->lock());
+	my $buf = $self->{_shm}->read($s->[0], 8);
+	$self->{_shm}->write($s->[0], pack('d', unpack('d', $buf) + $value)) if (defined $buf);
+	$self->{_shm}->unlock();
+	return 1;
+}
+
+=head2 observe ($name, \%labels, $seconds)
+
+Records value in histogram.
+
+=cut
+sub observe {
+	my ($self, $name, $labels, $value) = @_;
+	return 0 unless (defined $self->{_shm});
+	my $s = $self->{_series}->{_key($name, $labels)};
+	return 0 unless (defined $s && $s->[1] eq 'histogram');
+
+	# buckets are stored non-cumulative
+	my @b = (BUCKETS);
+	my $i = 0;
+	$i++ while ($i <= $#b && $value > $b[$i]);
+	my $len = (scalar(@b) + 3) * 8;
+
+	return 0 unless ($self->{_shm}->lock());
+	my $buf = $self->{_shm}->read($s->[0], $len);
+	if (defined $buf) {
+		my @v = unpack('d*', $buf);
+		$v[$i]++;
+		$v[-2] += $value;
+		$v[-1]++;
+		$self->{_shm}->write($s->[0], pack('d*', @v));
+	}
+	$self->{_shm}->unlock();
+	return 1;
+}
+
+=head2 setWorkerState ($busy)
+
+Marks calling process as busy or idle worker.
+
+=cut
+sub setWorkerState {
+	my ($self, $busy) = @_;
+	return 0 unless (defined $self->{_shm});
+
+	return 0 unless ($self->{_shm}->lock());
+	my $off = $self->_workerSlot();
+	$self->{_shm}->write($off, pack(WORKER_FMT, $$, ($busy) ? WORKER_BUSY : WORKER_IDLE)) if (defined $off);
+	$self->{_shm}->unlock();
+	return (defined $off) ? 1 : 0;
+}
+
+=head2 render (\%extra)
+
+Returns all series in Prometheus text format. Optional hash reference
+I<%extra> contains additional series which are not stored in shared
+memory (name => [ type, help, value ]).
+
+=cut
+sub render {
+	my ($self, $extra) = @_;
+	return "" unless (defined $self->{_shm});
+
+	my $size = $self->{_size} + $self->{workers} * WORKER_LEN;
+	return "" unless ($self->{_shm}->lock());
+	my $buf = $self->{_shm}->read(0, $size);
+	$self->{_shm}->unlock();
+	return "" unless (defined $buf);
+
+	my $p = $self->{prefix};
+	my $out = "";
+	my @series = sort { $a->[0] <=> $b->[0] } values %{$self->{_series}};
+	foreach my $name (@{$self->{_order}}) {
+		my ($type, $help) = @{$self->{_help}->{$name}};
+		$out .= "# HELP ${p}_$name $help\n# TYPE ${p}_$name $type\n";
+		foreach my $s (grep { $_->[2] eq $name } @series) {
+			if ($type eq 'counter') {
+				$out .= "${p}_$name" . _labels($s->[3]) . " " . _num(unpack('d', substr($buf, $s->[0], 8))) . "\n";
+				next;
+			}
+			my @b = (BUCKETS);
+			my @v = unpack('d*', substr($buf, $s->[0], (scalar(@b) + 3) * 8));
+			my $cum = 0;
+			for my $i (0 .. $#b) {
+				$cum += $v[$i];
+				$out .= "${p}_${name}_bucket" . _labels($s->[3], le => _num($b[$i])) . " " . _num($cum) . "\n";
+			}
+			$cum += $v[scalar(@b)];
+			$out .= "${p}_${name}_bucket" . _labels($s->[3], le => '+Inf') . " " . _num($cum) . "\n";
+			$out .= "${p}_${name}_sum" . _labels($s->[3]) . " " . _num($v[-2]) . "\n";
+			$out .= "${p}_${name}_count" . _labels($s->[3]) . " " . _num($v[-1]) . "\n";
+		}
+	}
+
+	# workers
+	my %workers = (busy => 0, idle => 0);
+	for (my $off = $self->{_size}; $off < $size; $off += WORKER_LEN) {
+		my ($pid, $state) = unpack(WORKER_FMT, substr($buf, $off, WORKER_LEN));
+		next unless ($pid && kill(0, $pid));
+		$workers{($state == WORKER_BUSY) ? 'busy' : 'idle'}++;
+	}
+	$out .= "# HELP ${p}_workers Running authentication workers.\n# TYPE ${p}_workers gauge\n";
+	$out .= "${p}_workers" . _labels({ state => $_ }) . " $workers{$_}\n" foreach (sort keys %workers);
+
+	if (ref($extra)) {
+		foreach my $name (sort keys %{$extra}) {
+			my ($type, $help, $value) = @{$extra->{$name}};
+			next unless (defined $value);
+			$out .= "# HELP ${p}_$name $help\n# TYPE ${p}_$name $type\n${p}_$name " . _num($value) . "\n";
+		}
+	}
+
+	return $out;
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+sub _declare {
+	my ($self, $type, $name, $help, $values, @labels) = @_;
+	if (defined $self->{_shm}) {
+		$self->{error} = "Series must be declared before shared memory is created.";
+		return 0;
+	}
+	if (exists($self->{_help}->{$name}) && $self->{_help}->{$name}->[0] ne $type) {
+		$self->{error} = "Metric '$name' is already declared as $self->{_help}->{$name}->[0].";
+		return 0;
+	}
+	unless (exists($self->{_help}->{$name})) {
+		$self->{_help}->{$name} = [ $type, $help ];
+		push(@{$self->{_order}}, $name);
+	}
+
+	@labels = (undef) unless (@labels);
+	foreach my $l (@labels) {
+		my $key = _key($name, $l);
+		next if (exists($self->{_series}->{$key}));
+		$self->{_series}->{$key} = [ $self->{_size}, $type, $name, { (ref($l) ? %{$l} : ()) } ];
+		$self->{_size} += $values * 8;
+	}
+	return 1;
+}
+
+# returns offset of worker's slot; must be called with lock held
+sub _workerSlot {
+	my ($self) = @_;
+	return $self->{_wslot} if (defined $self->{_wslot} && $self->{_wpid} == $$);
+	$self->{_wslot} = undef;
+
+	my $free = undef;
+	for my $i (0 .. $self->{workers} - 1) {
+		my $off = $self->{_size} + $i * WORKER_LEN;
+		my $buf = $self->{_shm}->read($off, WORKER_LEN);
+		next unless (defined $buf);
+		my ($pid) = unpack(WORKER_FMT, $buf);
+		if ($pid == $$) {
+			$free = $off;
+			last;
+		}
+		$free = $off if (! defined $free && (! $pid || ! kill(0, $pid)));
+	}
+
+	$self->{_wslot} = $free;
+	$self->{_wpid} = $$;
+	return $free;
+}
+
+sub _key {
+	my ($name, $labels) = @_;
+	return $name . _labels($labels);
+}
+
+sub _labels {
+	my ($labels, @extra) = @_;
+	my @l = (ref($labels)) ? map { [ $_, $labels->{$_} ] } sort keys %{$labels} : ();
+	push(@l, [ splice(@extra, 0, 2) ]) while (@extra);
+	return "" unless (@l);
+	return "{" . join(",", map { my $v = $_->[1]; $v =~ s/(["\\])/\\$1/g; $v =~ s/\n/\\n/g; $_->[0] . '="' . $v . '"' } @l) . "}";
+}
+
+sub _num {
+	my ($v) = @_;
+	return ($v == int($v) && abs($v) < 1e15) ? sprintf("%d", $v) : sprintf("%.6g", $v);
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::AuthDaemon>
+L<Net::OpenVPN::SharedMemory>
+
+=cut
+
+1;
@@ -0,0 +1,449 @@
+package Net::OpenVPN::PasswdIndex;
+
+use strict;
+use warnings;
+
+use IO::File;
+use IO::Handle;
+use File::Temp qw(tempfile);
+use File::Basename qw(dirname basename);
+use Fcntl qw(SEEK_SET);
+
+# header: magic, format version, bucket count, entry count,
+# bucket table offset, entry table offset, string area offset,
+# total file size
+use constant INDEX_MAGIC => "OVPWDB";
+use constant INDEX_VERSION => 1;
+use constant INDEX_HDR_LEN => 32;
+use constant INDEX_HDR_FMT => 'a6 n N N N N N N';
+
+# File::Map is optional; without it records are read with
+# positioned sysread(2) calls, which are served from the same
+# shared page cache pages.
+use constant HAVE_FILE_MAP => eval { require File::Map; 1; } ? 1 : 0;
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+
+	# how often (seconds) index file is checked for replacement
+	$self->{check_interval} = 1;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_file} = undef;
+	$self->{_map} = undef;			# File::Map mapped scalar
+	$self->{_fh} = undef;			# sysread(2) fallback
+	$self->{_pid} = 0;				# process which opened index
+	$self->{_id} = "";				# device, inode, size, mtime
+	$self->{_checked} = 0;
+	$self->{_hdr} = {};
+
+	bless($self, $class);
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head1 NAME
+
+Net::OpenVPN::PasswdIndex - indexed, memory mapped password database
+
+=head1 DESCRIPTION
+
+Password index is compact read-only on-disk hash table mapping usernames
+to password hashes. File consists of 32 byte header, bucket table
+(bucket count + 1 entry indexes; entries of bucket I<N> are entries from
+I<bucket[N]> up to I<bucket[N + 1]>), entry table (32 bit username hash
+and record offset for every entry) and string area (16 bit username
+length, 16 bit password hash length, username, password hash). All
+integers are big-endian, usernames are hashed using 32 bit FNV-1a.
+
+Index is mapped into memory (using L<File::Map> if available), so
+preforked authentication workers share its pages and username lookup
+touches only a few of them. Index is never modified in place: new index
+is written to temporary file and renamed over the old one (see
+L<build>); readers notice replaced file and map new one without restart.
+
+=head1 METHODS
+
+=head2 isIndex ($file)
+
+Returns 1 if specified file is password index, otherwise 0.
+
+=cut
+sub isIndex {
+	my ($self, $file) = @_;
+	my $fd = IO::File->new($file, 'r');
+	return 0 unless (defined $fd);
+	my $buf = '';
+	$fd->sysread($buf, length(INDEX_MAGIC));
+	$fd->close();
+	return ($buf eq INDEX_MAGIC) ? 1 : 0;
+}
+
+=head2 open ($file)
+
+Opens and maps password index. Returns 1 on success, otherwise 0.
+
+=cut
+sub open {
+	my ($self, $file) = @_;
+	$self->{error} = "";
+
+	my @st = stat($file);
+	unless (@st) {
+		$self->{error} = "Unable to stat password index '$file': $!";
+		return 0;
+	}
+	my $fd = IO::File->new($file, 'r');
+	unless (defined $fd) {
+		$self->{error} = "Unable to open password index '$file': $!";
+		return 0;
+	}
+	binmode($fd);
+
+	my $map = undef;
+	if (HAVE_FILE_MAP && $st[7] > 0) {
+		eval { File::Map::map_handle($map, $fd, '<'); };
+		if ($@) {
+			$self->{error} = "Unable to map password index '$file': $@";
+			return 0;
+		}
+	}
+
+	my $hdr = $self->_parseHeader((defined $map) ? substr($map, 0, INDEX_HDR_LEN) : _pread($fd, 0, INDEX_HDR_LEN), $st[7]);
+	unless (defined $hdr) {
+		$self->{error} = "Invalid password index '$file': $self->{error}";
+		return 0;
+	}
+
+	# replace previous mapping
+	$self->close();
+	$self->{_file} = $file;
+	$self->{_hdr} = $hdr;
+	$self->{_id} = join(":", @st[0, 1, 7, 9]);
+	$self->{_checked} = time();
+	$self->{_pid} = $$;
+	if (defined $map) {
+		$self->{_map} = \ $map;
+		$fd->close();
+	} else {
+		$self->{_fh} = $fd;
+	}
+
+	return 1;
+}
+
+=head2 close ()
+
+Unmaps password index.
+
+=cut
+sub close {
+	my ($self) = @_;
+	$self->{_fh}->close() if (defined $self->{_fh});
+	$self->{_fh} = undef;
+	$self->{_map} = undef;
+	$self->{_id} = "";
+	return 1;
+}
+
+=head2 getNumEntries ()
+
+Returns number of entries in opened index.
+
+=cut
+sub getNumEntries {
+	my ($self) = @_;
+	return (exists($self->{_hdr}->{entries})) ? $self->{_hdr}->{entries} : 0;
+}
+
+=head2 lookup ($username)
+
+Returns password hash for specified username, empty list if username
+doesn't exist or undef on error. Index file is remapped if it has been
+replaced since last check.
+
+=cut
+sub lookup {
+	my ($self, $username) = @_;
+	$self->{error} = "";
+
+	unless (defined $self->{_file}) {
+		$self->{error} = "Password index is not opened.";
+		return undef;
+	}
+	return undef unless ($self->_refresh());
+
+	utf8::encode($username) if (utf8::is_utf8($username));
+	my $hdr = $self->{_hdr};
+	my $h = _hash($username);
+	my $b = $h & ($hdr->{buckets} - 1);
+
+	my ($first, $last) = unpack('NN', $self->_read($hdr->{bucket_off} + $b * 4, 8));
+	return undef unless (defined $last);
+	return () if ($first >= $last);
+
+	# entry table of whole bucket at once
+	my $tbl = $self->_read($hdr->{entry_off} + $first * 8, ($last - $first) * 8);
+	return undef unless (defined $tbl);
+	my @ent = unpack('N*', $tbl);
+	while (@ent) {
+		my $eh = shift(@ent);
+		my $off = shift(@ent);
+		next unless ($eh == $h);
+
+		my ($ulen, $plen) = unpack('nn', $self->_read($off, 4));
+		return undef unless (defined $plen);
+		next unless ($ulen == length($username));
+		my $rec = $self->_read($off + 4, $ulen + $plen);
+		return undef unless (defined $rec);
+		return substr($rec, $ulen) if (substr($rec, 0, $ulen) eq $username);
+	}
+
+	return ();
+}
+
+=head2 getEntries ()
+
+Returns hash reference of all entries (username => password hash) in
+opened index or undef on error.
+
+=cut
+sub getEntries {
+	my ($self) = @_;
+	$self->{error} = "";
+
+	unless (defined $self->{_file}) {
+		$self->{error} = "Password index is not opened.";
+		return undef;
+	}
+
+	my $hdr = $self->{_hdr};
+	my %data = ();
+	my $tbl = $self->_read($hdr->{entry_off}, $hdr->{entries} * 8);
+	return undef unless (defined $tbl);
+	my @ent = unpack('N*', $tbl);
+	while (@ent) {
+		shift(@ent);
+		my $off = shift(@ent);
+		my ($ulen, $plen) = unpack('nn', $self->_read($off, 4));
+		return undef unless (defined $plen);
+		my $rec = $self->_read($off + 4, $ulen + $plen);
+		return undef unless (defined $rec);
+		$data{substr($rec, 0, $ulen)} = substr($rec, $ulen);
+	}
+
+	return \ %data;
+}
+
+=head2 build ($file, $data [, $mode])
+
+Writes password index containing hash reference I<$data> (username =>
+password hash) to specified file. Index is written to temporary file in
+the same directory and atomically renamed, so running readers never see
+partially written index. Optional I<$mode> sets file permissions
+(default 0600). Output doesn't depend on anything but data, so unchanged
+data produce identical index file. Returns 1 on success, otherwise 0.
+
+=cut
+sub build {
+	my ($self, $file, $data, $mode) = @_;
+	$self->{error} = "";
+	$mode = 0600 unless (defined $mode);
+
+	my @users = sort keys %{$data};
+	my $n = scalar(@users);
+	my $buckets = 1;
+	$buckets <<= 1 while ($buckets < $n);
+
+	# group entries by bucket
+	my @bucket = map { [] } (1 .. $buckets);
+	foreach my $u (@users) {
+		my $key = $u;
+		utf8::encode($key) if (utf8::is_utf8($key));
+		my $pw = (defined $data->{$u}) ? $data->{$u} : '';
+		utf8::encode($pw) if (utf8::is_utf8($pw));
+		if (length($key) > 0xffff || length($pw) > 0xffff) {
+			$self->{error} = "Username or password hash of user '$u' is too long.";
+			return 0;
+		}
+		my $h = _hash($key);
+		push(@{$bucket[$h & ($buckets - 1)]}, [ $h, $key, $pw ]);
+	}
+
+	my $bucket_off = INDEX_HDR_LEN;
+	my $entry_off = $bucket_off + ($buckets + 1) * 4;
+	my $string_off = $entry_off + $n * 8;
+
+	my $tbl = '';
+	my $entries = '';
+	my $strings = '';
+	my $i = 0;
+	foreach my $b (@bucket) {
+		$tbl .= pack('N', $i);
+		foreach my $e (@{$b}) {
+			$entries .= pack('NN', $e->[0], $string_off + length($strings));
+			$strings .= pack('nn', length($e->[1]), length($e->[2])) . $e->[1] . $e->[2];
+			$i++;
+		}
+	}
+	$tbl .= pack('N', $i);
+
+	my $size = $string_off + length($strings);
+	if ($size > 0xffffffff) {
+		$self->{error} = "Password index would be too large.";
+		return 0;
+	}
+	my $hdr = pack(INDEX_HDR_FMT, INDEX_MAGIC, INDEX_VERSION, $buckets, $n, $bucket_off, $entry_off, $string_off, $size);
+
+	# write temporary file next to destination, then rename it
+	my ($fd, $tmp) = eval {
+		tempfile(
+			"." . basename($file) . ".XXXXXX",
+			DIR => dirname($file),
+			UNLINK => 0,
+		);
+	};
+	unless (defined $fd) {
+		$self->{error} = "Unable to create temporary file in directory '" . dirname($file) . "': " . ($@ || $!);
+		return 0;
+	}
+	binmode($fd);
+	my $r = print $fd $hdr, $tbl, $entries, $strings;
+	$r = $fd->flush() && $fd->sync() if ($r);
+	$r = CORE::close($fd) && $r;
+	unless ($r && chmod($mode, $tmp) && rename($tmp, $file)) {
+		$self->{error} = "Unable to write password index '$file': $!";
+		unlink($tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+# 32 bit FNV-1a hash
+sub _hash {
+	my $h = 0x811c9dc5;
+	foreach my $c (unpack('C*', $_[0])) {
+		$h = (($h ^ $c) * 0x01000193) & 0xffffffff;
+	}
+	return $h;
+}
+
+sub _pread {
+	my ($fd, $off, $len) = @_;
+	my $buf = '';
+	return undef unless (sysseek($fd, $off, SEEK_SET));
+	my $r = sysread($fd, $buf, $len);
+	return (defined $r && $r == $len) ? $buf : undef;
+}
+
+sub _parseHeader {
+	my ($self, $buf, $size) = @_;
+	unless (defined $buf && length($buf) == INDEX_HDR_LEN) {
+		$self->{error} = "Truncated header.";
+		return undef;
+	}
+
+	my %h = ();
+	@h{qw(magic version buckets entries bucket_off entry_off string_off size)} = unpack(INDEX_HDR_FMT, $buf);
+	if ($h{magic} ne INDEX_MAGIC) {
+		$self->{error} = "Bad magic.";
+		return undef;
+	}
+	elsif ($h{version} != INDEX_VERSION) {
+		$self->{error} = "Unsupported format version $h{version}.";
+		return undef;
+	}
+	elsif ($h{size} != $size || $h{buckets} < 1 || ($h{buckets} & ($h{buckets} - 1)) ||
+		$h{entry_off} != $h{bucket_off} + ($h{buckets} + 1) * 4 ||
+		$h{string_off} != $h{entry_off} + $h{entries} * 8) {
+		$self->{error} = "Corrupted or truncated file.";
+		return undef;
+	}
+
+	return \ %h;
+}
+
+sub _read {
+	my ($self, $off, $len) = @_;
+	if ($off + $len > $self->{_hdr}->{size}) {
+		$self->{error} = "Corrupted password index (read beyond end of file).";
+		return undef;
+	}
+	return substr(${$self->{_map}}, $off, $len) if (defined $self->{_map});
+
+	my $buf = _pread($self->{_fh}, $off, $len);
+	$self->{error} = "Unable to read password index: $!" unless (defined $buf);
+	return $buf;
+}
+
+# remaps index if file has been replaced; forked children
+# reopen file descriptor, because file offset is shared
+sub _refresh {
+	my ($self) = @_;
+	my $now = time();
+
+	if (defined $self->{_fh} && $self->{_pid} != $$) {
+		return $self->open($self->{_file});
+	}
+	return 1 if ($now - $self->{_checked} < $self->{check_interval});
+	$self->{_checked} = $now;
+
+	my @st = stat($self->{_file});
+	return 1 unless (@st);
+	return 1 if (join(":", @st[0, 1, 7, 9]) eq $self->{_id});
+
+	# keep serving old index if new one is broken
+	my $old = $self->{error};
+	my $new = Net::OpenVPN::PasswdIndex->new();
+	unless ($new->open($self->{_file})) {
+		$self->{error} = $new->getError();
+		return 1;
+	}
+	$self->{error} = $old;
+	$self->{$_} = $new->{$_} foreach (qw(_map _fh _pid _id _checked _hdr));
+	$new->{_fh} = undef;
+	$new->{_map} = undef;
+
+	return 1;
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::Auth::File>
+L<File::Map>
+
+=cut
+
+1;
@@ -3,20 +3,33 @@ package Net::OpenVPN::PasswordValidator;
 use strict;
 use warnings;
 
+use MIME::Base64;
+
 # Supported password hashes
 my @HASHES = (
 	# [ 'name', 'Perl::Module', 'description']
 	[ 'PLAIN', 'IO::File', 'Cleartext password.' ],
 	[ 'CRYPT',  'IO::File', 'Old, traditional crypt(3) hashed password with 2 character salt.' ],
 	[ 'CRYPTMD5',  'Crypt::PasswdMD5', 'Modular crypt(3) MD5 hashed password with 8 character salt.' ],
+	[ 'SHACRYPT',  'IO::File', 'Modular crypt(3) SHA-256 ($5$) or SHA-512 ($6$) hashed password.' ],
 	[ 'MD5', "Digest::MD5", 'MD5 string digest.' ],
 	[ 'SHA1', "Digest::SHA1", 'SHA1 string digest.' ],
 	[ 'NTLM', "Crypt::SmbHash", 'NT LanManager hashed password.' ],
-#	[ 'SSHA', "Crypt::SaltedHash", 'Salted SHA1 hashed password with 16byte salt.' ],
+	[ 'SSHA', "Digest::SHA", 'Salted SHA1 hashed password (LDAP {SSHA}).' ],
+	[ 'SSHA256', "Digest::SHA", 'Salted SHA-256 hashed password (LDAP {SSHA256}).' ],
+	[ 'SSHA512', "Digest::SHA", 'Salted SHA-512 hashed password (LDAP {SSHA512}).' ],
 	[ 'TIGER', "Digest::Tiger", 'Tiger string digest.' ],
 	[ 'WHIRLPOOL', "Digest::Whirlpool", "Whirlpool string digest." ],
 );
 
+# Native (C) verifier, see Net::OpenVPN::PasswordVerify; algorithms
+# it supports don't depend on perl modules listed above.
+use constant HAVE_NATIVE => eval { require Net::OpenVPN::PasswordVerify; 1; } ? 1 : 0;
+my %NATIVE = (HAVE_NATIVE) ? map { $_ => 1 } Net::OpenVPN::PasswordVerify::algorithms() : ();
+
+# module probe results, shared by all validator instances
+my %PROBED = ();
+
 sub new {
 	my $proto = shift;
 	my $class = ref($proto) || $proto;
@@ -70,7 +83,10 @@ sub isEnabled {
 	my ($self, $hash) = @_;
 	my $str = "_has_" . $hash;
 
-	if (! exists($self->{$str})) {
+	if ($NATIVE{$hash}) {
+		return 1;
+	}
+	elsif (! exists($self->{$str})) {
 		$self->{error} = "Unsupported password hashing algorithm.";
 		return 0;
 	}
@@ -82,6 +98,11 @@ sub isEnabled {
 	return 1;
 }
 
+sub isNative {
+	my ($self, $hash) = @_;
+	return ($NATIVE{$hash}) ? 1 : 0;
+}
+
 sub getRequiredModule {
 	my ($self, $hash) = @_;
 	map {
@@ -119,6 +140,18 @@ sub setPasswordHash {
 sub validatePassword {
 	my ($self, $hashed_pw, $clear_pw, $hash_type) = @_;
 	$hash_type = $self->{hash} unless (defined $hash_type);
+	unless (defined $hashed_pw && defined $clear_pw) {
+		$self->{error} = "Undefined password or password hash.";
+		return 0;
+	}
+
+	# native verifier
+	if ($NATIVE{$hash_type}) {
+		my $r = Net::OpenVPN::PasswordVerify::verify($hash_type, $hashed_pw, $clear_pw);
+		return 1 if ($r > 0);
+		$self->{error} = ($r < 0) ? "Error validating password: " . Net::OpenVPN::PasswordVerify::error() : "Invalid password.";
+		return 0;
+	}
 	
 	my $str = "_has_" . $hash_type;
 	unless (exists($self->{$str}) && $self->{$str}) {
@@ -151,18 +184,33 @@ sub _init {
 	
 	# probe for available hashes...
 	foreach my $opt (@HASHES) {
-		my $str = "require " . $opt->[1];
-		eval $str;
-		$self->{"_has_" . $opt->[0]} = ($@) ? 0 : 1;
+		unless (exists($PROBED{$opt->[1]})) {
+			my $str = "require " . $opt->[1];
+			eval $str;
+			$PROBED{$opt->[1]} = ($@) ? 0 : 1;
+		}
+		$self->{"_has_" . $opt->[0]} = ($PROBED{$opt->[1]} || $NATIVE{$opt->[0]}) ? 1 : 0;
 	}
 
 	return 1;
 }
 
+# constant time string comparison
+sub _equals {
+	my ($x, $y) = @_;
+	my $d = length($x) ^ length($y);
+	$y = $x if ($d);
+	my @y = unpack('C*', $y);
+	foreach my $c (unpack('C*', $x)) {
+		$d |= $c ^ shift(@y);
+	}
+	return ($d == 0) ? 1 : 0;
+}
+
 # PLAIN
 sub _validatePLAIN {
 	my ($self, $hash, $password) = @_;
-	if ($password ne $hash) {
+	unless (_equals($password, $hash)) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -173,7 +221,7 @@ sub _validatePLAIN {
 sub _validateCRYPT {
 	my ($self, $hash, $password) = @_;
 	my $salt = substr($hash, 0, 2);
-	if ($hash ne crypt($password, $salt)) {
+	unless (_equals($hash, crypt($password, $salt))) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -184,7 +232,7 @@ sub _validateCRYPT {
 sub _validateCRYPTMD5 {
 	my ($self, $hash, $password) = @_;
 	my $salt = substr($hash, 3, 8);
-	if ($hash ne Crypt::PasswdMD5::unix_md5_crypt($password, $salt)) {
+	unless (_equals($hash, Crypt::PasswdMD5::unix_md5_crypt($password, $salt))) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -195,7 +243,7 @@ sub _validateCRYPTMD5 {
 # MD5 digest
 sub _validateMD5 {
 	my ($self, $hash, $password) = @_;
-	if ($hash ne Digest::MD5::md5_hex($password)) {
+	unless (_equals($hash, Digest::MD5::md5_hex($password))) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -206,7 +254,7 @@ sub _validateMD5 {
 # SHA1 digest
 sub _validateSHA1 {
 	my ($self, $hash, $password) = @_;
-	if ($hash ne Digest::SHA1::sha1_hex($password)) {
+	unless (_equals($hash, Digest::SHA1::sha1_hex($password))) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -217,28 +265,68 @@ sub _validateSHA1 {
 # NTLM
 sub _validateNTLM {
 	my ($self, $hash, $password) = @_;
-	if ($hash ne Crypt::SmbHash::ntlmgen($password)) {
+	unless (_equals($hash, scalar(Crypt::SmbHash::ntlmgen($password)))) {
+		$self->{error} = "Invalid password.";
+		return 0;
+	}
+
+	return 1;
+}
+
+# SHA-256/SHA-512 crypt(3)
+sub _validateSHACRYPT {
+	my ($self, $hash, $password) = @_;
+	unless ($hash =~ m/^\$[56]\$/) {
+		$self->{error} = "Password hash is not in expected crypt(3) format.";
+		return 0;
+	}
+	my $r = crypt($password, $hash);
+	unless (defined $r && _equals($hash, $r)) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
+	return 1;
+}
 
+# salted SHA: base64(digest(password . salt) . salt)
+sub _validateSaltedSHA {
+	my ($self, $hash, $password, $alg) = @_;
+	$hash =~ s/^{[^}]+}//;
+	my $raw = MIME::Base64::decode_base64($hash);
+	my $ctx = Digest::SHA->new($alg);
+	my $len = length($ctx->digest());
+	if (length($raw) <= $len) {
+		$self->{error} = "Malformed password hash.";
+		return 0;
+	}
+	$ctx->add($password, substr($raw, $len));
+	unless (_equals(substr($raw, 0, $len), $ctx->digest())) {
+		$self->{error} = "Invalid password.";
+		return 0;
+	}
 	return 1;
 }
 
-# salted SHA
 sub _validateSSHA {
 	my ($self, $hash, $password) = @_;
-	
-	# TODO implement SSHA password hashing
-	$self->{error} = "Salted hashing algorithms are currently not implemented.";
-	return 0;
+	return $self->_validateSaltedSHA($hash, $password, 1);
+}
+
+sub _validateSSHA256 {
+	my ($self, $hash, $password) = @_;
+	return $self->_validateSaltedSHA($hash, $password, 256);
+}
+
+sub _validateSSHA512 {
+	my ($self, $hash, $password) = @_;
+	return $self->_validateSaltedSHA($hash, $password, 512);
 }
 
 
 # TIGER
 sub _validateTIGER {
 	my ($self, $hash, $password) = @_;
-	if ($hash ne Digest::Tiger::hexhash($password)) {
+	unless (_equals($hash, Digest::Tiger::hexhash($password))) {
 		$self->{error} = "Invalid password.";
 		return 0;
 	}
@@ -250,7 +338,7 @@ sub _validateTIGER {
 sub _validateWHIRLPOOL {
 	my ($self, $hash, $password) = @_;	
 	my $h = Digest::Whirlpool->new();
-	if ($hash ne $h->hexdigest($password)) {
+	unless (_equals($hash, $h->hexdigest($password))) {
 		$self->{error} = "Invalid password.";
 		return 0;	
 	}
@@ -268,6 +356,8 @@ Brane F. Gracnar
 
 L<Digest::MD5>
 L<Digest::SHA1>
+L<Digest::SHA>
+L<Net::OpenVPN::PasswordVerify>
 L<Digest::Tiger>
 L<Digest::Whirlpool>
 L<Crypt::PasswdMD5>
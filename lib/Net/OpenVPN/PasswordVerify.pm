@@ -0,0 +1,71 @@
+package Net::OpenVPN::PasswordVerify;
+
+use strict;
+use warnings;
+
+use vars qw($VERSION);
+
+$VERSION = '0.10';
+
+require XSLoader;
+XSLoader::load('Net::OpenVPN::PasswordVerify', $VERSION);
+
+=head1 NAME
+
+Net::OpenVPN::PasswordVerify - native password hash verification
+
+=head1 SYNOPSIS
+
+ use Net::OpenVPN::PasswordVerify;
+
+ my $r = Net::OpenVPN::PasswordVerify::verify('SSHA', $hash, $password);
+ print Net::OpenVPN::PasswordVerify::error(), "\n" unless ($r > 0);
+
+=head1 DESCRIPTION
+
+XS binding of C password verifier (c/openvpn_auth_pwverify.c), built by
+
+ cd c && make pwverify
+
+which installs shared object into lib/auto. This module is used by
+L<Net::OpenVPN::PasswordValidator> if it is available; there is no need
+to use it directly.
+
+Supported algorithms: PLAIN, CRYPT, CRYPTMD5, SHACRYPT, MD5, SHA1, NTLM,
+SSHA, SSHA256 and SSHA512. All hash comparisons take constant time.
+
+=head1 FUNCTIONS
+
+=head2 algorithms ()
+
+Returns list of supported algorithm names.
+
+=head2 verify ($algorithm, $hash, $password)
+
+Returns 1 if password matches hash, 0 if it doesn't and -1 on error
+(unsupported algorithm or malformed hash).
+
+=head2 verify_batch ($algorithm, \@hashes, \@passwords)
+
+Verifies list of hash/password pairs and returns list of L<verify>
+results.
+
+=head2 error ()
+
+Returns last error message.
+
+=cut
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::PasswordValidator>
+
+=cut
+
+1;
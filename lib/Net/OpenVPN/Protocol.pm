@@ -0,0 +1,286 @@
+package Net::OpenVPN::Protocol;
+
+use strict;
+use warnings;
+
+use Exporter;
+
+use vars qw(@ISA @EXPORT_OK %EXPORT_TAGS);
+
+@ISA = qw(Exporter);
+
+# frame header: magic, version, frame type, flags, payload length
+use constant PROTO_MAGIC => 0x00;
+use constant PROTO_VERSION => 2;
+use constant PROTO_HDR_LEN => 8;
+use constant PROTO_MAX_FRAME => 65536;
+
+# frame types
+use constant PROTO_HELLO => 1;
+use constant PROTO_AUTH_REQUEST => 2;
+use constant PROTO_AUTH_RESPONSE => 3;
+
+# TLV types
+use constant T_VERSION => 0x01;
+use constant T_CAPS => 0x02;
+use constant T_AGENT => 0x03;
+use constant T_COMPAT => 0x04;
+use constant T_USERNAME => 0x10;
+use constant T_PASSWORD => 0x11;
+use constant T_COMMON_NAME => 0x12;
+use constant T_HOST => 0x13;
+use constant T_PORT => 0x14;
+use constant T_ID => 0x15;
+use constant T_KEEPALIVE => 0x16;
+use constant T_DEADLINE => 0x17;
+use constant T_STATUS => 0x20;
+use constant T_MESSAGE => 0x21;
+use constant T_SERVER_TIME => 0x22;
+
+# capabilities
+use constant CAP_KEEPALIVE => 0x01;
+use constant CAP_ID => 0x02;
+use constant CAP_TIMING => 0x04;
+
+# response status codes
+use constant STATUS_OK => 0;
+use constant STATUS_DENIED => 1;
+use constant STATUS_TIMEOUT => 2;
+use constant STATUS_INVALID => 3;
+use constant STATUS_ERROR => 4;
+use constant STATUS_OVERLOADED => 5;
+
+# numeric TLVs; everything else is byte string
+my %NUMERIC = (
+	T_VERSION() => 'C',
+	T_CAPS() => 'N',
+	T_PORT() => 'n',
+	T_ID() => 'N',
+	T_KEEPALIVE() => 'C',
+	T_DEADLINE() => 'Q>',
+	T_STATUS() => 'C',
+	T_SERVER_TIME() => 'N',
+);
+
+# TLV type => authentication structure key
+my %REQUEST_KEYS = (
+	T_USERNAME() => 'username',
+	T_PASSWORD() => 'password',
+	T_COMMON_NAME() => 'common_name',
+	T_HOST() => 'host',
+	T_PORT() => 'port',
+	T_ID() => 'id',
+	T_KEEPALIVE() => 'keepalive',
+	T_DEADLINE() => 'deadline',
+);
+
+@EXPORT_OK = qw(
+	PROTO_MAGIC PROTO_VERSION PROTO_HELLO PROTO_AUTH_REQUEST PROTO_AUTH_RESPONSE
+	T_VERSION T_CAPS T_AGENT T_COMPAT T_USERNAME T_PASSWORD T_COMMON_NAME T_HOST T_PORT
+	T_ID T_KEEPALIVE T_DEADLINE T_STATUS T_MESSAGE T_SERVER_TIME
+	CAP_KEEPALIVE CAP_ID CAP_TIMING
+	STATUS_OK STATUS_DENIED STATUS_TIMEOUT STATUS_INVALID STATUS_ERROR STATUS_OVERLOADED
+);
+%EXPORT_TAGS = (all => \ @EXPORT_OK);
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+sub new {
+	my ($proto, $fh) = @_;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_fh} = $fh;
+
+	bless($self, $class);
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head1 NAME
+
+Net::OpenVPN::Protocol - openvpn_authd binary (v2) protocol
+
+=head1 DESCRIPTION
+
+Protocol v2 frame consists of 8 byte header (magic byte 0x00, protocol
+version, frame type, flags and 32 bit big-endian payload length) followed
+by payload of TLV records (1 byte type, 16 bit big-endian length, value).
+
+Client opens connection with B<HELLO> frame (protocol version and
+capabilities) and can send B<AUTH_REQUEST> frame right after it without
+waiting for server's B<HELLO>. Client's B<HELLO> ends with B<COMPAT> record
+containing empty line, so that server without protocol v2 support treats
+it as (invalid) text protocol request and replies immediately; client then
+falls back to text protocol. Server answers every request with
+B<AUTH_RESPONSE> frame carrying numeric status code, message and
+server side processing time in microseconds.
+
+Since first byte of text protocol request is never zero, server can
+distinguish protocols by peeking at first byte of connection, see
+L<isFrameStart>.
+
+=head1 METHODS
+
+=head2 isFrameStart ()
+
+Peeks at first byte of connection. Returns 1 if client speaks protocol v2,
+0 if it speaks text protocol and undef on EOF.
+
+=cut
+sub isFrameStart {
+	my ($self) = @_;
+	my $c = $self->{_fh}->getc();
+	return undef unless (defined $c);
+	$self->{_fh}->ungetc(ord($c));
+	return (ord($c) == PROTO_MAGIC) ? 1 : 0;
+}
+
+=head2 readFrame ()
+
+Reads single frame. Returns list of (frame type, payload) on success,
+empty list on EOF and (undef, undef) on protocol error.
+
+=cut
+sub readFrame {
+	my ($self) = @_;
+	my $hdr = '';
+	my $payload = '';
+
+	my $r = read($self->{_fh}, $hdr, PROTO_HDR_LEN);
+	return () unless ($r);
+	unless ($r == PROTO_HDR_LEN) {
+		$self->{error} = "Truncated frame header.";
+		return (undef, undef);
+	}
+
+	my ($magic, $version, $type, $flags, $len) = unpack('CCCCN', $hdr);
+	if ($magic != PROTO_MAGIC || $version != PROTO_VERSION) {
+		$self->{error} = "Invalid frame header (magic $magic, version $version).";
+		return (undef, undef);
+	}
+	elsif ($len > PROTO_MAX_FRAME) {
+		$self->{error} = "Frame too long ($len bytes).";
+		return (undef, undef);
+	}
+
+	if ($len > 0 && read($self->{_fh}, $payload, $len) != $len) {
+		$self->{error} = "Truncated frame payload.";
+		return (undef, undef);
+	}
+
+	return ($type, $payload);
+}
+
+=head2 decode ($payload)
+
+Decodes TLV records in payload. Returns hash reference (TLV type => value)
+on success, otherwise undef.
+
+=cut
+sub decode {
+	my ($self, $payload) = @_;
+	my %tlv = ();
+	my $off = 0;
+	my $len = length($payload);
+
+	# walk records in place, only values are extracted
+	while ($off + 3 <= $len) {
+		my ($t, $l) = unpack("x$off C n", $payload);
+		$off += 3;
+		if ($off + $l > $len) {
+			$self->{error} = "Truncated TLV record (type $t).";
+			return undef;
+		}
+		if (exists($NUMERIC{$t})) {
+			my $fmt = $NUMERIC{$t};
+			my $need = length(pack($fmt, 0));
+			$tlv{$t} = ($l == $need) ? unpack("x$off $fmt", $payload) : 0;
+		} else {
+			$tlv{$t} = substr($payload, $off, $l);
+		}
+		$off += $l;
+	}
+	if ($off != $len) {
+		$self->{error} = "Trailing garbage in frame payload.";
+		return undef;
+	}
+
+	return \ %tlv;
+}
+
+=head2 decodeRequest ($payload)
+
+Decodes B<AUTH_REQUEST> frame payload into authentication structure
+(with optional B<id>, B<keepalive> and B<deadline> keys; deadline is
+client's request deadline in milliseconds since epoch). Returns hash reference
+on success, otherwise undef.
+
+=cut
+sub decodeRequest {
+	my ($self, $payload) = @_;
+	my $tlv = $self->decode($payload);
+	return undef unless (defined $tlv);
+
+	my $struct = {};
+	foreach my $t (keys %{$tlv}) {
+		next unless (exists($REQUEST_KEYS{$t}));
+		$struct->{$REQUEST_KEYS{$t}} = $tlv->{$t};
+	}
+
+	return $struct;
+}
+
+=head2 writeFrame ($type, $tlv_type => $value, ...)
+
+Encodes and writes single frame. Returns 1 on success, otherwise 0.
+
+=cut
+sub writeFrame {
+	my ($self, $type, @tlvs) = @_;
+	my $payload = '';
+
+	while (@tlvs) {
+		my $t = shift(@tlvs);
+		my $v = shift(@tlvs);
+		next unless (defined $v);
+		$v = pack($NUMERIC{$t}, $v) if (exists($NUMERIC{$t}));
+		$payload .= pack('Cn', $t, length($v)) . $v;
+	}
+
+	my $r = print {$self->{_fh}} pack('CCCCN', PROTO_MAGIC, PROTO_VERSION, $type, 0, length($payload)), $payload;
+	unless ($r) {
+		$self->{error} = "Unable to write frame: $!";
+		return 0;
+	}
+
+	return 1;
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::AuthDaemon>
+
+=cut
+
+1;
@@ -0,0 +1,591 @@
+package Net::OpenVPN::RadiusClient;
+
+use strict;
+use warnings;
+
+use IO::File;
+use IO::Select;
+use Digest::MD5 qw(md5);
+use Time::HiRes qw(time);
+use Socket qw(:addrinfo SOCK_DGRAM AF_INET AF_INET6 MSG_DONTWAIT inet_pton sockaddr_family unpack_sockaddr_in unpack_sockaddr_in6);
+
+# packet codes
+use constant ACCESS_REQUEST => 1;
+use constant ACCESS_ACCEPT => 2;
+use constant ACCESS_REJECT => 3;
+use constant ACCESS_CHALLENGE => 11;
+
+# attribute types
+use constant ATTR_USER_NAME => 1;
+use constant ATTR_USER_PASSWORD => 2;
+use constant ATTR_NAS_IP_ADDRESS => 4;
+use constant ATTR_NAS_IDENTIFIER => 32;
+use constant ATTR_MESSAGE_AUTHENTICATOR => 80;
+use constant ATTR_NAS_IPV6_ADDRESS => 95;
+
+# request identifier is single octet
+use constant MAX_PENDING => 256;
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::RadiusClient - multiplexing RADIUS authentication client
+
+=head1 SYNOPSIS
+
+ my $c = Net::OpenVPN::RadiusClient->new(
+ 	servers => [ 'radius1.example.org', 'radius2.example.org:1645' ],
+ 	secret => 's3cr3t',
+ );
+
+ # blocking
+ my $r = $c->authenticate('joe', 'password', '192.168.1.1');
+ die $c->getError() unless (defined $r);
+
+ # many requests at once
+ $c->request($_, 'password', undef, sub { my ($id, $r, $err) = @_; ... }) foreach (@users);
+ $c->poll(1) while ($c->pending());
+
+=head1 DESCRIPTION
+
+Sends Access-Request packets (PAP, RFC 2865, with Message-Authenticator
+of RFC 3579) from single UDP socket per address family and process; up
+to 256 requests (one per request identifier) may be outstanding at the
+same time. Request which is not answered in B<retransmit> seconds is
+sent again, to next server not tried by this request yet (or to the same
+server if there is only one), until B<timeout> seconds pass. Servers are
+ordered by smoothed round trip time of their answers, so the fastest
+responding server is preferred; server which doesn't answer is penalized
+by doubling its round trip time (up to B<timeout>). Sockets are reopened
+in forked processes, pending requests of parent process are dropped.
+
+Answers without Message-Authenticator attribute are discarded unless
+B<require_message_authenticator> is disabled (for servers which don't
+send it).
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+
+	# list of "host", "host:port" or "[address]:port" strings
+	$self->{servers} = [ 'localhost' ];
+
+	# default port
+	$self->{port} = 1812;
+	$self->{secret} = "";
+
+	# seconds after which request fails
+	$self->{timeout} = 2;
+
+	# seconds after which unanswered request is sent again
+	$self->{retransmit} = 1;
+
+	# NAS-Identifier attribute (empty: not sent)
+	$self->{nas_identifier} = "";
+
+	# discard answers without Message-Authenticator
+	$self->{require_message_authenticator} = 1;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_servers} = undef;		# resolved servers
+	$self->{_sock} = {};			# address family => socket
+	$self->{_sel} = undef;
+	$self->{_pid} = 0;				# process which opened sockets
+	$self->{_pending} = {};			# request identifier => request
+	$self->{_next} = 0;				# next request identifier
+	$self->{_key} = "";				# request authenticator key
+	$self->{_counter} = 0;
+	$self->{_retransmits} = 0;
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 request ($username, $password, $nas_ip [, $code])
+
+Sends Access-Request. Code reference I<$code> is called with request
+identifier, result (1: Access-Accept, 0: Access-Reject, undef: error)
+and error message when request completes (see L<poll>). Returns request
+identifier or undef on error.
+
+=cut
+sub request {
+	my ($self, $username, $password, $nas_ip, $code) = @_;
+	$self->{error} = "";
+	return undef unless ($self->_init());
+
+	if (scalar(keys %{$self->{_pending}}) >= MAX_PENDING) {
+		$self->{error} = "Too many outstanding RADIUS requests.";
+		return undef;
+	}
+	my $id = $self->{_next};
+	$id = ($id + 1) % MAX_PENDING while (exists($self->{_pending}->{$id}));
+	$self->{_next} = ($id + 1) % MAX_PENDING;
+
+	my $pkt = $self->_accessRequest($id, $username, $password, $nas_ip);
+	return undef unless (defined $pkt);
+
+	my $now = time();
+	my $req = {
+		id => $id,
+		packet => $pkt,
+		code => $code,
+		started => $now,
+		deadline => $now + $self->{timeout},
+		next => $now,
+		sent => {},				# server index => [ number of sends, time of last send ]
+		last => undef,			# server index of last send
+		result => undef,
+		err => "",
+	};
+	$self->{_pending}->{$id} = $req;
+	$self->_send($req, $now);
+
+	return $id;
+}
+
+=head2 poll ($wait)
+
+Waits up to I<$wait> seconds for answers, retransmits requests and fails
+requests which timed out. Returns number of requests completed.
+
+=cut
+sub poll {
+	my ($self, $wait) = @_;
+	$wait = 0 unless (defined $wait && $wait > 0);
+	return 0 unless ($self->_init());
+
+	my $done = 0;
+	my $until = time() + $wait;
+	while (1) {
+		my $now = time();
+
+		# timers
+		foreach my $req (sort { $a->{id} <=> $b->{id} } values %{$self->{_pending}}) {
+			if ($now >= $req->{deadline}) {
+				$self->_penalize($req->{last});
+				$self->_complete($req, undef, "No answer from RADIUS server(s) in $self->{timeout} second(s).");
+				$done++;
+			}
+			elsif ($now >= $req->{next}) {
+				$self->_penalize($req->{last});
+				$self->{_retransmits}++;
+				$self->_send($req, $now);
+			}
+		}
+		last if ($done > 0 || ! %{$self->{_pending}});
+
+		# wait for answer or next timer
+		my $t = $until;
+		foreach my $req (values %{$self->{_pending}}) {
+			$t = $req->{next} if ($req->{next} < $t);
+			$t = $req->{deadline} if ($req->{deadline} < $t);
+		}
+		$t -= $now;
+		$t = 0 if ($t < 0);
+		my @ready = $self->{_sel}->can_read($t);
+		$done += $self->_receive($_) foreach (@ready);
+		last if ($done > 0 || time() >= $until);
+	}
+
+	return $done;
+}
+
+=head2 prepare ()
+
+Resolves servers and opens sockets in calling process, which is
+otherwise done by first request. Returns 1 on success, otherwise 0.
+
+=cut
+sub prepare {
+	my ($self) = @_;
+	$self->{error} = "";
+	return $self->_init();
+}
+
+=head2 pending ()
+
+Returns number of outstanding requests.
+
+=cut
+sub pending {
+	my ($self) = @_;
+	return 0 unless ($self->{_pid} == $$);
+	return scalar(keys %{$self->{_pending}});
+}
+
+=head2 authenticate ($username, $password [, $nas_ip])
+
+Sends Access-Request and waits for its result. Returns 1 on
+Access-Accept, 0 on Access-Reject and undef on error.
+
+=cut
+sub authenticate {
+	my ($self, $username, $password, $nas_ip) = @_;
+	my ($done, $result, $err) = (0, undef, "");
+	my $id = $self->request($username, $password, $nas_ip, sub {
+		(undef, $result, $err) = @_;
+		$done = 1;
+	});
+	return undef unless (defined $id);
+
+	$self->poll($self->{timeout}) until ($done);
+	$self->{error} = $err;
+	return $result;
+}
+
+=head2 getServers ()
+
+Returns list of hash references describing servers in order of
+preference: B<name>, B<srtt> (smoothed round trip time in seconds),
+B<sent> (packets sent), B<answered> and B<lost> (retransmit timers
+expired).
+
+=cut
+sub getServers {
+	my ($self) = @_;
+	return () unless (defined $self->{_servers});
+	my @r = ();
+	foreach my $srv (map { $self->{_servers}->[$_] } $self->_order()) {
+		push(@r, { map { $_ => $srv->{$_} } qw(name srtt sent answered lost) });
+	}
+	return @r;
+}
+
+=head2 getRetransmits ()
+
+Returns number of packets sent again because of missing answer.
+
+=cut
+sub getRetransmits {
+	my ($self) = @_;
+	return $self->{_retransmits};
+}
+
+=head2 hmacMD5 ($key, $data)
+
+Function (not method) returning HMAC-MD5 of data (RFC 2104).
+
+=cut
+sub hmacMD5 {
+	my ($key, $data) = @_;
+	$key = md5($key) if (length($key) > 64);
+	$key .= "\0" x (64 - length($key));
+	return md5(($key ^ ("\x5c" x 64)) . md5(($key ^ ("\x36" x 64)) . $data));
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+# resolves servers and opens sockets in calling process
+sub _init {
+	my ($self) = @_;
+	return 1 if ($self->{_pid} == $$);
+
+	unless (length($self->{secret}) > 0) {
+		$self->{error} = "RADIUS secret is not set.";
+		return 0;
+	}
+
+	# resolve servers once; keep round trip times after fork
+	unless (defined $self->{_servers}) {
+		my @servers = ();
+		my @errors = ();
+		foreach my $spec (@{$self->{servers}}) {
+			my ($host, $port) = ($spec, $self->{port});
+			if ($spec =~ m/^\[([^\]]+)\](?::(\d+))?$/) {
+				($host, $port) = ($1, (defined $2) ? $2 : $self->{port});
+			}
+			elsif ($spec =~ m/^([^:]+):(\d+)$/) {
+				($host, $port) = ($1, $2);
+			}
+			my ($err, @res) = getaddrinfo($host, $port, { socktype => SOCK_DGRAM });
+			if ($err || ! @res) {
+				push(@errors, "Unable to resolve RADIUS server '$spec': $err");
+				next;
+			}
+			push(@servers, {
+				name => $spec,
+				addr => $res[0]->{addr},
+				family => $res[0]->{family},
+				key => _addrKey($res[0]->{addr}),
+				srtt => 0,
+				sent => 0,
+				answered => 0,
+				lost => 0,
+			});
+		}
+		unless (@servers) {
+			$self->{error} = (@errors) ? join(" ", @errors) : "No RADIUS servers configured.";
+			return 0;
+		}
+		$self->{_servers} = \ @servers;
+	}
+
+	# new process: sockets of parent receive its answers
+	foreach my $fh (values %{$self->{_sock}}) {
+		close($fh);
+	}
+	$self->{_sock} = {};
+	$self->{_pending} = {};
+	$self->{_sel} = IO::Select->new();
+	foreach my $srv (@{$self->{_servers}}) {
+		next if (exists($self->{_sock}->{$srv->{family}}));
+		my $fh = undef;
+		unless (socket($fh, $srv->{family}, SOCK_DGRAM, 0)) {
+			$self->{error} = "Unable to create RADIUS client socket: $!";
+			return 0;
+		}
+		$self->{_sock}->{$srv->{family}} = $fh;
+		$self->{_sel}->add($fh);
+	}
+
+	# request authenticators must be unpredictable
+	my $key = '';
+	my $fd = IO::File->new('/dev/urandom', 'r');
+	if (defined $fd) {
+		$fd->sysread($key, 16);
+		$fd->close();
+	}
+	$self->{_key} = $key . $$ . rand();
+	$self->{_next} = int(rand(MAX_PENDING));
+	$self->{_pid} = $$;
+
+	return 1;
+}
+
+# returns server indexes in order of preference
+sub _order {
+	my ($self) = @_;
+	my $s = $self->{_servers};
+	return sort { $s->[$a]->{srtt} <=> $s->[$b]->{srtt} || $a <=> $b } (0 .. $#{$s});
+}
+
+# sends request to most preferred server it hasn't been sent to
+sub _send {
+	my ($self, $req, $now) = @_;
+	my @order = $self->_order();
+	my ($i) = grep { ! exists($req->{sent}->{$_}) } @order;
+	$i = $order[0] unless (defined $i);
+
+	my $srv = $self->{_servers}->[$i];
+	my $sent = $req->{sent}->{$i} ||= [ 0, 0 ];
+	$sent->[0]++;
+	$sent->[1] = $now;
+	$req->{last} = $i;
+	$req->{next} = $now + $self->{retransmit};
+	$srv->{sent}++;
+
+	unless (defined send($self->{_sock}->{$srv->{family}}, $req->{packet}, 0, $srv->{addr})) {
+		$req->{err} = "Unable to send RADIUS request to '$srv->{name}': $!";
+	}
+	return 1;
+}
+
+sub _penalize {
+	my ($self, $i) = @_;
+	return unless (defined $i);
+	my $srv = $self->{_servers}->[$i];
+	$srv->{lost}++;
+	my $rtt = $srv->{srtt} * 2;
+	$rtt = $self->{retransmit} if ($rtt < $self->{retransmit});
+	$rtt = $self->{timeout} if ($rtt > $self->{timeout} && $self->{timeout} > $self->{retransmit});
+	$srv->{srtt} = $rtt;
+}
+
+# reads all queued answers; returns number of completed requests
+sub _receive {
+	my ($self, $fh) = @_;
+	my $done = 0;
+	while (1) {
+		my $buf = '';
+		my $peer = recv($fh, $buf, 4096, MSG_DONTWAIT);
+		last unless (defined $peer && length($buf) >= 20);
+		my ($code, $id, $len, $auth) = unpack('C C n a16', $buf);
+		my $req = $self->{_pending}->{$id};
+		next unless (defined $req && $len >= 20 && $len <= length($buf));
+		$buf = substr($buf, 0, $len);
+
+		# answer must come from server request was sent to
+		my $key = _addrKey($peer);
+		my ($i) = grep { $self->{_servers}->[$_]->{key} eq $key } keys %{$req->{sent}};
+		next unless (defined $i);
+		my $err = $self->_verify($buf, substr($req->{packet}, 4, 16));
+		if (length($err) > 0) {
+			$req->{err} = "Invalid answer from RADIUS server '$self->{_servers}->[$i]->{name}': $err";
+			next;
+		}
+
+		# round trip time of unambiguous answers only
+		my $srv = $self->{_servers}->[$i];
+		my $sent = $req->{sent}->{$i};
+		$srv->{answered}++;
+		if ($sent->[0] == 1) {
+			my $rtt = time() - $sent->[1];
+			$srv->{srtt} = ($srv->{answered} > 1 && $srv->{srtt} > 0) ? $srv->{srtt} * 7 / 8 + $rtt / 8 : $rtt;
+		}
+
+		if ($code == ACCESS_ACCEPT) {
+			$self->_complete($req, 1, "");
+		}
+		elsif ($code == ACCESS_REJECT) {
+			$self->_complete($req, 0, "RADIUS server '$srv->{name}' rejected credentials.");
+		}
+		elsif ($code == ACCESS_CHALLENGE) {
+			$self->_complete($req, 0, "RADIUS server '$srv->{name}' sent Access-Challenge, which is not supported.");
+		}
+		else {
+			$self->_complete($req, undef, "RADIUS server '$srv->{name}' sent unexpected packet code $code.");
+		}
+		$done++;
+	}
+
+	return $done;
+}
+
+# checks Response Authenticator and Message-Authenticator; returns
+# error message or empty string if answer is authentic
+sub _verify {
+	my ($self, $buf, $req_auth) = @_;
+	my $hdr = substr($buf, 0, 4);
+	my $attrs = substr($buf, 20);
+	return "invalid Response Authenticator (wrong secret?)." unless (md5($hdr . $req_auth . $attrs . $self->{secret}) eq substr($buf, 4, 16));
+
+	my $off = 0;
+	my $signed = 0;
+	while ($off + 2 <= length($attrs)) {
+		my ($type, $alen) = unpack('C C', substr($attrs, $off, 2));
+		return "malformed attribute." if ($alen < 2 || $off + $alen > length($attrs));
+		if ($type == ATTR_MESSAGE_AUTHENTICATOR) {
+			return "malformed Message-Authenticator." unless ($alen == 18);
+			my $zeroed = $attrs;
+			substr($zeroed, $off + 2, 16) = "\0" x 16;
+			return "invalid Message-Authenticator." unless (hmacMD5($self->{secret}, $hdr . $req_auth . $zeroed) eq substr($attrs, $off + 2, 16));
+			$signed = 1;
+		}
+		$off += $alen;
+	}
+
+	my $code = unpack('C', $hdr);
+	if (! $signed && $self->{require_message_authenticator} &&
+		($code == ACCESS_ACCEPT || $code == ACCESS_REJECT || $code == ACCESS_CHALLENGE)) {
+		return "missing Message-Authenticator.";
+	}
+
+	return "";
+}
+
+sub _complete {
+	my ($self, $req, $result, $err) = @_;
+	delete($self->{_pending}->{$req->{id}});
+	$err = $req->{err} . " " . $err if (! defined $result && length($req->{err}) > 0);
+	$req->{code}->($req->{id}, $result, $err) if (ref($req->{code}) eq 'CODE');
+}
+
+sub _accessRequest {
+	my ($self, $id, $username, $password, $nas_ip) = @_;
+	$username = '' unless (defined $username);
+	$password = '' unless (defined $password);
+	utf8::encode($username) if (utf8::is_utf8($username));
+	utf8::encode($password) if (utf8::is_utf8($password));
+	if (length($username) > 253 || length($password) > 128) {
+		$self->{error} = "Username or password is too long for RADIUS.";
+		return undef;
+	}
+
+	my $auth = md5($self->{_key} . pack('N', $self->{_counter}++) . time());
+
+	# User-Password: password padded to multiple of 16 octets,
+	# every block xor-ed with MD5 of secret and previous block
+	my $pw = $password;
+	$pw .= "\0" x (16 - length($pw) % 16) if (length($pw) % 16 || length($pw) == 0);
+	my $hidden = '';
+	my $prev = $auth;
+	for (my $i = 0; $i < length($pw); $i += 16) {
+		$prev = substr($pw, $i, 16) ^ md5($self->{secret} . $prev);
+		$hidden .= $prev;
+	}
+
+	my $attrs = _attr(ATTR_USER_NAME, $username) . _attr(ATTR_USER_PASSWORD, $hidden);
+	if (defined $nas_ip && length($nas_ip) > 0) {
+		my $a = inet_pton(AF_INET, $nas_ip);
+		if (defined $a) {
+			$attrs .= _attr(ATTR_NAS_IP_ADDRESS, $a);
+		}
+		elsif (defined ($a = inet_pton(AF_INET6, $nas_ip))) {
+			$attrs .= _attr(ATTR_NAS_IPV6_ADDRESS, $a);
+		}
+	}
+	$attrs .= _attr(ATTR_NAS_IDENTIFIER, $self->{nas_identifier}) if (length($self->{nas_identifier}) > 0);
+
+	# Message-Authenticator is computed over whole packet
+	# and must be the last attribute we append
+	$attrs .= _attr(ATTR_MESSAGE_AUTHENTICATOR, "\0" x 16);
+	my $pkt = pack('C C n a16', ACCESS_REQUEST, $id, 20 + length($attrs), $auth) . $attrs;
+	substr($pkt, -16) = hmacMD5($self->{secret}, $pkt);
+
+	return $pkt;
+}
+
+sub _attr {
+	my ($type, $value) = @_;
+	return pack('C C', $type, length($value) + 2) . $value;
+}
+
+sub _addrKey {
+	my ($addr) = @_;
+	my $family = sockaddr_family($addr);
+	if ($family == AF_INET) {
+		my ($port, $ip) = unpack_sockaddr_in($addr);
+		return "4:$port:$ip";
+	}
+	elsif ($family == AF_INET6) {
+		my ($port, $ip) = unpack_sockaddr_in6($addr);
+		return "6:$port:$ip";
+	}
+	return "";
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::Auth::Radius>
+
+=cut
+
+1;
@@ -0,0 +1,495 @@
+package Net::OpenVPN::RuleSet;
+
+use strict;
+use warnings;
+
+use Socket qw(AF_INET AF_INET6 inet_pton);
+
+# fields matched by regular expressions
+use constant REGEX_FIELDS => qw(username common_name);
+
+# fields matched by address prefixes
+use constant CIDR_FIELDS => qw(untrusted_ip);
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::RuleSet - declarative allow/deny rules for authentication structure
+
+=head1 SYNOPSIS
+
+ my $rules = Net::OpenVPN::RuleSet->new();
+ $rules->load("/etc/openvpn_auth/authstruct.rules") || die $rules->getError();
+ $rules->add("deny username ^joe\$", "config") || die $rules->getError();
+ $rules->compile() || die $rules->getError();
+
+ # for every request
+ my ($ok, $rule) = $rules->match($struct);
+
+=head1 DESCRIPTION
+
+Rule is a line of form
+
+ <allow|deny> <field> <pattern>
+
+Field is B<username> or B<common_name> (pattern is perl regular
+expression matched anywhere in value, use ^ and $ to anchor it) or
+B<untrusted_ip> (pattern is IPv4 or IPv6 address or CIDR prefix, e.g.
+10.0.0.0/8 or 2001:db8::/32; client address is taken from B<host> of
+authentication structure, or from B<untrusted_ip> if host is not set).
+Empty lines and lines starting with # are ignored.
+
+Every field is decided separately and all fields must be allowed:
+
+=over
+
+=item B<username>, B<common_name>: value matching any deny rule is
+denied. If field has allow rules, value must match at least one of them,
+otherwise any value is allowed.
+
+=item B<untrusted_ip>: the most specific (longest) matching prefix
+decides. If there is no matching prefix, address is denied if field has
+allow rules, otherwise it is allowed.
+
+=back
+
+compile() joins all regular expressions of every field and kind into one
+regular expression, which is evaluated in single pass by perl's regex
+engine (alternations of literal strings become a trie). Prefixes are
+stored in trie with 8 bit stride (prefixes not ending on byte boundary
+are expanded), so that lookup takes at most 4 (IPv4) or 16 (IPv6) hash
+lookups regardless of number of rules.
+
+Every rule counts its hits. Regular expressions must not use numbered
+backreferences (\1); use relative (\g{-1}) or named ones.
+
+=head1 METHODS
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_rules} = [];
+	$self->{_compiled} = undef;
+
+	bless($self, $class);
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 add ($line [, $where])
+
+Adds rule; I<$where> describes rule's origin in log messages and hit
+counters (default: rule number). Empty and comment lines are silently
+skipped. Returns 1 on success, otherwise 0.
+
+=cut
+sub add {
+	my ($self, $line, $where) = @_;
+	$self->{error} = "";
+	$where = "rule " . (scalar(@{$self->{_rules}}) + 1) unless (defined $where);
+
+	return 1 unless (defined $line);
+	$line =~ s/^\s+//;
+	$line =~ s/\s+$//;
+	return 1 if (length($line) < 1 || $line =~ m/^#/);
+
+	my ($action, $field, $pattern) = split(/\s+/, $line, 3);
+	unless (defined $pattern && $action =~ m/^(?:allow|deny)$/i) {
+		$self->{error} = "Invalid rule at $where: expected '<allow|deny> <field> <pattern>'.";
+		return 0;
+	}
+	$action = lc($action);
+
+	my $rule = {
+		action => $action,
+		field => $field,
+		pattern => $pattern,
+		where => $where,
+		hits => 0,
+	};
+
+	if (grep { $_ eq $field } REGEX_FIELDS) {
+		if ($pattern =~ m/\\(?:[1-9]|g\{?[1-9])/) {
+			$self->{error} = "Invalid rule at $where: numbered backreferences are not supported.";
+			return 0;
+		}
+		eval { $rule->{_re} = qr/$pattern/; };
+		if ($@) {
+			my $err = $@;
+			$err =~ s/\s+at \S+ line \d+\.?\s*$//s;
+			$self->{error} = "Invalid regular expression at $where: $err";
+			return 0;
+		}
+	}
+	elsif (grep { $_ eq $field } CIDR_FIELDS) {
+		my ($addr, $len) = $self->_parsePrefix($pattern);
+		unless (defined $addr) {
+			$self->{error} = "Invalid address prefix '$pattern' at $where.";
+			return 0;
+		}
+		$rule->{_addr} = $addr;
+		$rule->{_len} = $len;
+	}
+	else {
+		$self->{error} = "Invalid rule at $where: unknown field '$field' (expected one of: " . join(", ", REGEX_FIELDS, CIDR_FIELDS) . ").";
+		return 0;
+	}
+
+	push(@{$self->{_rules}}, $rule);
+	$self->{_compiled} = undef;
+	return 1;
+}
+
+=head2 load ($file)
+
+Adds rules from file, one per line. Returns 1 on success, otherwise 0.
+
+=cut
+sub load {
+	my ($self, $file) = @_;
+	$self->{error} = "";
+
+	my $fd = undef;
+	unless (open($fd, '<', $file)) {
+		$self->{error} = "Unable to open rules file '$file': $!";
+		return 0;
+	}
+	while (defined (my $line = <$fd>)) {
+		unless ($self->add($line, "$file:$.")) {
+			close($fd);
+			return 0;
+		}
+	}
+	close($fd);
+
+	return 1;
+}
+
+=head2 compile ()
+
+Builds combined regular expressions and prefix tries from added rules.
+Returns 1 on success, otherwise 0.
+
+=cut
+sub compile {
+	my ($self) = @_;
+	$self->{error} = "";
+
+	my $c = {};
+	foreach my $field (REGEX_FIELDS) {
+		foreach my $action (qw(allow deny)) {
+			my @rules = grep { $_->{field} eq $field && $_->{action} eq $action } @{$self->{_rules}};
+			next unless (@rules);
+			my $set = $self->_compileRegex(\@rules);
+			return 0 unless (defined $set);
+			$c->{$field}->{$action} = $set;
+		}
+	}
+	foreach my $field (CIDR_FIELDS) {
+		my @rules = grep { $_->{field} eq $field } @{$self->{_rules}};
+		next unless (@rules);
+		my $trie = { 4 => {}, 16 => {}, default => {}, allow => 0 };
+		foreach my $rule (@rules) {
+			$trie->{allow} = 1 if ($rule->{action} eq 'allow');
+			$self->_trieInsert($trie, $rule);
+		}
+		$c->{$field} = $trie;
+	}
+
+	$self->{_compiled} = $c;
+	return 1;
+}
+
+=head2 match ($struct)
+
+Evaluates rules against authentication structure. Returns list of
+verdict (1: allowed, 0: denied) and rule which decided it (undef if no
+rule matched). Error message is set to reason if structure is denied.
+
+=cut
+sub match {
+	my ($self, $struct) = @_;
+	$self->{error} = "";
+	return (1, undef) unless (@{$self->{_rules}});
+	return (0, undef) unless (defined $self->{_compiled} || $self->compile());
+	my $c = $self->{_compiled};
+	my $last = undef;
+
+	foreach my $field (REGEX_FIELDS) {
+		next unless (exists $c->{$field});
+		my $value = $struct->{$field};
+		$value = '' unless (defined $value);
+
+		my $rule = $self->_matchRegex($c->{$field}->{deny}, $value);
+		if (defined $rule) {
+			$self->{error} = "$field '$value' denied by $rule->{where}.";
+			return (0, $rule);
+		}
+		next unless (defined $c->{$field}->{allow});
+		$rule = $self->_matchRegex($c->{$field}->{allow}, $value);
+		unless (defined $rule) {
+			$self->{error} = "$field '$value' is not allowed by any rule.";
+			return (0, undef);
+		}
+		$last = $rule;
+	}
+
+	foreach my $field (CIDR_FIELDS) {
+		next unless (exists $c->{$field});
+		my $value = (defined $struct->{host} && length($struct->{host}) > 0) ? $struct->{host} : $struct->{$field};
+		$value = '' unless (defined $value);
+
+		my $rule = $self->_trieLookup($c->{$field}, $value);
+		if (defined $rule) {
+			$rule->{hits}++;
+			if ($rule->{action} eq 'deny') {
+				$self->{error} = "$field '$value' denied by $rule->{where}.";
+				return (0, $rule);
+			}
+			$last = $rule;
+		}
+		elsif ($c->{$field}->{allow}) {
+			$self->{error} = "$field '$value' is not allowed by any rule.";
+			return (0, undef);
+		}
+	}
+
+	return (1, $last);
+}
+
+=head2 count ()
+
+Returns number of rules.
+
+=cut
+sub count {
+	my ($self) = @_;
+	return scalar(@{$self->{_rules}});
+}
+
+=head2 getHits ()
+
+Returns list of [ origin, rule, hits ] of rules which were hit, most
+frequently hit first.
+
+=cut
+sub getHits {
+	my ($self) = @_;
+	return map {
+		[ $_->{where}, "$_->{action} $_->{field} $_->{pattern}", $_->{hits} ]
+	} sort { $b->{hits} <=> $a->{hits} } grep { $_->{hits} > 0 } @{$self->{_rules}};
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+# joins rules into one regex which tells whether any rule matches
+# and one with empty capture group after every rule, which tells
+# (by number of last matched group) which one did. Leading ^ of
+# anchored rules is factored out: perl turns alternation into trie
+# only if its branches don't start with assertion.
+sub _compileRegex {
+	my ($self, $rules) = @_;
+	my (@anchored, @floating);
+	my %marker = ();
+	my $group = 0;
+
+	foreach my $rule (@{$rules}) {
+		if ($rule->{pattern} =~ m/^\^/ && ! $self->_hasAlternation($rule->{pattern})) {
+			push(@anchored, [ $rule, substr($rule->{pattern}, 1) ]);
+		} else {
+			push(@floating, [ $rule, $rule->{pattern} ]);
+		}
+	}
+
+	my (@any, @which);
+	foreach my $list (\@anchored, \@floating) {
+		next unless (@{$list});
+		my (@a, @w);
+		foreach my $e (@{$list}) {
+			# number of capture groups in rule's regex
+			'' =~ m/|$e->[0]->{_re}/;
+			$group += $#+ + 1;
+			$marker{$group} = $e->[0];
+			push(@a, "(?:$e->[1])");
+			push(@w, "(?:$e->[1])()");
+		}
+		my $prefix = ($list == \@anchored) ? '^' : '';
+		push(@any, $prefix . '(?:' . join('|', @a) . ')');
+		push(@which, $prefix . '(?:' . join('|', @w) . ')');
+	}
+
+	my $set = { marker => \%marker };
+	eval {
+		my $any = join('|', @any);
+		my $which = join('|', @which);
+		$set->{any} = qr/$any/;
+		$set->{which} = qr/$which/;
+	};
+	if ($@) {
+		$self->{error} = "Unable to compile rules of field '$rules->[0]->{field}': $@";
+		return undef;
+	}
+
+	return $set;
+}
+
+# returns 1 if regex has alternation outside of groups
+sub _hasAlternation {
+	my ($self, $re) = @_;
+	my $depth = 0;
+	my $class = 0;
+
+	for (my $i = 0; $i < length($re); $i++) {
+		my $c = substr($re, $i, 1);
+		if ($c eq '\\') {
+			$i++;
+		}
+		elsif ($class) {
+			$class = 0 if ($c eq ']');
+		}
+		elsif ($c eq '[') {
+			$class = 1;
+			# ] right after [ or [^ is literal
+			$i++ if (substr($re, $i + 1, 1) eq '^');
+			$i++ if (substr($re, $i + 1, 1) eq ']');
+		}
+		elsif ($c eq '(') {
+			$depth++;
+		}
+		elsif ($c eq ')') {
+			$depth-- if ($depth > 0);
+		}
+		elsif ($c eq '|' && $depth == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+# returns rule of regex set matching value, counting its hit
+sub _matchRegex {
+	my ($self, $set, $value) = @_;
+	return undef unless (defined $set && $value =~ $set->{any});
+	return undef unless ($value =~ $set->{which});
+	my $rule = $set->{marker}->{$#-};
+	$rule->{hits}++ if (defined $rule);
+	return $rule;
+}
+
+# parses address or prefix into packed address and prefix length
+sub _parsePrefix {
+	my ($self, $str) = @_;
+	my ($ip, $len) = split(/\//, $str, 2);
+	my $addr = $self->_packAddr($ip);
+	return undef unless (defined $addr);
+
+	my $max = length($addr) * 8;
+	$len = $max unless (defined $len);
+	return undef unless ($len =~ m/^\d+$/ && $len <= $max);
+
+	# clear host bits
+	my $mask = ('1' x $len) . ('0' x ($max - $len));
+	return ($addr & pack('B*', $mask), $len);
+}
+
+# packs IPv4 or IPv6 address; IPv4 mapped IPv6 addresses become IPv4
+sub _packAddr {
+	my ($self, $ip) = @_;
+	return undef unless (defined $ip && length($ip) > 0);
+	my $addr = ($ip =~ m/:/) ? inet_pton(AF_INET6, $ip) : inet_pton(AF_INET, $ip);
+	return undef unless (defined $addr);
+	$addr = substr($addr, 12) if (length($addr) == 16 && substr($addr, 0, 12) eq ("\0" x 10) . "\xff\xff");
+	return $addr;
+}
+
+# trie node is hash of byte value => [ child node, rule ]; rule is
+# stored in entry of prefix's last (partial) byte; partial bytes are
+# expanded into all byte values they cover, longer prefix wins
+sub _trieInsert {
+	my ($self, $trie, $rule) = @_;
+	my $len = $rule->{_len};
+	my $af = length($rule->{_addr});
+
+	if ($len == 0) {
+		$trie->{default}->{$af} = $rule unless (defined $trie->{default}->{$af});
+		return 1;
+	}
+
+	my @bytes = unpack('C*', $rule->{_addr});
+	my $last = int(($len - 1) / 8);
+	my $node = $trie->{$af};
+	for (my $i = 0; $i < $last; $i++) {
+		$node->{$bytes[$i]} = [ undef, undef ] unless (exists $node->{$bytes[$i]});
+		$node->{$bytes[$i]}->[0] = {} unless (defined $node->{$bytes[$i]}->[0]);
+		$node = $node->{$bytes[$i]}->[0];
+	}
+
+	my $span = 1 << (($last + 1) * 8 - $len);
+	for (my $b = $bytes[$last]; $b < $bytes[$last] + $span; $b++) {
+		$node->{$b} = [ undef, undef ] unless (exists $node->{$b});
+		my $old = $node->{$b}->[1];
+		$node->{$b}->[1] = $rule unless (defined $old && $old->{_len} >= $len);
+	}
+
+	return 1;
+}
+
+# returns rule with longest prefix matching address
+sub _trieLookup {
+	my ($self, $trie, $ip) = @_;
+	my $addr = $self->_packAddr($ip);
+	return undef unless (defined $addr);
+
+	my $af = length($addr);
+	my $best = $trie->{default}->{$af};
+	my $node = $trie->{$af};
+	foreach my $b (unpack('C*', $addr)) {
+		my $e = $node->{$b};
+		last unless (defined $e);
+		$best = $e->[1] if (defined $e->[1]);
+		$node = $e->[0];
+		last unless (defined $node);
+	}
+
+	return $best;
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::Auth::AuthStruct>
+
+=cut
+
+1;
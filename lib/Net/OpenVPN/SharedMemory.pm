@@ -0,0 +1,234 @@
+package Net::OpenVPN::SharedMemory;
+
+use strict;
+use warnings;
+
+use IO::File;
+use IPC::SysV qw(IPC_PRIVATE IPC_CREAT IPC_RMID S_IRUSR S_IWUSR SETVAL SEM_UNDO);
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::SharedMemory - memory shared by daemon workers
+
+=head1 SYNOPSIS
+
+ # in parent, before forking workers
+ my $shm = Net::OpenVPN::SharedMemory->new(size => 4096);
+ $shm->create() || die $shm->getError();
+
+ # in workers
+ $shm->lock();
+ my $buf = $shm->read(0, 32);
+ $shm->write(0, $buf);
+ $shm->unlock();
+
+=head1 DESCRIPTION
+
+Private SysV shared memory segment (zero filled on creation) and
+semaphore serializing access to it. Segment is inherited by forked
+processes; lock held by process which dies is released by kernel.
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+	$self->{size} = 4096;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_shm} = undef;
+	$self->{_sem} = undef;
+	$self->{_owner} = 0;		# pid of creator
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 create ()
+
+Allocates shared memory segment and semaphore; must be called by the
+same user as processes using them run. Returns 1 on success, otherwise 0.
+
+=cut
+sub create {
+	my ($self) = @_;
+	$self->{error} = "";
+	$self->destroy();
+
+	my $size = int($self->{size});
+	$size = 1 if ($size < 1);
+	$self->{size} = $size;
+
+	my $shm = shmget(IPC_PRIVATE, $size, IPC_CREAT | S_IRUSR | S_IWUSR);
+	unless (defined $shm) {
+		$self->{error} = "Unable to create shared memory segment: $!";
+		return 0;
+	}
+	my $sem = semget(IPC_PRIVATE, 1, IPC_CREAT | S_IRUSR | S_IWUSR);
+	unless (defined $sem && semctl($sem, 0, SETVAL, 1)) {
+		$self->{error} = "Unable to create semaphore: $!";
+		shmctl($shm, IPC_RMID, 0);
+		semctl($sem, 0, IPC_RMID, 0) if (defined $sem);
+		return 0;
+	}
+	unless (shmwrite($shm, "\0" x $size, 0, $size)) {
+		$self->{error} = "Unable to initialize shared memory segment: $!";
+		shmctl($shm, IPC_RMID, 0);
+		semctl($sem, 0, IPC_RMID, 0);
+		return 0;
+	}
+
+	$self->{_shm} = $shm;
+	$self->{_sem} = $sem;
+	$self->{_owner} = $$;
+	return 1;
+}
+
+=head2 destroy ()
+
+Removes segment and semaphore. Only process which created them removes
+them, other processes just forget them.
+
+=cut
+sub destroy {
+	my ($self) = @_;
+	if ($self->{_owner} == $$) {
+		shmctl($self->{_shm}, IPC_RMID, 0) if (defined $self->{_shm});
+		semctl($self->{_sem}, 0, IPC_RMID, 0) if (defined $self->{_sem});
+	}
+	$self->{_shm} = undef;
+	$self->{_sem} = undef;
+	$self->{_owner} = 0;
+	return 1;
+}
+
+=head2 isCreated ()
+
+Returns 1 if segment has been created, otherwise 0.
+
+=cut
+sub isCreated {
+	my ($self) = @_;
+	return (defined $self->{_shm}) ? 1 : 0;
+}
+
+=head2 lock ()
+
+Acquires exclusive lock. Returns 1 on success, otherwise 0.
+
+=cut
+sub lock {
+	my ($self) = @_;
+	while (! semop($self->{_sem}, pack('s!3', 0, -1, SEM_UNDO))) {
+		next if ($!{EINTR});
+		$self->{error} = "Unable to lock shared memory: $!";
+		return 0;
+	}
+	return 1;
+}
+
+=head2 unlock ()
+
+Releases lock.
+
+=cut
+sub unlock {
+	my ($self) = @_;
+	return semop($self->{_sem}, pack('s!3', 0, 1, SEM_UNDO)) ? 1 : 0;
+}
+
+=head2 read ($offset, $length)
+
+Returns I<$length> bytes at I<$offset> or undef on error.
+
+=cut
+sub read {
+	my ($self, $off, $len) = @_;
+	my $buf = '';
+	unless (shmread($self->{_shm}, $buf, $off, $len)) {
+		$self->{error} = "Unable to read shared memory: $!";
+		return undef;
+	}
+	return $buf;
+}
+
+=head2 write ($offset, $data)
+
+Writes data at I<$offset>. Returns 1 on success, otherwise 0.
+
+=cut
+sub write {
+	my ($self, $off, $data) = @_;
+	unless (shmwrite($self->{_shm}, $data, $off, length($data))) {
+		$self->{error} = "Unable to write shared memory: $!";
+		return 0;
+	}
+	return 1;
+}
+
+=head2 randomKey ([$length])
+
+Returns random string (default length 32 bytes) suitable as key of
+keyed hash of data stored in shared memory, so that clients can't
+choose colliding slots.
+
+=cut
+sub randomKey {
+	my ($self, $len) = @_;
+	$len = 32 unless (defined $len && $len > 0);
+	my $key = '';
+	my $fd = IO::File->new('/dev/urandom', 'r');
+	if (defined $fd) {
+		$fd->sysread($key, $len);
+		$fd->close();
+	}
+	$key = join('', map { chr(int(rand(256))) } (1 .. $len)) unless (length($key) == $len);
+	return $key;
+}
+
+sub DESTROY {
+	my ($self) = @_;
+	$self->destroy();
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<IPC::SysV>
+
+=cut
+
+1;
@@ -0,0 +1,251 @@
+package Net::OpenVPN::SingleFlight;
+
+use strict;
+use warnings;
+
+use Digest::SHA qw(hmac_sha256);
+use Time::HiRes qw(time sleep);
+
+# my modules
+use Net::OpenVPN::SharedMemory;
+
+# slot: keyed credentials hash, owner pid, generation,
+# state, verdict
+use constant SLOT_LEN => 32;
+use constant SLOT_FMT => 'a16 N N C C x6';
+
+use constant STATE_FREE => 0;
+use constant STATE_RUNNING => 1;
+use constant STATE_DONE => 2;
+
+# how often waiting workers check slot (seconds)
+use constant POLL_INTERVAL => 0.002;
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::SingleFlight - coalesces identical concurrent authentication requests
+
+=head1 SYNOPSIS
+
+ # in parent, before forking workers
+ my $flight = Net::OpenVPN::SingleFlight->new(wait => 2);
+ $flight->create() || die $flight->getError();
+
+ # in worker
+ my $r = $flight->run($struct, sub { $chain->authenticate($struct) });
+
+ # in parent, on shutdown
+ $flight->destroy();
+
+=head1 DESCRIPTION
+
+Workers share table of in-flight authentications (SysV shared memory
+segment guarded by semaphore) keyed by HMAC of username, password,
+common name and client address; HMAC key is random and never leaves
+process memory. First worker authenticating given credentials runs
+authentication chain, workers receiving the same credentials meanwhile
+wait up to B<wait> seconds for its verdict instead of querying backends
+again. Verdict is visible only to requests which arrived while it was
+being computed, nothing is cached after that.
+
+If authenticating worker dies, one of waiting workers takes its place.
+If waiting time runs out, waiting worker runs authentication chain by
+itself. Requests hashing to slot occupied by different credentials are
+not coalesced.
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+	$self->{slots} = 1024;
+	$self->{wait} = 2;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_shm} = undef;
+	$self->{_key} = undef;
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 create ()
+
+Allocates shared table; must be called before workers are forked, by the
+same user as workers run. Returns 1 on success, otherwise 0.
+
+=cut
+sub create {
+	my ($self) = @_;
+	$self->{error} = "";
+	$self->destroy();
+
+	$self->{slots} = int($self->{slots});
+	$self->{slots} = 1 if ($self->{slots} < 1);
+	my $shm = Net::OpenVPN::SharedMemory->new(size => $self->{slots} * SLOT_LEN);
+	unless ($shm->create()) {
+		$self->{error} = $shm->getError();
+		return 0;
+	}
+
+	$self->{_shm} = $shm;
+	$self->{_key} = $shm->randomKey();
+	return 1;
+}
+
+=head2 destroy ()
+
+Removes shared table. Only process which created table removes it, in
+other processes table is just detached.
+
+=cut
+sub destroy {
+	my ($self) = @_;
+	$self->{_shm}->destroy() if (defined $self->{_shm});
+	$self->{_shm} = undef;
+	return 1;
+}
+
+=head2 run ($struct, $code)
+
+Returns verdict of authentication of credentials in authentication
+structure I<$struct>: either result of in-flight authentication of
+identical credentials or result of calling I<$code>.
+
+=cut
+sub run {
+	my ($self, $struct, $code) = @_;
+	return $code->() unless (defined $self->{_shm});
+
+	my $hash = $self->_hash($struct);
+	my $off = (unpack('N', $hash) % $self->{slots}) * SLOT_LEN;
+
+	my $until = time() + $self->{wait};
+	my ($h, $pid, $gen, $state, $verdict);
+	while (1) {
+		return $code->() unless ($self->{_shm}->lock());
+		($h, $pid, $gen, $state, $verdict) = $self->_readSlot($off);
+		last unless (defined $state && $state == STATE_RUNNING && $pid != $$ && kill(0, $pid));
+		$self->{_shm}->unlock();
+
+		# slot is used by other credentials
+		return $code->() unless ($h eq $hash);
+
+		# wait for verdict; if authenticating worker
+		# gives up, try to take its place
+		my $r = $self->_wait($off, $hash, $gen, $pid, $until);
+		return $r if (defined $r);
+		return $code->() unless (time() < $until);
+	}
+
+	# take slot
+	$gen = ((defined $gen) ? $gen + 1 : 1) & 0xffffffff;
+	my $ok = $self->_writeSlot($off, $hash, $$, $gen, STATE_RUNNING, 0);
+	$self->{_shm}->unlock();
+	return $code->() unless ($ok);
+
+	my $r = eval { $code->() };
+	my $err = $@;
+
+	# publish verdict, unless slot has been taken meanwhile
+	if ($self->{_shm}->lock()) {
+		my ($xh, $xpid, $xgen) = $self->_readSlot($off);
+		if (defined $xgen && $xgen == $gen && $xpid == $$) {
+			if ($err) {
+				$self->_writeSlot($off, $hash, 0, $gen, STATE_FREE, 0);
+			} else {
+				$self->_writeSlot($off, $hash, $$, $gen, STATE_DONE, ($r) ? 1 : 0);
+			}
+		}
+		$self->{_shm}->unlock();
+	}
+
+	die $err if ($err);
+	return $r;
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+# waits for verdict of in-flight authentication;
+# returns undef if there is none to wait for
+sub _wait {
+	my ($self, $off, $hash, $gen, $pid, $until) = @_;
+
+	while (time() < $until) {
+		sleep(POLL_INTERVAL);
+		return undef unless ($self->{_shm}->lock());
+		my ($h, $xpid, $xgen, $state, $verdict) = $self->_readSlot($off);
+		$self->{_shm}->unlock();
+
+		# slot taken by other request, or authentication aborted
+		return undef unless (defined $state && $h eq $hash && $xgen == $gen);
+		return $verdict if ($state == STATE_DONE);
+		return undef unless ($state == STATE_RUNNING && kill(0, $pid));
+	}
+
+	return undef;
+}
+
+sub _hash {
+	my ($self, $struct) = @_;
+	my $str = join("\0", map { (defined $struct->{$_}) ? $struct->{$_} : '' } qw(username password common_name host));
+	utf8::encode($str) if (utf8::is_utf8($str));
+	return substr(hmac_sha256($str, $self->{_key}), 0, 16);
+}
+
+sub _readSlot {
+	my ($self, $off) = @_;
+	my $buf = $self->{_shm}->read($off, SLOT_LEN);
+	return () unless (defined $buf);
+	return unpack(SLOT_FMT, $buf);
+}
+
+sub _writeSlot {
+	my ($self, $off, @slot) = @_;
+	return $self->{_shm}->write($off, pack(SLOT_FMT, @slot));
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::AuthDaemon>
+L<Net::OpenVPN::SharedMemory>
+
+=cut
+
+1;
@@ -0,0 +1,370 @@
+package Net::OpenVPN::Throttle;
+
+use strict;
+use warnings;
+
+use Digest::SHA qw(hmac_sha256);
+use Time::HiRes qw(time);
+
+# my modules
+use Net::OpenVPN::SharedMemory;
+
+# header: counters (see STATS)
+use constant HDR_LEN => 64;
+use constant HDR_FMT => 'd8';
+use constant STATS => qw(checked rejected_ip rejected_user lockouts failed succeeded);
+
+# slot: keyed hash of address/username, tokens, last update,
+# blocked until, number of consecutive lockouts
+use constant SLOT_LEN => 48;
+use constant SLOT_FMT => 'a16 d d d n x6';
+
+##################################################
+#             OBJECT CONSTRUCTOR                 #
+##################################################
+
+=head1 NAME
+
+Net::OpenVPN::Throttle - brute-force throttling shared by daemon workers
+
+=head1 SYNOPSIS
+
+ # in parent, before forking workers
+ my $throttle = Net::OpenVPN::Throttle->new(ip_rate => 10, user_rate => 5);
+ $throttle->create() || die $throttle->getError();
+
+ # in worker
+ my ($reason, $new) = $throttle->check($struct);
+ unless (defined $reason) {
+ 	my $r = $chain->authenticate($struct);
+ 	$throttle->update($struct, $r);
+ }
+
+=head1 DESCRIPTION
+
+Every client address (B<host> of authentication structure) and every
+username has token bucket holding up to B<*_burst> tokens, which is
+refilled with B<*_rate> tokens per minute. Failed authentication takes
+one token, successful one takes none (and refills username's bucket).
+Request for address or username with empty bucket is rejected and
+address or username is locked out for B<backoff> seconds; lockout time
+doubles with every next lockout (up to B<max_backoff> seconds) until
+bucket is full again. Buckets live in shared memory (see
+L<Net::OpenVPN::SharedMemory>) and are looked up by keyed hash; when
+table is full, idle buckets and then least recently used ones are reused.
+
+=head1 METHODS
+
+=cut
+sub new {
+	my $proto = shift;
+	my $class = ref($proto) || $proto;
+	my $self = {};
+
+	##################################################
+	#               PUBLIC VARS                      #
+	##################################################
+
+	# failed authentications per minute per client address (0: unlimited)
+	$self->{ip_rate} = 0;
+	$self->{ip_burst} = 10;
+
+	# failed authentications per minute per username (0: unlimited)
+	$self->{user_rate} = 0;
+	$self->{user_burst} = 5;
+
+	# lockout time (seconds), doubled for every next lockout
+	$self->{backoff} = 1;
+	$self->{max_backoff} = 300;
+
+	# buckets per table
+	$self->{slots} = 4096;
+
+	##################################################
+	#              PRIVATE VARS                      #
+	##################################################
+	$self->{error} = "";
+	$self->{_shm} = undef;
+	$self->{_key} = undef;
+	$self->{_tables} = [];
+
+	bless($self, $class);
+
+	while (@_) {
+		my $key = shift;
+		my $value = shift;
+		next if ($key =~ m/^_/);
+		$self->{$key} = $value;
+	}
+
+	return $self;
+}
+
+##################################################
+#               PUBLIC  METHODS                  #
+##################################################
+
+sub getError {
+	my ($self) = @_;
+	return $self->{error};
+}
+
+=head2 isEnabled ()
+
+Returns 1 if any limit is configured, otherwise 0.
+
+=cut
+sub isEnabled {
+	my ($self) = @_;
+	return ($self->{ip_rate} > 0 || $self->{user_rate} > 0) ? 1 : 0;
+}
+
+=head2 create ()
+
+Allocates bucket tables; must be called before workers are forked, by
+the same user as workers run. Returns 1 on success, otherwise 0.
+
+=cut
+sub create {
+	my ($self) = @_;
+	$self->{error} = "";
+	$self->destroy();
+
+	$self->{slots} = int($self->{slots});
+	$self->{slots} = 2 if ($self->{slots} < 2);
+
+	# table: name, authentication structure key, tokens per
+	# second, bucket size, rejection counter, offset
+	my @tables = ();
+	foreach my $t ([ 'address', 'host', 'ip', 'rejected_ip' ], [ 'username', 'username', 'user', 'rejected_user' ]) {
+		my $rate = $self->{$t->[2] . '_rate'};
+		next unless ($rate > 0);
+		my $burst = $self->{$t->[2] . '_burst'};
+		$burst = 1 if ($burst < 1);
+		push(@tables, {
+			name => $t->[0],
+			field => $t->[1],
+			rate => $rate / 60,
+			burst => $burst,
+			counter => $t->[3],
+			offset => HDR_LEN + scalar(@tables) * $self->{slots} * SLOT_LEN,
+		});
+	}
+	unless (@tables) {
+		$self->{error} = "No limits configured.";
+		return 0;
+	}
+
+	my $shm = Net::OpenVPN::SharedMemory->new(size => HDR_LEN + scalar(@tables) * $self->{slots} * SLOT_LEN);
+	unless ($shm->create()) {
+		$self->{error} = $shm->getError();
+		return 0;
+	}
+
+	$self->{_shm} = $shm;
+	$self->{_key} = $shm->randomKey();
+	$self->{_tables} = \ @tables;
+	return 1;
+}
+
+=head2 destroy ()
+
+Removes bucket tables (only in process which created them).
+
+=cut
+sub destroy {
+	my ($self) = @_;
+	$self->{_shm}->destroy() if (defined $self->{_shm});
+	$self->{_shm} = undef;
+	$self->{_tables} = [];
+	return 1;
+}
+
+=head2 check ($struct)
+
+Checks whether authentication request may be passed to authentication
+backends. Returns empty list if it may, otherwise reason of rejection
+and flag set when this request started new lockout.
+
+=cut
+sub check {
+	my ($self, $struct) = @_;
+	return () unless (defined $self->{_shm});
+	return () unless ($self->{_shm}->lock());
+
+	my $now = time();
+	my @stats = $self->_readStats();
+	my ($reason, $new) = (undef, 0);
+	$stats[0]++;
+
+	foreach my $t (@{$self->{_tables}}) {
+		my ($off, $b) = $self->_bucket($t, $struct, $now);
+		next unless (defined $off);
+
+		if ($b->{until} <= $now && $b->{tokens} < 1) {
+			# empty bucket: lock out
+			$b->{strikes}++ if ($b->{strikes} < 0xffff);
+			my $time = $self->{backoff} * 2 ** ($b->{strikes} - 1);
+			$time = $self->{max_backoff} if ($time > $self->{max_backoff});
+			$b->{until} = $now + $time;
+			$self->_writeBucket($off, $b);
+			$stats[3]++;
+			$new = 1;
+		}
+		if ($b->{until} > $now) {
+			$reason = sprintf("too many failed authentications for %s '%s', locked out for %.1f more second(s)", $t->{name}, $struct->{$t->{field}}, $b->{until} - $now);
+			$stats[$self->_statIndex($t->{counter})]++;
+			last;
+		}
+	}
+
+	$self->_writeStats(@stats);
+	$self->{_shm}->unlock();
+	return (defined $reason) ? ($reason, $new) : ();
+}
+
+=head2 update ($struct, $result)
+
+Records result of authentication.
+
+=cut
+sub update {
+	my ($self, $struct, $result) = @_;
+	return 1 unless (defined $self->{_shm});
+	return 0 unless ($self->{_shm}->lock());
+
+	my $now = time();
+	foreach my $t (@{$self->{_tables}}) {
+		my ($off, $b) = $self->_bucket($t, $struct, $now);
+		next unless (defined $off);
+
+		if (! $result) {
+			$b->{tokens} = ($b->{tokens} >= 1) ? $b->{tokens} - 1 : 0;
+		} else {
+			$b->{strikes} = 0;
+			# user has proven knowledge of password
+			$b->{tokens} = $t->{burst} if ($t->{field} eq 'username');
+		}
+		$self->_writeBucket($off, $b);
+	}
+
+	my @stats = $self->_readStats();
+	$stats[$self->_statIndex(($result) ? 'succeeded' : 'failed')]++;
+	$self->_writeStats(@stats);
+
+	$self->{_shm}->unlock();
+	return 1;
+}
+
+=head2 getStats ()
+
+Returns hash reference of counters: B<checked> (requests checked),
+B<rejected_ip>, B<rejected_user> (requests rejected, i.e. backend
+authentications avoided), B<lockouts> (lockouts started), B<failed> and
+B<succeeded> (authentication results recorded).
+
+=cut
+sub getStats {
+	my ($self) = @_;
+	my %r = map { $_ => 0 } (STATS);
+	return \ %r unless (defined $self->{_shm} && $self->{_shm}->lock());
+	my @stats = $self->_readStats();
+	$self->{_shm}->unlock();
+
+	my $i = 0;
+	$r{$_} = $stats[$i++] foreach (STATS);
+	return \ %r;
+}
+
+##################################################
+#              PRIVATE METHODS                   #
+##################################################
+
+sub _statIndex {
+	my ($self, $name) = @_;
+	my $i = 0;
+	foreach (STATS) {
+		return $i if ($_ eq $name);
+		$i++;
+	}
+	return 7;
+}
+
+sub _readStats {
+	my ($self) = @_;
+	my $buf = $self->{_shm}->read(0, HDR_LEN);
+	return (0) x 8 unless (defined $buf);
+	return unpack(HDR_FMT, $buf);
+}
+
+sub _writeStats {
+	my ($self, @stats) = @_;
+	return $self->{_shm}->write(0, pack(HDR_FMT, @stats));
+}
+
+# returns offset and refilled bucket of structure's address or
+# username; bucket of other key using one of two candidate slots
+# is replaced, preferably idle or least recently updated one
+sub _bucket {
+	my ($self, $t, $struct, $now) = @_;
+	my $val = $struct->{$t->{field}};
+	return () unless (defined $val && length($val) > 0);
+	utf8::encode($val) if (utf8::is_utf8($val));
+
+	my $hash = substr(hmac_sha256($val, $self->{_key}), 0, 16);
+	my $i = unpack('N', $hash) % $self->{slots};
+
+	my ($off, $b) = (undef, undef);
+	foreach my $j ($i, $i ^ 1) {
+		next if ($j >= $self->{slots});
+		my $xoff = $t->{offset} + $j * SLOT_LEN;
+		my $buf = $self->{_shm}->read($xoff, SLOT_LEN);
+		next unless (defined $buf);
+		my %x = ();
+		@x{qw(hash tokens updated until strikes)} = unpack(SLOT_FMT, $buf);
+		$x{idle} = ($x{hash} eq ("\0" x 16) || ($x{tokens} + ($now - $x{updated}) * $t->{rate} >= $t->{burst} && $x{until} <= $now)) ? 1 : 0;
+
+		if ($x{hash} eq $hash) {
+			($off, $b) = ($xoff, \ %x);
+			last;
+		}
+		if (! defined $b || ($x{idle} && ! $b->{idle}) || ($x{idle} == $b->{idle} && $x{updated} < $b->{updated})) {
+			($off, $b) = ($xoff, \ %x);
+		}
+	}
+	return () unless (defined $off);
+
+	if ($b->{hash} ne $hash) {
+		%{$b} = (hash => $hash, tokens => $t->{burst}, updated => $now, until => 0, strikes => 0);
+	}
+
+	# refill
+	$b->{tokens} += ($now - $b->{updated}) * $t->{rate} if ($now > $b->{updated});
+	if ($b->{tokens} >= $t->{burst}) {
+		$b->{tokens} = $t->{burst};
+		$b->{strikes} = 0 if ($b->{until} <= $now);
+	}
+	$b->{updated} = $now;
+
+	return ($off, $b);
+}
+
+sub _writeBucket {
+	my ($self, $off, $b) = @_;
+	return $self->{_shm}->write($off, pack(SLOT_FMT, @{$b}{qw(hash tokens updated until strikes)}));
+}
+
+=head1 AUTHOR
+
+Brane F. Gracnar
+
+=cut
+
+=head1 SEE ALSO
+
+L<Net::OpenVPN::AuthDaemon>
+L<Net::OpenVPN::SharedMemory>
+
+=cut
+
+1;